@@ -8,6 +8,8 @@
 
 #include <gfxprim.h>
 #include "xqx.h"
+#include "xqx_path_cache.h"
+#include "xqx_waypoints_layer.h"
 
 static struct xqx_map *map;
 static struct xqx_view *main_view;
@@ -57,14 +59,12 @@ static struct xqx_gps_notify widget_gps = {
 	.gps_msg_cb = update_gps_status,
 };
 
-void *xqx_make_waypoints_layer(void*);
-
 int zoom_in_event(gp_widget_event *ev)
 {
 	if (ev->type != GP_WIDGET_EVENT_WIDGET)
 		return 0;
 
-	xqx_view_zoom_in(main_view, 2<<10);
+	xqx_view_input_zoom(main_view, XQX_ZOOM_LEVEL, 1);
 
 	return 0;
 }
@@ -74,7 +74,7 @@ int zoom_out_event(gp_widget_event *ev)
 	if (ev->type != GP_WIDGET_EVENT_WIDGET)
 		return 0;
 
-	xqx_view_zoom_out(main_view, 2<<10);
+	xqx_view_input_zoom(main_view, XQX_ZOOM_LEVEL, 0);
 
 	return 0;
 }
@@ -84,7 +84,7 @@ int move_up_event(gp_widget_event *ev)
 	if (ev->type != GP_WIDGET_EVENT_WIDGET)
 		return 0;
 
-	xqx_view_move(main_view, 0, main_view->step_y);
+	xqx_view_input_move(main_view, 0, main_view->step_y);
 
 	return 0;
 }
@@ -94,7 +94,7 @@ int move_down_event(gp_widget_event *ev)
 	if (ev->type != GP_WIDGET_EVENT_WIDGET)
 		return 0;
 
-	xqx_view_move(main_view, 0, -main_view->step_y);
+	xqx_view_input_move(main_view, 0, -main_view->step_y);
 
 	return 0;
 }
@@ -104,7 +104,7 @@ int move_left_event(gp_widget_event *ev)
 	if (ev->type != GP_WIDGET_EVENT_WIDGET)
 		return 0;
 
-	xqx_view_move(main_view, main_view->step_x, 0);
+	xqx_view_input_move(main_view, main_view->step_x, 0);
 
 	return 0;
 }
@@ -114,7 +114,7 @@ int move_right_event(gp_widget_event *ev)
 	if (ev->type != GP_WIDGET_EVENT_WIDGET)
 		return 0;
 
-	xqx_view_move(main_view, -main_view->step_x, 0);
+	xqx_view_input_move(main_view, -main_view->step_x, 0);
 
 	return 0;
 }
@@ -157,16 +157,45 @@ int main(int argc, char *argv[])
 
 	main_view = xqx_make_view(pixmap);
 
+	const char *render_thread = getenv("GPMAPS_RENDER_THREAD");
+	if (render_thread && atoi(render_thread))
+		xqx_view_render_thread(main_view);
+
+	const char *record = getenv("GPMAPS_RECORD");
+	if (record) {
+		FILE *f = fopen(record, "w");
+
+		if (f)
+			xqx_view_record(main_view, f);
+		else
+			printf("WARNING: Failed to open '%s'\n", record);
+	}
+
 	main_view->maps = &map;
 	main_view->maps_num = 1;
 	xqx_view_choose_map(main_view, 0);
 
 	xqx_view_enable_gps(main_view);
 
-	struct xqx_path *path = xqx_path_geojson("example-data/waypoints.json");
-	if (path) {
-		xqx_path_print(path);
-		xqx_view_prepend_layer(main_view, xqx_make_waypoints_layer(path));
+	xqx_session_restore(main_view);
+	xqx_session_autosave(main_view);
+
+	struct xqx_paths *paths = xqx_paths_load_cached("example-data/waypoints.json", map ? map->epsg : 0);
+	if (paths) {
+		struct xqx_waypoints_layer *wl;
+		unsigned int i;
+
+		/* projected already if loaded from the cache, otherwise starts the simplification */
+		for (i = 0; map && i < paths->cnt; i++)
+			xqx_path_project(paths->paths[i], map->epsg);
+
+		wl = xqx_make_waypoints_layer(paths);
+		if (wl) {
+			xqx_view_prepend_layer(main_view, (struct xqx_view_layer *)wl);
+		} else {
+			printf("WARNING: Failed to allocate waypoints layer\n");
+			xqx_paths_free(paths);
+		}
 	}
 
 	gp_widgets_main_loop(layout, NULL, argc, argv);
@@ -0,0 +1,349 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Cyril Hrubis <metan@ucw.cz>
+ */
+
+/*
+
+   Replays a pan/zoom script against an offscreen view and prints frame
+   times, tile and cache statistics as JSON.
+
+   The script has one command per line, each command renders one or more
+   frames:
+
+   size w h                       view size, renders a frame after the first one
+   map n                          switches to n-th map passed by -m
+   center lat lon                 moves the view center
+   scale s                        sets scale, 1 is the most detailed level
+   view x y s                     sets center in map coordinates and scale
+   pan dx dy [frames]             pans by dx, dy pixels per frame
+   zoom in|out [frames]           zooms by a smooth step per frame
+   drive lat1 lon1 lat2 lon2 n    moves center along a line in n frames
+
+   The view commands are what gpmaps records with GPMAPS_RECORD=file set.
+
+   Each frame is rendered with whatever tiles are in the cache, which is the
+   frame time, then the missing tiles are loaded and the view is rendered
+   again, which is the time to complete the viewport. Tiles requested for
+   prefetch are not loaded.
+
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <gfxprim.h>
+
+#include "xqx.h"
+#include "xqx_bench.h"
+#include "xqx_map_cache.h"
+#include "xqx_projection.h"
+#include "xqx_time.h"
+#include "xqx_workers.h"
+
+#define MAX_MAPS 4
+
+static struct xqx_map *maps[MAX_MAPS];
+static unsigned int maps_cnt;
+
+static struct xqx_view *view;
+static gp_pixmap *pixmap;
+
+static struct xqx_samples frame_us, complete_us;
+
+/* map files are evicted from the page cache before the run */
+static int cold;
+
+static int frame(void)
+{
+	uint64_t t0, t1;
+
+	/* the recording may start before the view gets its size */
+	if (!view->valid)
+		return 0;
+
+	if (!pixmap) {
+		pixmap = gp_pixmap_alloc(view->w, view->h, GP_PIXEL_RGB888);
+		if (!pixmap) {
+			fprintf(stderr, "Failed to allocate pixmap\n");
+			return 1;
+		}
+	}
+
+	t0 = xqx_time_us();
+
+	if (xqx_view_render(view, pixmap))
+		return 1;
+
+	t1 = xqx_time_us();
+
+	if (xqx_view_load_tiles(view))
+		xqx_view_render(view, pixmap);
+
+	if (xqx_samples_add(&frame_us, t1 - t0) ||
+	    xqx_samples_add(&complete_us, xqx_time_us() - t0)) {
+		fprintf(stderr, "Failed to allocate samples\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+static void pan(int dx, int dy)
+{
+	struct xqx_coordinate c;
+
+	xqx_view_pixels_to_coords(view, view->w / 2 + dx, view->h / 2 + dy, &c);
+	xqx_view_set_center(view, c.x, c.y);
+}
+
+static int drive(double lat1, double lon1, double lat2, double lon2, unsigned int n)
+{
+	unsigned int epsg = view->active_map->epsg;
+	int32_t x1, y1, x2, y2, z;
+	unsigned int i;
+
+	if (xqx_wgs84_to_coords(epsg, lat1, lon1, 0, &x1, &y1, &z) ||
+	    xqx_wgs84_to_coords(epsg, lat2, lon2, 0, &x2, &y2, &z)) {
+		fprintf(stderr, "Failed to project the drive endpoints\n");
+		return 1;
+	}
+
+	for (i = 0; i <= n; i++) {
+		int64_t x = x1 + ((int64_t)x2 - x1) * i / MAX(n, 1u);
+		int64_t y = y1 + ((int64_t)y2 - y1) * i / MAX(n, 1u);
+
+		xqx_view_set_center(view, x, y);
+
+		if (frame())
+			return 1;
+	}
+
+	return 0;
+}
+
+static int run_cmd(const char *buf)
+{
+	double lat1, lon1, lat2, lon2, scale;
+	unsigned int w, h, n = 1, i, x, y;
+	int dx, dy, m;
+	int32_t cx, cy, cz;
+	char dir[4];
+
+	if (sscanf(buf, "size %u %u", &w, &h) == 2) {
+		xqx_view_set_size(view, w, h);
+
+		if (!pixmap)
+			return 0;
+
+		gp_pixmap_free(pixmap);
+		pixmap = NULL;
+		return frame();
+	}
+
+	if (sscanf(buf, "map %i", &m) == 1) {
+		if (m < 0 || (unsigned int)m >= maps_cnt) {
+			fprintf(stderr, "No map %i\n", m);
+			return 1;
+		}
+		xqx_view_choose_map(view, m);
+		return frame();
+	}
+
+	if (sscanf(buf, "center %lf %lf", &lat1, &lon1) == 2) {
+		if (xqx_wgs84_to_coords(view->active_map->epsg, lat1, lon1, 0, &cx, &cy, &cz)) {
+			fprintf(stderr, "Failed to project %lf %lf\n", lat1, lon1);
+			return 1;
+		}
+		xqx_view_set_center(view, cx, cy);
+		return frame();
+	}
+
+	if (sscanf(buf, "scale %lf", &scale) == 1) {
+		xqx_view_set_scale(view, scale * XQX_SCALE_ONE);
+		return frame();
+	}
+
+	if (sscanf(buf, "view %u %u %lf", &x, &y, &scale) == 3) {
+		xqx_view_set_center(view, x, y);
+		xqx_view_set_scale(view, scale * XQX_SCALE_ONE);
+		return frame();
+	}
+
+	if (sscanf(buf, "pan %i %i %u", &dx, &dy, &n) >= 2) {
+		for (i = 0; i < n; i++) {
+			pan(dx, dy);
+			if (frame())
+				return 1;
+		}
+		return 0;
+	}
+
+	if (sscanf(buf, "zoom %3s %u", dir, &n) >= 1) {
+		for (i = 0; i < n; i++) {
+			if (!strcmp(dir, "in"))
+				xqx_view_zoom_in(view, XQX_ZOOM_SMOOTH);
+			else
+				xqx_view_zoom_out(view, XQX_ZOOM_SMOOTH);
+			if (frame())
+				return 1;
+		}
+		return 0;
+	}
+
+	if (sscanf(buf, "drive %lf %lf %lf %lf %u", &lat1, &lon1, &lat2, &lon2, &n) == 5)
+		return drive(lat1, lon1, lat2, lon2, n);
+
+	fprintf(stderr, "Invalid command '%s'\n", buf);
+	return 1;
+}
+
+static int run_script(const char *pathname)
+{
+	FILE *f = fopen(pathname, "r");
+	char *buf = NULL;
+	size_t buf_size = 0;
+	unsigned int line = 0;
+	int ret = 0;
+
+	if (!f) {
+		fprintf(stderr, "Failed to open '%s': %s\n", pathname, strerror(errno));
+		return 1;
+	}
+
+	while (getline(&buf, &buf_size, f) >= 0) {
+		line++;
+
+		buf[strcspn(buf, "\n")] = 0;
+
+		if (!buf[0] || buf[0] == '#')
+			continue;
+
+		if (run_cmd(buf)) {
+			fprintf(stderr, "%s:%u: Failed\n", pathname, line);
+			ret = 1;
+			break;
+		}
+	}
+
+	free(buf);
+	fclose(f);
+	return ret;
+}
+
+static void print_results(const char *script, uint64_t total_us)
+{
+	const struct xqx_map_cache_stats *stats = xqx_map_cache_stats();
+	uint64_t hits = 0, misses = 0;
+	struct rusage usage;
+	unsigned int i;
+	int l;
+
+	for (i = 0; i < maps_cnt; i++) {
+		for (l = 0; l < maps[i]->num_levels; l++) {
+			hits += maps[i]->cache.levels[l].hits;
+			misses += maps[i]->cache.levels[l].misses;
+		}
+	}
+
+	getrusage(RUSAGE_SELF, &usage);
+
+	printf("{\n");
+	printf("\t\"script\": \"%s\",\n", script);
+	printf("\t\"page_cache\": \"%s\",\n", cold ? "cold" : "warm");
+	printf("\t\"threads\": %u,\n", xqx_workers_count());
+	printf("\t\"frames\": %u,\n", frame_us.cnt);
+	printf("\t\"total_us\": %llu,\n", (unsigned long long)total_us);
+	xqx_samples_print("frame_us", &frame_us);
+	xqx_samples_print("complete_us", &complete_us);
+	printf("\t\"tiles_read\": %u,\n", stats->io.cnt);
+	printf("\t\"tiles_decoded\": %u,\n", stats->decode.cnt);
+	printf("\t\"tiles_evicted\": %llu,\n", (unsigned long long)stats->evictions);
+	printf("\t\"cache_hits\": %llu,\n", (unsigned long long)hits);
+	printf("\t\"cache_misses\": %llu,\n", (unsigned long long)misses);
+	printf("\t\"cache_hit_ratio\": %.4f,\n", hits + misses ? (double)hits / (hits + misses) : 0);
+	printf("\t\"peak_rss_kb\": %li\n", usage.ru_maxrss);
+	printf("}\n");
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s -m map [-m map2 ...] [-c | -w] script\n\n", name);
+	printf("-m map\tmap, may be passed several times for map switching\n");
+	printf("-c\tevict map files from the page cache before the run\n");
+	printf("-w\tread map files into the page cache before the run (default)\n");
+	printf("-h\tprints this help\n");
+}
+
+int main(int argc, char *argv[])
+{
+	uint64_t t;
+	unsigned int i;
+	int opt, ret;
+
+	xqx_init_maps();
+
+	while ((opt = getopt(argc, argv, "chm:w")) != -1) {
+		switch (opt) {
+		case 'c':
+			cold = 1;
+		break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		case 'm':
+			if (maps_cnt >= MAX_MAPS) {
+				fprintf(stderr, "Too many maps\n");
+				return 1;
+			}
+			maps[maps_cnt] = xqx_map_load(optarg);
+			if (!maps[maps_cnt]) {
+				fprintf(stderr, "Failed to load map '%s'\n", optarg);
+				return 1;
+			}
+			maps_cnt++;
+		break;
+		case 'w':
+			cold = 0;
+		break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!maps_cnt || optind + 1 != argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	for (i = 0; i < maps_cnt; i++)
+		xqx_bench_page_cache(maps[i], cold);
+
+	view = xqx_make_view(NULL);
+	if (!view) {
+		fprintf(stderr, "Failed to allocate view\n");
+		return 1;
+	}
+
+	view->maps = maps;
+	view->maps_num = maps_cnt;
+	xqx_view_choose_map(view, 0);
+	xqx_view_set_size(view, 800, 480);
+
+	t = xqx_time_us();
+	ret = run_script(argv[optind]);
+	t = xqx_time_us() - t;
+
+	if (!ret)
+		print_results(argv[optind], t);
+
+	if (pixmap)
+		gp_pixmap_free(pixmap);
+
+	return ret;
+}
@@ -0,0 +1,435 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Cyril Hrubis <metan@ucw.cz>
+ */
+
+/*
+
+   Drives the map cache client protocol, i.e. query, notify and eval, with
+   random walk viewports over a synthetic map and prints lookup, eviction
+   and scheduler costs as JSON.
+
+   Each step every client moves its viewport by a few tiles, sometimes
+   changes the level, and requests attention. Then the cache loads all
+   missing tiles, viewport tiles with high priority and a one tile ring
+   around the viewport with low priority.
+
+   When the tiles do not fit into the cache, tiles are evicted and requested
+   again in a loop. Hence each client requests at most as many tiles per step
+   as there are in its viewport and the ring, steps that hit the limit are
+   counted as thrashing.
+
+   The scheduler overhead is the time spent in the cache minus the time to
+   produce tiles and the time spent in cleanups, it includes the client
+   queries.
+
+   Cache watermarks are set by GPMAPS_CACHE_LOW_MB and GPMAPS_CACHE_HIGH_MB.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "xqx.h"
+#include "xqx_bench.h"
+#include "xqx_map.h"
+#include "xqx_map_cache.h"
+#include "xqx_map_synth.h"
+#include "xqx_time.h"
+
+#define RING 1
+
+struct client {
+	struct xqx_map_cache_client *cc;
+	uint32_t l;
+	/* viewport in tiles */
+	int32_t x, y;
+	uint32_t w, h;
+	unsigned int seed;
+	/* tiles requested in this step */
+	uint32_t requests;
+};
+
+static struct xqx_map *map;
+
+static uint64_t lookups, query_ns, notifies, errors, thrashing;
+
+static struct xqx_samples step_us;
+
+static int in_rect(struct client *c, int ring, uint32_t x, uint32_t y)
+{
+	return (int32_t)x >= c->x - ring && (int32_t)x < c->x + (int32_t)c->w + ring &&
+	       (int32_t)y >= c->y - ring && (int32_t)y < c->y + (int32_t)c->h + ring;
+}
+
+static int find_missing(struct client *c, int ring, uint32_t *x, uint32_t *y)
+{
+	int32_t tx, ty;
+	int32_t tw = map->num_tiles_x[c->l], th = map->num_tiles_y[c->l];
+
+	for (ty = MAX(c->y - ring, 0); ty < MIN(c->y + (int32_t)c->h + ring, th); ty++) {
+		for (tx = MAX(c->x - ring, 0); tx < MIN(c->x + (int32_t)c->w + ring, tw); tx++) {
+			if (ring && in_rect(c, 0, tx, ty))
+				continue;
+
+			lookups++;
+
+			if (!xqx_map_cache_lookup(c->cc, map, c->l, tx, ty)) {
+				*x = tx;
+				*y = ty;
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static uint32_t client_query(void *priv, struct xqx_map **m, uint32_t *l, uint32_t *x, uint32_t *y)
+{
+	struct client *c = priv;
+	uint64_t t = xqx_time_ns();
+	uint32_t ret = 0;
+
+	*m = map;
+	*l = c->l;
+
+	if (c->requests >= (c->w + 2 * RING) * (c->h + 2 * RING))
+		goto out;
+
+	if (find_missing(c, 0, x, y))
+		ret = MAX_PRIO;
+	else if (find_missing(c, RING, x, y))
+		ret = MIN_PRIO;
+
+	if (ret && ++c->requests == (c->w + 2 * RING) * (c->h + 2 * RING))
+		thrashing++;
+out:
+	query_ns += xqx_time_ns() - t;
+
+	return ret;
+}
+
+static void client_notify(void *priv, struct xqx_map *m, uint32_t l, uint32_t x, uint32_t y,
+                          struct xqx_map_cache_node *cn)
+{
+	(void) priv; (void) m; (void) l; (void) x; (void) y;
+
+	notifies++;
+
+	if (cn->state == XQX_CACHE_NODE_ERROR)
+		errors++;
+}
+
+static uint32_t client_eval(void *priv, struct xqx_map_cache_node *cn)
+{
+	struct client *c = priv;
+
+	if (cn->l != c->l)
+		return 0;
+
+	if (in_rect(c, 0, cn->x, cn->y))
+		return MAX_PRIO;
+
+	if (in_rect(c, RING, cn->x, cn->y))
+		return MIN_PRIO;
+
+	return 0;
+}
+
+static struct xqx_map_cache_client_ops client_ops = {
+	client_notify, client_query, client_eval
+};
+
+static void clamp_viewport(struct client *c)
+{
+	int32_t tw = map->num_tiles_x[c->l], th = map->num_tiles_y[c->l];
+
+	c->x = CLAMP(c->x, 0, MAX(tw - (int32_t)c->w, 0));
+	c->y = CLAMP(c->y, 0, MAX(th - (int32_t)c->h, 0));
+}
+
+static void client_move(struct client *c)
+{
+	int32_t cx = c->x + c->w / 2;
+	int32_t cy = c->y + c->h / 2;
+
+	switch (rand_r(&c->seed) % 20) {
+	case 0:
+		if (c->l > 0) {
+			c->l--;
+			cx *= 2;
+			cy *= 2;
+		}
+	break;
+	case 1:
+		if (c->l + 1 < (uint32_t)map->num_levels) {
+			c->l++;
+			cx /= 2;
+			cy /= 2;
+		}
+	break;
+	default:
+		cx += (int32_t)(rand_r(&c->seed) % 5) - 2;
+		cy += (int32_t)(rand_r(&c->seed) % 5) - 2;
+	}
+
+	c->x = cx - c->w / 2;
+	c->y = cy - c->h / 2;
+	clamp_viewport(c);
+}
+
+static int walk(struct client *clients, unsigned int clients_cnt, unsigned int steps)
+{
+	unsigned int i, j;
+	uint64_t t;
+
+	for (i = 0; i < steps; i++) {
+		t = xqx_time_us();
+
+		for (j = 0; j < clients_cnt; j++) {
+			struct client *c = &clients[j];
+
+			client_move(c);
+			c->requests = 0;
+			xqx_map_cache_request_notification(c->cc, map, c->l);
+			xqx_map_cache_request_attention(c->cc, MAX_PRIO);
+		}
+
+		xqx_map_cache_run(MIN_PRIO);
+
+		if (xqx_samples_add(&step_us, xqx_time_us() - t)) {
+			fprintf(stderr, "Failed to allocate samples\n");
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Measures lookups of tiles resident in the cache and of random tiles on the
+ * most detailed level, which are mostly misses.
+ */
+static void lookup_cost(unsigned int cnt, double *lookup_ns, double *get_ns, double *miss_ns)
+{
+	struct xqx_map_cache_key keys[4096];
+	unsigned int i, keys_cnt, seed = 1;
+	struct xqx_map_cache_node *cn;
+	uint64_t t;
+
+	*lookup_ns = *get_ns = *miss_ns = 0;
+
+	keys_cnt = xqx_map_cache_recent(map, keys, 4096);
+	if (keys_cnt) {
+		t = xqx_time_ns();
+		for (i = 0; i < cnt; i++) {
+			struct xqx_map_cache_key *k = &keys[rand_r(&seed) % keys_cnt];
+
+			xqx_map_cache_lookup(NULL, map, k->l, k->x, k->y);
+		}
+		*lookup_ns = (double)(xqx_time_ns() - t) / cnt;
+
+		t = xqx_time_ns();
+		for (i = 0; i < cnt; i++) {
+			struct xqx_map_cache_key *k = &keys[rand_r(&seed) % keys_cnt];
+
+			cn = xqx_map_cache_get(NULL, map, k->l, k->x, k->y);
+			if (cn)
+				xqx_map_cache_put(cn);
+		}
+		*get_ns = (double)(xqx_time_ns() - t) / cnt;
+	}
+
+	t = xqx_time_ns();
+	for (i = 0; i < cnt; i++) {
+		xqx_map_cache_lookup(NULL, map, 0,
+		                     rand_r(&seed) % map->num_tiles_x[0],
+		                     rand_r(&seed) % map->num_tiles_y[0]);
+	}
+	*miss_ns = (double)(xqx_time_ns() - t) / cnt;
+}
+
+static void print_results(const char *name, unsigned int clients, uint64_t total_us)
+{
+	const struct xqx_map_cache_stats *stats = xqx_map_cache_stats();
+	uint64_t hits = 0, misses = 0, sched_us, run_us = 0;
+	double lookup_ns, get_ns, miss_ns;
+	struct rusage usage;
+	unsigned int i;
+	int l;
+
+	for (l = 0; l < map->num_levels; l++) {
+		hits += map->cache.levels[l].hits;
+		misses += map->cache.levels[l].misses;
+	}
+
+	for (i = 0; i < step_us.cnt; i++)
+		run_us += step_us.us[i];
+
+	sched_us = run_us - MIN(run_us, stats->io.total_us + stats->decode.total_us +
+	                                stats->cleanup.total_us);
+
+	lookup_cost(1000000, &lookup_ns, &get_ns, &miss_ns);
+
+	getrusage(RUSAGE_SELF, &usage);
+
+	printf("{\n");
+	printf("\t\"map\": \"%s\",\n", name);
+	printf("\t\"clients\": %u,\n", clients);
+	printf("\t\"steps\": %u,\n", step_us.cnt);
+	printf("\t\"total_us\": %llu,\n", (unsigned long long)total_us);
+	xqx_samples_print("step_us", &step_us);
+	printf("\t\"tiles_read\": %u,\n", stats->io.cnt);
+	printf("\t\"tile_errors\": %llu,\n", (unsigned long long)errors);
+	printf("\t\"notifications\": %llu,\n", (unsigned long long)notifies);
+	printf("\t\"io_us\": %llu,\n", (unsigned long long)stats->io.total_us);
+	printf("\t\"decode_us\": %llu,\n", (unsigned long long)stats->decode.total_us);
+	printf("\t\"cache_hits\": %llu,\n", (unsigned long long)hits);
+	printf("\t\"cache_misses\": %llu,\n", (unsigned long long)misses);
+	printf("\t\"query_lookups\": %llu,\n", (unsigned long long)lookups);
+	printf("\t\"query_us\": %llu,\n", (unsigned long long)(query_ns / 1000));
+	printf("\t\"query_lookups_per_s\": %.0f,\n", query_ns ? lookups * 1e9 / query_ns : 0);
+	printf("\t\"lookup_hit_ns\": %.1f,\n", lookup_ns);
+	printf("\t\"lookup_miss_ns\": %.1f,\n", miss_ns);
+	printf("\t\"get_put_ns\": %.1f,\n", get_ns);
+	printf("\t\"thrashing_steps\": %llu,\n", (unsigned long long)thrashing);
+	printf("\t\"evictions\": %llu,\n", (unsigned long long)stats->evictions);
+	printf("\t\"cleanups\": %u,\n", stats->cleanups + stats->cleanups_failed);
+	printf("\t\"cleanup_us\": %llu,\n", (unsigned long long)stats->cleanup.total_us);
+	printf("\t\"eviction_ns\": %.0f,\n",
+	       stats->evictions ? stats->cleanup.total_us * 1000.0 / stats->evictions : 0);
+	printf("\t\"scheduler_us\": %llu,\n", (unsigned long long)sched_us);
+	printf("\t\"scheduler_us_per_tile\": %.2f,\n",
+	       stats->io.cnt ? (double)sched_us / stats->io.cnt : 0);
+	printf("\t\"peak_rss_kb\": %li\n", usage.ru_maxrss);
+	printf("}\n");
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s [options]\n\n", name);
+	printf("-m map\t\tsynthetic map, built-in map is used if not set\n");
+	printf("-n steps\tnumber of random walk steps (default 1000)\n");
+	printf("-c clients\tnumber of cache clients (default 1)\n");
+	printf("-v WxH\t\tviewport size in pixels (default 800x480)\n");
+	printf("-l us\t\ttile latency for the built-in map\n");
+	printf("-j us\t\ttile latency jitter for the built-in map\n");
+	printf("-e rate\t\ttile error rate for the built-in map\n");
+	printf("-s seed\t\trandom seed (default 1)\n");
+	printf("-h\t\tprints this help\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct xqx_map_synth_params params;
+	unsigned int steps = 1000, clients_cnt = 1, vw = 800, vh = 480, seed = 1, i;
+	const char *map_path = NULL;
+	struct client *clients;
+	uint64_t t;
+	int opt, ret;
+
+	xqx_init_maps();
+	xqx_map_synth_defaults(&params);
+
+	while ((opt = getopt(argc, argv, "c:e:hj:l:m:n:s:v:")) != -1) {
+		switch (opt) {
+		case 'c':
+			if (xqx_bench_parse_uint(opt, optarg, 1, UINT32_MAX, &clients_cnt))
+				return 1;
+		break;
+		case 'e':
+			if (xqx_bench_parse_double(opt, optarg, 0, 1, &params.error_rate))
+				return 1;
+		break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		case 'j':
+			if (xqx_bench_parse_uint(opt, optarg, 0, UINT32_MAX, &params.jitter_us))
+				return 1;
+		break;
+		case 'l':
+			if (xqx_bench_parse_uint(opt, optarg, 0, UINT32_MAX, &params.latency_us))
+				return 1;
+		break;
+		case 'm':
+			map_path = optarg;
+		break;
+		case 'n':
+			if (xqx_bench_parse_uint(opt, optarg, 1, UINT32_MAX, &steps))
+				return 1;
+		break;
+		case 's':
+			if (xqx_bench_parse_uint(opt, optarg, 0, UINT32_MAX, &seed))
+				return 1;
+			params.seed = seed;
+		break;
+		case 'v':
+			if (sscanf(optarg, "%ux%u", &vw, &vh) != 2 || !vw || !vh) {
+				fprintf(stderr, "Invalid viewport size '%s'\n", optarg);
+				return 1;
+			}
+		break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind != argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (map_path)
+		map = xqx_map_load(map_path);
+	else
+		map = xqx_map_synth_make(&params);
+
+	if (!map) {
+		fprintf(stderr, "Failed to load map '%s'\n", map_path ? map_path : "(built-in)");
+		return 1;
+	}
+
+	clients = calloc(clients_cnt, sizeof(struct client));
+	if (!clients) {
+		fprintf(stderr, "Failed to allocate clients\n");
+		return 1;
+	}
+
+	for (i = 0; i < clients_cnt; i++) {
+		struct client *c = &clients[i];
+
+		c->cc = xqx_map_cache_make_client(&client_ops, c);
+		if (!c->cc) {
+			fprintf(stderr, "Failed to allocate cache client\n");
+			return 1;
+		}
+
+		c->seed = seed + i;
+		c->w = (vw + map->tile_w - 1) / map->tile_w + 1;
+		c->h = (vh + map->tile_h - 1) / map->tile_h + 1;
+		c->l = rand_r(&c->seed) % map->num_levels;
+		c->x = rand_r(&c->seed) % map->num_tiles_x[c->l];
+		c->y = rand_r(&c->seed) % map->num_tiles_y[c->l];
+		clamp_viewport(c);
+	}
+
+	t = xqx_time_us();
+	ret = walk(clients, clients_cnt, steps);
+	t = xqx_time_us() - t;
+
+	if (!ret)
+		print_results(map_path ? map_path : "(built-in)", clients_cnt, t);
+
+	for (i = 0; i < clients_cnt; i++)
+		xqx_map_cache_discard_client(clients[i].cc);
+
+	free(clients);
+
+	return ret;
+}
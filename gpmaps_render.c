@@ -0,0 +1,295 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Cyril Hrubis <metan@ucw.cz>
+ */
+
+/*
+
+   Renders map views into PNG images without a display.
+
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <gfxprim.h>
+
+#include "xqx.h"
+#include "xqx_projection.h"
+#include "xqx_time.h"
+#include "xqx_path_cache.h"
+#include "xqx_waypoints_layer.h"
+
+struct render_view {
+	/* bounding box or center in lat1, lon1 */
+	int bbox, center;
+	double lat1, lon1, lat2, lon2;
+	/* scale, 1 is the most detailed level, zero keeps the current one */
+	double scale;
+	const char *out;
+};
+
+static struct xqx_view *view;
+static gp_pixmap *pixmap;
+
+/*
+ * Picks the smallest scale the bounding box fits into the view at.
+ */
+static int fit_bbox(struct render_view *rv)
+{
+	unsigned int epsg = view->active_map->epsg;
+	int32_t x1, y1, x2, y2, z;
+
+	if (xqx_wgs84_to_coords(epsg, rv->lat1, rv->lon1, 0, &x1, &y1, &z) ||
+	    xqx_wgs84_to_coords(epsg, rv->lat2, rv->lon2, 0, &x2, &y2, &z)) {
+		fprintf(stderr, "Failed to project the bounding box\n");
+		return 1;
+	}
+
+	/* size in pixels at scale one */
+	int64_t pw = ABS(((int64_t)x2 - x1) * view->scale_px / view->scale_cx);
+	int64_t ph = ABS(((int64_t)y2 - y1) * view->scale_py / view->scale_cy);
+
+	int64_t sw = (pw * XQX_SCALE_ONE + view->w - 1) / view->w;
+	int64_t sh = (ph * XQX_SCALE_ONE + view->h - 1) / view->h;
+
+	xqx_view_set_scale(view, MAX(sw, sh));
+	xqx_view_set_center(view, ((int64_t)x1 + x2) / 2, ((int64_t)y1 + y2) / 2);
+
+	return 0;
+}
+
+static int render_view(struct render_view *rv)
+{
+	int32_t x, y, z;
+	uint64_t t0, t1, t2;
+	unsigned int tiles;
+
+	if (rv->bbox) {
+		if (fit_bbox(rv))
+			return 1;
+	} else {
+		if (rv->scale > 0)
+			xqx_view_set_scale(view, rv->scale * XQX_SCALE_ONE);
+
+		if (rv->center) {
+			if (xqx_wgs84_to_coords(view->active_map->epsg, rv->lat1, rv->lon1, 0, &x, &y, &z)) {
+				fprintf(stderr, "Failed to project %lf %lf\n", rv->lat1, rv->lon1);
+				return 1;
+			}
+
+			xqx_view_set_center(view, x, y);
+		}
+	}
+
+	t0 = xqx_time_us();
+	tiles = xqx_view_load_tiles(view);
+	t1 = xqx_time_us();
+
+	if (xqx_view_render(view, pixmap)) {
+		fprintf(stderr, "Failed to render view\n");
+		return 1;
+	}
+
+	t2 = xqx_time_us();
+
+	if (gp_save_png(pixmap, rv->out, NULL)) {
+		fprintf(stderr, "Failed to save '%s'\n", rv->out);
+		return 1;
+	}
+
+	printf("%s: scale %.3lf tiles %u loaded in %lluus rendered in %lluus\n",
+	       rv->out, (double)view->scale_fp / XQX_SCALE_ONE, tiles,
+	       (unsigned long long)(t1 - t0), (unsigned long long)(t2 - t1));
+
+	return 0;
+}
+
+/*
+ * The list has one view per line, either:
+ *
+ * center lat lon scale out.png
+ * bbox lat1 lon1 lat2 lon2 out.png
+ */
+static int render_list(const char *pathname)
+{
+	FILE *f = fopen(pathname, "r");
+	char *buf = NULL, *out = NULL;
+	size_t buf_size = 0;
+	unsigned int line = 0;
+	int ret = 0;
+
+	if (!f) {
+		fprintf(stderr, "Failed to open '%s': %s\n", pathname, strerror(errno));
+		return 1;
+	}
+
+	while (getline(&buf, &buf_size, f) >= 0) {
+		struct render_view rv = {};
+
+		line++;
+
+		buf[strcspn(buf, "\n")] = 0;
+
+		if (!buf[0] || buf[0] == '#')
+			continue;
+
+		free(out);
+		out = NULL;
+
+		if (sscanf(buf, "center %lf %lf %lf %ms", &rv.lat1, &rv.lon1, &rv.scale, &out) == 4) {
+			rv.center = 1;
+		} else if (sscanf(buf, "bbox %lf %lf %lf %lf %ms", &rv.lat1, &rv.lon1,
+		                  &rv.lat2, &rv.lon2, &out) == 5) {
+			rv.bbox = 1;
+		} else {
+			fprintf(stderr, "%s:%u: Invalid view '%s'\n", pathname, line, buf);
+			ret = 1;
+			continue;
+		}
+
+		rv.out = out;
+
+		if (render_view(&rv))
+			ret = 1;
+	}
+
+	free(out);
+	free(buf);
+	fclose(f);
+	return ret;
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s -m map [options]\n\n", name);
+	printf("-m map\t\tmap to render\n");
+	printf("-s WxH\t\timage size (default 512x512)\n");
+	printf("-c lat,lon\tview center (default map center)\n");
+	printf("-z scale\tview scale, 1 is the most detailed level\n");
+	printf("-b lat1,lon1,lat2,lon2\n\t\tbounding box to fit into the view\n");
+	printf("-o out.png\toutput image (default out.png)\n");
+	printf("-l file\t\tlist of views, one per line, either\n");
+	printf("\t\t'center lat lon scale out.png' or\n");
+	printf("\t\t'bbox lat1 lon1 lat2 lon2 out.png'\n");
+	printf("-w path.gpx\tdraw paths from a GPX or GeoJSON file\n");
+	printf("-g\t\tdraw grid\n");
+	printf("-h\t\tprints this help\n");
+}
+
+int main(int argc, char *argv[])
+{
+	const char *map_path = NULL, *list = NULL, *waypoints = NULL;
+	struct render_view rv = {.out = "out.png"};
+	unsigned int w = 512, h = 512;
+	struct xqx_map *map;
+	int opt, grid = 0, ret;
+
+	while ((opt = getopt(argc, argv, "b:c:ghl:m:o:s:w:z:")) != -1) {
+		switch (opt) {
+		case 'b':
+			if (sscanf(optarg, "%lf,%lf,%lf,%lf", &rv.lat1, &rv.lon1, &rv.lat2, &rv.lon2) != 4) {
+				fprintf(stderr, "Invalid bounding box '%s'\n", optarg);
+				return 1;
+			}
+			rv.bbox = 1;
+		break;
+		case 'c':
+			if (sscanf(optarg, "%lf,%lf", &rv.lat1, &rv.lon1) != 2) {
+				fprintf(stderr, "Invalid center '%s'\n", optarg);
+				return 1;
+			}
+			rv.center = 1;
+		break;
+		case 'g':
+			grid = 1;
+		break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		case 'l':
+			list = optarg;
+		break;
+		case 'm':
+			map_path = optarg;
+		break;
+		case 'o':
+			rv.out = optarg;
+		break;
+		case 's':
+			if (sscanf(optarg, "%ux%u", &w, &h) != 2 || !w || !h) {
+				fprintf(stderr, "Invalid size '%s'\n", optarg);
+				return 1;
+			}
+		break;
+		case 'w':
+			waypoints = optarg;
+		break;
+		case 'z':
+			rv.scale = atof(optarg);
+		break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!map_path) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	xqx_init_maps();
+
+	map = xqx_map_load(map_path);
+	if (!map) {
+		fprintf(stderr, "Failed to load map '%s'\n", map_path);
+		return 1;
+	}
+
+	view = xqx_make_view(NULL);
+	pixmap = gp_pixmap_alloc(w, h, GP_PIXEL_RGB888);
+
+	if (!view || !pixmap) {
+		fprintf(stderr, "Failed to allocate view\n");
+		return 1;
+	}
+
+	view->maps = &map;
+	view->maps_num = 1;
+	xqx_view_choose_map(view, 0);
+	xqx_view_set_size(view, w, h);
+
+	if (grid)
+		xqx_view_toggle_grid(view);
+
+	if (waypoints) {
+		struct xqx_paths *paths = xqx_paths_load_cached(waypoints, map->epsg);
+		struct xqx_waypoints_layer *wl;
+
+		if (!paths) {
+			fprintf(stderr, "Failed to load '%s'\n", waypoints);
+			return 1;
+		}
+
+		wl = xqx_make_waypoints_layer(paths);
+		if (!wl) {
+			fprintf(stderr, "Failed to allocate waypoints layer\n");
+			xqx_paths_free(paths);
+			return 1;
+		}
+
+		xqx_view_prepend_layer(view, (struct xqx_view_layer *)wl);
+	}
+
+	if (list)
+		ret = render_list(list);
+	else
+		ret = render_view(&rv);
+
+	gp_pixmap_free(pixmap);
+
+	return ret;
+}
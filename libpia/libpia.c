@@ -76,6 +76,7 @@ struct pia_file *open_pia(const char *filename, int rw)
 
 	obj->children = 0;
 	obj->table_dirty = 0;
+	obj->app_run = 0;
 
 	return obj;
 err3:
@@ -148,6 +149,7 @@ struct pia_file *make_pia(const char *filename, unsigned int tbl_w, unsigned int
 
 	obj->children = 0;
 	obj->table_dirty = 0;
+	obj->app_run = 0;
 
 	return obj;
 err3:
@@ -351,7 +353,7 @@ void pia_append_item(struct pia_file *obj, uint32_t x, uint32_t y)
 	obj->app_y = y;
 
 	off64_t rc1 = lseek64(obj->fd, 0, SEEK_END);
-	if (rc1 != 0)
+	if (rc1 < 0)
 		ABORT("PIA item header write failed");
 
 	ssize_t rc2 = write(obj->fd, &head, sizeof(struct pia_item_header));
@@ -368,7 +370,7 @@ void pia_append_data(struct pia_file *obj, void *buf, size_t count)
 		ABORT("invalid request - no append in progress");
 
 	off64_t rc1 = lseek64(obj->fd, 0, SEEK_END);
-	if (rc1 != 0)
+	if (rc1 < 0)
 		ABORT("PIA item header write failed");
 
 	ssize_t rc2 = write(obj->fd, buf, count);
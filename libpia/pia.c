@@ -16,6 +16,8 @@
 #include <sys/types.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
 
 #include <getopt.h>
 
@@ -50,7 +52,8 @@ enum {
 	MODE_EXTRACT,
 	MODE_REMOVE,
 	MODE_PACK,
-	MODE_LIST
+	MODE_LIST,
+	MODE_BENCH
 };
 
 static int global_mode = MODE_UNDEFINED;
@@ -61,6 +64,13 @@ static int arg_force;
 static int arg_tile_width = 512;
 static int arg_tile_height = 512;
 static uint32_t arg_empty_color = 0xFFFFFFFF;
+static uint32_t arg_bench_count = 500;
+static uint32_t arg_bench_vw = 4;
+static uint32_t arg_bench_vh = 3;
+static unsigned long long arg_bench_seed = 1;
+/* BENCH_COLD | BENCH_WARM */
+static int arg_bench_cache = 0x03;
+static const char *arg_bench_synth;
 
 static inline void check_syserror(int cond, const char *str)
 {
@@ -400,6 +410,532 @@ static int main_list(const char *file)
 	return 0;
 }
 
+/*
+ * Read benchmark
+ *
+ * Each request is either a single random tile or a viewport shaped rectangle
+ * of tiles. The same request sequence is replayed with every read strategy
+ * so that the numbers are comparable.
+ */
+#define BENCH_BATCH_GAP (64 * 1024)
+
+enum bench_cache {
+	BENCH_COLD = 0x01,
+	BENCH_WARM = 0x02,
+};
+
+struct bench_req {
+	uint32_t first;
+	uint32_t cnt;
+};
+
+struct bench_set {
+	const char *name;
+	uint32_t *tiles;
+	struct bench_req *reqs;
+	uint32_t req_cnt;
+};
+
+struct bench_strategy {
+	const char *name;
+	uint64_t (*read)(struct pia_file *obj, uint32_t *tiles, uint32_t cnt);
+	int batched;
+};
+
+static uint64_t bench_rand_state;
+static char *bench_buf;
+static size_t bench_buf_size;
+static char *bench_map;
+static size_t bench_map_size;
+
+static uint32_t bench_rand(void)
+{
+	bench_rand_state ^= bench_rand_state << 13;
+	bench_rand_state ^= bench_rand_state >> 7;
+	bench_rand_state ^= bench_rand_state << 17;
+
+	return bench_rand_state >> 32;
+}
+
+static uint64_t bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void bench_buf_reserve(size_t size)
+{
+	if (size <= bench_buf_size)
+		return;
+
+	free(bench_buf);
+	bench_buf = malloc(size);
+	check_error(!bench_buf, "malloc() failed");
+	bench_buf_size = size;
+}
+
+static uint64_t bench_item(struct pia_file *obj, uint32_t *tiles, uint32_t cnt)
+{
+	uint32_t i, w = obj->hdr.table_width;
+	uint64_t bytes = 0;
+	char buf[64 * 1024];
+	ssize_t rv;
+
+	for (i = 0; i < cnt; i++) {
+		struct pia_item *item = pia_open_item(obj, tiles[i] % w, tiles[i] / w);
+
+		check_error(!item, "failed to open item");
+
+		while ((rv = pia_item_read(item, buf, sizeof(buf))) > 0)
+			bytes += rv;
+
+		check_syserror(rv < 0, "item read failed");
+		pia_item_close(item);
+	}
+
+	return bytes;
+}
+
+static uint64_t bench_whole(struct pia_file *obj, uint32_t *tiles, uint32_t cnt)
+{
+	uint32_t i, w = obj->hdr.table_width;
+	uint64_t bytes = 0;
+	ssize_t size;
+	void *buf;
+
+	for (i = 0; i < cnt; i++) {
+		size = pia_read_whole_item(obj, tiles[i] % w, tiles[i] / w, &buf);
+		check_error(size != (ssize_t)obj->table[tiles[i]].size,
+		            "whole item read failed");
+		free(buf);
+		bytes += size;
+	}
+
+	return bytes;
+}
+
+static uint64_t bench_mmap(struct pia_file *obj, uint32_t *tiles, uint32_t cnt)
+{
+	struct pia_item_header head;
+	uint64_t bytes = 0;
+	uint32_t i;
+
+	for (i = 0; i < cnt; i++) {
+		struct pia_node *node = &obj->table[tiles[i]];
+		uint64_t start = node->offset + sizeof(head);
+
+		check_error(start + node->size > bench_map_size,
+		            "item out of the mapped file");
+
+		memcpy(&head, bench_map + node->offset, sizeof(head));
+		check_error(head.magic != PIA_ITEM_MAGIC, "invalid item header magic");
+
+		bench_buf_reserve(node->size);
+		memcpy(bench_buf, bench_map + start, node->size);
+		bytes += node->size;
+	}
+
+	return bytes;
+}
+
+static struct pia_file *bench_sort_obj;
+
+/* the request tiles are shared by all strategies, batch sorts a copy */
+static uint32_t *bench_sorted;
+static uint32_t bench_sorted_size;
+
+static int bench_cmp_offset(const void *a, const void *b)
+{
+	uint64_t oa = bench_sort_obj->table[*(const uint32_t *)a].offset;
+	uint64_t ob = bench_sort_obj->table[*(const uint32_t *)b].offset;
+
+	return (oa > ob) - (oa < ob);
+}
+
+/*
+ * Sorts the request by file offset and reads tiles that are close to each
+ * other in the file, including the gaps, with a single pread().
+ */
+static uint64_t bench_batch(struct pia_file *obj, uint32_t *tiles, uint32_t cnt)
+{
+	uint32_t i = 0, j;
+	uint64_t bytes = 0;
+
+	if (cnt > bench_sorted_size) {
+		free(bench_sorted);
+		bench_sorted = malloc(sizeof(*tiles) * cnt);
+		check_error(!bench_sorted, "malloc() failed");
+		bench_sorted_size = cnt;
+	}
+
+	memcpy(bench_sorted, tiles, sizeof(*tiles) * cnt);
+	tiles = bench_sorted;
+
+	bench_sort_obj = obj;
+	qsort(tiles, cnt, sizeof(*tiles), bench_cmp_offset);
+
+	while (i < cnt) {
+		struct pia_node *node = &obj->table[tiles[i]];
+		uint64_t start = node->offset;
+		uint64_t end = start + sizeof(struct pia_item_header) + node->size;
+		uint64_t payload = node->size;
+
+		for (j = i + 1; j < cnt; j++) {
+			node = &obj->table[tiles[j]];
+
+			if (node->offset > end + BENCH_BATCH_GAP)
+				break;
+
+			uint64_t nend = node->offset + sizeof(struct pia_item_header) + node->size;
+
+			if (nend > end)
+				end = nend;
+
+			payload += node->size;
+		}
+
+		bench_buf_reserve(end - start);
+
+		uint64_t pos = 0;
+
+		while (pos < end - start) {
+			ssize_t rv = pread64(obj->fd, bench_buf + pos, end - start - pos, start + pos);
+
+			check_syserror(rv < 0, "pread() failed");
+			check_error(rv == 0, "unexpected end of file");
+			pos += rv;
+		}
+
+		bytes += payload;
+		i = j;
+	}
+
+	return bytes;
+}
+
+static struct bench_strategy bench_strategies[] = {
+	{"item", bench_item, 0},
+	{"whole", bench_whole, 0},
+	{"mmap", bench_mmap, 0},
+	{"batch", bench_batch, 1},
+	{}
+};
+
+static void bench_drop_cache(struct pia_file *obj)
+{
+	fdatasync(obj->fd);
+	int rv = posix_fadvise(obj->fd, 0, 0, POSIX_FADV_DONTNEED);
+	check_error(rv != 0, "posix_fadvise() failed");
+}
+
+static void bench_warm_cache(struct pia_file *obj)
+{
+	off64_t off = 0;
+	ssize_t rv;
+
+	bench_buf_reserve(1024 * 1024);
+
+	while ((rv = pread64(obj->fd, bench_buf, 1024 * 1024, off)) > 0)
+		off += rv;
+
+	check_syserror(rv < 0, "pread() failed");
+}
+
+static int bench_cmp_u64(const void *a, const void *b)
+{
+	uint64_t ua = *(const uint64_t *)a;
+	uint64_t ub = *(const uint64_t *)b;
+
+	return (ua > ub) - (ua < ub);
+}
+
+static double bench_pct_us(uint64_t *lat, uint32_t cnt, unsigned int pct)
+{
+	return lat[((uint64_t)cnt - 1) * pct / 100] / 1000.0;
+}
+
+static void bench_run(struct pia_file *obj, struct bench_set *set,
+                      struct bench_strategy *strategy, int cache)
+{
+	uint64_t *lat = malloc(sizeof(uint64_t) * set->req_cnt);
+	uint64_t bytes = 0, tiles = 0, start, total;
+	struct stat st;
+	uint32_t i;
+
+	check_error(!lat, "malloc() failed");
+
+	if (cache == BENCH_COLD)
+		bench_drop_cache(obj);
+	else
+		bench_warm_cache(obj);
+
+	if (strategy->read == bench_mmap) {
+		check_syserror(fstat(obj->fd, &st), "fstat() failed");
+		bench_map_size = st.st_size;
+		bench_map = mmap(NULL, bench_map_size, PROT_READ, MAP_SHARED, obj->fd, 0);
+		check_syserror(bench_map == MAP_FAILED, "mmap() failed");
+	}
+
+	start = bench_now_ns();
+
+	for (i = 0; i < set->req_cnt; i++) {
+		struct bench_req *req = &set->reqs[i];
+		uint64_t t0 = bench_now_ns();
+
+		bytes += strategy->read(obj, set->tiles + req->first, req->cnt);
+		lat[i] = bench_now_ns() - t0;
+		tiles += req->cnt;
+	}
+
+	total = bench_now_ns() - start;
+
+	if (strategy->read == bench_mmap)
+		munmap(bench_map, bench_map_size);
+
+	qsort(lat, set->req_cnt, sizeof(uint64_t), bench_cmp_u64);
+
+	double secs = total / 1e9;
+
+	printf("%-6s %-9s %-6s %8u %8llu %10.2f %10.0f %9.1f %9.1f %9.1f %9.1f\n",
+	       cache == BENCH_COLD ? "cold" : "warm", set->name, strategy->name,
+	       set->req_cnt, (unsigned long long)tiles,
+	       bytes / secs / (1024 * 1024), tiles / secs,
+	       bench_pct_us(lat, set->req_cnt, 50),
+	       bench_pct_us(lat, set->req_cnt, 95),
+	       bench_pct_us(lat, set->req_cnt, 99),
+	       lat[set->req_cnt - 1] / 1000.0);
+
+	free(lat);
+}
+
+static uint32_t bench_used(struct pia_file *obj, uint32_t **used)
+{
+	uint32_t i, cnt = 0;
+	uint32_t m = obj->hdr.table_width * obj->hdr.table_height;
+
+	*used = malloc(sizeof(uint32_t) * (m ? m : 1));
+	check_error(!*used, "malloc() failed");
+
+	for (i = 0; i < m; i++) {
+		if (obj->table[i].offset)
+			(*used)[cnt++] = i;
+	}
+
+	return cnt;
+}
+
+static void bench_sizes(struct pia_file *obj, uint32_t *used, uint32_t cnt)
+{
+	static const char *const names[] = {"<1K", "<4K", "<16K", "<64K", "<256K", ">=256K"};
+	uint32_t hist[6] = {};
+	uint64_t *sizes = malloc(sizeof(uint64_t) * cnt);
+	uint64_t sum = 0;
+	uint32_t i, b;
+
+	check_error(!sizes, "malloc() failed");
+
+	for (i = 0; i < cnt; i++) {
+		uint64_t size = obj->table[used[i]].size;
+
+		sizes[i] = size;
+		sum += size;
+
+		for (b = 0; b < 5 && size >= (1024llu << (2 * b)); b++);
+
+		hist[b]++;
+	}
+
+	qsort(sizes, cnt, sizeof(uint64_t), bench_cmp_u64);
+
+	printf("tiles: %u of %u, %.2f MiB\n", cnt,
+	       obj->hdr.table_width * obj->hdr.table_height, sum / (1024.0 * 1024));
+	printf("tile size: min %llu p50 %llu p95 %llu max %llu avg %llu\n",
+	       (unsigned long long)sizes[0],
+	       (unsigned long long)sizes[(cnt - 1) / 2],
+	       (unsigned long long)sizes[(uint64_t)(cnt - 1) * 95 / 100],
+	       (unsigned long long)sizes[cnt - 1],
+	       (unsigned long long)(sum / cnt));
+	printf("histogram:");
+
+	for (b = 0; b < 6; b++)
+		printf(" %s %u", names[b], hist[b]);
+
+	printf("\n\n");
+
+	free(sizes);
+}
+
+static void bench_random(struct bench_set *set, uint32_t *used, uint32_t used_cnt)
+{
+	uint32_t i;
+
+	set->name = "random";
+	set->req_cnt = arg_bench_count;
+	set->tiles = malloc(sizeof(uint32_t) * set->req_cnt);
+	set->reqs = malloc(sizeof(struct bench_req) * set->req_cnt);
+	check_error(!set->tiles || !set->reqs, "malloc() failed");
+
+	for (i = 0; i < set->req_cnt; i++) {
+		set->tiles[i] = used[bench_rand() % used_cnt];
+		set->reqs[i].first = i;
+		set->reqs[i].cnt = 1;
+	}
+}
+
+static void bench_viewport(struct bench_set *set, struct pia_file *obj)
+{
+	uint32_t tw = obj->hdr.table_width, th = obj->hdr.table_height;
+	uint32_t vw = arg_bench_vw < tw ? arg_bench_vw : tw;
+	uint32_t vh = arg_bench_vh < th ? arg_bench_vh : th;
+	uint32_t i, x, y, tries, cnt = 0;
+
+	set->name = "viewport";
+	set->req_cnt = arg_bench_count;
+	set->tiles = malloc(sizeof(uint32_t) * set->req_cnt * vw * vh);
+	set->reqs = malloc(sizeof(struct bench_req) * set->req_cnt);
+	check_error(!set->tiles || !set->reqs, "malloc() failed");
+
+	for (i = 0; i < set->req_cnt; i++) {
+		/* Empty viewports would only skew the latencies */
+		for (tries = 0; tries < 100; tries++) {
+			uint32_t vx = bench_rand() % (tw - vw + 1);
+			uint32_t vy = bench_rand() % (th - vh + 1);
+
+			set->reqs[i].first = cnt;
+
+			for (y = vy; y < vy + vh; y++) {
+				for (x = vx; x < vx + vw; x++) {
+					if (obj->table[x + y * tw].offset)
+						set->tiles[cnt++] = x + y * tw;
+				}
+			}
+
+			if (cnt > set->reqs[i].first)
+				break;
+		}
+
+		set->reqs[i].cnt = cnt - set->reqs[i].first;
+	}
+}
+
+static void bench_free(struct bench_set *set)
+{
+	free(set->tiles);
+	free(set->reqs);
+}
+
+static void bench_synth(const char *file)
+{
+	uint32_t w, h, min, max, x, y, i;
+	struct pia_file *obj;
+	int rv;
+
+	rv = sscanf(arg_bench_synth, "%ux%u:%u-%u", &w, &h, &min, &max);
+	check_error(rv != 4 || !w || !h || min > max,
+	            "invalid argument after --synth, expected WxH:MIN-MAX");
+
+	check_error(!arg_force && !access(file, F_OK),
+	            "synthetic archive would overwrite existing file, use --force");
+
+	obj = make_pia(file, w, h, arg_tile_width, arg_tile_height, "bin", arg_empty_color);
+	check_syserror(!obj, "failed to create archive");
+
+	bench_buf_reserve(max ? max : 1);
+
+	for (y = 0; y < h; y++) {
+		for (x = 0; x < w; x++) {
+			uint32_t size = min + bench_rand() % (max - min + 1);
+
+			for (i = 0; i < size; i++)
+				bench_buf[i] = bench_rand();
+
+			pia_append_item(obj, x, y);
+			pia_append_data(obj, bench_buf, size);
+			pia_append_finish(obj);
+		}
+	}
+
+	check_error(pia_close(obj), "failed to close archive");
+
+	if (arg_verbose)
+		printf("created synthetic archive '%s' %ux%u tiles %u-%u bytes\n",
+		       file, w, h, min, max);
+}
+
+static int bench_file(const char *file)
+{
+	struct bench_set sets[2];
+	struct pia_file *obj;
+	uint32_t *used, used_cnt;
+	unsigned int s, i;
+	int cache;
+
+	bench_rand_state = arg_bench_seed ^ 0x9e3779b97f4a7c15llu;
+
+	if (arg_bench_synth)
+		bench_synth(file);
+
+	obj = open_pia(file, 0);
+	check_syserror(!obj, "failed to open archive");
+
+	printf("PIA file '%s' %ux%u\n", file,
+	       obj->hdr.table_width, obj->hdr.table_height);
+
+	used_cnt = bench_used(obj, &used);
+	if (!used_cnt) {
+		printf("no tiles, skipping\n\n");
+		free(used);
+		pia_close(obj);
+		return 0;
+	}
+
+	bench_sizes(obj, used, used_cnt);
+
+	bench_random(&sets[0], used, used_cnt);
+	bench_viewport(&sets[1], obj);
+
+	printf("%-6s %-9s %-6s %8s %8s %10s %10s %9s %9s %9s %9s\n",
+	       "cache", "pattern", "read", "requests", "tiles", "MiB/s",
+	       "tiles/s", "p50_us", "p95_us", "p99_us", "max_us");
+
+	for (cache = BENCH_COLD; cache <= BENCH_WARM; cache <<= 1) {
+		if (!(arg_bench_cache & cache))
+			continue;
+
+		for (s = 0; s < 2; s++) {
+			for (i = 0; bench_strategies[i].name; i++) {
+				/* Batching a single tile is the same as item read */
+				if (bench_strategies[i].batched && s == 0)
+					continue;
+
+				bench_run(obj, &sets[s], &bench_strategies[i], cache);
+			}
+		}
+	}
+
+	printf("\n");
+
+	bench_free(&sets[0]);
+	bench_free(&sets[1]);
+	free(used);
+	pia_close(obj);
+
+	return 0;
+}
+
+static int main_bench(int argc, char **argv)
+{
+	int i;
+
+	for (i = 0; i < argc; i++)
+		bench_file(argv[i]);
+
+	return 0;
+}
+
 static void print_help(const char *c)
 {
 	printf("PIA archiving tool, version %s\n\n"
@@ -410,10 +946,11 @@ static void print_help(const char *c)
 	       "    %s --remove  archive ...\n"
 	       "    %s --pack    archive-in archive-out\n"
 	       "    %s --list    archive\n"
+	       "    %s --bench   archive...\n"
 	       "    %s --help\n"
 	       "    %s --version\n"
 	       "  where ... is a list of options and specifications\n"
-	       "  it is possible to use shortcuts (-c -a -x -r -p -l -h -V)\n\n"
+	       "  it is possible to use shortcuts (-c -a -x -r -p -l -b -h -V)\n\n"
 	       "Options:\n"
 	       "    --common-data-header bytes (number or 'auto')   Can be used only with --create with some files specified.\n"
 	       "    --verbose | -v\n"
@@ -421,6 +958,13 @@ static void print_help(const char *c)
 	       "    --tile-width number\n"
 	       "    --tile-height number\n"
 	       "    --empty-color color (in hexadecimal notation)\n\n"
+	       "Bench options:\n"
+	       "    --count number      - number of requests per pattern (default 500)\n"
+	       "    --viewport WxH      - viewport size in tiles (default 4x3)\n"
+	       "    --seed number       - random seed for the request sequence\n"
+	       "    --cache cold|warm|both\n"
+	       "    --synth WxH:MIN-MAX - create the archive first with WxH random tiles\n"
+	       "                          sized uniformly in MIN-MAX bytes\n\n"
 	       "Specifications:\n"
 	       "    F            - position quessed from filename F (beginning with [0-9./])\n"
 	       "    f:X:Y        - position (X, Y), filename by default pattern\n"
@@ -430,7 +974,7 @@ static void print_help(const char *c)
 	       "    a            - all positions, filenames by default pattern\n"
 	       "    a:P          - all positions, filenames by pattern P\n"
 	       "  default pattern is %s\n",
-	       PIA_VERSION, c, c, c, c, c, c, c, c, DEFAULT_PATTERN);
+	       PIA_VERSION, c, c, c, c, c, c, c, c, c, DEFAULT_PATTERN);
 	exit(0);
 }
 
@@ -456,6 +1000,7 @@ int main(int argc, char **argv)
 		{ "remove", no_argument, 0, 'r' },
 		{ "pack", no_argument, 0, 'p' },
 		{ "list", no_argument, 0, 'l' },
+		{ "bench", no_argument, 0, 'b' },
 		{ "help", no_argument, 0, 'h' },
 		{ "version", no_argument, 0, 'V' },
 		{ "verbose", no_argument, 0, 'v' },
@@ -463,6 +1008,11 @@ int main(int argc, char **argv)
 		{ "tile-width", required_argument, 0, 1 },
 		{ "tile-height", required_argument, 0, 2 },
 		{ "empty-color", required_argument, 0, 3 },
+		{ "count", required_argument, 0, 4 },
+		{ "viewport", required_argument, 0, 5 },
+		{ "seed", required_argument, 0, 6 },
+		{ "cache", required_argument, 0, 7 },
+		{ "synth", required_argument, 0, 8 },
 		{ 0, 0, 0, 0 }
 	};
 
@@ -471,7 +1021,7 @@ int main(int argc, char **argv)
 
 	while (1) {
 		int index = 0;
-		int c = getopt_long(argc, argv, "caxrplhVvf", options, &index);
+		int c = getopt_long(argc, argv, "caxrplbhVvf", options, &index);
 
 		if (c == -1)
 			break;
@@ -507,6 +1057,11 @@ int main(int argc, char **argv)
 				    "more than one command specified");
 			global_mode = MODE_LIST;
 		break;
+		case 'b':
+			check_error(global_mode != MODE_UNDEFINED,
+				    "more than one command specified");
+			global_mode = MODE_BENCH;
+		break;
 		case 'h':
 			print_help(argv[0]);
 			exit(0);
@@ -534,6 +1089,34 @@ int main(int argc, char **argv)
 			check_error(rv != 1,
 				    "invalid argument after --empty-color");
 		break;
+		case 4:
+			rv = sscanf(optarg, "%u", &arg_bench_count);
+			check_error(rv != 1 || !arg_bench_count,
+				    "invalid argument after --count");
+		break;
+		case 5:
+			rv = sscanf(optarg, "%ux%u", &arg_bench_vw, &arg_bench_vh);
+			check_error(rv != 2 || !arg_bench_vw || !arg_bench_vh,
+				    "invalid argument after --viewport");
+		break;
+		case 6:
+			rv = sscanf(optarg, "%llu", &arg_bench_seed);
+			check_error(rv != 1,
+				    "invalid argument after --seed");
+		break;
+		case 7:
+			if (!strcmp(optarg, "cold"))
+				arg_bench_cache = BENCH_COLD;
+			else if (!strcmp(optarg, "warm"))
+				arg_bench_cache = BENCH_WARM;
+			else if (!strcmp(optarg, "both"))
+				arg_bench_cache = BENCH_COLD | BENCH_WARM;
+			else
+				check_error(1, "invalid argument after --cache");
+		break;
+		case 8:
+			arg_bench_synth = optarg;
+		break;
 		case -1:
 		case '?':
 			exit(-1);
@@ -593,6 +1176,10 @@ int main(int argc, char **argv)
 		check_error(rest > 1, "too many arguments to 'list' command");
 		return main_list(argv[optind]);
 
+	case MODE_BENCH:
+		check_error(rest < 1, "not enough arguments to 'bench' command");
+		return main_bench(argc - optind, argv + optind);
+
 	default:
 		BUG();
 	}
@@ -0,0 +1,95 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Cyril Hrubis <metan@ucw.cz>
+ */
+
+/*
+
+   Compares the closed form Web Mercator and UTM transformations with PROJ
+   over a grid of points, the difference must be under 1/16 of a meter, i.e.
+   one unit of the 28.4 fixed point map coordinates.
+
+   Exits with non-zero if any point is off.
+
+ */
+
+#include "../xqx_projection.c"
+
+struct grid {
+	unsigned int epsg;
+	double lat_min, lat_max, lat_step;
+	/* longitude relative to the UTM central meridian */
+	double lon_min, lon_max, lon_step;
+};
+
+static const struct grid grids[] = {
+	{3857, -85, 85, 0.5, -180, 180, 1},
+	/* UTM zones 1, 17, 33 and 60, north and south */
+	{32601, 0, 84, 0.25, -3, 3, 0.1},
+	{32617, 0, 84, 0.25, -3, 3, 0.1},
+	{32633, 0, 84, 0.25, -3, 3, 0.1},
+	{32660, 0, 84, 0.25, -3, 3, 0.1},
+	{32701, -80, 0, 0.25, -3, 3, 0.1},
+	{32717, -80, 0, 0.25, -3, 3, 0.1},
+	{32733, -80, 0, 0.25, -3, 3, 0.1},
+	{32760, -80, 0, 0.25, -3, 3, 0.1},
+};
+
+static int test_grid(const struct grid *g)
+{
+	struct native_proj np;
+	unsigned int i, j, points = 0, fails = 0;
+	double max_err = 0;
+
+	if (!native_proj(g->epsg, &np)) {
+		printf("FAIL epsg:%u is not a native projection\n", g->epsg);
+		return 1;
+	}
+
+	for (i = 0; g->lat_min + i * g->lat_step <= g->lat_max; i++) {
+		double lat = g->lat_min + i * g->lat_step;
+
+		for (j = 0; g->lon_min + j * g->lon_step <= g->lon_max + 1e-9; j++) {
+			double lon = g->lon_min + j * g->lon_step;
+			double x, y, px, py, pz, err;
+
+			if (np.type == NATIVE_UTM)
+				lon += np.lon0;
+
+			native_fwd(&np, lat, lon, &x, &y);
+
+			if (proj_fwd(g->epsg, lat, lon, 0, &px, &py, &pz)) {
+				printf("FAIL epsg:%u PROJ transformation failed\n", g->epsg);
+				return 1;
+			}
+
+			err = MAX(fabs(px - x), fabs(py - y));
+
+			if (!(err * 16 < 1)) {
+				if (fails++ < 10) {
+					printf("epsg:%u [%.4f, %.4f] native %.4f %.4f PROJ %.4f %.4f\n",
+					       g->epsg, lat, lon, x, y, px, py);
+				}
+			}
+
+			max_err = MAX(max_err, err);
+			points++;
+		}
+	}
+
+	printf("%s epsg:%u points %u max error %.9fm\n",
+	       fails ? "FAIL" : "PASS", g->epsg, points, max_err);
+
+	return !!fails;
+}
+
+int main(void)
+{
+	unsigned int i;
+	int ret = 0;
+
+	for (i = 0; i < sizeof(grids)/sizeof(*grids); i++)
+		ret |= test_grid(&grids[i]);
+
+	return ret;
+}
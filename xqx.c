@@ -3,13 +3,75 @@
  * Copyright (c) 2021 Cyril Hrubis <metan@ucw.cz>
  */
 
+#include <stdlib.h>
+#include <widgets/gp_widgets.h>
+
 #include "xqx.h"
 #include "xqx_map_cache.h"
 #include "xqx_map_tmc.h"
+#include "xqx_map_synth.h"
+#include "xqx_trace.h"
+#include "xqx_workers.h"
 
-void xqx_init(void)
+/*
+ * Cache watermarks in MB may be overriden from the environment so that they
+ * can be tuned on a device without rebuilding.
+ */
+static size_t env_size_mb(const char *name, size_t def)
+{
+	const char *val = getenv(name);
+	char *end;
+	unsigned long mb;
+
+	if (!val)
+		return def;
+
+	mb = strtoul(val, &end, 10);
+	if (*end || !mb) {
+		printf("WARNING: Invalid %s='%s'\n", name, val);
+		return def;
+	}
+
+	return (size_t)mb << 20;
+}
+
+void xqx_init_maps(void)
 {
-	xqx_map_cache_init(32 * 1 << 20, 128 * 1 << 20, 1023);
+	size_t low_size = env_size_mb("GPMAPS_CACHE_LOW_MB", 32 << 20);
+	size_t high_size = env_size_mb("GPMAPS_CACHE_HIGH_MB", 128 << 20);
+
+	if (high_size < low_size)
+		high_size = low_size;
+
+	xqx_trace_init();
+	xqx_workers_init(0);
+	xqx_map_cache_init(low_size, high_size, 1023);
 	xqx_map_tmc_init();
+	xqx_map_synth_init();
+}
+
+static enum gp_poll_event_ret workers_done(struct gp_fd *self)
+{
+	(void) self;
+
+	xqx_workers_complete(0);
+
+	return GP_POLL_RET_OK;
+}
+
+void xqx_init(void)
+{
+	static gp_fd workers_fd = {
+		.events = GP_POLLIN,
+		.event = workers_done,
+	};
+
+	xqx_init_maps();
+
+	/* background work is completed on the main loop */
+	workers_fd.fd = xqx_workers_fd();
+	if (workers_fd.fd >= 0)
+		gp_app_poll_add(&workers_fd);
+
 	xqx_gps_connect();
 }
@@ -13,7 +13,16 @@
 #include "xqx_view.h"
 #include "xqx_gps.h"
 #include "xqx_waypoints.h"
+#include "xqx_session.h"
 
+/*
+ * Initializes map loading and rendering and connects to gpsd.
+ */
 void xqx_init(void);
 
+/*
+ * Initializes map loading and rendering only, for offscreen rendering.
+ */
+void xqx_init_maps(void);
+
 #endif /* XQX_H__ */
@@ -0,0 +1,151 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Cyril Hrubis <metan@ucw.cz>
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xqx_map.h"
+#include "xqx_bench.h"
+
+int xqx_samples_add(struct xqx_samples *s, uint32_t us)
+{
+	if (s->cnt >= s->size) {
+		unsigned int size = s->size ? 2 * s->size : 1024;
+		uint32_t *tmp = realloc(s->us, size * sizeof(uint32_t));
+
+		if (!tmp)
+			return 1;
+
+		s->us = tmp;
+		s->size = size;
+	}
+
+	s->us[s->cnt++] = us;
+
+	return 0;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t ua = *(const uint32_t *)a;
+	uint32_t ub = *(const uint32_t *)b;
+
+	return (ua > ub) - (ua < ub);
+}
+
+void xqx_samples_sort(struct xqx_samples *s)
+{
+	qsort(s->us, s->cnt, sizeof(uint32_t), cmp_u32);
+}
+
+uint32_t xqx_samples_percentile(struct xqx_samples *s, unsigned int p)
+{
+	unsigned int rank;
+
+	if (!s->cnt)
+		return 0;
+
+	rank = (p * s->cnt + 99) / 100;
+
+	return s->us[rank ? rank - 1 : 0];
+}
+
+void xqx_samples_print(const char *name, struct xqx_samples *s)
+{
+	xqx_samples_sort(s);
+
+	printf("\t\"%s\": {\"p50\": %u, \"p95\": %u, \"p99\": %u, \"max\": %u},\n", name,
+	       xqx_samples_percentile(s, 50), xqx_samples_percentile(s, 95),
+	       xqx_samples_percentile(s, 99), s->cnt ? s->us[s->cnt - 1] : 0);
+}
+
+/* nftw() does not pass a private pointer */
+static int page_cache_cold;
+
+static int page_cache_file(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+	char buf[65536];
+	int fd;
+
+	(void) st;
+	(void) ftw;
+
+	if (type != FTW_F)
+		return 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	/* drops only clean pages, good enough for read only map data */
+	if (page_cache_cold)
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	else
+		while (read(fd, buf, sizeof(buf)) > 0);
+
+	close(fd);
+	return 0;
+}
+
+void xqx_bench_page_cache(struct xqx_map *map, int cold)
+{
+	char *tmp;
+
+	if (!map->pathname)
+		return;
+
+	tmp = strdup(map->pathname);
+	if (!tmp)
+		return;
+
+	page_cache_cold = cold;
+	nftw(dirname(tmp), page_cache_file, 16, FTW_PHYS);
+	free(tmp);
+}
+
+int xqx_bench_parse_uint(char opt, const char *val, unsigned int min, unsigned int max,
+                         unsigned int *res)
+{
+	unsigned long ret;
+	char *end;
+
+	errno = 0;
+	ret = strtoul(val, &end, 10);
+
+	if (!*val || *end || errno || val[strspn(val, " \t")] == '-' ||
+	    ret < min || ret > max) {
+		fprintf(stderr, "Invalid -%c value '%s', expected %u-%u\n", opt, val, min, max);
+		return 1;
+	}
+
+	*res = ret;
+
+	return 0;
+}
+
+int xqx_bench_parse_double(char opt, const char *val, double min, double max, double *res)
+{
+	double ret;
+	char *end;
+
+	errno = 0;
+	ret = strtod(val, &end);
+
+	if (!*val || *end || errno || !(ret >= min && ret <= max)) {
+		fprintf(stderr, "Invalid -%c value '%s', expected %g-%g\n", opt, val, min, max);
+		return 1;
+	}
+
+	*res = ret;
+
+	return 0;
+}
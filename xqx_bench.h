@@ -0,0 +1,62 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Cyril Hrubis <metan@ucw.cz>
+ */
+
+/*
+
+   Helpers shared by the benchmark tools.
+
+ */
+
+#ifndef XQX_BENCH_H__
+#define XQX_BENCH_H__
+
+#include <stdint.h>
+
+struct xqx_map;
+
+struct xqx_samples {
+	uint32_t *us;
+	unsigned int cnt, size;
+};
+
+/*
+ * Appends a sample, returns non-zero on allocation failure.
+ */
+int xqx_samples_add(struct xqx_samples *s, uint32_t us);
+
+/*
+ * Sorts the samples, has to be called before xqx_samples_percentile().
+ */
+void xqx_samples_sort(struct xqx_samples *s);
+
+/*
+ * Returns the nearest rank percentile, zero if there are no samples.
+ */
+uint32_t xqx_samples_percentile(struct xqx_samples *s, unsigned int p);
+
+/*
+ * Sorts the samples and prints p50, p95, p99 and max as a JSON object member.
+ */
+void xqx_samples_print(const char *name, struct xqx_samples *s);
+
+/*
+ * Evicts (cold) or reads the files in the map directory from or into the page
+ * cache.
+ */
+void xqx_bench_page_cache(struct xqx_map *map, int cold);
+
+/*
+ * Parses an unsigned integer option value, prints an error and returns
+ * non-zero if the value is not a number or is out of the [min, max] range.
+ */
+int xqx_bench_parse_uint(char opt, const char *val, unsigned int min, unsigned int max,
+                         unsigned int *res);
+
+/*
+ * Same as xqx_bench_parse_uint() for a floating point value.
+ */
+int xqx_bench_parse_double(char opt, const char *val, double min, double max, double *res);
+
+#endif /* XQX_BENCH_H__ */
@@ -27,6 +27,13 @@ struct xqx_map;
 	a__ < 0 ? -a__ : a__; \
 })
 
+/* Integer division rounding towards minus infinity */
+#define DIV_FLOOR(a, b) ({ \
+	typeof(a) a___ = (a); \
+	typeof(b) b___ = (b); \
+	(a___ / b___) - ((a___ % b___) && ((a___ < 0) != (b___ < 0))); \
+})
+
 #define CLAMP(x, min, max) (((x) > (max)) ? (max) : (((x) < (min)) ? (min) : (x)))
 
 #define CONTAINER_OF(ptr, structure, member) \
@@ -5,51 +5,72 @@
  * Copyright (c) 2021 Cyril Hrubis <metan@ucw.cz>
  */
 
+#include <limits.h>
 #include <gps.h>
 
 #include "xqx_view.h"
 #include "xqx_gps_layer.h"
 #include "xqx_projection.h"
 
+static gp_size marker_r(struct xqx_view *vw, double epx, double epy)
+{
+	int64_t ex, ey;
+
+	ex = xqx_view_len_to_px_x(vw, epx * 16);
+	ey = xqx_view_len_to_px_y(vw, epy * 16);
+
+	/* Scale the circle size by the reported error */
+	return MAX(4, MAX(ex+1, ey+1));
+}
+
+static gp_size marker_size(struct xqx_gps_layer *gl, struct xqx_view *vw, int64_t *x, int64_t *y)
+{
+	*x = xqx_view_coord_to_px_x(vw, gl->px);
+	*y = xqx_view_coord_to_px_y(vw, gl->py);
+
+	return marker_r(vw, gl->epx, gl->epy);
+}
+
+/*
+ * Returns non-zero if the marker for the new position would be drawn exactly
+ * over the current one.
+ */
+static int marker_same(struct xqx_gps_layer *gl, struct xqx_view *vw,
+                       int32_t px, int32_t py, double epx, double epy)
+{
+	if (gl->state < MODE_2D)
+		return 0;
+
+	return xqx_view_abs_px_x(vw, px) == xqx_view_abs_px_x(vw, gl->px) &&
+	       xqx_view_abs_px_y(vw, py) == xqx_view_abs_px_y(vw, gl->py) &&
+	       marker_r(vw, epx, epy) == marker_r(vw, gl->epx, gl->epy);
+}
+
+static void marker_redraw(struct xqx_gps_layer *gl, struct xqx_view *vw)
+{
+	int64_t x, y;
+	gp_size r;
+
+	if (gl->state < MODE_2D)
+		return;
+
+	r = marker_size(gl, vw, &x, &y);
+
+	xqx_view_request_redraw(vw, CLAMP(x - r, INT_MIN, INT_MAX), CLAMP(y - r, INT_MIN, INT_MAX),
+	                        CLAMP(x + r + 1, INT_MIN, INT_MAX), CLAMP(y + r + 1, INT_MIN, INT_MAX));
+}
+
 static void gps_layer_render(void *gl_i, struct xqx_view *vw, gp_pixmap *pixmap, struct xqx_rectangle *rect)
 {
 	struct xqx_gps_layer *gl = gl_i;
 	int64_t x, y;
-	int64_t ex, ey;
 
 	(void) rect;
 
 	if (gl->state == 0)
 		return;
 
-	x = gl->px;
-	x -= vw->center.x;
-	x *= vw->scale_px;
-	x /= vw->scale_cx;
-	x /= vw->scale_main;
-	x += vw->w / 2;
-
-	ex = gl->epx * 16;
-	ex *= vw->scale_px;
-	ex /= vw->scale_cx;
-	ex /= vw->scale_main;
-	ex = ABS(ex);
-
-	y = gl->py;
-	y -= vw->center.y;
-	y *= vw->scale_py;
-	y /= vw->scale_cy;
-	y /= vw->scale_main;
-	y += vw->h / 2;
-
-	ey = gl->epy * 16;
-	ey *= vw->scale_py;
-	ey /= vw->scale_cy;
-	ey /= vw->scale_main;
-	ey = ABS(ey);
-
-	/* Scale the circle size by the reported error */
-	gp_size r = MAX(4, MAX(ex+1, ey+1));
+	gp_size r = marker_size(gl, vw, &x, &y);
 
 	gp_pixel red = gp_rgb_to_pixmap_pixel(0xff, 0x00, 0x00, pixmap);
 
@@ -61,6 +82,7 @@ static void gps_msg_cb(struct xqx_gps_notify *self, enum xqx_gps_msg_type type,
 	struct xqx_gps_layer *gl = CONTAINER_OF(self, struct xqx_gps_layer, gps_notify);
 	struct xqx_view *vw = gl->common.view;
 	struct gps_fix_t *fix = data;
+	int32_t px, py, pz;
 
 	if (type != XQX_GPS_MSG_FIX)
 		return;
@@ -68,19 +90,46 @@ static void gps_msg_cb(struct xqx_gps_notify *self, enum xqx_gps_msg_type type,
 	if (gl == NULL || !vw->active_map->epsg)
 		return;
 
+	if (fix->mode >= MODE_2D) {
+		if (xqx_wgs84_to_coords(vw->active_map->epsg, fix->latitude, fix->longitude,
+		                        fix->altitude, &px, &py, &pz))
+			return;
+
+		/*
+		 * Sub-pixel movement changes nothing on the screen, neither the
+		 * view is moved nor the marker repainted. When locked the
+		 * center lags behind by less than a pixel.
+		 */
+		if (marker_same(gl, vw, px, py, fix->epx, fix->epy)) {
+			gl->px = px;
+			gl->py = py;
+			gl->pz = pz;
+			gl->epx = fix->epx;
+			gl->epy = fix->epy;
+			gl->state = fix->mode;
+			return;
+		}
+	}
+
+	/* the marker is repainted only where it was and where it is */
+	marker_redraw(gl, vw);
+
 	gl->state = fix->mode;
 
 	if (fix->mode < MODE_2D)
 		return;
 
-	xqx_wgs84_to_coords(vw->active_map->epsg, fix->latitude, fix->longitude, fix->altitude,
-			    &gl->px, &gl->py, &gl->pz);
-
+	gl->px = px;
+	gl->py = py;
+	gl->pz = pz;
 	gl->epx = fix->epx;
 	gl->epy = fix->epy;
 
+	/* whole pixel moves are scrolled, see xqx_view_set_center() */
 	if (gl->locked)
 		xqx_view_set_center(vw, gl->px, gl->py);
+
+	marker_redraw(gl, vw);
 }
 
 struct xqx_gps_layer *xqx_make_gps_layer(void)
@@ -90,7 +139,9 @@ struct xqx_gps_layer *xqx_make_gps_layer(void)
 	if (!gl)
 		return NULL;
 
+	gl->common.name = "gps";
 	gl->common.render_cb = gps_layer_render;
+	gl->common.flags = XQX_VIEW_LAYER_PAN_INVARIANT;
 	gl->locked = 1;
 
 	gl->gps_notify.gps_msg_cb = gps_msg_cb;
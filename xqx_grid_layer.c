@@ -19,8 +19,9 @@ static void grid_notify(void *gr_i, struct xqx_view *vw, unsigned int change)
 	if ((change == XQX_VLC_INIT) || (change == XQX_VLC_SCALE)) {
 		int64_t dx = gr->dist;
 		dx *= vw->scale_cx;
-		dx *= vw->scale_main;
+		dx *= vw->scale_fp;
 		dx /= vw->scale_px;
+		dx /= XQX_SCALE_ONE;
 		dx = abs((int) dx);
 
 		int i;
@@ -43,8 +44,11 @@ static void draw_coord(gp_pixmap *pixmap, int x, int y, int align, int coord)
 
 	snprintf(buf, 15, "%d", coord/16000);
 
-	gp_text(pixmap, NULL, x+1, y+1, align, 0xffffff, 0, buf);
-	gp_text(pixmap, NULL, x, y, align, 0, 0, buf);
+	gp_pixel white = gp_rgb_to_pixmap_pixel(0xff, 0xff, 0xff, pixmap);
+	gp_pixel black = gp_rgb_to_pixmap_pixel(0x00, 0x00, 0x00, pixmap);
+
+	gp_text(pixmap, NULL, x+1, y+1, align, white, black, buf);
+	gp_text(pixmap, NULL, x, y, align, black, black, buf);
 }
 
 static void dashed_vline(gp_pixmap *pixmap, gp_coord x, gp_coord y0, gp_coord y1, gp_pixel color)
@@ -95,11 +99,7 @@ static void grid_render(void *gr_i, struct xqx_view *vw, gp_pixmap *pixmap, stru
 	for (i = lc.x; i <= hc.x; i++) {
 		int64_t tmp = i;
 		tmp *= gr->step;
-		tmp -= vw->center.x;
-		tmp *= vw->scale_px;
-		tmp /= vw->scale_cx;
-		tmp /= vw->scale_main;
-		tmp += vw->w / 2;
+		tmp = xqx_view_coord_to_px_x(vw, tmp);
 
 		if (i % 5)
 			dashed_vline(pixmap, tmp, rect->ly, rect->hy, color);
@@ -110,11 +110,7 @@ static void grid_render(void *gr_i, struct xqx_view *vw, gp_pixmap *pixmap, stru
 	for (i = lc.y; i <= hc.y; i++) {
 		int64_t tmp = i;
 		tmp *= gr->step;
-		tmp -= vw->center.y;
-		tmp *= vw->scale_py;
-		tmp /= vw->scale_cy;
-		tmp /= vw->scale_main;
-		tmp += vw->h / 2;
+		tmp = xqx_view_coord_to_px_y(vw, tmp);
 
 		if (i % 5)
 			dashed_hline(pixmap, rect->lx, rect->hx, tmp, color);
@@ -125,12 +121,7 @@ static void grid_render(void *gr_i, struct xqx_view *vw, gp_pixmap *pixmap, stru
 	for (i = lc.x; i <= hc.x; i++) {
 		int coord = i * gr->step;
 		if (coord % 16000 == 0) {
-			int64_t tmp = coord;
-			tmp -= vw->center.x;
-			tmp *= vw->scale_px;
-			tmp /= vw->scale_cx;
-			tmp /= vw->scale_main;
-			tmp += vw->w / 2;
+			int64_t tmp = xqx_view_coord_to_px_x(vw, coord);
 			draw_coord(pixmap, (int) tmp, 1, GP_ALIGN_CENTER | GP_VALIGN_BELOW, coord);
 		}
 	}
@@ -138,12 +129,7 @@ static void grid_render(void *gr_i, struct xqx_view *vw, gp_pixmap *pixmap, stru
 	for (i = lc.y; i <= hc.y; i++) {
 		int coord = i * gr->step;
 		if (coord % 16000 == 0) {
-			int64_t tmp = coord;
-			tmp -= vw->center.y;
-			tmp *= vw->scale_py;
-			tmp /= vw->scale_cy;
-			tmp /= vw->scale_main;
-			tmp += vw->h / 2;
+			int64_t tmp = xqx_view_coord_to_px_y(vw, coord);
 
 			draw_coord(pixmap, 1, (int) tmp, GP_ALIGN_RIGHT | GP_VALIGN_CENTER, coord);
 		}
@@ -158,6 +144,7 @@ struct xqx_grid *xqx_make_grid(void)
 	if (!gr)
 		return NULL;
 
+	gr->common.name = "grid";
 	gr->common.notify_cb = grid_notify;
 	gr->common.render_cb = grid_render;
 	gr->dist = 60;
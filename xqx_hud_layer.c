@@ -0,0 +1,166 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Cyril Hrubis <metan@ucw.cz>
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "xqx_time.h"
+#include "xqx_map_cache.h"
+#include "xqx_map_layer.h"
+#include "xqx_hud_layer.h"
+
+#define HUD_PERIOD_MS 1000
+#define HUD_PADD 4
+
+static void level_counters(struct xqx_map *map, uint64_t *hits, uint64_t *misses)
+{
+	int l;
+
+	*hits = *misses = 0;
+
+	if (!map)
+		return;
+
+	for (l = 0; l < map->num_levels; l++) {
+		*hits += map->cache.levels[l].hits;
+		*misses += map->cache.levels[l].misses;
+	}
+}
+
+static void hud_update(struct xqx_hud *hud, struct xqx_view *vw)
+{
+	uint64_t now = xqx_time_us();
+	uint64_t dt = now - hud->last_us;
+	uint32_t frames = vw->frames - hud->last_frames;
+	uint64_t hits, misses, dh, dm;
+	unsigned int pending = 0;
+	size_t resident = 0;
+
+	level_counters(vw->active_map, &hits, &misses);
+
+	dh = hits - hud->last_hits;
+	dm = misses - hud->last_misses;
+
+	if (vw->active_map) {
+		/* map layer is always the last one, see xqx_view_choose_map() */
+		pending = xqx_map_layer_pending((struct xqx_map_layer *)vw->view_last);
+		resident = vw->active_map->cache.act_size;
+	}
+
+	snprintf(hud->lines[0], XQX_HUD_LINE_LEN, "%.1f FPS frame %.2fms",
+	         dt ? 1000000.0 * frames / dt : 0.0, vw->frame_us / 1000.0);
+
+	snprintf(hud->lines[1], XQX_HUD_LINE_LEN, "pending %u hit %.1f%%",
+	         pending, (dh + dm) ? 100.0 * dh / (dh + dm) : 100.0);
+
+	snprintf(hud->lines[2], XQX_HUD_LINE_LEN, "cache %zuMB queue %u/%u/%u/%u",
+	         resident >> 20,
+	         xqx_map_cache_queue_depth(0), xqx_map_cache_queue_depth(1),
+	         xqx_map_cache_queue_depth(2), xqx_map_cache_queue_depth(3));
+
+	hud->last_us = now;
+	hud->last_frames = vw->frames;
+	hud->last_hits = hits;
+	hud->last_misses = misses;
+}
+
+static void hud_box(struct xqx_hud *hud, struct xqx_view *vw, struct xqx_rectangle *box)
+{
+	gp_size w = 0;
+	unsigned int i;
+
+	for (i = 0; i < XQX_HUD_LINES; i++)
+		w = MAX(w, gp_text_width(NULL, hud->lines[i]));
+
+	box->lx = (int)vw->w - (int)w - 2 * HUD_PADD;
+	box->ly = 0;
+	box->hx = vw->w;
+	box->hy = XQX_HUD_LINES * gp_text_height(NULL) + 2 * HUD_PADD;
+}
+
+static uint32_t hud_timer(gp_timer *self)
+{
+	struct xqx_hud *hud = self->priv;
+	struct xqx_view *vw = hud->common.view;
+	struct xqx_rectangle old = hud->box;
+
+	if (!vw)
+		return GP_TIMER_STOP;
+
+	hud_update(hud, vw);
+	hud_box(hud, vw, &hud->box);
+
+	/* the box shrinks and grows with the text, repaint both */
+	xqx_view_request_overlay_redraw(vw, MIN(old.lx, hud->box.lx), 0,
+	                                vw->w, MAX(old.hy, hud->box.hy));
+
+	return HUD_PERIOD_MS;
+}
+
+static void hud_notify(void *hud_i, struct xqx_view *vw, uint32_t change)
+{
+	struct xqx_hud *hud = hud_i;
+
+	switch (change) {
+	case XQX_VLC_INIT:
+		hud->last_us = xqx_time_us();
+		hud->last_frames = vw->frames;
+		level_counters(vw->active_map, &hud->last_hits, &hud->last_misses);
+		hud->timer.expires = HUD_PERIOD_MS;
+		gp_app_timer_start(&hud->timer);
+	break;
+	case XQX_VLC_FINISH:
+		gp_app_timer_stop(&hud->timer);
+	break;
+	}
+}
+
+static void hud_render(void *hud_i, struct xqx_view *vw, gp_pixmap *pixmap, struct xqx_rectangle *rect)
+{
+	struct xqx_hud *hud = hud_i;
+	gp_size th = gp_text_height(NULL);
+	unsigned int i;
+
+	hud_box(hud, vw, &hud->box);
+
+	if (rect->hx <= hud->box.lx || rect->ly >= hud->box.hy)
+		return;
+
+	gp_pixel bg = gp_rgb_to_pixmap_pixel(0x00, 0x00, 0x00, pixmap);
+	gp_pixel fg = gp_rgb_to_pixmap_pixel(0xff, 0xff, 0xff, pixmap);
+
+	gp_fill_rect_xyxy(pixmap, hud->box.lx, hud->box.ly,
+	                  hud->box.hx - 1, hud->box.hy - 1, bg);
+
+	for (i = 0; i < XQX_HUD_LINES; i++) {
+		gp_text(pixmap, NULL, hud->box.lx + HUD_PADD, HUD_PADD + i * th,
+		        GP_ALIGN_RIGHT | GP_VALIGN_BELOW, fg, bg, hud->lines[i]);
+	}
+}
+
+struct xqx_hud *xqx_make_hud(void)
+{
+	struct xqx_hud *hud;
+
+	hud = calloc(1, sizeof(struct xqx_hud));
+	if (!hud)
+		return NULL;
+
+	hud->common.name = "hud";
+	hud->common.notify_cb = hud_notify;
+	hud->common.render_cb = hud_render;
+
+	hud->timer.callback = hud_timer;
+	hud->timer.id = "HUD refresh";
+	hud->timer.priv = hud;
+
+	return hud;
+}
+
+void xqx_discard_hud(struct xqx_hud *hud)
+{
+	gp_app_timer_stop(&hud->timer);
+	free(hud);
+}
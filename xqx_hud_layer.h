@@ -0,0 +1,45 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Cyril Hrubis <metan@ucw.cz>
+ */
+
+/*
+
+   A layer that draws performance counters, i.e. frame rate, frame time,
+   number of tiles that are being loaded and cache hit ratio.
+
+ */
+
+#ifndef XQX_HUD_LAYER_H__
+#define XQX_HUD_LAYER_H__
+
+#include <stdint.h>
+
+#include "xqx_view.h"
+
+#define XQX_HUD_LINES 3
+#define XQX_HUD_LINE_LEN 64
+
+struct xqx_hud
+{
+	struct xqx_view_layer common;
+
+	/* periodic refresh of the counters */
+	gp_timer timer;
+
+	/* values from the previous refresh, used to compute rates */
+	uint64_t last_us;
+	uint32_t last_frames;
+	uint64_t last_hits, last_misses;
+
+	/* area occupied on the screen during last render */
+	struct xqx_rectangle box;
+
+	char lines[XQX_HUD_LINES][XQX_HUD_LINE_LEN];
+};
+
+struct xqx_hud *xqx_make_hud(void);
+
+void xqx_discard_hud(struct xqx_hud *hud);
+
+#endif /* XQX_HUD_LAYER_H__ */
@@ -13,11 +13,16 @@ static struct xqx_map_ops *maps_ops;
 struct xqx_map *xqx_map_load(const char *filename)
 {
 	struct xqx_map_ops *ops;
+	struct xqx_map *map;
 	int nl = strlen(filename);
 
 	for (ops = maps_ops; ops; ops = ops->next) {
-		if ((nl > ops->suffix_len) && !strcmp(filename + (nl - ops->suffix_len), ops->suffix))
-			return (ops->map_load_cb(filename));
+		if ((nl > ops->suffix_len) && !strcmp(filename + (nl - ops->suffix_len), ops->suffix)) {
+			map = ops->map_load_cb(filename);
+			if (map)
+				map->pathname = realpath(filename, NULL);
+			return map;
+		}
 	}
 
 	return NULL;
@@ -30,6 +35,6 @@ void xqx_map_set_projection(struct xqx_map *map, unsigned int epsg)
 
 void xqx_register_map_ops(struct xqx_map_ops *ops)
 {
-	ops->next = ops;
+	ops->next = maps_ops;
 	maps_ops = ops;
 }
@@ -34,6 +34,8 @@ struct xqx_map_ops
 struct xqx_map
 {
 	struct xqx_map_ops *ops;
+	/* path the map was loaded from */
+	char *pathname;
 	int map_w, map_h, tile_w, tile_h;
 	int num_levels;
 	int *num_tiles_x, *num_tiles_y;
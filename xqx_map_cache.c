@@ -6,12 +6,15 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <widgets/gp_app_task.h>
 
 #include "xqx_map.h"
 #include "xqx_map_cache.h"
 #include "xqx_dllist.h"
+#include "xqx_time.h"
+#include "xqx_trace.h"
 
 static struct xqx_map_cache *cache;
 
@@ -46,26 +49,51 @@ void xqx_map_cache_init(size_t low_size, size_t high_size, uint32_t hash_size)
 	cache->low_size = low_size;
 	cache->high_size = high_size;
 	cache->hash_size = hash_size;
+	pthread_rwlock_init(&cache->lock, NULL);
 }
 
 static void register_cleanup(void);
 
+static void unlink_cache_node(struct xqx_map *map, struct xqx_map_cache_node *cn);
+
 struct xqx_map_cache_node *xqx_map_cache_node_make(struct xqx_map *map, uint32_t l, uint32_t x, uint32_t y, enum xqx_map_cache_node_state state, void *data)
 {
 	struct xqx_map_cache_map *ci = &(map->cache);
-	struct xqx_map_cache_node *cn = calloc(1, sizeof(struct xqx_map_cache_node));
-	struct xqx_map_cache_node **pos;
+	struct xqx_map_cache_node *old = xqx_map_cache_find(map, l, x, y);
+	struct xqx_map_cache_node *cn, **pos;
+
+	/* a tile loaded in the background replaces its placeholder */
+	if (old && old->state == XQX_CACHE_NODE_PENDING) {
+		unlink_cache_node(map, old);
+		xqx_map_cache_put(old);
+	} else if (old) {
+		/* loaded already, e.g. by a job queued again after its placeholder was evicted */
+		if (state == XQX_CACHE_NODE_VALID_DATA)
+			xqx_pixmap_free(data);
+
+		return old;
+	}
+
+	cn = calloc(1, sizeof(struct xqx_map_cache_node));
 
 	cn->state = state;
 	cn->data = data;
 	cn->l = l;
 	cn->x = x;
 	cn->y = y;
+	cn->used = __atomic_add_fetch(&cache->clock, 1, __ATOMIC_RELAXED);
+	cn->refs = 1;
 
+	pthread_rwlock_wrlock(&cache->lock);
 	DLL_APPEND(ci, node_first, node_last, cn, prev, next);
 	pos = index_hash(ci, l, x, y);
 	cn->hash_next = *pos;
 	*pos = cn;
+	pthread_rwlock_unlock(&cache->lock);
+
+	ci->nodes++;
+	cache->stats.inserts++;
+	XQX_TRACE_TILE(XQX_TRACE_TILE_INSERT, l, x, y);
 
 	if (state == XQX_CACHE_NODE_VALID_DATA)
 		map->cache.act_size += map->cache.node_size;
@@ -73,6 +101,9 @@ struct xqx_map_cache_node *xqx_map_cache_node_make(struct xqx_map *map, uint32_t
 	if (map->cache.act_size > cache->high_size)
 		register_cleanup();
 
+	if (state == XQX_CACHE_NODE_PENDING)
+		return cn;
+
 	// printf("ADD L%u X%u Y%u S%u\n", l, x, y, state);
 	struct xqx_map_cache_client *cc;
 	for (cc = ci->levels[l].notify_first; cc != NULL; cc = cc->notify_next)
@@ -81,8 +112,22 @@ struct xqx_map_cache_node *xqx_map_cache_node_make(struct xqx_map *map, uint32_t
 	return cn;
 }
 
-static void destroy_cache_node(struct xqx_map *map, struct xqx_map_cache_node *cn)
+void xqx_map_cache_put(struct xqx_map_cache_node *cn)
 {
+	if (__atomic_sub_fetch(&cn->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	/* ugly hack */
+	if (cn->state == XQX_CACHE_NODE_VALID_DATA)
+		xqx_pixmap_free(cn->data);
+
+	free(cn);
+}
+
+static void unlink_cache_node(struct xqx_map *map, struct xqx_map_cache_node *cn)
+{
+	pthread_rwlock_wrlock(&cache->lock);
+
 	DLL_REMOVE(map, cache.node_first, cache.node_last, cn, prev, next);
 
 	struct xqx_map_cache_node **pos;
@@ -92,31 +137,89 @@ static void destroy_cache_node(struct xqx_map *map, struct xqx_map_cache_node *c
 //	ASSERT (*pos != NULL);
 	*pos = cn->hash_next;
 
-	/* ugly hack */
-	if (cn->state == XQX_CACHE_NODE_VALID_DATA) {
+	pthread_rwlock_unlock(&cache->lock);
+
+	map->cache.nodes--;
+
+	if (cn->state == XQX_CACHE_NODE_VALID_DATA)
 		map->cache.act_size -= map->cache.node_size;
-		xqx_pixmap_free(cn->data);
+}
+
+static void destroy_cache_node(struct xqx_map *map, struct xqx_map_cache_node *cn)
+{
+	unlink_cache_node(map, cn);
+
+	cache->stats.evictions++;
+	XQX_TRACE_TILE(XQX_TRACE_TILE_EVICT, cn->l, cn->x, cn->y);
+
+	/* the data are freed once the last renderer is done with them */
+	xqx_map_cache_put(cn);
+}
+
+struct xqx_map_cache_node *xqx_map_cache_find(struct xqx_map *map, uint32_t level, uint32_t x, uint32_t y)
+{
+	struct xqx_map_cache_node *n;
+
+	for (n = *index_hash(&(map->cache), level, x, y); n; n = n->hash_next) {
+		if ((n->l == level) && (n->x == x) && (n->y == y))
+			return n;
 	}
 
-	free(cn);
+	return NULL;
 }
 
+/*
+ * Lookups may run concurrently from the render bands, hence the counters
+ * are updated atomically.
+ */
 struct xqx_map_cache_node *xqx_map_cache_lookup(struct xqx_map_cache_client *client, struct xqx_map *map,
                                                 uint32_t level, uint32_t x, uint32_t y)
 {
-	struct xqx_map_cache_node *n;
+	struct xqx_map_cache_node *n = xqx_map_cache_find(map, level, x, y);
 
 	(void) client;
 
-	for (n = *index_hash(&(map->cache), level, x, y); n; n = n->hash_next) {
-		if ((n->l == level) && (n->x == x) && (n->y == y)) {
-			// printf("L OK\n");
-			/* FIXME update LRU */
-			return n;
-		}
+	if (!n) {
+		__atomic_add_fetch(&map->cache.levels[level].misses, 1, __ATOMIC_RELAXED);
+		return NULL;
 	}
 
-	return NULL;
+	// printf("L OK\n");
+	__atomic_add_fetch(&map->cache.levels[level].hits, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&n->used, __atomic_add_fetch(&cache->clock, 1, __ATOMIC_RELAXED),
+	                 __ATOMIC_RELAXED);
+	return n;
+}
+
+static struct xqx_map_cache_node *node_get(struct xqx_map_cache_client *client, struct xqx_map *map,
+                                           uint32_t level, uint32_t x, uint32_t y, int count)
+{
+	struct xqx_map_cache_node *n;
+
+	pthread_rwlock_rdlock(&cache->lock);
+
+	if (count)
+		n = xqx_map_cache_lookup(client, map, level, x, y);
+	else
+		n = xqx_map_cache_find(map, level, x, y);
+
+	if (n)
+		__atomic_add_fetch(&n->refs, 1, __ATOMIC_RELAXED);
+
+	pthread_rwlock_unlock(&cache->lock);
+
+	return n;
+}
+
+struct xqx_map_cache_node *xqx_map_cache_get(struct xqx_map_cache_client *client, struct xqx_map *map,
+                                             uint32_t level, uint32_t x, uint32_t y)
+{
+	return node_get(client, map, level, x, y, 1);
+}
+
+struct xqx_map_cache_node *xqx_map_cache_find_get(struct xqx_map *map, uint32_t level, uint32_t x, uint32_t y)
+{
+	return node_get(NULL, map, level, x, y, 0);
 }
 
 void xqx_map_cache_init_map(struct xqx_map *map)
@@ -225,54 +328,57 @@ static int cache_iteration(uint32_t least_prio)
 	uint32_t l, x, y;
 
 	int rv = query_cache_clients(least_prio, &map, &l, &x, &y);
-	if (rv)
+	if (rv) {
+		XQX_TRACE_EV(XQX_TRACE_INSTANT, XQX_TRACE_TILE_REQ, NULL, l, x, y, rv);
 		xqx_map_read_tile(map, l, x, y);
+	}
 
 	return (rv);
 }
 
+static void hist_add(struct xqx_map_cache_hist *hist, uint32_t us);
+
 static void local_cache_cleanup(struct xqx_map *map)
 {
 	struct xqx_map_cache_node *cn, *acn;
 	struct xqx_map_cache_client *cc;
+	uint64_t t = xqx_time_us();
 
 	uint32_t prio, node_prio, tmp;
 
-	int tbl[4] = {0, 0, 0, 0};
-	int cln = 0;
-
 	for (prio = 0; prio < MAX_PRIO; prio++) {
-		if (prio == 1)
-			printf("TBL %d %d %d %d\n", tbl[0], tbl[1], tbl[2], tbl[3]);
 		cn = map->cache.node_first;
 
 		while (cn) {
 			if(map->cache.act_size <= cache->low_size) {
-				printf("Cleanup finished successfully during phase %d (%d cleaned)\n", prio, cln);
-				return;
+				cache->stats.cleanups++;
+				goto out;
 			}
 
 			acn = cn;
 			cn = cn->next;
 			node_prio = 0;
 
+			/*
+			 * Placeholders take no memory and evicting one would
+			 * queue the tile to be loaded in the background again.
+			 */
+			if (acn->state == XQX_CACHE_NODE_PENDING)
+				continue;
+
 			for (cc = map->cache.levels[acn->l].notify_first; cc; cc = cc->notify_next) {
 				tmp = eval_in_cache_client(cc, acn);
 				node_prio = MAX(node_prio, tmp);
 			}
 
-			if (prio == 0)
-				tbl[node_prio]++;
-
-			if (node_prio <= prio) {
+			if (node_prio <= prio)
 				destroy_cache_node(map, acn);
-				cln++;
-			}
 		}
 	}
 
-	printf("Cleanup finished unsuccessfully (%d cleaned)\n", cln);
-	printf("TBL %d %d %d %d\n", tbl[0], tbl[1], tbl[2], tbl[3]);
+	cache->stats.cleanups_failed++;
+out:
+	hist_add(&cache->stats.cleanup, xqx_time_us() - t);
 }
 
 static void cache_cleanup(void)
@@ -282,6 +388,54 @@ static void cache_cleanup(void)
 		local_cache_cleanup(map);
 }
 
+/* the cleanup task does not run without the main loop */
+static void run_cleanup(void)
+{
+	struct xqx_map *map;
+
+	for (map = cache->map_first; map; map = map->cache.next) {
+		if (map->cache.act_size > cache->high_size)
+			local_cache_cleanup(map);
+	}
+}
+
+unsigned int xqx_map_cache_run(unsigned int least_prio)
+{
+	unsigned int ret = 0;
+
+	least_prio = CLAMP(least_prio, MIN_PRIO, MAX_PRIO);
+
+	while (cache_iteration(least_prio)) {
+		ret++;
+		run_cleanup();
+	}
+
+	return ret;
+}
+
+unsigned int xqx_map_cache_run_client(struct xqx_map_cache_client *cc, unsigned int least_prio)
+{
+	struct xqx_map *map;
+	uint32_t l, x, y, prio;
+	unsigned int ret = 0;
+
+	least_prio = CLAMP(least_prio, MIN_PRIO, MAX_PRIO);
+
+	for (;;) {
+		prio = query_cache_client(cc, &map, &l, &x, &y);
+		if (prio < least_prio)
+			break;
+
+		XQX_TRACE_EV(XQX_TRACE_INSTANT, XQX_TRACE_TILE_REQ, NULL, l, x, y, prio);
+		xqx_map_read_tile(map, l, x, y);
+
+		ret++;
+		run_cleanup();
+	}
+
+	return ret;
+}
+
 static int cache_high_iteration(gp_task *self)
 {
 	(void) self;
@@ -323,15 +477,11 @@ static void register_event_source(void)
 		.prio = 2,
 	};
 
-	if (prio == MAX_PRIO) {
-		printf("CACHE MAX!\n");
+	if (prio == MAX_PRIO)
 		gp_app_task_start(&high_prio);
-	}
 
-	if (prio > 0) {
-		printf("CACHE LOW!\n");
+	if (prio > 0)
 		gp_app_task_start(&low_prio);
-	}
 }
 
 static int cache_cleanup_iteration(gp_task *self)
@@ -352,3 +502,259 @@ static void register_cleanup(void)
 
 	gp_app_task_start(&cleanup);
 }
+
+/* statistics */
+
+const struct xqx_map_cache_stats *xqx_map_cache_stats(void)
+{
+	return &cache->stats;
+}
+
+void xqx_map_cache_stats_reset(void)
+{
+	struct xqx_map *map;
+	int l;
+
+	memset(&cache->stats, 0, sizeof(cache->stats));
+
+	for (map = cache->map_first; map; map = map->cache.next) {
+		for (l = 0; l < map->num_levels; l++) {
+			map->cache.levels[l].hits = 0;
+			map->cache.levels[l].misses = 0;
+		}
+	}
+}
+
+unsigned int xqx_map_cache_queue_depth(unsigned int prio)
+{
+	struct xqx_map_cache_client *cc;
+	unsigned int ret = 0;
+
+	if (prio > MAX_PRIO)
+		return 0;
+
+	for (cc = cache->query_first[prio]; cc; cc = cc->query_next)
+		ret++;
+
+	return ret;
+}
+
+static void hist_add(struct xqx_map_cache_hist *hist, uint32_t us)
+{
+	unsigned int i = 0;
+
+	while (us >> (i + 1) && i < XQX_CACHE_HIST_BUCKETS - 1)
+		i++;
+
+	hist->buckets[i]++;
+	hist->cnt++;
+	hist->total_us += us;
+}
+
+void xqx_map_cache_account_io(uint32_t us)
+{
+	hist_add(&cache->stats.io, us);
+}
+
+void xqx_map_cache_account_decode(uint32_t us)
+{
+	hist_add(&cache->stats.decode, us);
+}
+
+static void hist_print(FILE *f, const char *name, const struct xqx_map_cache_hist *hist)
+{
+	unsigned int i;
+
+	fprintf(f, "%s: %u samples avg %lluus\n", name, hist->cnt,
+	        hist->cnt ? (unsigned long long)(hist->total_us / hist->cnt) : 0llu);
+
+	for (i = 0; i < XQX_CACHE_HIST_BUCKETS; i++) {
+		if (hist->buckets[i])
+			fprintf(f, "\t< %8uus %u\n", 2u << i, hist->buckets[i]);
+	}
+}
+
+void xqx_map_cache_stats_print(FILE *f)
+{
+	const struct xqx_map_cache_stats *stats = &cache->stats;
+	struct xqx_map *map;
+	unsigned int i;
+	int l;
+
+	fprintf(f, "inserts %llu evictions %llu cleanups %u (%u failed)\n",
+	        (unsigned long long)stats->inserts, (unsigned long long)stats->evictions,
+	        stats->cleanups, stats->cleanups_failed);
+
+	fprintf(f, "queue depth");
+	for (i = 0; i <= MAX_PRIO; i++)
+		fprintf(f, " %u", xqx_map_cache_queue_depth(i));
+	fprintf(f, "\n");
+
+	for (map = cache->map_first; map; map = map->cache.next) {
+		fprintf(f, "map '%s' nodes %u resident %zukB\n",
+		        map->pathname ? map->pathname : "(unknown)",
+		        map->cache.nodes, map->cache.act_size / 1024);
+
+		for (l = 0; l < map->num_levels; l++) {
+			fprintf(f, "\tlevel %i hits %llu misses %llu\n", l,
+			        (unsigned long long)map->cache.levels[l].hits,
+			        (unsigned long long)map->cache.levels[l].misses);
+		}
+	}
+
+	hist_print(f, "io", &stats->io);
+	hist_print(f, "decode", &stats->decode);
+	hist_print(f, "cleanup", &stats->cleanup);
+}
+
+/* working set snapshot and prefetch */
+
+static int cmp_used(const void *a, const void *b)
+{
+	const struct xqx_map_cache_node *na = *(struct xqx_map_cache_node **)a;
+	const struct xqx_map_cache_node *nb = *(struct xqx_map_cache_node **)b;
+
+	/* clock differences are wraparound safe */
+	int32_t diff = nb->used - na->used;
+
+	return (diff > 0) - (diff < 0);
+}
+
+unsigned int xqx_map_cache_recent(struct xqx_map *map, struct xqx_map_cache_key *keys, unsigned int max)
+{
+	struct xqx_map_cache_node *cn, **nodes;
+	unsigned int i, cnt = 0;
+
+	for (cn = map->cache.node_first; cn; cn = cn->next)
+		cnt++;
+
+	if (!cnt)
+		return 0;
+
+	nodes = malloc(cnt * sizeof(*nodes));
+	if (!nodes)
+		return 0;
+
+	cnt = 0;
+	for (cn = map->cache.node_first; cn; cn = cn->next) {
+		if (cn->state != XQX_CACHE_NODE_ERROR && cn->state != XQX_CACHE_NODE_PENDING)
+			nodes[cnt++] = cn;
+	}
+
+	qsort(nodes, cnt, sizeof(*nodes), cmp_used);
+
+	cnt = MIN(cnt, max);
+
+	for (i = 0; i < cnt; i++) {
+		keys[i].l = nodes[i]->l;
+		keys[i].x = nodes[i]->x;
+		keys[i].y = nodes[i]->y;
+	}
+
+	free(nodes);
+
+	return cnt;
+}
+
+struct prefetch {
+	struct xqx_map_cache_client *cc;
+	struct xqx_map *map;
+	unsigned int cnt, pos;
+	struct xqx_map_cache_key keys[];
+};
+
+static struct prefetch *prefetch;
+
+static uint32_t prefetch_query(void *priv, struct xqx_map **map, uint32_t *l, uint32_t *x, uint32_t *y)
+{
+	struct prefetch *pf = priv;
+
+	for (; pf->pos < pf->cnt; pf->pos++) {
+		struct xqx_map_cache_key *key = &pf->keys[pf->pos];
+
+		if (xqx_map_cache_lookup(pf->cc, pf->map, key->l, key->x, key->y))
+			continue;
+
+		*map = pf->map;
+		*l = key->l;
+		*x = key->x;
+		*y = key->y;
+
+		/* must not delay tiles requested by layers */
+		return MIN_PRIO;
+	}
+
+	return 0;
+}
+
+static void prefetch_notify(void *priv, struct xqx_map *map, uint32_t l, uint32_t x, uint32_t y,
+                            struct xqx_map_cache_node *cn)
+{
+	(void) priv; (void) map; (void) l; (void) x; (void) y; (void) cn;
+}
+
+static uint32_t prefetch_eval(void *priv, struct xqx_map_cache_node *cn)
+{
+	(void) priv; (void) cn;
+
+	return 0;
+}
+
+static struct xqx_map_cache_client_ops prefetch_ops = {
+	prefetch_notify, prefetch_query, prefetch_eval
+};
+
+static int key_valid(struct xqx_map *map, const struct xqx_map_cache_key *key)
+{
+	if (key->l >= (uint32_t)map->num_levels)
+		return 0;
+
+	return key->x < (uint32_t)map->num_tiles_x[key->l] &&
+	       key->y < (uint32_t)map->num_tiles_y[key->l];
+}
+
+static void prefetch_free(void)
+{
+	xqx_map_cache_discard_client(prefetch->cc);
+	free(prefetch);
+	prefetch = NULL;
+}
+
+void xqx_map_cache_prefetch_cancel(struct xqx_map *map)
+{
+	if (prefetch && prefetch->map == map)
+		prefetch_free();
+}
+
+void xqx_map_cache_prefetch(struct xqx_map *map, const struct xqx_map_cache_key *keys, unsigned int cnt)
+{
+	unsigned int i;
+
+	if (prefetch)
+		prefetch_free();
+
+	if (!cnt)
+		return;
+
+	prefetch = malloc(sizeof(*prefetch) + cnt * sizeof(*keys));
+	if (!prefetch)
+		return;
+
+	prefetch->cc = xqx_map_cache_make_client(&prefetch_ops, prefetch);
+	if (!prefetch->cc) {
+		free(prefetch);
+		prefetch = NULL;
+		return;
+	}
+
+	prefetch->map = map;
+	prefetch->pos = 0;
+	prefetch->cnt = 0;
+
+	for (i = 0; i < cnt; i++) {
+		if (key_valid(map, &keys[i]))
+			prefetch->keys[prefetch->cnt++] = keys[i];
+	}
+
+	xqx_map_cache_request_attention(prefetch->cc, MIN_PRIO);
+}
@@ -18,33 +18,77 @@
 #define MAX_PRIO 3
 #define MIN_PRIO 1
 
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
 #include "xqx_common.h"
 #include "xqx_pixmap.h"
 
 enum xqx_map_cache_node_state {
 	XQX_CACHE_NODE_ERROR,
 	XQX_CACHE_NODE_VALID_DATA,
-	XQX_CACHE_NODE_VALID_COLOR
+	XQX_CACHE_NODE_VALID_COLOR,
+	/* tile is being loaded in the background, replaced once finished */
+	XQX_CACHE_NODE_PENDING
+};
+
+/* bucket i counts samples between 2^i and 2^(i+1) - 1 microseconds */
+#define XQX_CACHE_HIST_BUCKETS 24
+
+struct xqx_map_cache_hist
+{
+	uint32_t buckets[XQX_CACHE_HIST_BUCKETS];
+	uint32_t cnt;
+	uint64_t total_us;
+};
+
+struct xqx_map_cache_stats
+{
+	uint64_t inserts, evictions;
+
+	/* cleanups that did and did not get under the low watermark */
+	uint32_t cleanups, cleanups_failed;
+
+	/* time to read and decode a tile */
+	struct xqx_map_cache_hist io, decode;
+
+	/* time spent in cleanups, i.e. evicting tiles */
+	struct xqx_map_cache_hist cleanup;
 };
 
 struct xqx_map_cache
 {
 	size_t low_size, high_size;
 	uint32_t hash_size;
+	/* incremented on each node use, for LRU */
+	uint32_t clock;
 
 	struct xqx_map *map_first, *map_last;
 	struct xqx_map_cache_client *query_first[MAX_PRIO+1];
 	struct xqx_map_cache_client *query_last[MAX_PRIO+1];
+
+	struct xqx_map_cache_stats stats;
+
+	/*
+	 * Nodes are inserted and removed only from the main thread, the lock
+	 * serializes that with xqx_map_cache_get() called from other threads.
+	 */
+	pthread_rwlock_t lock;
 };
 
 struct xqx_map_cache_level
 {
 	struct xqx_map_cache_client *notify_first, *notify_last;
+
+	uint64_t hits, misses;
 };
 
 struct xqx_map_cache_map
 {
+	/* act_size is the size of pixmaps resident in memory */
 	size_t act_size, node_size;
+	uint32_t nodes;
 	struct xqx_map_cache_node **hash_table;
 	uint32_t hash_size;
 	struct xqx_map_cache_level *levels;
@@ -58,6 +102,10 @@ struct xqx_map_cache_node
 	uint32_t state;
 	void *data;
 	uint32_t l, x, y;
+	/* cache clock at last use */
+	uint32_t used;
+	/* the cache and each xqx_map_cache_get() caller hold a reference */
+	uint32_t refs;
 	struct xqx_map_cache_node *next, *prev; /* per image */
 	struct xqx_map_cache_node *hash_next;	 /* in hash list */
 };
@@ -104,9 +152,40 @@ xqx_map_cache_make_color_node(struct xqx_map *map, uint32_t l, uint32_t x, uint3
 	return xqx_map_cache_node_make(map, l, x, y, XQX_CACHE_NODE_VALID_COLOR, (void *) (uintptr_t) color);
 }
 
+/*
+ * Marks a tile that is being loaded in the background so that it's not
+ * requested again, the node is replaced by the node made for the loaded tile.
+ */
+static inline struct xqx_map_cache_node *
+xqx_map_cache_make_pending_node(struct xqx_map *map, uint32_t l, uint32_t x, uint32_t y)
+{
+	return xqx_map_cache_node_make(map, l, x, y, XQX_CACHE_NODE_PENDING, NULL);
+}
+
 struct xqx_map_cache_node *xqx_map_cache_lookup(struct xqx_map_cache_client *client, struct xqx_map *map,
                                                 uint32_t level, uint32_t x, uint32_t y);
 
+/*
+ * Looks up a node and takes a reference so that the node stays valid even if
+ * it's evicted meanwhile. Unlike xqx_map_cache_lookup() this can be called
+ * from any thread, the node has to be released by xqx_map_cache_put().
+ */
+struct xqx_map_cache_node *xqx_map_cache_get(struct xqx_map_cache_client *client, struct xqx_map *map,
+                                             uint32_t level, uint32_t x, uint32_t y);
+
+void xqx_map_cache_put(struct xqx_map_cache_node *cn);
+
+/*
+ * Looks up a node without counting it as a use, for statistics and inspection.
+ */
+struct xqx_map_cache_node *xqx_map_cache_find(struct xqx_map *map, uint32_t level, uint32_t x, uint32_t y);
+
+/*
+ * Same as xqx_map_cache_get() but not counted as a use, for probing tiles that
+ * are not the ones being rendered, e.g. when composing a stand-in tile.
+ */
+struct xqx_map_cache_node *xqx_map_cache_find_get(struct xqx_map *map, uint32_t level, uint32_t x, uint32_t y);
+
 void xqx_map_cache_init_map(struct xqx_map *map);
 
 struct xqx_map_cache_client *xqx_map_cache_make_client(struct xqx_map_cache_client_ops *ops, void *data);
@@ -117,4 +196,69 @@ void xqx_map_cache_request_notification(struct xqx_map_cache_client *client, str
 
 void xqx_map_cache_request_attention(struct xqx_map_cache_client *client, unsigned int prio);
 
+/*
+ * Loads tiles requested by the clients with at least least_prio priority
+ * synchronously, for rendering without the main loop.
+ *
+ * Returns number of tiles read.
+ */
+unsigned int xqx_map_cache_run(unsigned int least_prio);
+
+/*
+ * Same as xqx_map_cache_run() but loads only tiles requested by one client.
+ */
+unsigned int xqx_map_cache_run_client(struct xqx_map_cache_client *client, unsigned int least_prio);
+
+struct xqx_map_cache_key
+{
+	uint32_t l, x, y;
+};
+
+/*
+ * Stores up to max keys of tiles of a map cached in memory, most recently used
+ * first.
+ *
+ * Returns number of keys stored.
+ */
+unsigned int xqx_map_cache_recent(struct xqx_map *map, struct xqx_map_cache_key *keys, unsigned int max);
+
+/*
+ * Requests tiles to be loaded into the cache in the background in the order
+ * they are passed, with the lowest priority so that tiles requested by layers
+ * are loaded first. Previous prefetch request, if not finished, is replaced.
+ */
+void xqx_map_cache_prefetch(struct xqx_map *map, const struct xqx_map_cache_key *keys, unsigned int cnt);
+
+/*
+ * Cancels and frees the prefetch request for the map, if there is any.
+ */
+void xqx_map_cache_prefetch_cancel(struct xqx_map *map);
+
+/*
+ * Returns cache statistics, per level hits and misses are stored in the
+ * map->cache.levels[] and resident size in map->cache.act_size.
+ */
+const struct xqx_map_cache_stats *xqx_map_cache_stats(void);
+
+/*
+ * Resets cache statistics, including per map level counters.
+ */
+void xqx_map_cache_stats_reset(void);
+
+/*
+ * Returns number of clients that requested attention with a given priority.
+ */
+unsigned int xqx_map_cache_queue_depth(unsigned int prio);
+
+/*
+ * Accounts a time spent by reading and decoding a tile, called by map loaders.
+ */
+void xqx_map_cache_account_io(uint32_t us);
+void xqx_map_cache_account_decode(uint32_t us);
+
+/*
+ * Prints cache statistics.
+ */
+void xqx_map_cache_stats_print(FILE *f);
+
 #endif /* XQX_CACHE_H__ */
@@ -11,7 +11,7 @@ static uint32_t search_array(struct xqx_map_layer *ml, unsigned int level, int l
 {
 	while (ml->ay < hy) {
 		while (ml->ax < hx) {
-			if (xqx_map_cache_lookup(ml->cc, ml->map, level, ml->ax, ml->ay) == NULL)
+			if (xqx_map_cache_find(ml->map, level, ml->ax, ml->ay) == NULL)
 				return 1;
 			ml->ax++;
 		}
@@ -26,49 +26,49 @@ static uint32_t find_missing_tile(struct xqx_map_layer *ml)
 {
 	switch (ml->as) {
 	case 0:
-		ml->ax = ml->tx2;
-		ml->ay = ml->ty2;
+		ml->ax = ml->g.tx2;
+		ml->ay = ml->g.ty2;
 		ml->as = 1;
 	/* fallthrough */
 	case 1:
-		if (search_array(ml, ml->level, ml->tx2, ml->tx3, ml->ty3))
+		if (search_array(ml, ml->g.level, ml->g.tx2, ml->g.tx3, ml->g.ty3))
 			return 3;
-		ml->ax = ml->tx1;
-		ml->ay = ml->ty1;
+		ml->ax = ml->g.tx1;
+		ml->ay = ml->g.ty1;
 		ml->as = 2;
 	/* fallthrough */
 	case 2:
-		if (search_array(ml, ml->level, ml->tx1, ml->tx4, ml->ty2))
+		if (search_array(ml, ml->g.level, ml->g.tx1, ml->g.tx4, ml->g.ty2))
 			return 2;
-		ml->ax = ml->tx1;
-		ml->ay = ml->ty3;
+		ml->ax = ml->g.tx1;
+		ml->ay = ml->g.ty3;
 		ml->as = 3;
 	/* fallthrough */
 	case 3:
-		if (search_array(ml, ml->level, ml->tx1, ml->tx4, ml->ty4))
+		if (search_array(ml, ml->g.level, ml->g.tx1, ml->g.tx4, ml->g.ty4))
 			return 2;
-		ml->ax = ml->tx1;
-		ml->ay = ml->ty2;
+		ml->ax = ml->g.tx1;
+		ml->ay = ml->g.ty2;
 		ml->as = 4;
 	/* fallthrough */
 	case 4:
-		if (search_array(ml, ml->level, ml->tx1, ml->tx2, ml->ty3))
+		if (search_array(ml, ml->g.level, ml->g.tx1, ml->g.tx2, ml->g.ty3))
 			return 2;
-		ml->ax = ml->tx3;
-		ml->ay = ml->ty2;
+		ml->ax = ml->g.tx3;
+		ml->ay = ml->g.ty2;
 		ml->as = 5;
 	/* fallthrough */
 	case 5:
-		if (search_array(ml, ml->level, ml->tx3, ml->tx4, ml->ty3))
+		if (search_array(ml, ml->g.level, ml->g.tx3, ml->g.tx4, ml->g.ty3))
 			return 2;
-		ml->ax = ml->t2x1;
-		ml->ay = ml->t2y1;
+		ml->ax = ml->g.t2x1;
+		ml->ay = ml->g.t2y1;
 		ml->as = 6;
-		if (ml->level == 0)
+		if (ml->g.level == 0)
 			return 0;
 	/* fallthrough */
 	case 6:
-		if (search_array(ml, ml->level - 1, ml->t2x1, ml->t2x2, ml->t2y2))
+		if (search_array(ml, ml->g.level - 1, ml->g.t2x1, ml->g.t2x2, ml->g.t2y2))
 			return 1;
 		ml->as = 7;
 	/* fallthrough */
@@ -79,20 +79,284 @@ static uint32_t find_missing_tile(struct xqx_map_layer *ml)
 	return 0;
 }
 
+/* stand-in tiles scaled from a neighbouring level */
+
+/* Has to be called with the fallback_lock held */
+static void fallback_put(struct xqx_map_fallback *fb)
+{
+	if (--fb->refs)
+		return;
+
+	xqx_pixmap_free(fb->pixmap);
+	free(fb);
+}
+
+static void fallbacks_flush(struct xqx_map_layer *ml)
+{
+	unsigned int i;
+
+	for (i = 0; i < XQX_MAP_LAYER_FALLBACKS; i++) {
+		if (ml->fallbacks[i]) {
+			fallback_put(ml->fallbacks[i]);
+			ml->fallbacks[i] = NULL;
+		}
+	}
+
+	ml->fallback_next = 0;
+}
+
+static struct xqx_map_fallback **fallback_find(struct xqx_map_layer *ml, uint32_t l, uint32_t x, uint32_t y)
+{
+	unsigned int i;
+
+	for (i = 0; i < XQX_MAP_LAYER_FALLBACKS; i++) {
+		struct xqx_map_fallback *fb = ml->fallbacks[i];
+
+		if (fb && fb->l == l && fb->x == x && fb->y == y)
+			return &ml->fallbacks[i];
+	}
+
+	return NULL;
+}
+
+static void fallback_insert(struct xqx_map_layer *ml, struct xqx_map_fallback *fb)
+{
+	struct xqx_map_fallback **slot = &ml->fallbacks[ml->fallback_next];
+
+	if (*slot)
+		fallback_put(*slot);
+
+	*slot = fb;
+
+	ml->fallback_next = (ml->fallback_next + 1) % XQX_MAP_LAYER_FALLBACKS;
+}
+
+/*
+ * Returns tile pixmap and a cache node reference that has to be released by
+ * xqx_map_cache_put() once the pixmap is not used anymore.
+ */
+static xqx_pixmap *tile_get(struct xqx_map_layer *ml, uint32_t l, uint32_t x, uint32_t y,
+                            struct xqx_map_cache_node **cn)
+{
+	*cn = NULL;
+
+	if (l >= (uint32_t)ml->map->num_levels)
+		return NULL;
+
+	if (x >= (uint32_t)ml->map->num_tiles_x[l] || y >= (uint32_t)ml->map->num_tiles_y[l])
+		return NULL;
+
+	*cn = xqx_map_cache_find_get(ml->map, l, x, y);
+	if (!*cn)
+		return NULL;
+
+	if ((*cn)->state != XQX_CACHE_NODE_VALID_DATA) {
+		xqx_map_cache_put(*cn);
+		*cn = NULL;
+		return NULL;
+	}
+
+	return (*cn)->data;
+}
+
+/*
+ * Composes a tile from children on the more detailed level, returns NULL
+ * unless at least min_children are available.
+ */
+static xqx_pixmap *fallback_from_children(struct xqx_map_layer *ml, uint32_t l, uint32_t x, uint32_t y,
+                                          unsigned int min_children)
+{
+	struct xqx_map_cache_node *nodes[4];
+	xqx_pixmap *children[4];
+	unsigned int i, cnt = 0, avail = 0;
+	xqx_pixmap *ret = NULL;
+
+	if (l == 0)
+		return NULL;
+
+	for (i = 0; i < 4; i++) {
+		uint32_t cx = 2 * x + i % 2;
+		uint32_t cy = 2 * y + i / 2;
+
+		if (cx < (uint32_t)ml->map->num_tiles_x[l - 1] &&
+		    cy < (uint32_t)ml->map->num_tiles_y[l - 1])
+			avail++;
+
+		children[i] = tile_get(ml, l - 1, cx, cy, &nodes[i]);
+		if (children[i])
+			cnt++;
+	}
+
+	if (!cnt || cnt < MIN(min_children, avail))
+		goto out;
+
+	for (i = 0; !children[i]; i++);
+
+	ret = xqx_pixmap_alloc(ml->map->tile_w, ml->map->tile_h, children[i]);
+	if (!ret)
+		goto out;
+
+	gp_fill(ret, ml->bg_color);
+
+	for (i = 0; i < 4; i++) {
+		if (children[i])
+			xqx_pixmap_downscale_quadrant(children[i], ret, i % 2, i / 2);
+	}
+
+out:
+	for (i = 0; i < 4; i++) {
+		if (nodes[i])
+			xqx_map_cache_put(nodes[i]);
+	}
+
+	return ret;
+}
+
+static xqx_pixmap *fallback_from_parent(struct xqx_map_layer *ml, uint32_t l, uint32_t x, uint32_t y)
+{
+	struct xqx_map_cache_node *node;
+	xqx_pixmap *parent = tile_get(ml, l + 1, x / 2, y / 2, &node);
+	xqx_pixmap *ret;
+
+	if (!parent)
+		return NULL;
+
+	ret = xqx_pixmap_alloc(ml->map->tile_w, ml->map->tile_h, parent);
+	if (!ret)
+		goto out;
+
+	/* a parent on the map edge covers only part of the tile */
+	gp_fill(ret, ml->bg_color);
+
+	if (xqx_pixmap_upscale_quadrant(parent, x % 2, y % 2, ret)) {
+		xqx_pixmap_free(ret);
+		ret = NULL;
+	}
+out:
+	xqx_map_cache_put(node);
+
+	return ret;
+}
+
+/*
+ * Returns a substitute for a tile that is not loaded yet. Complete set of
+ * children is preferred since it's downscaled, then the parent tile, and
+ * partial set of children as a last resort.
+ *
+ * The fallbacks are shared between bands rendered in parallel, the lock
+ * protects only the ring and the reference counts while the stand-ins are
+ * composed and blitted without it. The reference has to be released by
+ * fallback_release().
+ */
+static struct xqx_map_fallback *fallback_get(struct xqx_map_layer *ml, uint32_t l, uint32_t x, uint32_t y)
+{
+	struct xqx_map_fallback **slot, *fb = NULL;
+	xqx_pixmap *pixmap;
+
+	pthread_mutex_lock(&ml->fallback_lock);
+	slot = fallback_find(ml, l, x, y);
+	if (slot) {
+		fb = *slot;
+		fb->refs++;
+	}
+	pthread_mutex_unlock(&ml->fallback_lock);
+
+	if (fb)
+		return fb;
+
+	pixmap = fallback_from_children(ml, l, x, y, 4);
+
+	if (!pixmap)
+		pixmap = fallback_from_parent(ml, l, x, y);
+
+	if (!pixmap)
+		pixmap = fallback_from_children(ml, l, x, y, 1);
+
+	if (!pixmap)
+		return NULL;
+
+	fb = malloc(sizeof(*fb));
+	if (!fb) {
+		xqx_pixmap_free(pixmap);
+		return NULL;
+	}
+
+	fb->l = l;
+	fb->x = x;
+	fb->y = y;
+	fb->pixmap = pixmap;
+	/* one for the ring and one for the caller */
+	fb->refs = 2;
+
+	pthread_mutex_lock(&ml->fallback_lock);
+	slot = fallback_find(ml, l, x, y);
+	if (slot) {
+		/* composed by another band in the meantime */
+		xqx_pixmap_free(fb->pixmap);
+		free(fb);
+		fb = *slot;
+		fb->refs++;
+	} else {
+		fallback_insert(ml, fb);
+	}
+	pthread_mutex_unlock(&ml->fallback_lock);
+
+	return fb;
+}
+
+static void fallback_release(struct xqx_map_layer *ml, struct xqx_map_fallback *fb)
+{
+	pthread_mutex_lock(&ml->fallback_lock);
+	fallback_put(fb);
+	pthread_mutex_unlock(&ml->fallback_lock);
+}
+
 /* notification from cache about new avamlable tiles */
 
+#define ZOOM_ONE (1 << 16)
+
+static int level_to_view(struct xqx_map_geom *g, int v, uint32_t frac)
+{
+	return ((int64_t)v * ZOOM_ONE - frac) / g->zoom;
+}
+
 static void map_layer_cc_notify(void *ml_i, struct xqx_map *map, unsigned int l, unsigned int x, unsigned int y, struct xqx_map_cache_node *tile)
 {
 	struct xqx_map_layer *ml = ml_i;
-	// printf("CC notify L%u X%u Y%u\n", l, x, y);
+	struct xqx_map_geom *g = &ml->g;
+	struct xqx_map_fallback **slot;
+	struct xqx_rectangle r;
 
 	(void) map;
 	(void) tile;
 
-	if ((ml->level == l) && (ml->tx2 <= x) && (x < ml->tx3) && (ml->ty2 <= y) && (y < ml->ty3)) {
-		int sx = (x - ml->tx2) * ml->map->tile_w + ml->pix_off_x;
-		int sy = (y - ml->ty2) * ml->map->tile_h + ml->pix_off_y;
-		xqx_view_request_redraw(ml->common.view, sx, sy, sx + ml->map->tile_w, sy + ml->map->tile_h);
+	pthread_mutex_lock(&ml->fallback_lock);
+	slot = fallback_find(ml, l, x, y);
+	if (slot) {
+		fallback_put(*slot);
+		*slot = NULL;
+	}
+	pthread_mutex_unlock(&ml->fallback_lock);
+
+	/* the redraw replaces the stand-in with the real tile */
+	if ((g->level == l) && (g->tx2 <= x) && (x < g->tx3) && (g->ty2 <= y) && (y < g->ty3)) {
+		int sx = (x - g->tx2) * ml->map->tile_w + g->pix_off_x;
+		int sy = (y - g->ty2) * ml->map->tile_h + g->pix_off_y;
+
+		if (g->zoom == ZOOM_ONE) {
+			r.lx = sx;
+			r.ly = sy;
+			r.hx = sx + ml->map->tile_w;
+			r.hy = sy + ml->map->tile_h;
+		} else {
+			/* resampled tiles affect a pixel around */
+			r.lx = level_to_view(g, sx, g->frac_x) - 1;
+			r.ly = level_to_view(g, sy, g->frac_y) - 1;
+			r.hx = level_to_view(g, sx + ml->map->tile_w, g->frac_x) + 2;
+			r.hy = level_to_view(g, sy + ml->map->tile_h, g->frac_y) + 2;
+		}
+
+		xqx_view_layer_invalidate(&ml->common, &r);
 	}
 }
 
@@ -105,11 +369,11 @@ static uint32_t map_layer_cc_query(void *ml_i, struct xqx_map **map, uint32_t *l
 	uint32_t mt = find_missing_tile(ml);
 
 	if (mt > 0) {
-		// printf("AF0 QUERY %d L%d X%d Y%d\n", mt, ml->level, ml->ax, ml->ay);
+		// printf("AF0 QUERY %d L%d X%d Y%d\n", mt, ml->g.level, ml->ax, ml->ay);
 		*map = ml->map;
 		*x = ml->ax;
 		*y = ml->ay;
-		*l = (mt == 1) ? (ml->level - 1) : ml->level;
+		*l = (mt == 1) ? (ml->g.level - 1) : ml->g.level;
 	}
 
 	return mt;
@@ -121,28 +385,16 @@ static uint32_t map_layer_cc_eval(void *ml_i, struct xqx_map_cache_node *cn)
 {
 	struct xqx_map_layer *ml = ml_i;
 
-	if ((cn->l == ml->level)
-	    && (ml->tx2 <= cn->x) && (cn->x < ml->tx3)
-	    && (ml->ty2 <= cn->y) && (cn->y < ml->ty3))
+	if ((cn->l == ml->g.level)
+	    && (ml->g.tx2 <= cn->x) && (cn->x < ml->g.tx3)
+	    && (ml->g.ty2 <= cn->y) && (cn->y < ml->g.ty3))
 		return 3;
 
-	if ((cn->l == ml->level)
-	    && (ml->tx1 <= cn->x) && (cn->x < ml->tx4)
-	    && (ml->ty1 <= cn->y) && (cn->y < ml->ty4))
+	if ((cn->l == ml->g.level)
+	    && (ml->g.tx1 <= cn->x) && (cn->x < ml->g.tx4)
+	    && (ml->g.ty1 <= cn->y) && (cn->y < ml->g.ty4))
 		return 2;
 
-	/*
-	if ((cn->l + 1) == ml->level)
-		{
-			printf("X %d %d %d\n", (2 * ml->tx2), cn->x, (2 * ml->tx3));
-			printf("Y %d %d %d\n", (2 * ml->ty2), cn->y, (2 * ml->ty3));
-			if ((1)
-			&& ((2 * ml->tx2) <= cn->x) && (cn->x < (2 * ml->tx3))
-			&& ((2 * ml->ty2) <= cn->y) && (cn->y < (2 * ml->ty3)))
-		return (1);
-		}
-	*/
-
 	return 0;
 }
 
@@ -159,56 +411,63 @@ static uint32_t get_nearest_level(struct xqx_map *map, int scale_main)
 }
 
 
-/* notification from view about view geometry change */
-
-static void map_layer_notify(void *ml_i, struct xqx_view *vw, uint32_t change)
+/*
+ * Computes which tiles are visible in a view and where.
+ */
+static void map_geom(struct xqx_map_layer *ml, struct xqx_view *vw, struct xqx_map_geom *g)
 {
-	struct xqx_map_layer *ml = ml_i;
 	struct xqx_coordinate *c = &(vw->center);
 
-	if (change == XQX_VLC_FINISH)
-		return;
-
-	if ((change == XQX_VLC_INIT) || (change == XQX_VLC_SCALE)) {
-		ml->level = get_nearest_level(ml->map, vw->scale_main);
-		xqx_map_cache_request_notification(ml->cc, ml->map, ml->level);
-	}
+	g->level = get_nearest_level(ml->map, vw->scale_main);
 
-	// FIXME remove next check
-	if (vw->scale_main != (1 << ml->level))
-		printf("WARNING: Inconsistent scale and level\n");
+	/* scale between levels, tiles are resampled when rendered */
+	g->zoom = ((int64_t)vw->scale_fp * ZOOM_ONE) / ((1 << g->level) * XQX_SCALE_ONE);
 
 	int tw = ml->map->tile_w;
 	int th = ml->map->tile_h;
-	int txc = ml->map->num_tiles_x[ml->level];
-	int tyc = ml->map->num_tiles_y[ml->level];
+	int txc = ml->map->num_tiles_x[g->level];
+	int tyc = ml->map->num_tiles_y[g->level];
 
 	/* coordinates in current pixel coordinate space (CPCS)
 		 are coordinates in pixels of current zoom,
 		 relative to the start of a image */
 
-	/* c. are coordinates of center of view in CPCS */
 	/* FIXME analyze needed precision */
 
-	int64_t tmpx = c->x;
-	tmpx -= ml->map->geo_cox;
-	tmpx *= ml->map->geo_psx;
-	tmpx /= ml->map->geo_csx;
-	tmpx += ml->map->geo_pox;
-	int cx = tmpx / (1 << ml->level);
+	int lx, ly;
+
+	/*
+	 * The view origin is computed on the view pixel grid so that the map
+	 * moves by whole pixels with the overlays when the view is panned.
+	 * At fractional zoom it lands in between level pixels, which makes a
+	 * pan by whole view pixels shift the resampled image by exactly the
+	 * same amount.
+	 */
+	int64_t ox = xqx_view_abs_px_x(vw, c->x) - xqx_view_abs_px_x(vw, ml->map->geo_cox) - vw->w / 2;
+	int64_t oy = xqx_view_abs_px_y(vw, c->y) - xqx_view_abs_px_y(vw, ml->map->geo_coy) - vw->h / 2;
+
+	if (g->zoom == ZOOM_ONE) {
+		/* View and level pixels are the same */
+		lx = ox + ml->map->geo_pox / (1 << g->level);
+		ly = oy + ml->map->geo_poy / (1 << g->level);
+		g->frac_x = 0;
+		g->frac_y = 0;
+	} else {
+		ox = ox * g->zoom + ((int64_t)ml->map->geo_pox * ZOOM_ONE) / (1 << g->level);
+		oy = oy * g->zoom + ((int64_t)ml->map->geo_poy * ZOOM_ONE) / (1 << g->level);
+		lx = DIV_FLOOR(ox, ZOOM_ONE);
+		ly = DIV_FLOOR(oy, ZOOM_ONE);
+		g->frac_x = ox - (int64_t)lx * ZOOM_ONE;
+		g->frac_y = oy - (int64_t)ly * ZOOM_ONE;
+	}
 
-	int64_t tmpy = c->y;
-	tmpy -= ml->map->geo_coy;
-	tmpy *= ml->map->geo_psy;
-	tmpy /= ml->map->geo_csy;
-	tmpy += ml->map->geo_poy;
-	int cy = tmpy / (1 << ml->level);
+	/* size of the view in CPCS */
+	int vw_w = ((int64_t)vw->w * g->zoom + g->frac_x + ZOOM_ONE - 1) / ZOOM_ONE;
+	int vw_h = ((int64_t)vw->h * g->zoom + g->frac_y + ZOOM_ONE - 1) / ZOOM_ONE;
 
 	/* l. and h. are coordinates of ul,lr corners of view in CPCS */
-	int lx = cx - (vw->w / 2);
-	int ly = cy - (vw->h / 2);
-	int hx = lx + vw->w;
-	int hy = ly + vw->h;
+	int hx = lx + vw_w;
+	int hy = ly + vw_h;
 
 	/* tl. and th. are indices of 'interesting' tiles - tiles
 		 containing corners of view */
@@ -223,38 +482,56 @@ static void map_layer_notify(void *ml_i, struct xqx_view *vw, uint32_t change)
 	thx = CLAMP(thx, 0, txc);
 	thy = CLAMP(thy, 0, tyc);
 
-	/* ml->pix_off_. are offsets of a start of 'interesting' tile rectangle
+	/* g->pix_off_. are offsets of a start of 'interesting' tile rectangle
 		 in pixels of current zoom, relative to the start of a view */
-	ml->pix_off_x = tlx * tw - lx;
-	ml->pix_off_y = tly * th - ly;
+	g->pix_off_x = tlx * tw - lx;
+	g->pix_off_y = tly * th - ly;
 
 	/* save 'interesting' tiles coords */
-	ml->tx2 = tlx;
-	ml->tx3 = thx;
-	ml->ty2 = tly;
-	ml->ty3 = thy;
+	g->tx2 = tlx;
+	g->tx3 = thx;
+	g->ty2 = tly;
+	g->ty3 = thy;
 
 	int dx = (thx - tlx + 1) / 2;
 	int dy = (thy - tly + 1) / 2;
 
 	/* extended interesting tiles */
-	ml->tx1 = MAX(0, tlx - dx);
-	ml->ty1 = MAX(0, tly - dy);
-	ml->tx4 = MIN(thx + dx, txc);
-	ml->ty4 = MIN(thy + dy, tyc);
+	g->tx1 = MAX(0, tlx - dx);
+	g->ty1 = MAX(0, tly - dy);
+	g->tx4 = MIN(thx + dx, txc);
+	g->ty4 = MIN(thy + dy, tyc);
 
 	/* rectangle for prefetch of lower level */
-	if (ml->level > 0) {
-		int t2xc = ml->map->num_tiles_x[ml->level - 1];
-		int t2yc = ml->map->num_tiles_y[ml->level - 1];
-		ml->t2x1 = MIN(t2xc, (int) ml->tx2 * 2);
-		ml->t2y1 = MIN(t2yc, (int) ml->ty2 * 2);
-		ml->t2x2 = MIN(t2xc, (int) ml->tx3 * 2);
-		ml->t2y2 = MIN(t2yc, (int) ml->ty3 * 2);
+	if (g->level > 0) {
+		int t2xc = ml->map->num_tiles_x[g->level - 1];
+		int t2yc = ml->map->num_tiles_y[g->level - 1];
+		g->t2x1 = MIN(t2xc, (int) g->tx2 * 2);
+		g->t2y1 = MIN(t2yc, (int) g->ty2 * 2);
+		g->t2x2 = MIN(t2xc, (int) g->tx3 * 2);
+		g->t2y2 = MIN(t2yc, (int) g->ty3 * 2);
 	}
-	//	printf("CONF X: %d %d %d %d\n", ml->tx1, ml->tx2, ml->tx3, ml->tx4);
-	//	printf("CONF Y: %d %d %d %d\n", ml->ty1, ml->ty2, ml->ty3, ml->ty4);
-	//	printf("OFF: %d %d\n", ml->pix_off_x, ml->pix_off_y);
+}
+
+/* notification from view about view geometry change */
+
+static void map_layer_notify(void *ml_i, struct xqx_view *vw, uint32_t change)
+{
+	struct xqx_map_layer *ml = ml_i;
+
+	if (change == XQX_VLC_FINISH)
+		return;
+
+	if ((change == XQX_VLC_INIT) || (change == XQX_VLC_SCALE)) {
+		pthread_mutex_lock(&ml->fallback_lock);
+		fallbacks_flush(ml);
+		pthread_mutex_unlock(&ml->fallback_lock);
+	}
+
+	map_geom(ml, vw, &ml->g);
+
+	if ((change == XQX_VLC_INIT) || (change == XQX_VLC_SCALE))
+		xqx_map_cache_request_notification(ml->cc, ml->map, ml->g.level);
 
 	ml->as = 0;
 	int mt = find_missing_tile(ml);
@@ -262,12 +539,137 @@ static void map_layer_notify(void *ml_i, struct xqx_view *vw, uint32_t change)
 	xqx_map_cache_request_attention(ml->cc, mt);
 }
 
-static void map_layer_render(void *ml_i, struct xqx_view *vw, gp_pixmap *dst, struct xqx_rectangle *rect)
+/*
+ * Clips a tile at ax, ay of aw x ah size to the rectangle.
+ *
+ * Returns zero if nothing is left.
+ */
+static int clip_tile(struct xqx_rectangle *rect, int *ax, int *ay, int *aw, int *ah, int *sx, int *sy)
 {
-	struct xqx_map_layer *ml = ml_i;
+	int lx = MAX(*ax, rect->lx);
+	int ly = MAX(*ay, rect->ly);
+	int hx = MIN(*ax + *aw, rect->hx);
+	int hy = MIN(*ay + *ah, rect->hy);
+
+	if (lx >= hx || ly >= hy)
+		return 0;
+
+	*sx = lx - *ax;
+	*sy = ly - *ay;
+	*ax = lx;
+	*ay = ly;
+	*aw = hx - lx;
+	*ah = hy - ly;
+
+	return 1;
+}
+
+/*
+ * Scratch pixmaps are per thread so that bands can be rendered in parallel.
+ * Only the allocations are reused, the content is redrawn on each render.
+ */
+struct xqx_map_layer_bufs {
+	pthread_t thread;
+	/* tiles in level pixels for fractional zoom */
+	gp_pixmap *zoom;
+	/* inverted part of a tile for the dark color scheme */
+	gp_pixmap *invert;
+	struct xqx_map_layer_bufs *next;
+};
+
+static struct xqx_map_layer_bufs *bufs_get(struct xqx_map_layer *ml)
+{
+	pthread_t self = pthread_self();
+	struct xqx_map_layer_bufs *bufs;
+
+	pthread_mutex_lock(&ml->bufs_lock);
+
+	for (bufs = ml->bufs; bufs; bufs = bufs->next) {
+		if (pthread_equal(bufs->thread, self))
+			goto out;
+	}
 
-	(void) vw;
+	bufs = calloc(1, sizeof(*bufs));
+	if (!bufs)
+		goto out;
 
+	bufs->thread = self;
+	bufs->next = ml->bufs;
+	ml->bufs = bufs;
+out:
+	pthread_mutex_unlock(&ml->bufs_lock);
+	return bufs;
+}
+
+static void bufs_free(struct xqx_map_layer *ml)
+{
+	struct xqx_map_layer_bufs *bufs, *next;
+
+	for (bufs = ml->bufs; bufs; bufs = next) {
+		next = bufs->next;
+		gp_pixmap_free(bufs->zoom);
+		gp_pixmap_free(bufs->invert);
+		free(bufs);
+	}
+
+	ml->bufs = NULL;
+}
+
+/*
+ * Returns a scratch pixmap at least w x h big, the buffer only grows.
+ */
+static gp_pixmap *get_buf(gp_pixmap **buf, uint32_t w, uint32_t h, gp_pixel_type pixel_type)
+{
+	if (*buf && ((*buf)->w < w || (*buf)->h < h || (*buf)->pixel_type != pixel_type)) {
+		w = MAX(w, (*buf)->w);
+		h = MAX(h, (*buf)->h);
+		gp_pixmap_free(*buf);
+		*buf = NULL;
+	}
+
+	if (!*buf)
+		*buf = gp_pixmap_alloc(w, h, pixel_type);
+
+	return *buf;
+}
+
+/*
+ * Blits part of a tile, the ax and ay are in rect coordinates while the dst
+ * pixmap starts at ox, oy.
+ *
+ * Nothing outside of the rect is touched so that the view can be rendered
+ * in parallel in bands.
+ */
+static void blit_tile(struct xqx_map_layer_bufs *bufs, gp_pixmap *pb, int aw, int ah,
+                      gp_pixmap *dst, int ax, int ay, struct xqx_rectangle *rect, int ox, int oy)
+{
+	gp_pixmap *tmp;
+	int sx, sy;
+
+	if (!clip_tile(rect, &ax, &ay, &aw, &ah, &sx, &sy))
+		return;
+
+	if (gp_widgets_color_scheme_get() == GP_WIDGET_COLOR_SCHEME_DARK) {
+		tmp = get_buf(&bufs->invert, aw, ah, pb->pixel_type);
+		if (!tmp)
+			return;
+
+		gp_filter_invert_ex(pb, sx, sy, aw, ah, tmp, 0, 0, NULL);
+		sx = sy = 0;
+	} else {
+		tmp = pb;
+	}
+
+	gp_blit_xywh_clipped(tmp, sx, sy, aw, ah, dst, ax - ox, ay - oy);
+}
+
+/*
+ * Renders tiles in the rect, the dst pixmap starts at ox, oy.
+ */
+static void render_tiles(struct xqx_map_layer *ml, struct xqx_map_layer_bufs *bufs,
+                         struct xqx_map_geom *g, gp_pixmap *dst,
+                         struct xqx_rectangle *rect, int ox, int oy)
+{
 	int tw = ml->map->tile_w;
 	int th = ml->map->tile_h;
 
@@ -279,20 +681,21 @@ static void map_layer_render(void *ml_i, struct xqx_view *vw, gp_pixmap *dst, st
 		 - we should draw tiles satisfying lx <= x < hx, ly <= y < hy
 	*/
 
-	int lx = (rect->lx - ml->pix_off_x) / tw + ml->tx2;
-	int ly = (rect->ly - ml->pix_off_y) / th + ml->ty2;
-	int hx = (rect->hx - ml->pix_off_x - 1 + tw) / tw + ml->tx2;
-	int hy = (rect->hy - ml->pix_off_y - 1 + th) / th + ml->ty2;
+	int lx = (rect->lx - g->pix_off_x) / tw + g->tx2;
+	int ly = (rect->ly - g->pix_off_y) / th + g->ty2;
+	int hx = (rect->hx - g->pix_off_x - 1 + tw) / tw + g->tx2;
+	int hy = (rect->hy - g->pix_off_y - 1 + th) / th + g->ty2;
 
 	/* now crop tile coords to visible tiles range (tiles between t_2 and t_3) */
 
-	lx = (lx < (int)ml->tx2) ? (int)ml->tx2 : lx;
-	ly = (ly < (int)ml->ty2) ? (int)ml->ty2 : ly;
-	hx = (hx > (int)ml->tx3) ? (int)ml->tx3 : hx;
-	hy = (hy < (int)ml->ty3) ? (int)ml->ty3 : hy;
+	lx = (lx < (int)g->tx2) ? (int)g->tx2 : lx;
+	ly = (ly < (int)g->ty2) ? (int)g->ty2 : ly;
+	hx = (hx > (int)g->tx3) ? (int)g->tx3 : hx;
+	hy = (hy > (int)g->ty3) ? (int)g->ty3 : hy;
 
 	//TODO: Optimize?
-	gp_fill_rect_xyxy(dst, rect->lx, rect->ly, rect->hx, rect->hy, ml->bg_color);
+	gp_fill_rect_xyxy(dst, rect->lx - ox, rect->ly - oy,
+	                  rect->hx - ox - 1, rect->hy - oy - 1, ml->bg_color);
 
 	//printf("*** RENDER (%d %d) - (%d %d)\n", lx, ly, hx, hy);
 
@@ -300,54 +703,110 @@ static void map_layer_render(void *ml_i, struct xqx_view *vw, gp_pixmap *dst, st
 
 	for (i = lx; i < hx; i++) {
 		for (j = ly; j < hy; j++) {
-			int ax = (i - ml->tx2) * tw + ml->pix_off_x;
-			int ay = (j - ml->ty2) * th + ml->pix_off_y;
+			int ax = (i - g->tx2) * tw + g->pix_off_x;
+			int ay = (j - g->ty2) * th + g->pix_off_y;
 			int aw = tw;
 			int ah = th;
 
 			/* fixup for a width/height of tile at last column/row */
-			if ((i + 1) == ml->map->num_tiles_x[ml->level])
-				aw = (ml->map->map_w >> ml->level) - i * tw;
+			if ((i + 1) == ml->map->num_tiles_x[g->level])
+				aw = (ml->map->map_w >> g->level) - i * tw;
 
-			if ((j + 1) == ml->map->num_tiles_y[ml->level])
-				ah = (ml->map->map_h >> ml->level) - j * th;
+			if ((j + 1) == ml->map->num_tiles_y[g->level])
+				ah = (ml->map->map_h >> g->level) - j * th;
 
-			struct xqx_map_cache_node *cn = xqx_map_cache_lookup(ml->cc, ml->map, ml->level, i, j);
+			struct xqx_map_cache_node *cn = xqx_map_cache_get(ml->cc, ml->map, g->level, i, j);
 
-			if (cn == NULL) {
+			if (cn == NULL || cn->state == XQX_CACHE_NODE_PENDING) {
 				//printf("NODATA (%d %d) at (%d %d)\n", i, j, ax, ay);
-				/* no data */
-				/* FIXME add scaling of larger */
+				/*
+				 * No data, draw a tile scaled from a different
+				 * level if possible, the reference keeps the
+				 * pixmap from being freed while we blit it.
+				 */
+				struct xqx_map_fallback *fb = fallback_get(ml, g->level, i, j);
+
+				if (fb) {
+					blit_tile(bufs, fb->pixmap, aw, ah, dst, ax, ay, rect, ox, oy);
+					fallback_release(ml, fb);
+				}
 			} else if (cn->state == XQX_CACHE_NODE_VALID_DATA) {
 				//printf("DRAW (%d %d) at (%d %d)\n", i, j, ax, ay);
-				gp_pixmap *pb = cn->data, *tmp;
-
-				int invert_pixmap = gp_widgets_color_scheme_get() == GP_WIDGET_COLOR_SCHEME_DARK;
-				printf("INVERT PIXMAP %i\n", invert_pixmap);
-				if (invert_pixmap)
-					tmp = gp_filter_invert_alloc(pb, NULL);
-				else
-					tmp = pb;
-
-				gp_blit_xywh_clipped(tmp, 0, 0, aw, ah, dst, ax, ay);
-
-				if (invert_pixmap)
-					gp_pixmap_free(tmp);
-
+				blit_tile(bufs, cn->data, aw, ah, dst, ax, ay, rect, ox, oy);
 			} else if (cn->state == XQX_CACHE_NODE_VALID_COLOR) {
 				//printf("COLOR (%d %d) at (%d %d)\n", i, j, ax, ay);
 				uint32_t rgb = (uintptr_t) cn->data;
+				int sx, sy;
 
-				gp_pixel color = gp_rgb_to_pixmap_pixel(rgb&0x00ff0000>>16,
-				                                        rgb&0x0000ff00>>8,
-				                                        rgb&0x000000ff, dst);
+				gp_pixel color = gp_rgb_to_pixmap_pixel((rgb >> 16) & 0xff,
+				                                        (rgb >> 8) & 0xff,
+				                                        rgb & 0xff, dst);
 
-				gp_fill_rect_xywh(dst, ax, ay, aw, ah, color);
+				if (clip_tile(rect, &ax, &ay, &aw, &ah, &sx, &sy))
+					gp_fill_rect_xywh(dst, ax - ox, ay - oy, aw, ah, color);
 			}
+
+			if (cn)
+				xqx_map_cache_put(cn);
 		}
 	}
 }
 
+/*
+ * Tiles are drawn into a buffer in level pixels which is then resampled to the
+ * view.
+ *
+ * The view origin sits on the view pixel grid, so the layer is pan invariant
+ * even at fractional zoom. While the scale stays the same the view scrolls the
+ * resampled frame and only the exposed strips end up here.
+ */
+static void render_resampled(struct xqx_map_layer *ml, struct xqx_map_layer_bufs *bufs,
+                             struct xqx_map_geom *g, struct xqx_view *vw,
+                             gp_pixmap *dst, struct xqx_rectangle *rect)
+{
+	uint32_t zw = ((int64_t)vw->w * g->zoom + g->frac_x) / ZOOM_ONE + 2;
+	uint32_t zh = ((int64_t)vw->h * g->zoom + g->frac_y) / ZOOM_ONE + 2;
+
+	/* view pixel x starts at level pixel (x * zoom + frac) / ZOOM_ONE */
+	int64_t fx = (int64_t)rect->lx * g->zoom + g->frac_x;
+	int64_t fy = (int64_t)rect->ly * g->zoom + g->frac_y;
+
+	struct xqx_rectangle zrect = {
+		.lx = fx / ZOOM_ONE,
+		.ly = fy / ZOOM_ONE,
+		.hx = MIN(((int64_t)rect->hx * g->zoom + g->frac_x) / ZOOM_ONE + 2, (int64_t)zw),
+		.hy = MIN(((int64_t)rect->hy * g->zoom + g->frac_y) / ZOOM_ONE + 2, (int64_t)zh),
+	};
+
+	gp_pixmap *buf = get_buf(&bufs->zoom, zrect.hx - zrect.lx, zrect.hy - zrect.ly, dst->pixel_type);
+	if (!buf)
+		return;
+
+	render_tiles(ml, bufs, g, buf, &zrect, zrect.lx, zrect.ly);
+
+	xqx_pixmap_resample(buf, fx - (int64_t)zrect.lx * ZOOM_ONE,
+	                    fy - (int64_t)zrect.ly * ZOOM_ONE, g->zoom,
+	                    dst, rect->lx, rect->ly, rect->hx - rect->lx, rect->hy - rect->ly);
+}
+
+static void map_layer_render(void *ml_i, struct xqx_view *vw, gp_pixmap *dst, struct xqx_rectangle *rect)
+{
+	struct xqx_map_layer *ml = ml_i;
+	struct xqx_map_layer_bufs *bufs = bufs_get(ml);
+	struct xqx_map_geom g;
+
+	if (!bufs)
+		return;
+
+	/* the view may be a snapshot that differs from the current one */
+	map_geom(ml, vw, &g);
+
+	if (g.zoom == ZOOM_ONE)
+		render_tiles(ml, bufs, &g, dst, rect, 0, 0);
+	else
+		render_resampled(ml, bufs, &g, vw, dst, rect);
+}
+
 static struct xqx_map_cache_client_ops map_layer_ops = {
 	map_layer_cc_notify, map_layer_cc_query, map_layer_cc_eval
 };
@@ -359,9 +818,12 @@ struct xqx_map_layer *xqx_make_map_layer(struct xqx_map *map)
 	if (!ml)
 		return NULL;
 
+	ml->common.name = "map";
 	ml->common.notify_cb = map_layer_notify;
 	ml->common.render_cb = map_layer_render;
+	ml->common.flags = XQX_VIEW_LAYER_THREAD_SAFE | XQX_VIEW_LAYER_PAN_INVARIANT;
 	ml->map = map;
+	ml->g.zoom = ZOOM_ONE;
 	ml->cc = xqx_map_cache_make_client(&map_layer_ops, ml);
 
 	if (!ml->cc) {
@@ -369,12 +831,38 @@ struct xqx_map_layer *xqx_make_map_layer(struct xqx_map *map)
 		return NULL;
 	}
 
+	pthread_mutex_init(&ml->fallback_lock, NULL);
+	pthread_mutex_init(&ml->bufs_lock, NULL);
+
 	return ml;
 }
 
 /* image_layer should be removed from view before discarding */
 void xqx_discard_map_layer(struct xqx_map_layer *ml)
 {
+	fallbacks_flush(ml);
+	pthread_mutex_destroy(&ml->fallback_lock);
+
+	bufs_free(ml);
+	pthread_mutex_destroy(&ml->bufs_lock);
+
+	xqx_map_cache_prefetch_cancel(ml->map);
 	xqx_map_cache_discard_client(ml->cc);
 	free(ml);
 }
+
+unsigned int xqx_map_layer_pending(struct xqx_map_layer *ml)
+{
+	unsigned int x, y, ret = 0;
+	struct xqx_map_cache_node *cn;
+
+	for (y = ml->g.ty2; y < ml->g.ty3; y++) {
+		for (x = ml->g.tx2; x < ml->g.tx3; x++) {
+			cn = xqx_map_cache_find(ml->map, ml->g.level, x, y);
+			if (!cn)
+				ret++;
+		}
+	}
+
+	return ret;
+}
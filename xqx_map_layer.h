@@ -12,27 +12,79 @@
 #define XQX_MAP_LAYER_H__
 
 #include <stdint.h>
+#include <pthread.h>
 
 #include "xqx_view.h"
 
-struct xqx_map_layer {
-	struct xqx_view_layer common;
+/*
+ * Number of stand-in tiles, scaled from a neighbouring level, that are kept
+ * around while the real tiles are being loaded.
+ */
+#define XQX_MAP_LAYER_FALLBACKS 32
 
-	struct xqx_map *map;
-	struct xqx_map_cache_client *cc;
+struct xqx_map_fallback {
+	uint32_t l, x, y;
+	/* the ring holds one reference and each blit in progress another */
+	unsigned int refs;
+	xqx_pixmap *pixmap;
+};
 
-	int pix_off_x, pix_off_y;
+/*
+ * Tiles visible in a view and their position, derived from the view center,
+ * scale and size.
+ */
+struct xqx_map_geom {
 	uint32_t level;
 
+	/*
+	 * Ratio between level and view pixels in 16.16 fixed point, tiles are
+	 * resampled when the view scale is not a power of two.
+	 */
+	uint32_t zoom;
+
+	/* Subpixel position of the view origin in level pixels, 16.16 */
+	uint32_t frac_x, frac_y;
+
+	int pix_off_x, pix_off_y;
+
 	uint32_t tx1, tx2, tx3, tx4, ty1, ty2, ty3, ty4;
 	uint32_t t2x1, t2x2, t2y1, t2y2;
+};
+
+struct xqx_map_layer_bufs;
+
+struct xqx_map_layer {
+	struct xqx_view_layer common;
+
+	struct xqx_map *map;
+	struct xqx_map_cache_client *cc;
+
+	/*
+	 * Geometry of the view the tiles are requested for, rendering
+	 * computes its own from the view it's passed so that it can render a
+	 * view snapshot.
+	 */
+	struct xqx_map_geom g;
 	uint32_t ax, ay, as;
 
 	gp_pixel bg_color;
+
+	pthread_mutex_t fallback_lock;
+	unsigned int fallback_next;
+	struct xqx_map_fallback *fallbacks[XQX_MAP_LAYER_FALLBACKS];
+
+	/* scratch pixmaps, one set for each thread that renders the layer */
+	pthread_mutex_t bufs_lock;
+	struct xqx_map_layer_bufs *bufs;
 };
 
 struct xqx_map_layer *xqx_make_map_layer(struct xqx_map *map);
 
 void xqx_discard_map_layer(struct xqx_map_layer *il);
 
+/*
+ * Returns number of visible tiles that are not loaded yet.
+ */
+unsigned int xqx_map_layer_pending(struct xqx_map_layer *ml);
+
 #endif /* XQX_MAP_LAYER_H__ */
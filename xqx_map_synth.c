@@ -0,0 +1,328 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Cyril Hrubis <metan@ucw.cz>
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "xqx_time.h"
+#include "xqx_trace.h"
+#include "xqx_map.h"
+#include "xqx_pixmap.h"
+#include "xqx_map_synth.h"
+
+enum salt {
+	SALT_COLOR,
+	SALT_LATENCY,
+	SALT_ERROR,
+	SALT_EMPTY,
+};
+
+static uint64_t mix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdllu;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53llu;
+	h ^= h >> 33;
+
+	return h;
+}
+
+static uint64_t tile_hash(struct xqx_map_synth *map, uint32_t l, uint32_t x, uint32_t y, enum salt salt)
+{
+	uint64_t h = mix(map->params.seed + 0x9e3779b97f4a7c15llu * (salt + 1));
+
+	h = mix(h ^ l);
+	h = mix(h ^ x);
+
+	return mix(h ^ y);
+}
+
+static int tile_chance(struct xqx_map_synth *map, uint32_t l, uint32_t x, uint32_t y,
+                       enum salt salt, double rate)
+{
+	if (rate <= 0)
+		return 0;
+
+	return (tile_hash(map, l, x, y, salt) >> 11) * 0x1p-53 < rate;
+}
+
+static void tile_latency(struct xqx_map_synth *map, uint32_t l, uint32_t x, uint32_t y)
+{
+	uint32_t us = map->params.latency_us;
+	struct timespec ts;
+
+	if (map->params.jitter_us)
+		us += tile_hash(map, l, x, y, SALT_LATENCY) % (map->params.jitter_us + 1);
+
+	if (!us)
+		return;
+
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+
+	while (nanosleep(&ts, &ts) && errno == EINTR);
+}
+
+/*
+ * Solid color with a checkerboard and a border on the top and left edge so
+ * that misplaced and scaled tiles are easy to spot.
+ */
+static xqx_pixmap *draw_tile(struct xqx_map_synth *map, uint32_t l, uint32_t x, uint32_t y)
+{
+	uint32_t w = map->common.tile_w, h = map->common.tile_h;
+	uint32_t rgb = tile_hash(map, l, x, y, SALT_COLOR) & 0xffffff;
+	uint32_t dark = (rgb >> 1) & 0x7f7f7f;
+	uint32_t cw = MAX(w / 8, 1u), ch = MAX(h / 8, 1u);
+	uint32_t cx, cy;
+	xqx_pixmap *pb;
+
+	pb = xqx_pixmap_alloc_format(w, h, map->params.pixel_format);
+	if (!pb)
+		return NULL;
+
+	xqx_pixmap_fill_rect(pb, 0, 0, w, h, rgb);
+
+	for (cy = 0; cy * ch < h; cy++) {
+		for (cx = cy % 2; cx * cw < w; cx += 2)
+			xqx_pixmap_fill_rect(pb, cx * cw, cy * ch, cw, ch, dark);
+	}
+
+	xqx_pixmap_fill_rect(pb, 0, 0, w, 1, 0);
+	xqx_pixmap_fill_rect(pb, 0, 0, 1, h, 0);
+
+	return pb;
+}
+
+static void read_synth_tile(struct xqx_map *common, uint32_t l, uint32_t x, uint32_t y)
+{
+	struct xqx_map_synth *map = (struct xqx_map_synth *)common;
+	uint64_t t = xqx_time_us();
+	xqx_pixmap *pb;
+
+	XQX_TRACE_TILE_BEGIN(XQX_TRACE_TILE_READ, l, x, y);
+	tile_latency(map, l, x, y);
+	XQX_TRACE_TILE_END(XQX_TRACE_TILE_READ, l, x, y);
+	xqx_map_cache_account_io(xqx_time_us() - t);
+
+	if (tile_chance(map, l, x, y, SALT_ERROR, map->params.error_rate)) {
+		xqx_map_cache_make_error_node(common, l, x, y);
+		return;
+	}
+
+	if (tile_chance(map, l, x, y, SALT_EMPTY, map->params.empty_rate)) {
+		xqx_map_cache_make_color_node(common, l, x, y, map->params.empty_color);
+		return;
+	}
+
+	t = xqx_time_us();
+	XQX_TRACE_TILE_BEGIN(XQX_TRACE_TILE_DECODE, l, x, y);
+	pb = draw_tile(map, l, x, y);
+	XQX_TRACE_TILE_END(XQX_TRACE_TILE_DECODE, l, x, y);
+	xqx_map_cache_account_decode(xqx_time_us() - t);
+
+	if (!pb)
+		xqx_map_cache_make_error_node(common, l, x, y);
+	else
+		xqx_map_cache_make_data_node(common, l, x, y, pb);
+}
+
+static struct xqx_map *map_load_synth(const char *filename);
+
+static struct xqx_map_ops map_synth_ops = {
+	.suffix = "synth",
+	.suffix_len = 5,
+	.map_load_cb = map_load_synth,
+	.read_tile_cb = read_synth_tile,
+};
+
+void xqx_map_synth_init(void)
+{
+	xqx_register_map_ops(&map_synth_ops);
+}
+
+void xqx_map_synth_defaults(struct xqx_map_synth_params *params)
+{
+	memset(params, 0, sizeof(*params));
+
+	params->image_w = 1 << 20;
+	params->image_h = 1 << 20;
+	params->tile_w = 256;
+	params->tile_h = 256;
+	params->levels = 13;
+	params->pixel_format = "RGB888";
+	params->empty_color = 0xffffff;
+	params->seed = 1;
+}
+
+struct xqx_map *xqx_map_synth_make(const struct xqx_map_synth_params *params)
+{
+	struct xqx_map_synth *map;
+	uint32_t l, tx, ty;
+	xqx_pixmap *pb;
+
+	if (!params->image_w || !params->image_h || !params->tile_w || !params->tile_h) {
+		printf("error: synthetic map image and tile size must be non-zero\n");
+		return NULL;
+	}
+
+	if (!params->levels || params->levels > 32) {
+		printf("error: synthetic map levels must be in 1-32\n");
+		return NULL;
+	}
+
+	if (params->error_rate < 0 || params->error_rate > 1 ||
+	    params->empty_rate < 0 || params->empty_rate > 1) {
+		printf("error: synthetic map rates must be in 0-1\n");
+		return NULL;
+	}
+
+	pb = xqx_pixmap_alloc_format(1, 1, params->pixel_format);
+	if (!pb) {
+		printf("error: unknown or unsupported pixel format '%s'\n", params->pixel_format);
+		return NULL;
+	}
+	xqx_pixmap_free(pb);
+
+	map = calloc(1, sizeof(struct xqx_map_synth));
+	if (!map)
+		return NULL;
+
+	map->params = *params;
+	map->params.pixel_format = strdup(params->pixel_format);
+	map->common.num_tiles_x = calloc(params->levels, sizeof(int));
+	map->common.num_tiles_y = calloc(params->levels, sizeof(int));
+
+	if (!map->params.pixel_format || !map->common.num_tiles_x || !map->common.num_tiles_y) {
+		free((char *)map->params.pixel_format);
+		free(map->common.num_tiles_x);
+		free(map->common.num_tiles_y);
+		free(map);
+		return NULL;
+	}
+
+	map->common.ops = &map_synth_ops;
+	map->common.map_w = params->image_w;
+	map->common.map_h = params->image_h;
+	map->common.tile_w = params->tile_w;
+	map->common.tile_h = params->tile_h;
+	map->common.num_levels = params->levels;
+
+	/* No georeferencing, pixel based coordinates */
+	map->common.geo_psx = map->common.geo_psy = 1;
+	map->common.geo_csx = map->common.geo_csy = 16;
+
+	xqx_map_set_projection(&map->common, 0);
+
+	tx = (params->image_w + params->tile_w - 1) / params->tile_w;
+	ty = (params->image_h + params->tile_h - 1) / params->tile_h;
+
+	for (l = 0; l < params->levels; l++) {
+		map->common.num_tiles_x[l] = tx;
+		map->common.num_tiles_y[l] = ty;
+
+		tx = (tx + 1) / 2;
+		ty = (ty + 1) / 2;
+	}
+
+	xqx_map_cache_init_map(&map->common);
+
+	return &map->common;
+}
+
+static int parse_u32(const char *val, uint32_t *res, int base)
+{
+	char *end;
+	unsigned long l;
+
+	errno = 0;
+	l = strtoul(val, &end, base);
+
+	if (errno || *end || end == val || l > UINT32_MAX)
+		return 0;
+
+	*res = l;
+	return 1;
+}
+
+static int parse_rate(const char *val, double *res)
+{
+	char *end;
+
+	*res = strtod(val, &end);
+
+	return !*end && end != val;
+}
+
+static struct xqx_map *map_load_synth(const char *filename)
+{
+	struct xqx_map_synth_params params;
+	char key[32], val[32], format[32];
+	char *buf = NULL;
+	size_t bufsize = 0;
+	FILE *f;
+
+	f = fopen(filename, "r");
+	if (!f)
+		return NULL;
+
+	xqx_map_synth_defaults(&params);
+
+	while (getline(&buf, &bufsize, f) >= 0) {
+		int ok, rv = sscanf(buf, "%31s %31s", key, val);
+
+		if (rv <= 0 || key[0] == '#')
+			continue;
+
+		if (rv != 2) {
+			ok = 0;
+		} else if (!strcmp(key, "image-width")) {
+			ok = parse_u32(val, &params.image_w, 10);
+		} else if (!strcmp(key, "image-height")) {
+			ok = parse_u32(val, &params.image_h, 10);
+		} else if (!strcmp(key, "tile-width")) {
+			ok = parse_u32(val, &params.tile_w, 10);
+		} else if (!strcmp(key, "tile-height")) {
+			ok = parse_u32(val, &params.tile_h, 10);
+		} else if (!strcmp(key, "levels")) {
+			ok = parse_u32(val, &params.levels, 10);
+		} else if (!strcmp(key, "pixel-format")) {
+			strcpy(format, val);
+			params.pixel_format = format;
+			ok = 1;
+		} else if (!strcmp(key, "empty-color")) {
+			ok = parse_u32(val, &params.empty_color, 16);
+		} else if (!strcmp(key, "latency-us")) {
+			ok = parse_u32(val, &params.latency_us, 10);
+		} else if (!strcmp(key, "jitter-us")) {
+			ok = parse_u32(val, &params.jitter_us, 10);
+		} else if (!strcmp(key, "error-rate")) {
+			ok = parse_rate(val, &params.error_rate);
+		} else if (!strcmp(key, "empty-rate")) {
+			ok = parse_rate(val, &params.empty_rate);
+		} else if (!strcmp(key, "seed")) {
+			ok = parse_u32(val, &params.seed, 10);
+		} else {
+			printf("warning: unsupported option in '%s': '%s'\n", filename, buf);
+			ok = 1;
+		}
+
+		if (!ok) {
+			printf("error: unparsable line in '%s': '%s'\n", filename, buf);
+			fclose(f);
+			free(buf);
+			return NULL;
+		}
+	}
+
+	fclose(f);
+	free(buf);
+
+	return xqx_map_synth_make(&params);
+}
@@ -0,0 +1,70 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Cyril Hrubis <metan@ucw.cz>
+ */
+
+/*
+
+   Synthetic map, tiles are generated procedurally so that the cache and the
+   view can be stressed with maps of arbitrary size without any map data.
+
+   The map is described by a .synth file with one option per line:
+
+   image-width 1048576       size of the most detailed level in pixels
+   image-height 1048576
+   tile-width 256
+   tile-height 256
+   levels 13                 pyramid depth
+   pixel-format RGB888       gfxprim pixel type name, 8 bits per channel
+   empty-color FFFFFF
+   latency-us 2000           time to produce a tile
+   jitter-us 1000            random latency added on top of latency-us
+   error-rate 0.01           probability of a tile failing to load
+   empty-rate 0.05           probability of a tile being an empty color tile
+   seed 1
+
+   All options have defaults. Whether a tile fails, is empty and how long it
+   takes depends only on the seed and the tile coordinates, so tiles behave
+   the same when they are loaded again after eviction.
+
+ */
+
+#ifndef XQX_MAP_SYNTH_H__
+#define XQX_MAP_SYNTH_H__
+
+#include <stdint.h>
+#include "xqx_map.h"
+
+struct xqx_map_synth_params
+{
+	uint32_t image_w, image_h;
+	uint32_t tile_w, tile_h;
+	uint32_t levels;
+	const char *pixel_format;
+	uint32_t empty_color;
+	uint32_t latency_us, jitter_us;
+	double error_rate, empty_rate;
+	uint32_t seed;
+};
+
+struct xqx_map_synth
+{
+	struct xqx_map common;
+	struct xqx_map_synth_params params;
+};
+
+/*
+ * Fills in default parameters.
+ */
+void xqx_map_synth_defaults(struct xqx_map_synth_params *params);
+
+/*
+ * Creates a synthetic map, the parameters are copied.
+ *
+ * Returns NULL on invalid parameters or allocation failure.
+ */
+struct xqx_map *xqx_map_synth_make(const struct xqx_map_synth_params *params);
+
+void xqx_map_synth_init(void);
+
+#endif /* XQX_MAP_SYNTH_H__ */
@@ -5,6 +5,7 @@
  */
 
 #define _GNU_SOURCE
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <string.h>
@@ -16,10 +17,18 @@
 #include <libgen.h>
 
 #include "libpia/libpia.h"
+#include "xqx_time.h"
+#include "xqx_trace.h"
+#include "xqx_common.h"
 #include "xqx_map.h"
 #include "xqx_pixmap.h"
+#include "xqx_workers.h"
+#include "xqx_xdg.h"
 #include "xqx_map_tmc.h"
 
+/* marks level directories created by mipmap-write */
+#define SYNTH_MARKER ".synth"
+
 static uint32_t
 format_filename(struct xqx_map_tmc *map, char *namebuf, uint32_t l, uint32_t x, uint32_t y)
 {
@@ -68,30 +77,278 @@ ssize_t dir_read_whole_item(struct xqx_map_tmc *map, uint32_t l, uint32_t x, uin
 	return rv;
 }
 
-static void read_tmc_tile(struct xqx_map *map, uint32_t l, uint32_t x, uint32_t y)
+static void write_synth_tile(struct xqx_map_tmc *map, uint32_t l, uint32_t x, uint32_t y, xqx_pixmap *pb)
+{
+	char namebuf[map->namebuf_size];
+
+	if (!format_filename(map, namebuf, l, x, y))
+		return;
+
+	if (xqx_xdg_make_dirs(namebuf) || xqx_pixmap_save(pb, namebuf))
+		printf("warning: failed to write synthesized tile '%s'\n", namebuf);
+}
+
+static ssize_t read_item(struct xqx_map_tmc *map, uint32_t l, uint32_t x, uint32_t y, void **buf)
 {
-	struct xqx_map_tmc *tmc_map = (void*)map;;
+	if (map->levels[l].pia)
+		return pia_read_whole_item(map->levels[l].pia, x, y, buf);
+
+	return dir_read_whole_item(map, l, x, y, buf);
+}
+
+/*
+ * Tiles are synthesized on the worker threads, the tiles read and built on
+ * the way are not inserted into the cache since that is done only from the
+ * main loop.
+ */
+struct synth_work {
+	struct xqx_work work;
+	struct xqx_map_tmc *map;
+	uint32_t l, x, y;
+
+	enum xqx_map_cache_node_state state;
+	void *data;
+
+	uint32_t io_us, decode_us;
+};
+
+struct synth_tile {
+	enum xqx_map_cache_node_state state;
+	void *data;
+	/* the data are owned by a cache node if set */
+	struct xqx_map_cache_node *cn;
+};
+
+static void synth_tile_release(struct synth_tile *t)
+{
+	if (t->cn)
+		xqx_map_cache_put(t->cn);
+	else if (t->state == XQX_CACHE_NODE_VALID_DATA)
+		xqx_pixmap_free(t->data);
+}
+
+static void synth_build(struct synth_work *sw, uint32_t l, uint32_t x, uint32_t y, struct synth_tile *t);
+
+/*
+ * Loads a tile from the cache if it's there, otherwise from the disk, tiles
+ * missing on the disk are synthesized unless too far from sw->l.
+ */
+static void synth_load(struct synth_work *sw, uint32_t l, uint32_t x, uint32_t y, struct synth_tile *t)
+{
+	struct xqx_map_tmc *map = sw->map;
+	struct xqx_map *common = &map->common;
 	void *buf = NULL;
 	ssize_t bufsize;
+	uint64_t t0;
 
-	if (tmc_map->levels[l].pia)
-		bufsize = pia_read_whole_item(tmc_map->levels[l].pia, x, y, &buf);
-	else
-		bufsize = dir_read_whole_item(tmc_map, l, x, y, &buf);
+	t->cn = xqx_map_cache_get(NULL, common, l, x, y);
+	if (t->cn && t->cn->state != XQX_CACHE_NODE_PENDING) {
+		t->state = t->cn->state;
+		t->data = t->cn->data;
+		return;
+	}
+
+	if (t->cn) {
+		xqx_map_cache_put(t->cn);
+		t->cn = NULL;
+	}
+
+	t0 = xqx_time_us();
+	bufsize = read_item(map, l, x, y, &buf);
+	sw->io_us += xqx_time_us() - t0;
+
+	t->state = XQX_CACHE_NODE_ERROR;
+	t->data = NULL;
+
+	if (bufsize == 0 && map->levels[l].synth && sw->l - l < XQX_TMC_SYNTH_DEPTH) {
+		synth_build(sw, l, x, y, t);
+	} else if (bufsize == 0) {
+		t->state = XQX_CACHE_NODE_VALID_COLOR;
+		t->data = (void *)(uintptr_t)map->levels[l].empty_color;
+	} else if (bufsize > 0) {
+		t0 = xqx_time_us();
+		t->data = xqx_pixmap_decode(common, buf, bufsize);
+		sw->decode_us += xqx_time_us() - t0;
+
+		if (t->data)
+			t->state = XQX_CACHE_NODE_VALID_DATA;
+	}
+
+	free(buf);
+}
+
+/*
+ * Builds a tile from the four tiles on the more detailed level.
+ */
+static void synth_build(struct synth_work *sw, uint32_t l, uint32_t x, uint32_t y, struct synth_tile *t)
+{
+	struct xqx_map_tmc *map = sw->map;
+	struct xqx_map *common = &map->common;
+	struct synth_tile children[4] = {};
+	xqx_pixmap *pb = NULL;
+	unsigned int i, errors = 0;
+
+	t->cn = NULL;
+	t->data = NULL;
+
+	for (i = 0; i < 4; i++) {
+		uint32_t cx = 2 * x + i % 2;
+		uint32_t cy = 2 * y + i / 2;
+
+		children[i].state = XQX_CACHE_NODE_PENDING;
+
+		if (cx >= (uint32_t)common->num_tiles_x[l - 1] ||
+		    cy >= (uint32_t)common->num_tiles_y[l - 1])
+			continue;
+
+		synth_load(sw, l - 1, cx, cy, &children[i]);
+
+		if (children[i].state == XQX_CACHE_NODE_ERROR)
+			errors++;
+
+		if (!pb && children[i].state == XQX_CACHE_NODE_VALID_DATA)
+			pb = children[i].data;
+	}
+
+	if (errors == 4) {
+		t->state = XQX_CACHE_NODE_ERROR;
+		goto out;
+	}
+
+	if (!pb) {
+		t->state = XQX_CACHE_NODE_VALID_COLOR;
+		t->data = (void *)(uintptr_t)map->levels[l].empty_color;
+
+		for (i = 0; i < 4; i++) {
+			if (children[i].state == XQX_CACHE_NODE_VALID_COLOR) {
+				t->data = children[i].data;
+				break;
+			}
+		}
+
+		goto out;
+	}
+
+	pb = xqx_pixmap_alloc(common->tile_w, common->tile_h, pb);
+	if (!pb) {
+		t->state = XQX_CACHE_NODE_ERROR;
+		goto out;
+	}
+
+	for (i = 0; i < 4; i++) {
+		struct synth_tile *c = &children[i];
+
+		if (c->state == XQX_CACHE_NODE_VALID_DATA &&
+		    !xqx_pixmap_downscale_quadrant(c->data, pb, i % 2, i / 2))
+			continue;
+
+		if (c->state == XQX_CACHE_NODE_VALID_COLOR)
+			xqx_pixmap_fill_quadrant(pb, i % 2, i / 2, (uintptr_t)c->data);
+		else
+			xqx_pixmap_fill_quadrant(pb, i % 2, i / 2, map->levels[l].empty_color);
+	}
+
+	if (map->mipmap_write)
+		write_synth_tile(map, l, x, y, pb);
+
+	t->state = XQX_CACHE_NODE_VALID_DATA;
+	t->data = pb;
+out:
+	for (i = 0; i < 4; i++)
+		synth_tile_release(&children[i]);
+}
+
+static void synth_work_fn(struct xqx_work *self)
+{
+	struct synth_work *sw = CONTAINER_OF(self, struct synth_work, work);
+	struct synth_tile t;
+
+	XQX_TRACE_TILE_BEGIN(XQX_TRACE_TILE_DECODE, sw->l, sw->x, sw->y);
+	synth_build(sw, sw->l, sw->x, sw->y, &t);
+	XQX_TRACE_TILE_END(XQX_TRACE_TILE_DECODE, sw->l, sw->x, sw->y);
+
+	sw->state = t.state;
+	sw->data = t.data;
+}
+
+static void synth_work_done(struct xqx_work *self)
+{
+	struct synth_work *sw = CONTAINER_OF(self, struct synth_work, work);
+
+	xqx_map_cache_account_io(sw->io_us);
+	xqx_map_cache_account_decode(sw->decode_us);
+
+	/* replaces the pending node */
+	xqx_map_cache_node_make(&sw->map->common, sw->l, sw->x, sw->y, sw->state, sw->data);
+
+	free(sw);
+}
+
+/*
+ * Queues the tile to be synthesized on the worker threads, the tile is marked
+ * as pending in the cache until then.
+ */
+static struct xqx_map_cache_node *synth_tmc_tile(struct xqx_map_tmc *map, uint32_t l, uint32_t x, uint32_t y)
+{
+	struct xqx_map *common = &map->common;
+	struct synth_work *sw = calloc(1, sizeof(*sw));
+
+	if (!sw)
+		return xqx_map_cache_make_error_node(common, l, x, y);
+
+	sw->work.fn = synth_work_fn;
+	sw->work.done = synth_work_done;
+	sw->map = map;
+	sw->l = l;
+	sw->x = x;
+	sw->y = y;
+
+	xqx_workers_queue(&sw->work);
+
+	return xqx_map_cache_make_pending_node(common, l, x, y);
+}
+
+static struct xqx_map_cache_node *load_tmc_tile(struct xqx_map_tmc *map, uint32_t l, uint32_t x, uint32_t y)
+{
+	struct xqx_map *common = &map->common;
+	struct xqx_map_cache_node *ret;
+	void *buf = NULL;
+	ssize_t bufsize;
+	uint64_t t = xqx_time_us();
+
+	XQX_TRACE_TILE_BEGIN(XQX_TRACE_TILE_READ, l, x, y);
+
+	bufsize = read_item(map, l, x, y, &buf);
+
+	XQX_TRACE_TILE_END(XQX_TRACE_TILE_READ, l, x, y);
+	xqx_map_cache_account_io(xqx_time_us() - t);
 
 	if (bufsize < 0)
-		xqx_map_cache_make_error_node(map, l, x, y);
+		ret = xqx_map_cache_make_error_node(common, l, x, y);
+	else if (bufsize == 0 && map->levels[l].synth)
+		ret = synth_tmc_tile(map, l, x, y);
 	else if (bufsize == 0)
-		xqx_map_cache_make_color_node(map, l, x, y, tmc_map->levels[l].empty_color);
+		ret = xqx_map_cache_make_color_node(common, l, x, y, map->levels[l].empty_color);
 	else {
-		xqx_pixmap *pb = xqx_pixmap_decode(map, buf, bufsize);
+		t = xqx_time_us();
+		XQX_TRACE_TILE_BEGIN(XQX_TRACE_TILE_DECODE, l, x, y);
+		xqx_pixmap *pb = xqx_pixmap_decode(common, buf, bufsize);
+		XQX_TRACE_TILE_END(XQX_TRACE_TILE_DECODE, l, x, y);
+		xqx_map_cache_account_decode(xqx_time_us() - t);
 		if (!pb)
-			xqx_map_cache_make_error_node(map, l, x, y);
+			ret = xqx_map_cache_make_error_node(common, l, x, y);
 		else
-			xqx_map_cache_make_data_node(map, l, x, y, pb);
+			ret = xqx_map_cache_make_data_node(common, l, x, y, pb);
 	}
 
 	free(buf);
+
+	return ret;
+}
+
+static void read_tmc_tile(struct xqx_map *map, uint32_t l, uint32_t x, uint32_t y)
+{
+	load_tmc_tile((void*)map, l, x, y);
 }
 
 /* TMC description parser */
@@ -221,12 +478,59 @@ void xqx_map_tmc_init(void)
 	xqx_register_map_ops(&map_tmc_ops);
 }
 
+/*
+ * Levels that are not on the disk at all are synthesized from the more
+ * detailed level. With mipmap-write the level directory is created right away
+ * and marked so that it's still synthesized on the next start.
+ *
+ * At most XQX_TMC_SYNTH_DEPTH levels in a row are synthesized so that a tile
+ * is never built from more than 4^XQX_TMC_SYNTH_DEPTH tiles.
+ */
+static void check_synth_level(struct xqx_map_tmc *map, uint32_t l, const char *dn,
+                              char *namebuf, size_t nbs, unsigned int *synth_run)
+{
+	int fd;
+
+	snprintf(namebuf, nbs, "%s/%02d/" SYNTH_MARKER, dn, l);
+	if (access(namebuf, F_OK)) {
+		snprintf(namebuf, nbs, "%s/%02d", dn, l);
+		if (!access(namebuf, F_OK)) {
+			*synth_run = 0;
+			return;
+		}
+	}
+
+	if (*synth_run >= XQX_TMC_SYNTH_DEPTH) {
+		printf("warning: level %u is too far from levels on the disk, not synthesized\n", l);
+		return;
+	}
+
+	printf("Level %u is synthesized from level %u\n", l, l - 1);
+	map->levels[l].synth = 1;
+	(*synth_run)++;
+
+	if (!map->mipmap_write)
+		return;
+
+	snprintf(namebuf, nbs, "%s/%02d/" SYNTH_MARKER, dn, l);
+	if (xqx_xdg_make_dirs(namebuf)) {
+		printf("warning: failed to create '%s'\n", namebuf);
+		return;
+	}
+
+	fd = open(namebuf, O_CREAT | O_WRONLY, 0666);
+	if (fd < 0)
+		printf("warning: failed to create '%s': %s\n", namebuf, strerror(errno));
+	else
+		close(fd);
+}
+
 static struct xqx_map *map_load_tmc(const char *filename)
 {
 	FILE *f;
 	char *buf = NULL;
 	size_t bufsize = 0;
-	uint32_t iw, ih, tw, th, levels, jpl, proj=0, empty_color;
+	uint32_t iw, ih, tw, th, levels, jpl, proj=0, empty_color, mipmap_write=0;
 	iw = ih = tw = th = levels = 0;
 	jpl = UINT32_MAX;
 	empty_color = 0xFFFFFFFF;
@@ -273,6 +577,8 @@ static struct xqx_map *map_load_tmc(const char *filename)
 			ok = match_u32_hex(&pos, &empty_color) && match_eol(&pos);
 		} else if (match_fixed_str(&pos, "jpeg-level")) {
 			ok = match_uint32_t(&pos, &jpl) && match_eol(&pos);
+		} else if (match_fixed_str(&pos, "mipmap-write")) {
+			ok = match_uint32_t(&pos, &mipmap_write) && match_eol(&pos);
 		} else if (pos != NULL) {
 			printf("warning: unsupported option in '%s': '%s'\n", filename, buf);
 		}
@@ -326,6 +632,7 @@ static struct xqx_map *map_load_tmc(const char *filename)
 	map->common.tile_w = tw;
 	map->common.tile_h = th;
 	map->common.num_levels = levels;
+	map->mipmap_write = mipmap_write;
 
 	if (p1_ok == 0)	{
 		/* No georeferencing, suppose pixel-bases coordinates */
@@ -370,6 +677,7 @@ static struct xqx_map *map_load_tmc(const char *filename)
 	char namebuf[nbs];
 	int s1c = 0;
 	int s2c = 0;
+	unsigned int synth_run = 0;
 
 	/* in next cycle we compute number of tiles in each level (using iw, ih),
 		 check for (and open) PIA files, set format_string to s1 or s2, check
@@ -384,6 +692,7 @@ static struct xqx_map *map_load_tmc(const char *filename)
 			printf("Found PIA file '%s'\n", namebuf);
 			map->levels[l].pia = open_pia(namebuf, 0);
 			map->levels[l].empty_color = map->levels[l].pia->hdr.empty_color;
+			synth_run = 0;
 		} else {
 			map->levels[l].format_string = (l < jpl) ? s1 : s2;
 			map->levels[l].empty_color = empty_color;
@@ -402,6 +711,12 @@ static struct xqx_map *map_load_tmc(const char *filename)
 			} else {
 				((l < jpl) ? s1c++ : s2c++);
 			}
+
+			if ((l > 0) && (map->levels[l].format_string == s1 ||
+			                map->levels[l].format_string == s2))
+				check_synth_level(map, l, dn, namebuf, nbs, &synth_run);
+			else
+				synth_run = 0;
 		}
 
 		map->common.num_tiles_x[l] = iw;
@@ -9,11 +9,16 @@
 
 struct pia_file;
 
+/* maximal number of synthesized levels in a row */
+#define XQX_TMC_SYNTH_DEPTH 3
+
 struct xqx_tmc_level
 {
 	struct pia_file *pia;
 	const char *format_string;
 	uint32_t empty_color;
+	/* tiles missing on the disk are synthesized from the previous level */
+	int synth;
 };
 
 struct xqx_map_tmc
@@ -22,6 +27,8 @@ struct xqx_map_tmc
 	struct xqx_tmc_level *levels;
 
 	unsigned int namebuf_size;
+	/* write synthesized tiles back to the disk */
+	int mipmap_write;
 };
 
 void xqx_map_tmc_init(void);
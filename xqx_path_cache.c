@@ -0,0 +1,656 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Cyril Hrubis <metan@ucw.cz>
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "xqx_common.h"
+#include "xqx_projection.h"
+#include "xqx_path_lod.h"
+#include "xqx_path_cache.h"
+#include "xqx_workers.h"
+#include "xqx_xdg.h"
+
+static int64_t stat_mtime(const struct stat *st)
+{
+	return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+void xqx_path_file_put(struct xqx_path_file *file)
+{
+	if (!file || --file->refs)
+		return;
+
+	munmap(file->addr, file->size);
+	free(file);
+}
+
+struct writer {
+	FILE *f;
+	uint64_t off;
+	int err;
+};
+
+static void w_align(struct writer *w)
+{
+	static const char zeros[8];
+	size_t pad = (8 - w->off % 8) % 8;
+
+	if (pad && fwrite(zeros, pad, 1, w->f) != 1)
+		w->err = 1;
+
+	w->off += pad;
+}
+
+static uint64_t w_data(struct writer *w, const void *data, size_t size)
+{
+	uint64_t off;
+
+	w_align(w);
+	off = w->off;
+
+	if (size && fwrite(data, size, 1, w->f) != 1)
+		w->err = 1;
+
+	w->off += size;
+
+	return off;
+}
+
+static int write_proj(struct writer *w, struct xqxp_proj *proj, unsigned int epsg,
+                      const double *lat, const double *lon, unsigned int cnt)
+{
+	int32_t *x = malloc(2 * MAX(cnt, 1u) * sizeof(int32_t)), *y;
+	struct xqx_path_lod *lod = NULL;
+	struct xqxp_level *levels = NULL;
+	unsigned int i;
+	int ret = 1;
+
+	if (!x)
+		return 1;
+
+	y = x + cnt;
+
+	if (xqx_wgs84_to_coords_arr(epsg, lat, lon, cnt, x, y))
+		goto err;
+
+	lod = xqx_path_lod_build(x, y, cnt, NULL);
+	if (!lod)
+		goto err;
+
+	levels = calloc(MAX(lod->levels_cnt, 1u), sizeof(struct xqxp_level));
+	if (!levels)
+		goto err;
+
+	proj->x_off = w_data(w, x, cnt * sizeof(int32_t));
+	proj->y_off = w_data(w, y, cnt * sizeof(int32_t));
+	proj->lod_off = w_data(w, lod->lod, cnt);
+
+	for (i = 0; i < lod->levels_cnt; i++) {
+		struct xqx_path_lod_level *level = &lod->levels[i];
+		struct xqx_rtree *tree = &level->tree;
+		unsigned int d, boxes_cnt = 0;
+
+		for (d = 0; d < tree->depth; d++) {
+			levels[i].level_cnt[d] = tree->level_cnt[d];
+			levels[i].level_off[d] = tree->level_off[d];
+			boxes_cnt += tree->level_cnt[d];
+		}
+
+		levels[i].lod = level->lod;
+		levels[i].verts_cnt = level->verts_cnt;
+		levels[i].verts_off = w_data(w, level->verts, level->verts_cnt * sizeof(uint32_t));
+		levels[i].depth = tree->depth;
+		levels[i].boxes_cnt = boxes_cnt;
+		levels[i].boxes_off = w_data(w, tree->boxes, boxes_cnt * sizeof(struct xqx_rtree_box));
+	}
+
+	proj->levels_cnt = lod->levels_cnt;
+	proj->levels_off = w_data(w, levels, lod->levels_cnt * sizeof(struct xqxp_level));
+
+	ret = 0;
+err:
+	free(levels);
+	xqx_path_lod_free(lod);
+	free(x);
+	return ret;
+}
+
+static int write_path(struct writer *w, struct xqxp_path *entry, struct xqx_path *path,
+                      const struct xqxp_name *names, const unsigned int *epsg, unsigned int epsg_cnt)
+{
+	unsigned int i, cnt = path->waypoints_cnt;
+
+	entry->cnt = cnt;
+	entry->lat_off = w_data(w, path->lat, cnt * sizeof(double));
+	entry->lon_off = w_data(w, path->lon, cnt * sizeof(double));
+
+	if (path->alt)
+		entry->alt_off = w_data(w, path->alt, cnt * sizeof(double));
+
+	entry->names_cnt = path->names_cnt;
+	entry->names_off = w_data(w, names, path->names_cnt * sizeof(struct xqxp_name));
+
+	for (i = 0; i < epsg_cnt; i++) {
+		if (write_proj(w, &entry->proj[i], epsg[i], path->lat, path->lon, cnt))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Appends a string to the names section, returns the offset into the section.
+ */
+static uint32_t write_name(struct writer *w, uint64_t names_off, const char *name)
+{
+	uint32_t off = w->off - names_off;
+	size_t len = strlen(name) + 1;
+
+	if (fwrite(name, len, 1, w->f) != 1)
+		w->err = 1;
+
+	w->off += len;
+
+	return off;
+}
+
+int xqx_path_cache_write(const char *pathname, struct xqx_paths *paths, const char *src,
+                         const unsigned int *epsg, unsigned int epsg_cnt)
+{
+	struct xqxp_header hdr = {
+		.magic = XQXP_MAGIC,
+		.version = XQXP_VERSION,
+		.byte_order = XQXP_BYTE_ORDER,
+		.paths_cnt = paths->cnt,
+		.proj_cnt = epsg_cnt,
+	};
+	struct writer w = {};
+	struct xqxp_path *table;
+	struct xqxp_name **names = NULL;
+	struct stat st;
+	unsigned int i, j;
+	int ret = 1;
+	char tmp[PATH_MAX + 4];
+
+	if (epsg_cnt > XQXP_PROJ_MAX || strlen(pathname) >= PATH_MAX)
+		return 1;
+
+	if (stat(src, &st)) {
+		printf("WARNING: stat('%s'): %s\n", src, strerror(errno));
+		return 1;
+	}
+
+	hdr.src_mtime = stat_mtime(&st);
+	hdr.src_size = st.st_size;
+
+	for (i = 0; i < epsg_cnt; i++)
+		hdr.epsg[i] = epsg[i];
+
+	table = calloc(MAX(paths->cnt, 1u), sizeof(struct xqxp_path));
+	names = calloc(MAX(paths->cnt, 1u), sizeof(struct xqxp_name *));
+	if (!table || !names)
+		goto err0;
+
+	for (i = 0; i < paths->cnt; i++) {
+		names[i] = malloc(MAX(paths->paths[i]->names_cnt, 1u) * sizeof(struct xqxp_name));
+		if (!names[i])
+			goto err0;
+	}
+
+	/* written to a temporary file and renamed so that readers never see a partial file */
+	snprintf(tmp, sizeof(tmp), "%s.tmp", pathname);
+
+	w.f = fopen(tmp, "w");
+	if (!w.f) {
+		printf("WARNING: Failed to create '%s': %s\n", tmp, strerror(errno));
+		goto err0;
+	}
+
+	w_data(&w, &hdr, sizeof(hdr));
+	hdr.paths_off = w_data(&w, table, paths->cnt * sizeof(struct xqxp_path));
+
+	hdr.names_off = w_data(&w, NULL, 0);
+
+	for (i = 0; i < paths->cnt; i++) {
+		struct xqx_path *path = paths->paths[i];
+
+		if (path->name)
+			table[i].name = write_name(&w, hdr.names_off, path->name);
+		else
+			table[i].name = XQXP_NO_NAME;
+
+		for (j = 0; j < path->names_cnt; j++) {
+			names[i][j].idx = path->names[j].idx;
+			names[i][j].name = write_name(&w, hdr.names_off, path->names[j].name);
+		}
+	}
+
+	hdr.names_size = w.off - hdr.names_off;
+
+	for (i = 0; i < paths->cnt && !w.err; i++) {
+		if (write_path(&w, &table[i], paths->paths[i], names[i], epsg, epsg_cnt))
+			w.err = 1;
+	}
+
+	hdr.file_size = w.off;
+
+	if (fseek(w.f, 0, SEEK_SET) ||
+	    fwrite(&hdr, sizeof(hdr), 1, w.f) != 1 ||
+	    fseek(w.f, hdr.paths_off, SEEK_SET) ||
+	    (paths->cnt && fwrite(table, paths->cnt * sizeof(struct xqxp_path), 1, w.f) != 1))
+		w.err = 1;
+
+	if (fclose(w.f))
+		w.err = 1;
+
+	if (w.err || rename(tmp, pathname)) {
+		printf("WARNING: Failed to write '%s'\n", pathname);
+		unlink(tmp);
+		goto err0;
+	}
+
+	ret = 0;
+err0:
+	for (i = 0; names && i < paths->cnt; i++)
+		free(names[i]);
+
+	free(names);
+	free(table);
+
+	return ret;
+}
+
+/*
+ * Returns pointer to size bytes at offset in the file or NULL if out of the
+ * file bounds or misaligned.
+ */
+static const void *file_ptr(struct xqx_path_file *file, uint64_t off, uint64_t size)
+{
+	if (off % 8 || off > file->size || size > file->size - off)
+		return NULL;
+
+	return (const char *)file->addr + off;
+}
+
+/*
+ * The vertex and segment indexes are used without further checks when the
+ * path is drawn, all of them have to be in range.
+ */
+static int check_level(const struct xqx_path_lod_level *level, unsigned int cnt)
+{
+	const struct xqx_rtree *tree = &level->tree;
+	unsigned int i, segs = MAX(level->verts_cnt - 1, 1u);
+
+	for (i = 0; i < level->verts_cnt; i++) {
+		if (level->verts[i] >= cnt)
+			return 1;
+	}
+
+	/* the query starts at the single root box */
+	if (tree->depth && tree->level_cnt[tree->depth - 1] != 1)
+		return 1;
+
+	for (i = 0; tree->depth && i < tree->level_cnt[0]; i++) {
+		if (tree->boxes[tree->level_off[0] + i].id >= segs)
+			return 1;
+	}
+
+	return 0;
+}
+
+static struct xqx_path_lod *map_lod(struct xqx_path_file *file, const struct xqxp_proj *proj, unsigned int cnt)
+{
+	const struct xqxp_level *levels;
+	struct xqx_path_lod *lod;
+	unsigned int i, d;
+
+	levels = file_ptr(file, proj->levels_off, (uint64_t)proj->levels_cnt * sizeof(*levels));
+	if (!levels || !proj->levels_cnt)
+		return NULL;
+
+	lod = calloc(1, sizeof(*lod));
+	if (!lod)
+		return NULL;
+
+	lod->cnt = cnt;
+	lod->lod = (uint8_t *)file_ptr(file, proj->lod_off, cnt);
+	lod->levels_cnt = proj->levels_cnt;
+	lod->levels = calloc(proj->levels_cnt, sizeof(struct xqx_path_lod_level));
+
+	if (!lod->lod || !lod->levels)
+		goto err;
+
+	for (i = 0; i < proj->levels_cnt; i++) {
+		struct xqx_path_lod_level *level = &lod->levels[i];
+		struct xqx_rtree *tree = &level->tree;
+		uint64_t boxes_cnt = 0;
+
+		if (levels[i].depth > XQX_RTREE_MAX_DEPTH ||
+		    !levels[i].verts_cnt || levels[i].verts_cnt > cnt)
+			goto err;
+
+		level->lod = levels[i].lod;
+		level->verts_cnt = levels[i].verts_cnt;
+		level->verts = (uint32_t *)file_ptr(file, levels[i].verts_off,
+		                                    (uint64_t)levels[i].verts_cnt * sizeof(uint32_t));
+
+		tree->depth = levels[i].depth;
+
+		for (d = 0; d < tree->depth; d++) {
+			tree->level_cnt[d] = levels[i].level_cnt[d];
+			tree->level_off[d] = levels[i].level_off[d];
+
+			if ((uint64_t)tree->level_off[d] + tree->level_cnt[d] > levels[i].boxes_cnt)
+				goto err;
+
+			boxes_cnt += tree->level_cnt[d];
+		}
+
+		tree->boxes = (struct xqx_rtree_box *)file_ptr(file, levels[i].boxes_off,
+		                                              boxes_cnt * sizeof(struct xqx_rtree_box));
+
+		if (!level->verts || !tree->boxes || boxes_cnt != levels[i].boxes_cnt ||
+		    check_level(level, cnt))
+			goto err;
+	}
+
+	return lod;
+err:
+	xqx_path_lod_free(lod);
+	return NULL;
+}
+
+static const char *map_name(const struct xqxp_header *hdr, const char *names, uint32_t off)
+{
+	if (off >= hdr->names_size || !memchr(names + off, 0, hdr->names_size - off))
+		return NULL;
+
+	return names + off;
+}
+
+static struct xqx_path *map_path(struct xqx_path_file *file, const struct xqxp_header *hdr,
+                                 const struct xqxp_path *entry, int proj)
+{
+	const char *names = (const char *)file->addr + hdr->names_off;
+	const struct xqxp_name *wnames;
+	const double *lat, *lon, *alt = NULL;
+	const char *name = NULL;
+	struct xqx_path *path;
+	uint64_t size = (uint64_t)entry->cnt * sizeof(double);
+	unsigned int i;
+
+	if (entry->name != XQXP_NO_NAME) {
+		name = map_name(hdr, names, entry->name);
+		if (!name)
+			return NULL;
+	}
+
+	lat = file_ptr(file, entry->lat_off, size);
+	lon = file_ptr(file, entry->lon_off, size);
+
+	if (entry->alt_off)
+		alt = file_ptr(file, entry->alt_off, size);
+
+	wnames = file_ptr(file, entry->names_off, (uint64_t)entry->names_cnt * sizeof(*wnames));
+
+	if (!lat || !lon || (entry->alt_off && !alt) || !wnames)
+		return NULL;
+
+	path = xqx_path_new(name);
+	if (!path)
+		return NULL;
+
+	path->lat = (double *)lat;
+	path->lon = (double *)lon;
+	path->alt = (double *)alt;
+	path->waypoints_cnt = entry->cnt;
+	path->waypoints_size = entry->cnt;
+	path->mapped = 1;
+
+	path->file = file;
+	file->refs++;
+
+	for (i = 0; i < entry->names_cnt; i++) {
+		const char *wname = map_name(hdr, names, wnames[i].name);
+
+		if (!wname || wnames[i].idx >= entry->cnt ||
+		    xqx_path_waypoint_name_set(path, wnames[i].idx, wname))
+			goto err;
+	}
+
+	if (proj < 0)
+		return path;
+
+	const struct xqxp_proj *p = &entry->proj[proj];
+	int32_t *x = (int32_t *)file_ptr(file, p->x_off, (uint64_t)entry->cnt * sizeof(int32_t));
+	int32_t *y = (int32_t *)file_ptr(file, p->y_off, (uint64_t)entry->cnt * sizeof(int32_t));
+
+	if (!x || !y)
+		goto err;
+
+	path->proj_x = x;
+	path->proj_y = y;
+	path->proj_cnt = entry->cnt;
+	path->proj_epsg = hdr->epsg[proj];
+	path->proj_mapped = 1;
+
+	if (p->levels_cnt) {
+		path->lod = map_lod(file, p, entry->cnt);
+		if (!path->lod)
+			goto err;
+	}
+
+	return path;
+err:
+	xqx_path_free(path);
+	return NULL;
+}
+
+struct xqx_paths *xqx_path_cache_open(const char *pathname, const char *src, unsigned int epsg)
+{
+	const struct xqxp_header *hdr;
+	const struct xqxp_path *table;
+	struct xqx_path_file *file;
+	struct xqx_paths *paths;
+	struct stat st;
+	unsigned int i;
+	int fd, proj = -1;
+
+	fd = open(pathname, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) || (size_t)st.st_size < sizeof(*hdr)) {
+		close(fd);
+		return NULL;
+	}
+
+	file = calloc(1, sizeof(*file));
+	if (!file) {
+		close(fd);
+		return NULL;
+	}
+
+	file->size = st.st_size;
+	file->addr = mmap(NULL, file->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (file->addr == MAP_FAILED) {
+		free(file);
+		return NULL;
+	}
+
+	/* keeps the file mapped until all the paths are created */
+	file->refs = 1;
+
+	hdr = file->addr;
+
+	if (memcmp(hdr->magic, XQXP_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != XQXP_VERSION || hdr->byte_order != XQXP_BYTE_ORDER ||
+	    hdr->file_size != file->size || hdr->proj_cnt > XQXP_PROJ_MAX ||
+	    !file_ptr(file, hdr->names_off, hdr->names_size))
+		goto err0;
+
+	if (src) {
+		if (stat(src, &st) || stat_mtime(&st) != hdr->src_mtime ||
+		    (uint64_t)st.st_size != hdr->src_size)
+			goto err0;
+	}
+
+	table = file_ptr(file, hdr->paths_off, (uint64_t)hdr->paths_cnt * sizeof(*table));
+	if (!table)
+		goto err0;
+
+	for (i = 0; i < hdr->proj_cnt; i++) {
+		if (epsg && hdr->epsg[i] == epsg)
+			proj = i;
+	}
+
+	paths = calloc(1, sizeof(*paths));
+	if (!paths)
+		goto err0;
+
+	paths->paths = calloc(MAX(hdr->paths_cnt, 1u), sizeof(struct xqx_path *));
+	if (!paths->paths)
+		goto err1;
+
+	for (i = 0; i < hdr->paths_cnt; i++) {
+		paths->paths[i] = map_path(file, hdr, &table[i], proj);
+		if (!paths->paths[i])
+			goto err1;
+
+		paths->cnt++;
+	}
+
+	xqx_path_file_put(file);
+
+	return paths;
+err1:
+	printf("WARNING: Corrupted path cache '%s'\n", pathname);
+	xqx_paths_free(paths);
+err0:
+	xqx_path_file_put(file);
+	return NULL;
+}
+
+/*
+ * The cache is named after the source file and a hash of its absolute path so
+ * that files with the same name in different directories do not collide.
+ */
+static int cache_path(char *buf, size_t buf_size, const char *pathname)
+{
+	char *abs = realpath(pathname, NULL);
+	uint64_t hash = 0xcbf29ce484222325;
+	char name[NAME_MAX + 1];
+	const char *p;
+
+	if (!abs)
+		return 1;
+
+	/* FNV-1a */
+	for (p = abs; *p; p++) {
+		hash ^= (unsigned char)*p;
+		hash *= 0x100000001b3;
+	}
+
+	snprintf(name, sizeof(name), "paths/%.64s-%016llx.xqxp",
+	         strrchr(abs, '/') + 1, (unsigned long long)hash);
+
+	free(abs);
+
+	if (xqx_xdg_cache_path(buf, buf_size, name, 1)) {
+		printf("WARNING: Failed to create path cache directory\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * The cache is written from a separate copy of the paths parsed on a worker,
+ * the level of detail for all the paths takes far too long to be computed on
+ * the main thread and the returned paths may be freed in the meantime.
+ */
+struct cache_job {
+	struct xqx_work work;
+	unsigned int epsg;
+	char *src;
+	char cache[PATH_MAX];
+};
+
+static void cache_job_fn(struct xqx_work *self)
+{
+	struct cache_job *job = CONTAINER_OF(self, struct cache_job, work);
+	struct xqx_paths *paths = xqx_paths_load(job->src);
+
+	if (!paths)
+		return;
+
+	xqx_path_cache_write(job->cache, paths, job->src, &job->epsg, job->epsg ? 1 : 0);
+	xqx_paths_free(paths);
+}
+
+static void cache_job_done(struct xqx_work *self)
+{
+	struct cache_job *job = CONTAINER_OF(self, struct cache_job, work);
+
+	free(job->src);
+	free(job);
+}
+
+static void cache_job_queue(const char *cache, const char *pathname, unsigned int epsg)
+{
+	struct cache_job *job = calloc(1, sizeof(*job));
+
+	if (!job)
+		return;
+
+	job->src = strdup(pathname);
+	if (!job->src) {
+		free(job);
+		return;
+	}
+
+	strcpy(job->cache, cache);
+	job->epsg = epsg;
+	job->work.fn = cache_job_fn;
+	job->work.done = cache_job_done;
+
+	xqx_workers_queue(&job->work);
+}
+
+struct xqx_paths *xqx_paths_load_cached(const char *pathname, unsigned int epsg)
+{
+	char cache[PATH_MAX];
+	struct xqx_paths *paths;
+	struct stat src_st, cache_st;
+
+	if (cache_path(cache, sizeof(cache), pathname))
+		return xqx_paths_load(pathname);
+
+	if (!stat(pathname, &src_st) && !stat(cache, &cache_st) &&
+	    stat_mtime(&cache_st) >= stat_mtime(&src_st)) {
+		paths = xqx_path_cache_open(cache, pathname, epsg);
+		if (paths)
+			return paths;
+	}
+
+	paths = xqx_paths_load(pathname);
+	if (!paths)
+		return NULL;
+
+	cache_job_queue(cache, pathname, epsg);
+
+	return paths;
+}
@@ -0,0 +1,147 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Cyril Hrubis <metan@ucw.cz>
+ */
+
+/*
+
+   Binary path cache.
+
+   Parsed paths are stored in $XDG_CACHE_HOME/gpmaps/paths/, see xqx_xdg.h,
+   the cache is used instead of the GPX or GeoJSON file as long as it's newer
+   and the source size and modification time stored in it match.
+
+   The file is mmapped and the waypoint coordinates, projected coordinates,
+   level of detail and the segment R-trees are used directly from the mapping.
+   All numbers are in the native byte order, files written on a different
+   architecture are ignored.
+
+   Layout, all offsets are from the start of the file and 8 byte aligned:
+
+   struct xqxp_header
+   struct xqxp_path[paths_cnt]
+   names                  NUL terminated path and waypoint names
+   per path:
+     double lat[cnt], lon[cnt], alt[cnt]   alt only if the path has altitude
+     struct xqxp_name[names_cnt]
+     per projection:
+       int32_t x[cnt], y[cnt]
+       uint8_t lod[cnt]
+       struct xqxp_level[levels_cnt]
+       per level: uint32_t verts[verts_cnt], struct xqx_rtree_box boxes[]
+
+ */
+
+#ifndef XQX_PATH_CACHE_H__
+#define XQX_PATH_CACHE_H__
+
+#include <stdint.h>
+#include "xqx_rtree.h"
+#include "xqx_path_load.h"
+
+#define XQXP_MAGIC "XQXPATH"
+#define XQXP_VERSION 3
+#define XQXP_BYTE_ORDER 0x01020304
+#define XQXP_PROJ_MAX 4
+#define XQXP_NO_NAME UINT32_MAX
+
+struct xqxp_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+
+	/* the source file the cache was created from */
+	int64_t src_mtime;
+	uint64_t src_size;
+
+	uint64_t file_size;
+
+	uint32_t paths_cnt;
+	uint32_t proj_cnt;
+	uint32_t epsg[XQXP_PROJ_MAX];
+
+	uint64_t paths_off;
+	uint64_t names_off;
+	uint64_t names_size;
+};
+
+struct xqxp_level {
+	uint32_t lod;
+	uint32_t verts_cnt;
+	uint64_t verts_off;
+
+	uint32_t depth;
+	uint32_t boxes_cnt;
+	uint32_t level_cnt[XQX_RTREE_MAX_DEPTH];
+	uint32_t level_off[XQX_RTREE_MAX_DEPTH];
+	uint64_t boxes_off;
+};
+
+struct xqxp_proj {
+	uint64_t x_off, y_off;
+	uint64_t lod_off;
+	uint64_t levels_off;
+	uint32_t levels_cnt;
+	uint32_t reserved;
+};
+
+struct xqxp_name {
+	uint32_t idx;
+	/* offset into names */
+	uint32_t name;
+};
+
+struct xqxp_path {
+	uint32_t cnt;
+	/* offset into names or XQXP_NO_NAME */
+	uint32_t name;
+	/* alt_off is zero if there is no altitude */
+	uint64_t lat_off, lon_off, alt_off;
+	uint64_t names_off;
+	uint32_t names_cnt;
+	uint32_t reserved;
+	struct xqxp_proj proj[XQXP_PROJ_MAX];
+};
+
+/*
+ * A mapped cache file, shared by all the paths loaded from it.
+ */
+struct xqx_path_file {
+	void *addr;
+	size_t size;
+	unsigned int refs;
+};
+
+void xqx_path_file_put(struct xqx_path_file *file);
+
+/*
+ * Writes paths into a cache file, the paths are projected into each of the
+ * epsg projections and the level of detail is computed for them.
+ *
+ * @src: Source file to record the size and modification time of.
+ *
+ * Returns non-zero on failure.
+ */
+int xqx_path_cache_write(const char *pathname, struct xqx_paths *paths, const char *src,
+                         const unsigned int *epsg, unsigned int epsg_cnt);
+
+/*
+ * Opens a cache file, paths are projected into epsg if the file contains the
+ * projection.
+ *
+ * @src: If not NULL, the cache is rejected when it does not match the file.
+ *
+ * Returns NULL on failure.
+ */
+struct xqx_paths *xqx_path_cache_open(const char *pathname, const char *src, unsigned int epsg);
+
+/*
+ * Loads paths from a GPX or GeoJSON file through the cache. When the source is
+ * newer the paths are parsed and returned right away and the cache is written
+ * on the workers.
+ *
+ * @epsg: Projection to store in the cache, zero for none.
+ */
+struct xqx_paths *xqx_paths_load_cached(const char *pathname, unsigned int epsg);
+
+#endif /* XQX_PATH_CACHE_H__ */
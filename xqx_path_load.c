@@ -0,0 +1,1066 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Cyril Hrubis <metan@ucw.cz>
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "xqx_common.h"
+#include "xqx_path_load.h"
+
+struct loader {
+	const char *pathname;
+	const char *start, *pos, *end;
+
+	struct xqx_paths *paths;
+	unsigned int paths_size;
+
+	/* waypoints of the path being parsed */
+	double *lat, *lon, *alt;
+	unsigned int cnt, size;
+
+	/* name of the current Feature, trk or rte */
+	char *name;
+};
+
+static void load_err(struct loader *ld, const char *msg)
+{
+	const char *s;
+	unsigned int line = 1;
+
+	for (s = ld->start; s < ld->pos && s < ld->end; s++)
+		line += *s == '\n';
+
+	printf("error: %s:%u: %s\n", ld->pathname, line, msg);
+}
+
+static int point_add(struct loader *ld, double lat, double lon, double alt)
+{
+	if (ld->cnt >= ld->size) {
+		unsigned int size = MAX(2 * ld->size, 1024u);
+		double *lat_arr = realloc(ld->lat, size * sizeof(double));
+		double *lon_arr = realloc(ld->lon, size * sizeof(double));
+		double *alt_arr = realloc(ld->alt, size * sizeof(double));
+
+		if (lat_arr)
+			ld->lat = lat_arr;
+		if (lon_arr)
+			ld->lon = lon_arr;
+		if (alt_arr)
+			ld->alt = alt_arr;
+
+		if (!lat_arr || !lon_arr || !alt_arr) {
+			load_err(ld, "Out of memory");
+			return 1;
+		}
+
+		ld->size = size;
+	}
+
+	ld->lat[ld->cnt] = lat;
+	ld->lon[ld->cnt] = lon;
+	ld->alt[ld->cnt] = alt;
+	ld->cnt++;
+
+	return 0;
+}
+
+/*
+ * Turns the collected waypoints into a path, empty paths are ignored.
+ */
+static int path_finish(struct loader *ld)
+{
+	struct xqx_paths *paths = ld->paths;
+	struct xqx_path *path;
+
+	if (!ld->cnt)
+		return 0;
+
+	if (paths->cnt >= ld->paths_size) {
+		unsigned int size = MAX(2 * ld->paths_size, 16u);
+		struct xqx_path **arr = realloc(paths->paths, size * sizeof(struct xqx_path *));
+
+		if (!arr) {
+			load_err(ld, "Out of memory");
+			return 1;
+		}
+
+		paths->paths = arr;
+		ld->paths_size = size;
+	}
+
+	path = xqx_path_new_arr(NULL, ld->cnt, ld->lat, ld->lon, ld->alt);
+	if (!path) {
+		load_err(ld, "Out of memory");
+		return 1;
+	}
+
+	paths->paths[paths->cnt++] = path;
+	ld->cnt = 0;
+
+	return 0;
+}
+
+/*
+ * Names paths created since mark after the Feature, trk or rte they belong to,
+ * the name may be stored after the coordinates. Paths named by a nested
+ * Feature keep their name.
+ */
+static void paths_name(struct loader *ld, unsigned int mark)
+{
+	unsigned int i;
+
+	for (i = mark; ld->name && i < ld->paths->cnt; i++) {
+		if (!ld->paths->paths[i]->name)
+			ld->paths->paths[i]->name = strdup(ld->name);
+	}
+
+	free(ld->name);
+	ld->name = NULL;
+}
+
+static void paths_drop(struct loader *ld, unsigned int mark)
+{
+	while (ld->paths->cnt > mark)
+		xqx_path_free(ld->paths->paths[--ld->paths->cnt]);
+}
+
+static const double pow10_tab[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+static inline int is_digit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+static inline int is_ws(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+/*
+ * Parses a decimal number, plain decimals with up to 19 significant digits
+ * are converted without strtod() which is the common case for coordinates.
+ */
+static int parse_num(const char **pos, const char *end, double *val)
+{
+	const char *s = *pos;
+	uint64_t mant = 0;
+	unsigned int digits = 0, frac = 0;
+	int neg = 0;
+
+	if (s < end && (*s == '-' || *s == '+'))
+		neg = *s++ == '-';
+
+	while (s < end && is_digit(*s) && digits < 19) {
+		mant = mant * 10 + (*s++ - '0');
+		digits++;
+	}
+
+	if (s < end && *s == '.') {
+		s++;
+
+		while (s < end && is_digit(*s) && digits < 19) {
+			mant = mant * 10 + (*s++ - '0');
+			digits++;
+			frac++;
+		}
+	}
+
+	if (s < end && (is_digit(*s) || *s == 'e' || *s == 'E' || *s == '.')) {
+		char buf[64], *e;
+		size_t len = 0;
+
+		s = *pos;
+		while (s + len < end && len < sizeof(buf) - 1 &&
+		       (is_digit(s[len]) || (s[len] && strchr("+-.eE", s[len]))))
+			len++;
+
+		memcpy(buf, s, len);
+		buf[len] = 0;
+
+		*val = strtod(buf, &e);
+		if (e == buf)
+			return 1;
+
+		*pos = s + (e - buf);
+		return 0;
+	}
+
+	if (!digits)
+		return 1;
+
+	*val = (double)mant / pow10_tab[frac];
+	if (neg)
+		*val = -*val;
+
+	*pos = s;
+	return 0;
+}
+
+static void utf8_put(char **d, unsigned long c)
+{
+	if (c < 0x80) {
+		*(*d)++ = c;
+	} else if (c < 0x800) {
+		*(*d)++ = 0xc0 | (c >> 6);
+		*(*d)++ = 0x80 | (c & 0x3f);
+	} else if (c < 0x10000) {
+		*(*d)++ = 0xe0 | (c >> 12);
+		*(*d)++ = 0x80 | ((c >> 6) & 0x3f);
+		*(*d)++ = 0x80 | (c & 0x3f);
+	} else {
+		*(*d)++ = 0xf0 | (c >> 18);
+		*(*d)++ = 0x80 | ((c >> 12) & 0x3f);
+		*(*d)++ = 0x80 | ((c >> 6) & 0x3f);
+		*(*d)++ = 0x80 | (c & 0x3f);
+	}
+}
+
+/*
+ * Decodes JSON string escapes or XML entities into a newly allocated string.
+ */
+static char *decode_str(const char *s, const char *end, int xml)
+{
+	/* escapes never expand, \uXXXX is at most three bytes of UTF-8 */
+	char *ret = malloc(end - s + 1), *d = ret;
+
+	if (!ret)
+		return NULL;
+
+	while (s < end) {
+		if (!xml && *s == '\\' && s + 1 < end) {
+			s++;
+			switch (*s) {
+			case 'n': *d++ = '\n'; s++; break;
+			case 't': *d++ = '\t'; s++; break;
+			case 'r': *d++ = '\r'; s++; break;
+			case 'b': *d++ = '\b'; s++; break;
+			case 'f': *d++ = '\f'; s++; break;
+			case 'u':
+				if (end - s >= 5) {
+					char hex[5] = {s[1], s[2], s[3], s[4], 0};
+
+					utf8_put(&d, strtoul(hex, NULL, 16));
+					s += 5;
+					break;
+				}
+			/* fallthrough */
+			default:
+				*d++ = *s++;
+			}
+		} else if (xml && *s == '&') {
+			const char *e = memchr(s, ';', end - s);
+			size_t len = e ? (size_t)(e - s - 1) : 0;
+
+			if (len && s[1] == '#') {
+				if (s[2] == 'x')
+					utf8_put(&d, strtoul(s + 3, NULL, 16));
+				else
+					utf8_put(&d, strtoul(s + 2, NULL, 10));
+			} else if (len == 3 && !strncmp(s + 1, "amp", 3)) {
+				*d++ = '&';
+			} else if (len == 2 && !strncmp(s + 1, "lt", 2)) {
+				*d++ = '<';
+			} else if (len == 2 && !strncmp(s + 1, "gt", 2)) {
+				*d++ = '>';
+			} else if (len == 4 && !strncmp(s + 1, "quot", 4)) {
+				*d++ = '"';
+			} else if (len == 4 && !strncmp(s + 1, "apos", 4)) {
+				*d++ = '\'';
+			} else {
+				*d++ = *s++;
+				continue;
+			}
+
+			s = e + 1;
+		} else {
+			*d++ = *s++;
+		}
+	}
+
+	*d = 0;
+
+	return ret;
+}
+
+/*
+ * GeoJSON, a recursive descent parser that looks only for the keys needed to
+ * find the paths and skips everything else.
+ */
+enum json_obj {
+	JSON_ROOT,
+	JSON_FEATURE,
+	JSON_GEOMETRY,
+	JSON_PROPERTIES,
+};
+
+enum json_coords {
+	COORDS_EMPTY,
+	COORDS_POS,
+	COORDS_LINE,
+	COORDS_MULTI,
+};
+
+#define JSON_MAX_DEPTH 64
+
+static void json_ws(struct loader *ld)
+{
+	while (ld->pos < ld->end && is_ws(*ld->pos))
+		ld->pos++;
+}
+
+static int json_expect(struct loader *ld, char c)
+{
+	json_ws(ld);
+
+	if (ld->pos >= ld->end || *ld->pos != c) {
+		char msg[32];
+
+		snprintf(msg, sizeof(msg), "Expected '%c'", c);
+		load_err(ld, msg);
+		return 1;
+	}
+
+	ld->pos++;
+	return 0;
+}
+
+static int json_peek(struct loader *ld)
+{
+	json_ws(ld);
+
+	return ld->pos < ld->end ? *ld->pos : 0;
+}
+
+/*
+ * Returns the string without the quotes, escapes are left in place.
+ */
+static int json_str(struct loader *ld, const char **s, const char **e)
+{
+	if (json_expect(ld, '"'))
+		return 1;
+
+	*s = ld->pos;
+
+	while (ld->pos < ld->end && *ld->pos != '"') {
+		if (*ld->pos == '\\')
+			ld->pos++;
+		ld->pos++;
+	}
+
+	if (ld->pos >= ld->end) {
+		load_err(ld, "Unterminated string");
+		return 1;
+	}
+
+	*e = ld->pos++;
+
+	return 0;
+}
+
+static int json_str_eq(const char *s, const char *e, const char *str)
+{
+	size_t len = strlen(str);
+
+	return (size_t)(e - s) == len && !memcmp(s, str, len);
+}
+
+static int json_skip(struct loader *ld)
+{
+	unsigned int depth = 0;
+	const char *s, *e;
+
+	do {
+		switch (json_peek(ld)) {
+		case '"':
+			if (json_str(ld, &s, &e))
+				return 1;
+		break;
+		case '{':
+		case '[':
+			depth++;
+			ld->pos++;
+		break;
+		case '}':
+		case ']':
+			if (!depth) {
+				load_err(ld, "Unexpected end of object");
+				return 1;
+			}
+			depth--;
+			ld->pos++;
+		break;
+		case ',':
+		case ':':
+			ld->pos++;
+		break;
+		case 0:
+			load_err(ld, "Unexpected end of file");
+			return 1;
+		default:
+			while (ld->pos < ld->end && !is_ws(*ld->pos) &&
+			       !strchr(",:[]{}\"", *ld->pos))
+				ld->pos++;
+		}
+	} while (depth);
+
+	return 0;
+}
+
+/*
+ * Iterates over array elements, returns 1 for the next element, 0 at the end
+ * and -1 on a syntax error.
+ */
+static int json_arr_next(struct loader *ld, int *first)
+{
+	int c = json_peek(ld);
+
+	if (c == ']') {
+		ld->pos++;
+		return 0;
+	}
+
+	if (!*first && json_expect(ld, ','))
+		return -1;
+
+	*first = 0;
+
+	if (json_peek(ld) == ']') {
+		load_err(ld, "Trailing comma");
+		return -1;
+	}
+
+	return 1;
+}
+
+/*
+ * Coordinates are nested arrays, the type is derived from the nesting so
+ * that the type key may be stored before or after them.
+ */
+static int json_coords(struct loader *ld, double *pos, unsigned int depth)
+{
+	enum json_coords ret = COORDS_EMPTY;
+	int first = 1, r;
+
+	if (depth > JSON_MAX_DEPTH) {
+		load_err(ld, "Too deep nesting");
+		return -1;
+	}
+
+	if (json_expect(ld, '['))
+		return -1;
+
+	int c = json_peek(ld);
+
+	/* a position, the hot path, parsed without the generic array helpers */
+	if (c == '-' || c == '+' || is_digit(c)) {
+		unsigned int i = 0;
+
+		pos[2] = NAN;
+
+		for (;;) {
+			double val;
+
+			json_ws(ld);
+
+			if (parse_num(&ld->pos, ld->end, &val)) {
+				load_err(ld, "Expected number");
+				return -1;
+			}
+
+			if (i < 3)
+				pos[i] = val;
+
+			i++;
+
+			c = json_peek(ld);
+			ld->pos++;
+
+			if (c == ']')
+				break;
+
+			if (c != ',') {
+				ld->pos--;
+				load_err(ld, "Expected ',' or ']'");
+				return -1;
+			}
+		}
+
+		if (i < 2) {
+			load_err(ld, "Expected [lon, lat]");
+			return -1;
+		}
+
+		return COORDS_POS;
+	}
+
+	while ((r = json_arr_next(ld, &first)) > 0) {
+		double child_pos[3];
+
+		switch (json_coords(ld, child_pos, depth + 1)) {
+		case COORDS_POS:
+			/* RFC 7946 positions are [lon, lat, alt] */
+			if (point_add(ld, child_pos[1], child_pos[0], child_pos[2]))
+				return -1;
+			ret = COORDS_LINE;
+		break;
+		case COORDS_LINE:
+			if (path_finish(ld))
+				return -1;
+			ret = COORDS_MULTI;
+		break;
+		case COORDS_MULTI:
+			ret = COORDS_MULTI;
+		break;
+		case COORDS_EMPTY:
+		break;
+		default:
+			return -1;
+		}
+	}
+
+	if (r < 0)
+		return -1;
+
+	return ret;
+}
+
+static int json_obj(struct loader *ld, enum json_obj type, unsigned int depth);
+
+static int json_arr_of_obj(struct loader *ld, enum json_obj type, unsigned int depth)
+{
+	int first = 1, r;
+
+	if (json_expect(ld, '['))
+		return 1;
+
+	while ((r = json_arr_next(ld, &first)) > 0) {
+		if (json_peek(ld) == '{')
+			r = json_obj(ld, type, depth + 1);
+		else
+			r = json_skip(ld);
+
+		if (r)
+			return 1;
+	}
+
+	return r < 0;
+}
+
+static int json_line_type(const char *s, const char *e)
+{
+	return json_str_eq(s, e, "LineString") || json_str_eq(s, e, "MultiLineString");
+}
+
+static int json_obj(struct loader *ld, enum json_obj type, unsigned int depth)
+{
+	unsigned int mark = ld->paths->cnt;
+	int first = 1, coords = 0, lines = 0, r;
+	const char *s, *e;
+
+	if (depth > JSON_MAX_DEPTH) {
+		load_err(ld, "Too deep nesting");
+		return 1;
+	}
+
+	if (json_expect(ld, '{'))
+		return 1;
+
+	if (type == JSON_FEATURE) {
+		free(ld->name);
+		ld->name = NULL;
+	}
+
+	for (;;) {
+		if (json_peek(ld) == '}') {
+			ld->pos++;
+			break;
+		}
+
+		if (!first && json_expect(ld, ','))
+			return 1;
+
+		first = 0;
+
+		if (json_str(ld, &s, &e) || json_expect(ld, ':'))
+			return 1;
+
+		int c = json_peek(ld);
+
+		if (json_str_eq(s, e, "type") && c == '"') {
+			r = json_str(ld, &s, &e);
+			lines = !r && json_line_type(s, e);
+		} else if (json_str_eq(s, e, "coordinates") && c == '[' &&
+		           (type == JSON_GEOMETRY || type == JSON_ROOT)) {
+			double pos[3];
+
+			coords = 1;
+
+			switch (json_coords(ld, pos, depth + 1)) {
+			case COORDS_LINE:
+				r = path_finish(ld);
+			break;
+			case -1:
+				r = 1;
+			break;
+			default:
+				r = 0;
+			}
+		} else if (json_str_eq(s, e, "features") && c == '[') {
+			r = json_arr_of_obj(ld, JSON_FEATURE, depth);
+		} else if (json_str_eq(s, e, "geometries") && c == '[') {
+			r = json_arr_of_obj(ld, JSON_GEOMETRY, depth);
+		} else if (json_str_eq(s, e, "geometry") && c == '{') {
+			r = json_obj(ld, JSON_GEOMETRY, depth + 1);
+		} else if (json_str_eq(s, e, "properties") && c == '{' &&
+		           (type == JSON_FEATURE || type == JSON_ROOT)) {
+			r = json_obj(ld, JSON_PROPERTIES, depth + 1);
+		} else if (json_str_eq(s, e, "name") && c == '"' && type == JSON_PROPERTIES) {
+			r = json_str(ld, &s, &e);
+			if (!r) {
+				free(ld->name);
+				ld->name = decode_str(s, e, 0);
+			}
+		} else {
+			r = json_skip(ld);
+		}
+
+		if (r)
+			return 1;
+	}
+
+	/* Points and polygons have coordinates too */
+	if (coords && !lines)
+		paths_drop(ld, mark);
+
+	if (type == JSON_FEATURE || type == JSON_ROOT)
+		paths_name(ld, mark);
+
+	return 0;
+}
+
+static int load_geojson(struct loader *ld)
+{
+	if (json_obj(ld, JSON_ROOT, 0))
+		return 1;
+
+	if (json_peek(ld)) {
+		load_err(ld, "Trailing data");
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * GPX, tags are matched by their local names, everything but the tracks and
+ * routes is skipped.
+ */
+static const char *find_str(const char *s, const char *end, const char *str)
+{
+	size_t len = strlen(str);
+
+	while (s + len <= end) {
+		const char *c = memchr(s, str[0], end - s);
+
+		if (!c || c + len > end)
+			return NULL;
+
+		if (!memcmp(c, str, len))
+			return c;
+
+		s = c + 1;
+	}
+
+	return NULL;
+}
+
+static int skip_past(struct loader *ld, const char *str)
+{
+	const char *s = find_str(ld->pos, ld->end, str);
+
+	if (!s) {
+		load_err(ld, "Unexpected end of file");
+		return 1;
+	}
+
+	ld->pos = s + strlen(str);
+	return 0;
+}
+
+/* Strips the namespace prefix */
+static const char *local_name(const char *s, const char *e)
+{
+	const char *colon = memchr(s, ':', e - s);
+
+	return colon ? colon + 1 : s;
+}
+
+#define TAG_EQ(s, e, name) \
+	((size_t)((e) - (s)) == sizeof(name) - 1 && !memcmp(s, name, sizeof(name) - 1))
+
+struct gpx_state {
+	int in_path;
+	int in_pt;
+	unsigned int mark;
+	double lat, lon, alt;
+	/* text of ele or name is being read */
+	enum {
+		GPX_TEXT_NONE,
+		GPX_TEXT_ELE,
+		GPX_TEXT_NAME,
+	} text;
+	const char *text_start;
+};
+
+static int gpx_attrs(struct loader *ld, struct gpx_state *st, int pt, int *self_close)
+{
+	int have_lat = 0, have_lon = 0;
+
+	for (;;) {
+		while (ld->pos < ld->end && is_ws(*ld->pos))
+			ld->pos++;
+
+		if (ld->pos >= ld->end) {
+			load_err(ld, "Unexpected end of file");
+			return 1;
+		}
+
+		if (*ld->pos == '>') {
+			ld->pos++;
+			break;
+		}
+
+		if (*ld->pos == '/' && ld->pos + 1 < ld->end && ld->pos[1] == '>') {
+			ld->pos += 2;
+			*self_close = 1;
+			break;
+		}
+
+		const char *name = ld->pos;
+
+		while (ld->pos < ld->end && *ld->pos != '=' && *ld->pos != '>' && !is_ws(*ld->pos))
+			ld->pos++;
+
+		const char *name_end = ld->pos;
+
+		while (ld->pos < ld->end && is_ws(*ld->pos))
+			ld->pos++;
+
+		if (ld->pos + 1 >= ld->end || *ld->pos != '=') {
+			load_err(ld, "Expected attribute value");
+			return 1;
+		}
+
+		ld->pos++;
+
+		while (ld->pos < ld->end && is_ws(*ld->pos))
+			ld->pos++;
+
+		if (ld->pos >= ld->end || (*ld->pos != '"' && *ld->pos != '\'')) {
+			load_err(ld, "Expected quoted attribute value");
+			return 1;
+		}
+
+		char quote = *ld->pos++;
+		const char *val = ld->pos;
+		const char *val_end = memchr(val, quote, ld->end - val);
+
+		if (!val_end) {
+			load_err(ld, "Unterminated attribute value");
+			return 1;
+		}
+
+		ld->pos = val_end + 1;
+
+		if (!pt)
+			continue;
+
+		double *dst = NULL;
+
+		name = local_name(name, name_end);
+
+		if (TAG_EQ(name, name_end, "lat")) {
+			dst = &st->lat;
+			have_lat = 1;
+		} else if (TAG_EQ(name, name_end, "lon")) {
+			dst = &st->lon;
+			have_lon = 1;
+		}
+
+		if (dst) {
+			const char *s = val;
+
+			while (s < val_end && is_ws(*s))
+				s++;
+
+			if (parse_num(&s, val_end, dst)) {
+				load_err(ld, "Expected number");
+				return 1;
+			}
+		}
+	}
+
+	if (pt && (!have_lat || !have_lon)) {
+		load_err(ld, "Point without lat and lon");
+		return 1;
+	}
+
+	return 0;
+}
+
+static int gpx_text_end(struct loader *ld, struct gpx_state *st, const char *text_end)
+{
+	const char *s = st->text_start;
+
+	if (st->text == GPX_TEXT_ELE) {
+		while (s < text_end && is_ws(*s))
+			s++;
+
+		if (parse_num(&s, text_end, &st->alt)) {
+			load_err(ld, "Expected number");
+			return 1;
+		}
+	}
+
+	if (st->text == GPX_TEXT_NAME) {
+		free(ld->name);
+		ld->name = decode_str(s, text_end, 1);
+	}
+
+	st->text = GPX_TEXT_NONE;
+
+	return 0;
+}
+
+static int gpx_tag(struct loader *ld, struct gpx_state *st)
+{
+	const char *tag_start = ld->pos - 1;
+	int closing = 0, self_close = 0;
+
+	if (ld->pos < ld->end && *ld->pos == '/') {
+		closing = 1;
+		ld->pos++;
+	}
+
+	const char *name = ld->pos;
+
+	while (ld->pos < ld->end && !is_ws(*ld->pos) && *ld->pos != '>' && *ld->pos != '/')
+		ld->pos++;
+
+	const char *name_end = ld->pos;
+
+	name = local_name(name, name_end);
+
+	int pt = TAG_EQ(name, name_end, "trkpt") || TAG_EQ(name, name_end, "rtept");
+	int path = TAG_EQ(name, name_end, "trk") || TAG_EQ(name, name_end, "rte");
+
+	if (closing) {
+		if (skip_past(ld, ">"))
+			return 1;
+	} else {
+		if (gpx_attrs(ld, st, pt && st->in_path, &self_close))
+			return 1;
+	}
+
+	if (closing && st->text) {
+		if (gpx_text_end(ld, st, tag_start))
+			return 1;
+	}
+
+	if (path) {
+		if (!closing) {
+			st->in_path = !self_close;
+			st->mark = ld->paths->cnt;
+			free(ld->name);
+			ld->name = NULL;
+		} else if (st->in_path) {
+			if (path_finish(ld))
+				return 1;
+			paths_name(ld, st->mark);
+			st->in_path = 0;
+		}
+
+		return 0;
+	}
+
+	if (!st->in_path)
+		return 0;
+
+	if (TAG_EQ(name, name_end, "trkseg")) {
+		if (closing && path_finish(ld))
+			return 1;
+		return 0;
+	}
+
+	if (pt) {
+		if (!closing) {
+			st->alt = NAN;
+			st->in_pt = !self_close;
+		}
+
+		if (closing || self_close) {
+			st->in_pt = 0;
+			return point_add(ld, st->lat, st->lon, st->alt);
+		}
+
+		return 0;
+	}
+
+	if (closing || self_close)
+		return 0;
+
+	if (st->in_pt && TAG_EQ(name, name_end, "ele")) {
+		st->text = GPX_TEXT_ELE;
+		st->text_start = ld->pos;
+	} else if (!st->in_pt && TAG_EQ(name, name_end, "name")) {
+		st->text = GPX_TEXT_NAME;
+		st->text_start = ld->pos;
+	}
+
+	return 0;
+}
+
+static int load_gpx(struct loader *ld)
+{
+	struct gpx_state st = {};
+
+	for (;;) {
+		const char *s = memchr(ld->pos, '<', ld->end - ld->pos);
+
+		if (!s)
+			break;
+
+		ld->pos = s + 1;
+
+		if (ld->end - s >= 4 && !memcmp(s, "<!--", 4)) {
+			if (skip_past(ld, "-->"))
+				return 1;
+		} else if (ld->end - s >= 9 && !memcmp(s, "<![CDATA[", 9)) {
+			if (st.text == GPX_TEXT_NAME) {
+				const char *e = find_str(s, ld->end, "]]>");
+
+				if (!e)
+					break;
+
+				free(ld->name);
+				ld->name = strndup(s + 9, e - s - 9);
+				st.text = GPX_TEXT_NONE;
+			}
+
+			if (skip_past(ld, "]]>"))
+				return 1;
+		} else if (ld->end - s >= 2 && (s[1] == '?' || s[1] == '!')) {
+			if (skip_past(ld, ">"))
+				return 1;
+		} else if (gpx_tag(ld, &st)) {
+			return 1;
+		}
+	}
+
+	if (st.in_path) {
+		load_err(ld, "Unterminated track");
+		return 1;
+	}
+
+	return 0;
+}
+
+static void loader_free(struct loader *ld)
+{
+	free(ld->lat);
+	free(ld->lon);
+	free(ld->alt);
+	free(ld->name);
+}
+
+void xqx_paths_free(struct xqx_paths *paths)
+{
+	unsigned int i;
+
+	if (!paths)
+		return;
+
+	for (i = 0; i < paths->cnt; i++)
+		xqx_path_free(paths->paths[i]);
+
+	free(paths->paths);
+	free(paths);
+}
+
+struct xqx_paths *xqx_paths_load(const char *pathname)
+{
+	struct loader ld = {.pathname = pathname};
+	struct stat st;
+	void *map;
+	int fd, ret;
+
+	fd = open(pathname, O_RDONLY);
+	if (fd < 0) {
+		printf("error: Failed to open '%s': %s\n", pathname, strerror(errno));
+		return NULL;
+	}
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) || !st.st_size) {
+		printf("error: '%s' is not a non-empty file\n", pathname);
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		printf("error: Failed to mmap '%s': %s\n", pathname, strerror(errno));
+		return NULL;
+	}
+
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	ld.start = ld.pos = map;
+	ld.end = ld.start + st.st_size;
+
+	ld.paths = calloc(1, sizeof(struct xqx_paths));
+	if (!ld.paths) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	/* UTF-8 BOM */
+	if (st.st_size >= 3 && !memcmp(ld.pos, "\xef\xbb\xbf", 3))
+		ld.pos += 3;
+
+	switch (json_peek(&ld)) {
+	case '{':
+		ret = load_geojson(&ld);
+	break;
+	case '<':
+		ret = load_gpx(&ld);
+	break;
+	default:
+		load_err(&ld, "Unknown format, expected GeoJSON or GPX");
+		ret = 1;
+	}
+
+	munmap(map, st.st_size);
+	loader_free(&ld);
+
+	if (ret) {
+		xqx_paths_free(ld.paths);
+		return NULL;
+	}
+
+	return ld.paths;
+}
@@ -0,0 +1,46 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Cyril Hrubis <metan@ucw.cz>
+ */
+
+/*
+
+   Path loaders.
+
+   Files are mmapped and parsed in a single pass, waypoints are collected in
+   arrays and copied into the path arrays.
+
+   Supported formats, detected from the file content:
+
+   GPX 1.1    each trkseg and rte is a path, named after its trk or rte
+
+   GeoJSON    Feature, FeatureCollection, GeometryCollection or a bare
+              geometry, each LineString and each part of MultiLineString is
+              a path named after the Feature name property. Positions are
+              [lon, lat, alt] as in RFC 7946.
+
+ */
+
+#ifndef XQX_PATH_LOAD_H__
+#define XQX_PATH_LOAD_H__
+
+#include "xqx_waypoints.h"
+
+struct xqx_paths {
+	unsigned int cnt;
+	struct xqx_path **paths;
+};
+
+/*
+ * Loads all paths from a file.
+ *
+ * Returns NULL on failure.
+ */
+struct xqx_paths *xqx_paths_load(const char *pathname);
+
+/*
+ * Frees the paths and the container, set cnt to zero to keep the paths.
+ */
+void xqx_paths_free(struct xqx_paths *paths);
+
+#endif /* XQX_PATH_LOAD_H__ */
@@ -0,0 +1,277 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Cyril Hrubis <metan@ucw.cz>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "xqx_common.h"
+#include "xqx_path_lod.h"
+
+struct dp_span {
+	unsigned int a, b;
+	double tol;
+};
+
+/*
+ * Squared distance of (px, py) from the segment (ax, ay) (bx, by).
+ */
+static double seg_dist2(double px, double py, double ax, double ay, double bx, double by)
+{
+	double dx = bx - ax, dy = by - ay;
+	double len2 = dx * dx + dy * dy;
+	double t = 0;
+
+	if (len2 > 0)
+		t = CLAMP(((px - ax) * dx + (py - ay) * dy) / len2, 0.0, 1.0);
+
+	dx = ax + t * dx - px;
+	dy = ay + t * dy - py;
+
+	return dx * dx + dy * dy;
+}
+
+static uint8_t tol_to_lod(double tol)
+{
+	uint8_t l = 0;
+
+	while (tol >= 1) {
+		tol /= 2;
+		l++;
+	}
+
+	return l;
+}
+
+/*
+ * Douglas-Peucker with an explicit stack, the tolerance of a waypoint is
+ * capped by the tolerance of the span it splits so that the tolerances
+ * decrease down the hierarchy and the path simplified for any pixel size is
+ * a subset of the paths simplified for smaller ones.
+ */
+static int path_lod(const int32_t *x, const int32_t *y, struct xqx_path_lod *lod, int *abort)
+{
+	unsigned int cnt = lod->cnt, sp = 0;
+	struct dp_span *stack;
+
+	lod->lod[0] = XQX_PATH_LOD_KEEP;
+	lod->lod[cnt - 1] = XQX_PATH_LOD_KEEP;
+
+	if (cnt < 3)
+		return 0;
+
+	/* each span splits into two, the stack never has more than cnt entries */
+	stack = malloc(cnt * sizeof(*stack));
+	if (!stack)
+		return 1;
+
+	stack[sp++] = (struct dp_span){0, cnt - 1, INFINITY};
+
+	while (sp) {
+		struct dp_span s = stack[--sp];
+		double max = -1;
+		unsigned int i, m = s.a;
+
+		if (abort && __atomic_load_n(abort, __ATOMIC_RELAXED)) {
+			free(stack);
+			return 1;
+		}
+
+		for (i = s.a + 1; i < s.b; i++) {
+			double d = seg_dist2(x[i], y[i], x[s.a], y[s.a], x[s.b], y[s.b]);
+
+			if (d > max) {
+				max = d;
+				m = i;
+			}
+		}
+
+		double tol = MIN(sqrt(max), s.tol);
+
+		lod->lod[m] = tol_to_lod(tol);
+
+		if (m - s.a > 1)
+			stack[sp++] = (struct dp_span){s.a, m, tol};
+
+		if (s.b - m > 1)
+			stack[sp++] = (struct dp_span){m, s.b, tol};
+	}
+
+	free(stack);
+	return 0;
+}
+
+static int level_build(struct xqx_path_lod_level *level, const struct xqx_path_lod *lod,
+                       const int32_t *x, const int32_t *y)
+{
+	struct xqx_rtree_box *boxes;
+	unsigned int i, j = 0, segs;
+	int ret;
+
+	level->verts = malloc(level->verts_cnt * sizeof(uint32_t));
+	if (!level->verts)
+		return 1;
+
+	for (i = 0; i < lod->cnt; i++) {
+		if (lod->lod[i] >= level->lod)
+			level->verts[j++] = i;
+	}
+
+	segs = MAX(level->verts_cnt - 1, 1u);
+
+	boxes = malloc(segs * sizeof(*boxes));
+	if (!boxes)
+		return 1;
+
+	for (i = 0; i < segs; i++) {
+		uint32_t a = level->verts[i];
+		uint32_t b = level->verts[MIN(i + 1, level->verts_cnt - 1)];
+
+		boxes[i].lx = MIN(x[a], x[b]);
+		boxes[i].ly = MIN(y[a], y[b]);
+		boxes[i].hx = MAX(x[a], x[b]);
+		boxes[i].hy = MAX(y[a], y[b]);
+		boxes[i].id = i;
+	}
+
+	ret = xqx_rtree_build(&level->tree, boxes, segs);
+
+	free(boxes);
+
+	return ret;
+}
+
+void xqx_path_lod_free(struct xqx_path_lod *lod)
+{
+	unsigned int i;
+
+	if (!lod)
+		return;
+
+	for (i = 0; lod->owned && i < lod->levels_cnt; i++) {
+		free(lod->levels[i].verts);
+		xqx_rtree_free(&lod->levels[i].tree);
+	}
+
+	free(lod->levels);
+	free(lod);
+}
+
+/*
+ * Picks levels that halve the number of waypoints and builds their indexes.
+ */
+static int levels_build(struct xqx_path_lod *lod, const int32_t *x, const int32_t *y)
+{
+	unsigned int hist[XQX_PATH_LOD_KEEP + 1] = {};
+	unsigned int i, l, cnt = lod->cnt, prev = 0;
+
+	for (i = 0; i < lod->cnt; i++)
+		hist[lod->lod[i]]++;
+
+	lod->levels = calloc(XQX_PATH_LOD_KEEP + 1, sizeof(struct xqx_path_lod_level));
+	if (!lod->levels)
+		return 1;
+
+	for (l = 0; l <= XQX_PATH_LOD_KEEP; l++) {
+		if (!l || 2 * cnt <= prev) {
+			struct xqx_path_lod_level *level = &lod->levels[lod->levels_cnt++];
+
+			level->lod = l;
+			level->verts_cnt = cnt;
+
+			if (level_build(level, lod, x, y))
+				return 1;
+
+			prev = cnt;
+		}
+
+		cnt -= hist[l];
+	}
+
+	return 0;
+}
+
+struct xqx_path_lod *xqx_path_lod_build(const int32_t *x, const int32_t *y, unsigned int cnt, int *abort)
+{
+	struct xqx_path_lod *lod;
+
+	lod = calloc(1, sizeof(*lod) + cnt);
+	if (!lod)
+		return NULL;
+
+	lod->cnt = cnt;
+	lod->lod = (uint8_t *)(lod + 1);
+	lod->owned = 1;
+
+	if (path_lod(x, y, lod, abort) || levels_build(lod, x, y)) {
+		xqx_path_lod_free(lod);
+		return NULL;
+	}
+
+	return lod;
+}
+
+static void lod_work_fn(struct xqx_work *self)
+{
+	struct xqx_path *path = CONTAINER_OF(self, struct xqx_path, lod_work);
+
+	path->lod_new = xqx_path_lod_build(path->proj_x, path->proj_y, path->lod_work_cnt, &path->lod_abort);
+}
+
+static void lod_work_done(struct xqx_work *self)
+{
+	struct xqx_path *path = CONTAINER_OF(self, struct xqx_path, lod_work);
+
+	path->lod_queued = 0;
+
+	if (!path->lod_new)
+		return;
+
+	xqx_path_lod_free(path->lod);
+	path->lod = path->lod_new;
+	path->lod_new = NULL;
+
+	if (path->lod_done)
+		path->lod_done(path, path->lod_priv);
+
+	/* waypoints may have been appended in the meantime */
+	xqx_path_lod_update(path);
+}
+
+void xqx_path_lod_update(struct xqx_path *path)
+{
+	struct xqx_path_lod *lod = path->lod;
+
+	if (path->lod_queued || !path->proj_cnt)
+		return;
+
+	if (lod && path->proj_cnt - lod->cnt < MAX(XQX_PATH_LOD_TAIL, lod->cnt / 8))
+		return;
+
+	path->lod_abort = 0;
+	path->lod_work.fn = lod_work_fn;
+	path->lod_work.done = lod_work_done;
+	path->lod_work_cnt = path->proj_cnt;
+	path->lod_queued = 1;
+
+	xqx_workers_queue(&path->lod_work);
+}
+
+void xqx_path_lod_cancel(struct xqx_path *path)
+{
+	__atomic_store_n(&path->lod_abort, 1, __ATOMIC_RELAXED);
+	xqx_workers_cancel(&path->lod_work);
+	path->lod_queued = 0;
+
+	xqx_path_lod_free(path->lod_new);
+	path->lod_new = NULL;
+}
+
+void xqx_path_lod_stop(struct xqx_path *path)
+{
+	xqx_path_lod_cancel(path);
+
+	xqx_path_lod_free(path->lod);
+	path->lod = NULL;
+}
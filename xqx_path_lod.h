@@ -0,0 +1,146 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Cyril Hrubis <metan@ucw.cz>
+ */
+
+/*
+
+   Level of detail for projected paths.
+
+   Each projected waypoint is assigned the Douglas-Peucker tolerance at which
+   it is dropped from the path, rounded down to a power of two so that the
+   levels match the map pyramid levels. A waypoint with lod[i] == l deviates
+   from the simplified path by at least 2^(l-1) coordinate units, i.e. it
+   has to be drawn when a pixel is smaller than 2^(l+1) units.
+
+   The first and the last waypoint are never dropped.
+
+   The segments of the simplified path are indexed by an R-tree for a subset
+   of the levels, each indexed level has at most half of the waypoints of the
+   previous one so that all the trees together are at most twice the size
+   of the full path. Renderer picks the coarsest indexed level that is still
+   detailed enough.
+
+   Everything is computed on the worker threads, queued by xqx_path_project(),
+   and published on the main loop, until then the whole path is drawn.
+
+   Waypoints appended to a path, e.g. a recorded track, are drawn as they are
+   after the simplified part, the level of detail is recomputed once the tail
+   is long enough so that each new waypoint does not restart the work.
+
+ */
+
+#ifndef XQX_PATH_LOD_H__
+#define XQX_PATH_LOD_H__
+
+#include <stdint.h>
+#include "xqx_rtree.h"
+#include "xqx_waypoints.h"
+
+#define XQX_PATH_LOD_KEEP 0xff
+
+/*
+ * Minimal number of appended waypoints to recompute the level of detail,
+ * longer paths wait for 1/8 of their length.
+ */
+#define XQX_PATH_LOD_TAIL 64u
+
+struct xqx_path_lod_level {
+	/* waypoints with lod[i] >= lod are part of this level */
+	uint8_t lod;
+
+	/* indexes of the waypoints in this level */
+	unsigned int verts_cnt;
+	uint32_t *verts;
+
+	/* segments verts[id] -> verts[id+1], or a single point */
+	struct xqx_rtree tree;
+};
+
+struct xqx_path_lod {
+	unsigned int levels_cnt;
+	struct xqx_path_lod_level *levels;
+
+	/*
+	 * The vertex indexes and trees are freed with the lod, unset when
+	 * they point into a path cache file.
+	 */
+	int owned;
+
+	/* number of waypoints, path->proj_cnt may be larger if appended to */
+	unsigned int cnt;
+	uint8_t *lod;
+};
+
+/*
+ * Computes the level of detail for cnt projected waypoints.
+ *
+ * @abort: The computation is stopped when set to non-zero, may be NULL.
+ *
+ * Returns NULL on failure or when aborted.
+ */
+struct xqx_path_lod *xqx_path_lod_build(const int32_t *x, const int32_t *y, unsigned int cnt, int *abort);
+
+void xqx_path_lod_free(struct xqx_path_lod *lod);
+
+/*
+ * Queues computing the level of detail for the projected waypoints on the
+ * workers unless already queued, or unless path->lod exists and less than
+ * XQX_PATH_LOD_TAIL waypoints were appended since. The result replaces
+ * path->lod from xqx_workers_complete() and path->lod_done is called.
+ */
+void xqx_path_lod_update(struct xqx_path *path);
+
+/*
+ * Cancels the queued computation and waits for it if running, path->lod is
+ * kept.
+ *
+ * Must be called before the projected waypoint arrays are reallocated,
+ * waypoints can be appended while the computation runs.
+ */
+void xqx_path_lod_cancel(struct xqx_path *path);
+
+/*
+ * Cancels the computation and frees path->lod.
+ *
+ * Must be called before the projected waypoints are changed.
+ */
+void xqx_path_lod_stop(struct xqx_path *path);
+
+/*
+ * Returns the level of detail or NULL if not computed yet.
+ */
+static inline struct xqx_path_lod *xqx_path_lod_get(struct xqx_path *path)
+{
+	return path->lod;
+}
+
+/*
+ * Returns the smallest lod[i] that has to be drawn when a pixel is px
+ * coordinate units wide.
+ */
+static inline unsigned int xqx_path_lod_min(int64_t px)
+{
+	unsigned int l = 0;
+
+	while (l < 62 && (px >> (l + 1)))
+		l++;
+
+	return l;
+}
+
+/*
+ * Returns the coarsest indexed level that includes all waypoints with
+ * lod[i] >= min_lod.
+ */
+static inline struct xqx_path_lod_level *xqx_path_lod_level(struct xqx_path_lod *lod, unsigned int min_lod)
+{
+	unsigned int i = 0;
+
+	while (i + 1 < lod->levels_cnt && lod->levels[i + 1].lod <= min_lod)
+		i++;
+
+	return &lod->levels[i];
+}
+
+#endif /* XQX_PATH_LOD_H__ */
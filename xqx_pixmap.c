@@ -3,6 +3,9 @@
  * Copyright (c) 2021 Cyril Hrubis <metan@ucw.cz>
  */
 
+#include <string.h>
+#include <core/gp_pixmap.h>
+#include <gfx/gp_gfx.h>
 #include <loaders/gp_loaders.h>
 
 #include "xqx_pixmap.h"
@@ -29,3 +32,307 @@ void xqx_pixmap_free(xqx_pixmap *pixmap)
 {
 	gp_pixmap_free(pixmap);
 }
+
+xqx_pixmap *xqx_pixmap_alloc(unsigned int w, unsigned int h, const xqx_pixmap *tmpl)
+{
+	return gp_pixmap_alloc(w, h, tmpl->pixel_type);
+}
+
+/*
+ * The scaling kernels work on bytes so that they are pixel format agnostic as
+ * long as each channel is a whole byte, which is true for the RGB888 and
+ * xRGB8888 the image loaders produce for map tiles but not for packed formats
+ * such as RGB565. The 32bit case is special cased so that the compiler can
+ * vectorize the inner loops.
+ */
+static int byte_channels(gp_pixel_type type)
+{
+	const gp_pixel_type_desc *desc = gp_pixel_desc(type);
+	unsigned int i;
+
+	if (!desc || desc->size % 8)
+		return 0;
+
+	for (i = 0; i < desc->numchannels; i++) {
+		if (desc->channels[i].size != 8 || desc->channels[i].offset % 8)
+			return 0;
+	}
+
+	return 1;
+}
+
+static int compatible(const xqx_pixmap *src, const xqx_pixmap *dst)
+{
+	return src->pixel_type == dst->pixel_type && byte_channels(src->pixel_type);
+}
+
+xqx_pixmap *xqx_pixmap_alloc_format(unsigned int w, unsigned int h, const char *format)
+{
+	gp_pixel_type type = gp_pixel_type_by_name(format);
+
+	if (type == GP_PIXEL_UNKNOWN || !byte_channels(type))
+		return NULL;
+
+	return gp_pixmap_alloc(w, h, type);
+}
+
+int xqx_pixmap_upscale_quadrant(const xqx_pixmap *src, unsigned int qx, unsigned int qy,
+                                xqx_pixmap *dst)
+{
+	unsigned int bpp = src->bpp / 8;
+	unsigned int sx = qx * (dst->w / 2);
+	unsigned int sy = qy * (dst->h / 2);
+	unsigned int x, y, c;
+
+	if (!compatible(src, dst))
+		return 1;
+
+	if (sx >= src->w || sy >= src->h)
+		return 1;
+
+	unsigned int w = MIN(dst->w, 2 * (src->w - sx));
+	unsigned int h = MIN(dst->h, 2 * (src->h - sy));
+
+	for (y = 0; y < h; y++) {
+		uint8_t *d = GP_PIXEL_ADDR(dst, 0, y);
+
+		if (y % 2) {
+			memcpy(d, GP_PIXEL_ADDR(dst, 0, y - 1), w * bpp);
+			continue;
+		}
+
+		const uint8_t *s = GP_PIXEL_ADDR(src, sx, sy + y / 2);
+
+		if (bpp == 4) {
+			const uint32_t *s32 = (const uint32_t *)s;
+			uint32_t *d32 = (uint32_t *)d;
+
+			for (x = 0; x < w; x++)
+				d32[x] = s32[x / 2];
+
+			continue;
+		}
+
+		for (x = 0; x < w; x++) {
+			for (c = 0; c < bpp; c++)
+				d[x * bpp + c] = s[(x / 2) * bpp + c];
+		}
+	}
+
+	return 0;
+}
+
+int xqx_pixmap_downscale_quadrant(const xqx_pixmap *src, xqx_pixmap *dst,
+                                  unsigned int qx, unsigned int qy)
+{
+	unsigned int bpp = src->bpp / 8;
+	unsigned int dx = qx * (dst->w / 2);
+	unsigned int dy = qy * (dst->h / 2);
+	unsigned int x, y, i;
+
+	if (!compatible(src, dst))
+		return 1;
+
+	if (dx >= dst->w || dy >= dst->h)
+		return 1;
+
+	unsigned int w = MIN(src->w / 2, dst->w - dx);
+	unsigned int h = MIN(src->h / 2, dst->h - dy);
+
+	for (y = 0; y < h; y++) {
+		const uint8_t *s0 = GP_PIXEL_ADDR(src, 0, 2 * y);
+		const uint8_t *s1 = GP_PIXEL_ADDR(src, 0, 2 * y + 1);
+		uint8_t *d = GP_PIXEL_ADDR(dst, dx, dy + y);
+
+		for (x = 0; x < w; x++) {
+			for (i = 0; i < bpp; i++) {
+				unsigned int j = 2 * x * bpp + i;
+
+				d[x * bpp + i] = (s0[j] + s0[j + bpp] +
+				                  s1[j] + s1[j + bpp] + 2) >> 2;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Interpolates all four 8 bit channels of a 32bpp pixel at once, the red and
+ * blue and the green and alpha pairs are weighted in 16 bit lanes. The weight
+ * is in 1/256.
+ */
+static inline uint32_t lerp32(uint32_t a, uint32_t b, uint32_t w)
+{
+	uint32_t rb = (a & 0x00ff00ff) * (256 - w) + (b & 0x00ff00ff) * w + 0x00800080;
+	uint32_t ga = ((a >> 8) & 0x00ff00ff) * (256 - w) + ((b >> 8) & 0x00ff00ff) * w + 0x00800080;
+
+	return ((rb >> 8) & 0x00ff00ff) | (ga & 0xff00ff00);
+}
+
+int xqx_pixmap_resample(const xqx_pixmap *src, uint32_t sx, uint32_t sy, uint32_t step,
+                        xqx_pixmap *dst, unsigned int dx, unsigned int dy,
+                        unsigned int w, unsigned int h)
+{
+	unsigned int bpp = src->bpp / 8;
+	unsigned int x, y, c;
+
+	if (!compatible(src, dst) || !src->w || !src->h)
+		return 1;
+
+	if (dx >= dst->w || dy >= dst->h)
+		return 0;
+
+	w = MIN(w, dst->w - dx);
+	h = MIN(h, dst->h - dy);
+
+	/* Source pixels and weights are the same for all rows */
+	uint32_t x0[w], x1[w], xw[w];
+
+	for (x = 0; x < w; x++) {
+		uint32_t fx = sx + x * step;
+		uint32_t ix = MIN(fx >> 16, src->w - 1);
+
+		x0[x] = ix;
+		x1[x] = MIN(ix + 1, src->w - 1);
+		xw[x] = (fx >> 8) & 0xff;
+	}
+
+	for (y = 0; y < h; y++) {
+		uint32_t fy = sy + y * step;
+		uint32_t iy = MIN(fy >> 16, src->h - 1);
+		uint32_t yw = (fy >> 8) & 0xff;
+		const uint8_t *s0 = GP_PIXEL_ADDR(src, 0, iy);
+		const uint8_t *s1 = GP_PIXEL_ADDR(src, 0, MIN(iy + 1, src->h - 1));
+		uint8_t *d = GP_PIXEL_ADDR(dst, dx, dy + y);
+
+		if (bpp == 4) {
+			const uint32_t *t32 = (const uint32_t *)s0;
+			const uint32_t *b32 = (const uint32_t *)s1;
+			uint32_t *d32 = (uint32_t *)d;
+
+			for (x = 0; x < w; x++) {
+				uint32_t t = lerp32(t32[x0[x]], t32[x1[x]], xw[x]);
+				uint32_t b = lerp32(b32[x0[x]], b32[x1[x]], xw[x]);
+
+				d32[x] = lerp32(t, b, yw);
+			}
+
+			continue;
+		}
+
+		for (x = 0; x < w; x++) {
+			for (c = 0; c < bpp; c++) {
+				uint32_t t = s0[x0[x] * bpp + c] * (256 - xw[x]) + s0[x1[x] * bpp + c] * xw[x];
+				uint32_t b = s1[x0[x] * bpp + c] * (256 - xw[x]) + s1[x1[x] * bpp + c] * xw[x];
+
+				d[x * bpp + c] = (t * (256 - yw) + b * yw + 0x8000) >> 16;
+			}
+		}
+	}
+
+	return 0;
+}
+
+void xqx_pixmap_fill_quadrant(xqx_pixmap *dst, unsigned int qx, unsigned int qy, uint32_t rgb)
+{
+	gp_pixel color = gp_rgb_to_pixmap_pixel((rgb >> 16) & 0xff, (rgb >> 8) & 0xff,
+	                                        rgb & 0xff, dst);
+
+	unsigned int x = qx * (dst->w / 2);
+	unsigned int y = qy * (dst->h / 2);
+	unsigned int w = qx ? dst->w - x : dst->w / 2;
+	unsigned int h = qy ? dst->h - y : dst->h / 2;
+
+	gp_fill_rect_xywh(dst, x, y, w, h, color);
+}
+
+void xqx_pixmap_fill_rect(xqx_pixmap *dst, unsigned int x, unsigned int y,
+                          unsigned int w, unsigned int h, uint32_t rgb)
+{
+	gp_pixel color = gp_rgb_to_pixmap_pixel((rgb >> 16) & 0xff, (rgb >> 8) & 0xff,
+	                                        rgb & 0xff, dst);
+
+	if (x >= dst->w || y >= dst->h)
+		return;
+
+	w = MIN(w, dst->w - x);
+	h = MIN(h, dst->h - y);
+
+	gp_fill_rect_xywh(dst, x, y, w, h, color);
+}
+
+int xqx_pixmap_save(const xqx_pixmap *pixmap, const char *pathname)
+{
+	return gp_save_image(pixmap, pathname, NULL);
+}
+
+int xqx_pixmap_composite(const xqx_pixmap *src, xqx_pixmap *dst, unsigned int x, unsigned int y,
+                         unsigned int w, unsigned int h, uint32_t key)
+{
+	unsigned int i, j;
+
+	if (src->pixel_type != GP_PIXEL_xRGB8888)
+		return 1;
+
+	if (x + w > src->w || y + h > src->h || x + w > dst->w || y + h > dst->h)
+		return 1;
+
+	for (j = 0; j < h; j++) {
+		const uint32_t *s = (const uint32_t *)GP_PIXEL_ADDR(src, x, y + j);
+
+		if (dst->pixel_type == GP_PIXEL_xRGB8888) {
+			uint32_t *d = (uint32_t *)GP_PIXEL_ADDR(dst, x, y + j);
+
+			for (i = 0; i < w; i++) {
+				if ((s[i] & 0xffffff) != key)
+					d[i] = s[i];
+			}
+
+			continue;
+		}
+
+		for (i = 0; i < w; i++) {
+			uint32_t p = s[i] & 0xffffff;
+
+			if (p == key)
+				continue;
+
+			gp_putpixel_raw(dst, x + i, y + j,
+			                gp_rgb_to_pixmap_pixel(p >> 16, (p >> 8) & 0xff,
+			                                       p & 0xff, dst));
+		}
+	}
+
+	return 0;
+}
+
+int xqx_pixmap_scroll(xqx_pixmap *pixmap, int dx, int dy)
+{
+	unsigned int bpp = pixmap->bpp / 8;
+	int w = pixmap->w - ABS(dx);
+	int h = pixmap->h - ABS(dy);
+	int sx = MAX(0, -dx), dstx = MAX(0, dx);
+	int y;
+
+	if ((pixmap->bpp % 8) || pixmap->axes_swap || pixmap->x_swap || pixmap->y_swap)
+		return 1;
+
+	if (w <= 0 || h <= 0)
+		return 0;
+
+	/* rows are moved in the direction that does not overwrite the source */
+	if (dy > 0) {
+		for (y = h - 1; y >= 0; y--) {
+			memmove(GP_PIXEL_ADDR(pixmap, dstx, y + dy),
+			        GP_PIXEL_ADDR(pixmap, sx, y), w * bpp);
+		}
+	} else {
+		for (y = 0; y < h; y++) {
+			memmove(GP_PIXEL_ADDR(pixmap, dstx, y),
+			        GP_PIXEL_ADDR(pixmap, sx, y - dy), w * bpp);
+		}
+	}
+
+	return 0;
+}
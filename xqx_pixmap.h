@@ -29,4 +29,96 @@ xqx_pixmap *xqx_pixmap_decode(struct xqx_map *map, void *buf, size_t bufsize);
  */
 void xqx_pixmap_free(xqx_pixmap *pixmap);
 
+/*
+ * Allocates a pixmap with the same pixel format as the template pixmap.
+ */
+xqx_pixmap *xqx_pixmap_alloc(unsigned int w, unsigned int h, const xqx_pixmap *tmpl);
+
+/*
+ * Allocates a pixmap with a pixel format given by name, e.g. "RGB888".
+ *
+ * Returns NULL if the pixel format is not known, does not have 8 bits per
+ * channel and cannot be scaled, or on allocation failure.
+ */
+xqx_pixmap *xqx_pixmap_alloc_format(unsigned int w, unsigned int h, const char *format);
+
+/*
+ * Scales a quadrant of the src pixmap twice and stores the result to dst.
+ *
+ * @qx, qy: Quadrant coordinates, either 0 or 1.
+ *
+ * Returns non-zero if the pixmaps are not compatible.
+ */
+int xqx_pixmap_upscale_quadrant(const xqx_pixmap *src, unsigned int qx, unsigned int qy,
+                                xqx_pixmap *dst);
+
+/*
+ * Scales the src pixmap down twice, each pixel is an average of 2x2 source
+ * pixels, and stores the result into a quadrant of the dst pixmap.
+ *
+ * @qx, qy: Quadrant coordinates, either 0 or 1.
+ *
+ * Returns non-zero if the pixmaps are not compatible.
+ */
+int xqx_pixmap_downscale_quadrant(const xqx_pixmap *src, xqx_pixmap *dst,
+                                  unsigned int qx, unsigned int qy);
+
+/*
+ * Resamples src into a rectangle in dst with a bilinear interpolation.
+ *
+ * The dst pixel at (dx + x, dy + y) is interpolated from the src pixmap at
+ * (sx + x * step, sy + y * step), all of sx, sy and step are 16.16 fixed
+ * point numbers.
+ *
+ * Returns non-zero if the pixmaps are not compatible.
+ */
+int xqx_pixmap_resample(const xqx_pixmap *src, uint32_t sx, uint32_t sy, uint32_t step,
+                        xqx_pixmap *dst, unsigned int dx, unsigned int dy,
+                        unsigned int w, unsigned int h);
+
+/*
+ * Fills a quadrant of the dst pixmap with a color.
+ *
+ * @qx, qy: Quadrant coordinates, either 0 or 1.
+ * @rgb: A color in 0xRRGGBB format.
+ */
+void xqx_pixmap_fill_quadrant(xqx_pixmap *dst, unsigned int qx, unsigned int qy, uint32_t rgb);
+
+/*
+ * Fills a rectangle in the dst pixmap with a color, the rectangle is clipped
+ * to the pixmap.
+ *
+ * @rgb: A color in 0xRRGGBB format.
+ */
+void xqx_pixmap_fill_rect(xqx_pixmap *dst, unsigned int x, unsigned int y,
+                          unsigned int w, unsigned int h, uint32_t rgb);
+
+/*
+ * Saves a pixmap into a file, the image format is choosen by the file
+ * extension.
+ *
+ * Returns non-zero on failure.
+ */
+int xqx_pixmap_save(const xqx_pixmap *pixmap, const char *pathname);
+
+/*
+ * Moves the pixmap content by dx, dy pixels in place, the pixels that are
+ * moved in from outside of the pixmap are left unchanged.
+ *
+ * Returns non-zero if the pixmap is rotated or pixels are not byte aligned.
+ */
+int xqx_pixmap_scroll(xqx_pixmap *pixmap, int dx, int dy);
+
+/*
+ * Composites a rectangle of xRGB8888 src pixmap over dst pixmap, the
+ * rectangle is at the same position in both pixmaps.
+ *
+ * Src pixels with the key RGB value are transparent, all other pixels are
+ * copied.
+ *
+ * Returns non-zero if src is not xRGB8888 or the rectangle is out of src.
+ */
+int xqx_pixmap_composite(const xqx_pixmap *src, xqx_pixmap *dst, unsigned int x, unsigned int y,
+                         unsigned int w, unsigned int h, uint32_t key);
+
 #endif /* XQX_PIXMAP_H__ */
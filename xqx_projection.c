@@ -4,36 +4,254 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
 #include <proj.h>
 #include <math.h>
+#include "xqx_common.h"
+#include "xqx_workers.h"
 #include "xqx_projection.h"
 
-static PJ *cur_proj;
-static unsigned int cur_epsg;
+/*
+ * PROJ objects must not be shared between threads, hence each thread has its
+ * own context and a small LRU of transformations.
+ */
+#define PROJ_LRU 4
 
-int xqx_wgs84_to_coords(unsigned int epsg, double lat, double lon, double alt,
-                        int32_t *x, int32_t *y, int32_t *z)
+struct proj_entry {
+	unsigned int src, dst;
+	PJ *pj;
+	uint32_t used;
+};
+
+struct proj_tls {
+	PJ_CONTEXT *ctx;
+	uint32_t clock;
+	struct proj_entry lru[PROJ_LRU];
+};
+
+static pthread_key_t proj_key;
+static pthread_once_t proj_once = PTHREAD_ONCE_INIT;
+
+static void proj_tls_free(void *ptr)
+{
+	struct proj_tls *tls = ptr;
+	unsigned int i;
+
+	for (i = 0; i < PROJ_LRU; i++) {
+		if (tls->lru[i].pj)
+			proj_destroy(tls->lru[i].pj);
+	}
+
+	proj_context_destroy(tls->ctx);
+	free(tls);
+}
+
+static void proj_key_init(void)
 {
-	if (cur_epsg != epsg) {
-		char buf[40];
+	pthread_key_create(&proj_key, proj_tls_free);
+}
 
-		proj_context_use_proj4_init_rules(PJ_DEFAULT_CTX, 1);
+static struct proj_tls *proj_tls(void)
+{
+	struct proj_tls *tls;
 
-		sprintf(buf, "+init=epsg:%d", epsg);
+	pthread_once(&proj_once, proj_key_init);
 
-		if (cur_proj)
-			proj_destroy(cur_proj);
+	tls = pthread_getspecific(proj_key);
+	if (tls)
+		return tls;
 
-		cur_proj = proj_create_crs_to_crs(PJ_DEFAULT_CTX,
-		                                  "+proj=latlong +datum=WGS84",
-						  buf,
-						  NULL);
-		if (!cur_proj)
-			return 1;
+	tls = calloc(1, sizeof(*tls));
+	if (!tls)
+		return NULL;
+
+	tls->ctx = proj_context_create();
+	if (!tls->ctx) {
+		free(tls);
+		return NULL;
+	}
+
+	proj_context_use_proj4_init_rules(tls->ctx, 1);
+	pthread_setspecific(proj_key, tls);
+
+	return tls;
+}
+
+static void crs_name(char *buf, size_t buf_size, unsigned int epsg)
+{
+	if (epsg == XQX_EPSG_WGS84)
+		snprintf(buf, buf_size, "+proj=latlong +datum=WGS84");
+	else
+		snprintf(buf, buf_size, "+init=epsg:%u", epsg);
+}
+
+/*
+ * Returns a transformation from src to dst for the calling thread.
+ */
+static PJ *get_proj(unsigned int src, unsigned int dst)
+{
+	struct proj_tls *tls = proj_tls();
+	struct proj_entry *e, *lru;
+	char src_buf[40], dst_buf[40];
+	unsigned int i;
+
+	if (!tls)
+		return NULL;
+
+	lru = &tls->lru[0];
+
+	for (i = 0; i < PROJ_LRU; i++) {
+		e = &tls->lru[i];
+
+		if (e->pj && e->src == src && e->dst == dst) {
+			e->used = ++tls->clock;
+			return e->pj;
+		}
+
+		if (!e->pj || e->used < lru->used)
+			lru = e;
+	}
+
+	crs_name(src_buf, sizeof(src_buf), src);
+	crs_name(dst_buf, sizeof(dst_buf), dst);
+
+	PJ *pj = proj_create_crs_to_crs(tls->ctx, src_buf, dst_buf, NULL);
+	if (!pj)
+		return NULL;
+
+	if (lru->pj)
+		proj_destroy(lru->pj);
+
+	lru->src = src;
+	lru->dst = dst;
+	lru->pj = pj;
+	lru->used = ++tls->clock;
+
+	return pj;
+}
+
+/*
+ * Closed form transformations for Web Mercator and WGS84 UTM zones, which are
+ * the projections nearly all maps use, PROJ is used for everything else.
+ *
+ * The transverse Mercator uses the Krüger series to the sixth order in n, see
+ * C. F. F. Karney, Transverse Mercator with an accuracy of a few nanometers,
+ * J. Geodesy 85(8), 475-485 (2011). That is the same algorithm PROJ uses.
+ */
+#define WGS84_A 6378137.0
+#define WGS84_F (1 / 298.257223563)
+#define UTM_K0 0.9996
+#define UTM_FE 500000.0
+#define UTM_FN_SOUTH 10000000.0
+
+#define DEG2RAD (M_PI / 180)
+
+static struct {
+	double e, A;
+	double alpha[7];
+} tm;
+
+static pthread_once_t tm_once = PTHREAD_ONCE_INIT;
+
+static void tm_init(void)
+{
+	double n = WGS84_F / (2 - WGS84_F);
+	double n2 = n * n, n3 = n2 * n, n4 = n3 * n, n5 = n4 * n, n6 = n5 * n;
+
+	tm.e = sqrt(WGS84_F * (2 - WGS84_F));
+	tm.A = WGS84_A / (1 + n) * (1 + n2 / 4 + n4 / 64 + n6 / 256);
+
+	tm.alpha[1] = n / 2 - 2 * n2 / 3 + 5 * n3 / 16 + 41 * n4 / 180 - 127 * n5 / 288 + 7891 * n6 / 37800;
+	tm.alpha[2] = 13 * n2 / 48 - 3 * n3 / 5 + 557 * n4 / 1440 + 281 * n5 / 630 - 1983433 * n6 / 1935360;
+	tm.alpha[3] = 61 * n3 / 240 - 103 * n4 / 140 + 15061 * n5 / 26880 + 167603 * n6 / 181440;
+	tm.alpha[4] = 49561 * n4 / 161280 - 179 * n5 / 168 + 6601661 * n6 / 7257600;
+	tm.alpha[5] = 34729 * n5 / 80640 - 3418889 * n6 / 1995840;
+	tm.alpha[6] = 212378941 * n6 / 319334400;
+}
+
+enum native {
+	NATIVE_NONE,
+	NATIVE_MERC,
+	NATIVE_UTM,
+};
+
+struct native_proj {
+	enum native type;
+	/* UTM central meridian in degrees and false northing */
+	double lon0, fn;
+};
+
+static enum native native_proj(unsigned int epsg, struct native_proj *np)
+{
+	unsigned int zone;
+
+	np->type = NATIVE_NONE;
+
+	if (epsg == 3857) {
+		np->type = NATIVE_MERC;
+		return np->type;
+	}
+
+	if (epsg > 32600 && epsg <= 32660) {
+		zone = epsg - 32600;
+		np->fn = 0;
+	} else if (epsg > 32700 && epsg <= 32760) {
+		zone = epsg - 32700;
+		np->fn = UTM_FN_SOUTH;
+	} else {
+		return NATIVE_NONE;
+	}
+
+	pthread_once(&tm_once, tm_init);
+
+	np->type = NATIVE_UTM;
+	np->lon0 = zone * 6.0 - 183;
+
+	return np->type;
+}
 
-		cur_epsg = epsg;
+static void merc_fwd(double lat, double lon, double *x, double *y)
+{
+	*x = WGS84_A * lon * DEG2RAD;
+	*y = WGS84_A * atanh(sin(lat * DEG2RAD));
+}
+
+static void utm_fwd(const struct native_proj *np, double lat, double lon, double *x, double *y)
+{
+	double s = sin(lat * DEG2RAD);
+	double lam = (lon - np->lon0) * DEG2RAD;
+	double t = sinh(atanh(s) - tm.e * atanh(tm.e * s));
+	double xi_ = atan2(t, cos(lam));
+	double eta_ = atanh(sin(lam) / sqrt(1 + t * t));
+	double xi = xi_, eta = eta_;
+	int j;
+
+	for (j = 1; j <= 6; j++) {
+		xi += tm.alpha[j] * sin(2 * j * xi_) * cosh(2 * j * eta_);
+		eta += tm.alpha[j] * cos(2 * j * xi_) * sinh(2 * j * eta_);
 	}
 
+	*x = UTM_FE + UTM_K0 * tm.A * eta;
+	*y = np->fn + UTM_K0 * tm.A * xi;
+}
+
+static void native_fwd(const struct native_proj *np, double lat, double lon, double *x, double *y)
+{
+	if (np->type == NATIVE_MERC)
+		merc_fwd(lat, lon, x, y);
+	else
+		utm_fwd(np, lat, lon, x, y);
+}
+
+static int proj_fwd(unsigned int epsg, double lat, double lon, double alt,
+                    double *x, double *y, double *z)
+{
+	PJ *proj = get_proj(XQX_EPSG_WGS84, epsg);
+
+	if (!proj)
+		return 1;
+
 	PJ_COORD c_in = {
 		.lpzt = {
 			.lam = lon,
@@ -43,11 +261,150 @@ int xqx_wgs84_to_coords(unsigned int epsg, double lat, double lon, double alt,
 		},
 	};
 
-	PJ_COORD c_out = proj_trans(cur_proj, PJ_FWD, c_in);
+	PJ_COORD c_out = proj_trans(proj, PJ_FWD, c_in);
+
+	*x = c_out.xyz.x;
+	*y = c_out.xyz.y;
+	*z = c_out.xyz.z;
+
+	return 0;
+}
+
+#ifdef XQX_PROJ_VERIFY
+/*
+ * Compares a native transformation with PROJ, the difference must be under
+ * 1/16 of meter, i.e. one unit of the 28.4 fixed point coordinates.
+ */
+static void verify_fwd(unsigned int epsg, double lat, double lon, double x, double y)
+{
+	double px, py, pz;
+
+	if (proj_fwd(epsg, lat, lon, 0, &px, &py, &pz))
+		return;
+
+	if (fabs(px - x) * 16 >= 1 || fabs(py - y) * 16 >= 1) {
+		printf("WARNING: epsg:%u [%.9f, %.9f] native %.4f %.4f PROJ %.4f %.4f\n",
+		       epsg, lat, lon, x, y, px, py);
+	}
+}
+#else
+static inline void verify_fwd(unsigned int epsg, double lat, double lon, double x, double y)
+{
+	(void) epsg; (void) lat; (void) lon; (void) x; (void) y;
+}
+#endif
+
+int xqx_wgs84_to_coords(unsigned int epsg, double lat, double lon, double alt,
+                        int32_t *x, int32_t *y, int32_t *z)
+{
+	struct native_proj np;
+	double fx, fy, fz = alt;
+
+	if (native_proj(epsg, &np)) {
+		native_fwd(&np, lat, lon, &fx, &fy);
+		verify_fwd(epsg, lat, lon, fx, fy);
+	} else if (proj_fwd(epsg, lat, lon, alt, &fx, &fy, &fz)) {
+		return 1;
+	}
+
+	*x = fx * 16;
+	*y = fy * 16;
+	*z = fz * 16;
+
+	return 0;
+}
+
+/* proj_trans_generic() works in place, the arrays are converted in chunks */
+#define CHUNK 256
+
+static int wgs84_to_coords_arr(unsigned int epsg, const double *lat, const double *lon,
+                               size_t cnt, int32_t *x, int32_t *y)
+{
+	struct native_proj np;
+	double bx[CHUNK], by[CHUNK];
+	size_t i, j, n;
+	PJ *proj;
+
+	if (native_proj(epsg, &np)) {
+		for (i = 0; i < cnt; i++) {
+			double fx, fy;
+
+			native_fwd(&np, lat[i], lon[i], &fx, &fy);
+			verify_fwd(epsg, lat[i], lon[i], fx, fy);
+
+			x[i] = fx * 16;
+			y[i] = fy * 16;
+		}
+
+		return 0;
+	}
+
+	proj = get_proj(XQX_EPSG_WGS84, epsg);
+	if (!proj)
+		return 1;
+
+	for (i = 0; i < cnt; i += n) {
+		n = MIN(cnt - i, (size_t)CHUNK);
+
+		for (j = 0; j < n; j++) {
+			bx[j] = lon[i + j];
+			by[j] = lat[i + j];
+		}
 
-	*x = c_out.xyz.x * 16;
-	*y = c_out.xyz.y * 16;
-	*z = c_out.xyz.z * 16;
+		if (proj_trans_generic(proj, PJ_FWD, bx, sizeof(double), n,
+		                       by, sizeof(double), n,
+		                       NULL, 0, 0, NULL, 0, 0) != n)
+			return 1;
+
+		for (j = 0; j < n; j++) {
+			x[i + j] = bx[j] * 16;
+			y[i + j] = by[j] * 16;
+		}
+	}
 
 	return 0;
 }
+
+/* Arrays shorter than this are not worth splitting between threads */
+#define PARALLEL_MIN 4096
+
+struct arr_job {
+	unsigned int epsg;
+	const double *lat, *lon;
+	int32_t *x, *y;
+	size_t cnt;
+	unsigned int parts;
+	int failed;
+};
+
+static void arr_part(void *priv, unsigned int i)
+{
+	struct arr_job *job = priv;
+	size_t from = job->cnt * i / job->parts;
+	size_t to = job->cnt * (i + 1) / job->parts;
+
+	if (wgs84_to_coords_arr(job->epsg, job->lat + from, job->lon + from, to - from,
+	                        job->x + from, job->y + from))
+		__atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+}
+
+int xqx_wgs84_to_coords_arr(unsigned int epsg, const double *lat, const double *lon,
+                            size_t cnt, int32_t *x, int32_t *y)
+{
+	struct arr_job job = {
+		.epsg = epsg,
+		.lat = lat,
+		.lon = lon,
+		.x = x,
+		.y = y,
+		.cnt = cnt,
+		.parts = xqx_workers_count(),
+	};
+
+	if (cnt < PARALLEL_MIN || job.parts <= 1)
+		return wgs84_to_coords_arr(epsg, lat, lon, cnt, x, y);
+
+	xqx_workers_run(arr_part, &job, job.parts);
+
+	return job.failed;
+}
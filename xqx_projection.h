@@ -6,8 +6,21 @@
 #ifndef XQX_PROJECTION_H__
 #define XQX_PROJECTION_H__
 
+#include <stddef.h>
 #include <stdint.h>
 
+#define XQX_EPSG_WGS84 4326
+
+/*
+ * Web Mercator (EPSG:3857) and WGS84 UTM zones (EPSG:326xx and 327xx) are
+ * transformed by closed form formulas, everything else by PROJ.
+ *
+ * All functions may be called from any thread, each thread keeps its own
+ * PROJ context and a few recently used transformations.
+ *
+ * Compiling with XQX_PROJ_VERIFY checks the closed form results against PROJ.
+ */
+
 /*
  * @epsg: A projection id
  * @lat, lon, alt: WGS84 coordinates
@@ -16,4 +29,13 @@
 int xqx_wgs84_to_coords(unsigned int epsg, double lat, double lon, double alt,
                         int32_t *x, int32_t *y, int32_t *z);
 
+/*
+ * Transforms arrays of cnt WGS84 coordinates, large arrays are split between
+ * the worker threads.
+ *
+ * Returns non-zero on failure.
+ */
+int xqx_wgs84_to_coords_arr(unsigned int epsg, const double *lat, const double *lon,
+                            size_t cnt, int32_t *x, int32_t *y);
+
 #endif /* XQX_PROJECTION_H__ */
@@ -0,0 +1,148 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Cyril Hrubis <metan@ucw.cz>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "xqx_common.h"
+#include "xqx_rtree.h"
+
+static int cmp_x(const void *a, const void *b)
+{
+	const struct xqx_rtree_box *ba = a, *bb = b;
+	int64_t ca = (int64_t)ba->lx + ba->hx;
+	int64_t cb = (int64_t)bb->lx + bb->hx;
+
+	return (ca > cb) - (ca < cb);
+}
+
+static int cmp_y(const void *a, const void *b)
+{
+	const struct xqx_rtree_box *ba = a, *bb = b;
+	int64_t ca = (int64_t)ba->ly + ba->hy;
+	int64_t cb = (int64_t)bb->ly + bb->hy;
+
+	return (ca > cb) - (ca < cb);
+}
+
+/*
+ * Sort-Tile-Recursive, sorts the leaves into vertical slices by x and then
+ * each slice by y, consecutive runs of XQX_RTREE_FANOUT leaves are then
+ * spatially close to each other.
+ */
+static void str_sort(struct xqx_rtree_box *leaves, unsigned int cnt)
+{
+	unsigned int nodes = (cnt + XQX_RTREE_FANOUT - 1) / XQX_RTREE_FANOUT;
+	unsigned int slices = ceil(sqrt(nodes));
+	unsigned int slice_size = (nodes + slices - 1) / slices * XQX_RTREE_FANOUT;
+	unsigned int i;
+
+	qsort(leaves, cnt, sizeof(*leaves), cmp_x);
+
+	for (i = 0; i < cnt; i += slice_size)
+		qsort(leaves + i, MIN(slice_size, cnt - i), sizeof(*leaves), cmp_y);
+}
+
+int xqx_rtree_build(struct xqx_rtree *tree, const struct xqx_rtree_box *leaves, unsigned int cnt)
+{
+	unsigned int total = 0, n = cnt, d = 0, i, j;
+
+	memset(tree, 0, sizeof(*tree));
+
+	if (!cnt)
+		return 0;
+
+	for (;;) {
+		tree->level_off[d] = total;
+		tree->level_cnt[d] = n;
+		total += n;
+		d++;
+
+		if (n == 1)
+			break;
+
+		n = (n + XQX_RTREE_FANOUT - 1) / XQX_RTREE_FANOUT;
+	}
+
+	tree->depth = d;
+
+	tree->boxes = malloc(total * sizeof(struct xqx_rtree_box));
+	if (!tree->boxes)
+		return 1;
+
+	memcpy(tree->boxes, leaves, cnt * sizeof(struct xqx_rtree_box));
+	str_sort(tree->boxes, cnt);
+
+	for (d = 1; d < tree->depth; d++) {
+		struct xqx_rtree_box *child = tree->boxes + tree->level_off[d - 1];
+		struct xqx_rtree_box *node = tree->boxes + tree->level_off[d];
+		unsigned int child_cnt = tree->level_cnt[d - 1];
+
+		for (i = 0; i < tree->level_cnt[d]; i++) {
+			unsigned int from = i * XQX_RTREE_FANOUT;
+			unsigned int to = MIN(from + XQX_RTREE_FANOUT, child_cnt);
+
+			node[i] = child[from];
+			node[i].id = from;
+
+			for (j = from + 1; j < to; j++) {
+				node[i].lx = MIN(node[i].lx, child[j].lx);
+				node[i].ly = MIN(node[i].ly, child[j].ly);
+				node[i].hx = MAX(node[i].hx, child[j].hx);
+				node[i].hy = MAX(node[i].hy, child[j].hy);
+			}
+		}
+	}
+
+	return 0;
+}
+
+void xqx_rtree_free(struct xqx_rtree *tree)
+{
+	free(tree->boxes);
+	tree->boxes = NULL;
+	tree->depth = 0;
+}
+
+static inline int box_hit(const struct xqx_rtree_box *b, int32_t lx, int32_t ly, int32_t hx, int32_t hy)
+{
+	return b->lx <= hx && b->hx >= lx && b->ly <= hy && b->hy >= ly;
+}
+
+void xqx_rtree_query(const struct xqx_rtree *tree, int32_t lx, int32_t ly, int32_t hx, int32_t hy,
+                     void (*cb)(void *priv, uint32_t id), void *priv)
+{
+	struct {
+		unsigned int level, idx;
+	} stack[XQX_RTREE_MAX_DEPTH * XQX_RTREE_FANOUT];
+	unsigned int sp = 0, i;
+
+	if (!tree->depth)
+		return;
+
+	stack[sp].level = tree->depth - 1;
+	stack[sp++].idx = 0;
+
+	while (sp) {
+		unsigned int level = stack[--sp].level;
+		unsigned int idx = stack[sp].idx;
+		const struct xqx_rtree_box *b = tree->boxes + tree->level_off[level] + idx;
+
+		if (!box_hit(b, lx, ly, hx, hy))
+			continue;
+
+		if (!level) {
+			cb(priv, b->id);
+			continue;
+		}
+
+		unsigned int to = MIN(b->id + XQX_RTREE_FANOUT, tree->level_cnt[level - 1]);
+
+		for (i = b->id; i < to; i++) {
+			stack[sp].level = level - 1;
+			stack[sp++].idx = i;
+		}
+	}
+}
@@ -0,0 +1,56 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Cyril Hrubis <metan@ucw.cz>
+ */
+
+/*
+
+   Static packed R-tree.
+
+   The tree is built once from a list of bounding boxes and cannot be
+   modified afterwards. Leaves are sorted with the Sort-Tile-Recursive
+   algorithm and packed into nodes of XQX_RTREE_FANOUT items, each upper
+   level groups XQX_RTREE_FANOUT consecutive nodes of the level below, so
+   no child pointers are stored.
+
+ */
+
+#ifndef XQX_RTREE_H__
+#define XQX_RTREE_H__
+
+#include <stdint.h>
+
+#define XQX_RTREE_FANOUT 16
+#define XQX_RTREE_MAX_DEPTH 16
+
+struct xqx_rtree_box {
+	/* bounding box, inclusive */
+	int32_t lx, ly, hx, hy;
+	/* user id for leaves */
+	uint32_t id;
+};
+
+struct xqx_rtree {
+	unsigned int depth;
+	/* number of boxes and offset into boxes for each level, leaves first */
+	unsigned int level_cnt[XQX_RTREE_MAX_DEPTH];
+	unsigned int level_off[XQX_RTREE_MAX_DEPTH];
+	struct xqx_rtree_box *boxes;
+};
+
+/*
+ * Builds a tree from cnt leaves.
+ *
+ * Returns non-zero on allocation failure.
+ */
+int xqx_rtree_build(struct xqx_rtree *tree, const struct xqx_rtree_box *leaves, unsigned int cnt);
+
+void xqx_rtree_free(struct xqx_rtree *tree);
+
+/*
+ * Calls cb for each leaf that intersects the inclusive rectangle.
+ */
+void xqx_rtree_query(const struct xqx_rtree *tree, int32_t lx, int32_t ly, int32_t hx, int32_t hy,
+                     void (*cb)(void *priv, uint32_t id), void *priv);
+
+#endif /* XQX_RTREE_H__ */
@@ -0,0 +1,174 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Cyril Hrubis <metan@ucw.cz>
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xqx_map.h"
+#include "xqx_view.h"
+#include "xqx_session.h"
+#include "xqx_xdg.h"
+
+#define SESSION_TILES_MAX 256
+
+/* check for an idle view every 10 seconds */
+#define SESSION_IDLE_MS 10000
+
+static int session_path(char *buf, size_t buf_size, int create)
+{
+	return xqx_xdg_cache_path(buf, buf_size, "session", create);
+}
+
+int xqx_session_save(struct xqx_view *vw)
+{
+	struct xqx_map_cache_key keys[SESSION_TILES_MAX];
+	struct xqx_map *map = vw->active_map;
+	char path[PATH_MAX], tmp_path[PATH_MAX + 4];
+	unsigned int i, cnt;
+	FILE *f;
+
+	if (!map || !map->pathname)
+		return 1;
+
+	if (session_path(path, sizeof(path), 1))
+		return 1;
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+	f = fopen(tmp_path, "w");
+	if (!f)
+		return 1;
+
+	cnt = xqx_map_cache_recent(map, keys, SESSION_TILES_MAX);
+
+	fprintf(f, "map %s\n", map->pathname);
+	fprintf(f, "center %u %u\n", vw->center.x, vw->center.y);
+	fprintf(f, "scale %i\n", vw->scale_fp);
+
+	for (i = 0; i < cnt; i++)
+		fprintf(f, "tile %u %u %u\n", keys[i].l, keys[i].x, keys[i].y);
+
+	if (fclose(f)) {
+		unlink(tmp_path);
+		return 1;
+	}
+
+	return rename(tmp_path, path);
+}
+
+int xqx_session_restore(struct xqx_view *vw)
+{
+	struct xqx_map_cache_key keys[SESSION_TILES_MAX];
+	struct xqx_map *map = vw->active_map;
+	char path[PATH_MAX];
+	char *buf = NULL;
+	size_t buf_size = 0;
+	unsigned int cnt = 0;
+	uint32_t cx, cy;
+	int scale = 0, center = 0, ret = 1;
+	FILE *f;
+
+	if (!map || !map->pathname)
+		return 1;
+
+	if (session_path(path, sizeof(path), 0))
+		return 1;
+
+	f = fopen(path, "r");
+	if (!f)
+		return 1;
+
+	if (getline(&buf, &buf_size, f) < 0)
+		goto exit;
+
+	buf[strcspn(buf, "\n")] = 0;
+
+	if (strncmp(buf, "map ", 4) || strcmp(buf + 4, map->pathname))
+		goto exit;
+
+	while (getline(&buf, &buf_size, f) >= 0) {
+		struct xqx_map_cache_key key;
+
+		if (sscanf(buf, "center %u %u", &cx, &cy) == 2) {
+			center = 1;
+		} else if (sscanf(buf, "scale %i", &scale) == 1) {
+			continue;
+		} else if (sscanf(buf, "tile %u %u %u", &key.l, &key.x, &key.y) == 3) {
+			if (cnt < SESSION_TILES_MAX)
+				keys[cnt++] = key;
+		} else {
+			printf("warning: unparsable line in '%s': '%s'\n", path, buf);
+		}
+	}
+
+	if (center)
+		xqx_view_set_center(vw, cx, cy);
+
+	if (scale > 0)
+		xqx_view_set_scale(vw, scale);
+
+	xqx_map_cache_prefetch(map, keys, cnt);
+
+	ret = 0;
+exit:
+	free(buf);
+	fclose(f);
+	return ret;
+}
+
+static struct xqx_view *autosave_view;
+static struct xqx_coordinate saved_center, last_center;
+static int saved_scale, last_scale;
+
+static uint32_t autosave_callback(gp_timer *self)
+{
+	struct xqx_view *vw = autosave_view;
+
+	(void) self;
+
+	int moved = vw->center.x != last_center.x || vw->center.y != last_center.y ||
+	            vw->scale_fp != last_scale;
+
+	int changed = vw->center.x != saved_center.x || vw->center.y != saved_center.y ||
+	              vw->scale_fp != saved_scale;
+
+	last_center = vw->center;
+	last_scale = vw->scale_fp;
+
+	if (!moved && changed && !xqx_session_save(vw)) {
+		saved_center = vw->center;
+		saved_scale = vw->scale_fp;
+	}
+
+	return SESSION_IDLE_MS;
+}
+
+static gp_timer autosave_timer = {
+	.callback = autosave_callback,
+	.id = "xqx session autosave",
+};
+
+static void autosave_exit(void)
+{
+	xqx_session_save(autosave_view);
+}
+
+void xqx_session_autosave(struct xqx_view *vw)
+{
+	if (autosave_view)
+		return;
+
+	autosave_view = vw;
+	saved_center = last_center = vw->center;
+	saved_scale = last_scale = vw->scale_fp;
+
+	autosave_timer.expires = SESSION_IDLE_MS;
+	gp_app_timer_start(&autosave_timer);
+
+	atexit(autosave_exit);
+}
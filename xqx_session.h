@@ -0,0 +1,42 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Cyril Hrubis <metan@ucw.cz>
+ */
+
+/*
+
+   Session stores the view position and the map cache working set so that the
+   tiles that were on the screen when gpmaps exited are loaded in the
+   background on the next start, before the first redraw asks for them one by
+   one.
+
+   The session is stored in $XDG_CACHE_HOME/gpmaps/session.
+
+ */
+
+#ifndef XQX_SESSION_H__
+#define XQX_SESSION_H__
+
+struct xqx_view;
+
+/*
+ * Saves view center, scale and recently used tiles of the active map.
+ *
+ * Returns non-zero on failure.
+ */
+int xqx_session_save(struct xqx_view *vw);
+
+/*
+ * Restores view center and scale if the session was saved for the active map
+ * and starts loading the saved tiles into the map cache.
+ *
+ * Returns non-zero if there was no session to restore.
+ */
+int xqx_session_restore(struct xqx_view *vw);
+
+/*
+ * Saves the session when the view was idle for a while and at exit.
+ */
+void xqx_session_autosave(struct xqx_view *vw);
+
+#endif /* XQX_SESSION_H__ */
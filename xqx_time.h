@@ -0,0 +1,36 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Cyril Hrubis <metan@ucw.cz>
+ */
+
+#ifndef XQX_TIME_H__
+#define XQX_TIME_H__
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Returns monotonic timestamp in microseconds.
+ */
+static inline uint64_t xqx_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Returns monotonic timestamp in nanoseconds.
+ */
+static inline uint64_t xqx_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#endif /* XQX_TIME_H__ */
@@ -0,0 +1,223 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Cyril Hrubis <metan@ucw.cz>
+ */
+
+#ifdef XQX_TRACE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xqx_time.h"
+#include "xqx_trace.h"
+
+/* Number of events per thread, has to be power of two */
+#define RING_SIZE (1<<16)
+
+struct trace_ev {
+	uint64_t ts;
+	const char *name;
+	uint32_t args[4];
+	uint8_t type, phase;
+};
+
+/*
+ * The ring is written only by the owning thread, the head is published with
+ * release semantics so that the dump sees complete events. Rings are never
+ * freed, the list is only ever pushed to.
+ */
+struct trace_ring {
+	struct trace_ring *next;
+	uint32_t tid;
+	uint64_t head;
+	struct trace_ev evs[RING_SIZE];
+};
+
+static struct trace_ring *rings;
+static __thread struct trace_ring *ring;
+static uint32_t next_tid;
+
+int xqx_trace_enabled;
+
+/* events recorded before last start are ignored */
+static uint64_t start_ts;
+
+static const struct trace_type {
+	const char *name;
+	const char *args[4];
+} types[XQX_TRACE_MAX] = {
+	[XQX_TRACE_TILE_REQ] = {"tile request", {"l", "x", "y", "prio"}},
+	[XQX_TRACE_TILE_READ] = {"tile read", {"l", "x", "y"}},
+	[XQX_TRACE_TILE_DECODE] = {"tile decode", {"l", "x", "y"}},
+	[XQX_TRACE_TILE_INSERT] = {"tile insert", {"l", "x", "y"}},
+	[XQX_TRACE_TILE_EVICT] = {"tile evict", {"l", "x", "y"}},
+	[XQX_TRACE_REDRAW_REQ] = {"redraw request", {"lx", "ly", "hx", "hy"}},
+	[XQX_TRACE_REDRAW] = {"redraw", {"lx", "ly", "hx", "hy"}},
+	[XQX_TRACE_LAYER_RENDER] = {"layer render", {"lx", "ly", "hx", "hy"}},
+};
+
+static struct trace_ring *ring_alloc(void)
+{
+	struct trace_ring *r = calloc(1, sizeof(*r));
+
+	if (!r)
+		return NULL;
+
+	r->tid = __atomic_add_fetch(&next_tid, 1, __ATOMIC_RELAXED);
+	r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+
+	while (!__atomic_compare_exchange_n(&rings, &r->next, r, 0,
+	                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	return r;
+}
+
+void xqx_trace_event(enum xqx_trace_type type, enum xqx_trace_phase phase, const char *name,
+                     uint32_t a, uint32_t b, uint32_t c, uint32_t d)
+{
+	struct trace_ev *ev;
+
+	if (!ring) {
+		ring = ring_alloc();
+		if (!ring)
+			return;
+	}
+
+	ev = &ring->evs[ring->head & (RING_SIZE - 1)];
+
+	ev->ts = xqx_time_ns();
+	ev->name = name;
+	ev->args[0] = a;
+	ev->args[1] = b;
+	ev->args[2] = c;
+	ev->args[3] = d;
+	ev->type = type;
+	ev->phase = phase;
+
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+void xqx_trace_start(void)
+{
+	start_ts = xqx_time_ns();
+	__atomic_store_n(&xqx_trace_enabled, 1, __ATOMIC_RELEASE);
+}
+
+void xqx_trace_stop(void)
+{
+	__atomic_store_n(&xqx_trace_enabled, 0, __ATOMIC_RELEASE);
+}
+
+static void dump_ev(FILE *f, struct trace_ev *ev, uint32_t tid, int first)
+{
+	const struct trace_type *t = &types[ev->type];
+	int i;
+
+	fprintf(f, "%s\n{\"name\":\"%s\",\"cat\":\"gpmaps\",\"ph\":\"%c\","
+	        "\"ts\":%llu.%03u,\"pid\":1,\"tid\":%u,",
+	        first ? "" : ",", ev->name ? ev->name : t->name, ev->phase,
+	        (unsigned long long)((ev->ts - start_ts) / 1000),
+	        (unsigned int)((ev->ts - start_ts) % 1000), tid);
+
+	if (ev->phase == XQX_TRACE_INSTANT)
+		fprintf(f, "\"s\":\"t\",");
+
+	fprintf(f, "\"args\":{");
+
+	for (i = 0; i < 4 && t->args[i]; i++)
+		fprintf(f, "%s\"%s\":%u", i ? "," : "", t->args[i], ev->args[i]);
+
+	fprintf(f, "}}");
+}
+
+/*
+ * Rings of threads that are still tracing may wrap while we dump them, which
+ * may corrupt the oldest events, stop the tracing for a consistent trace.
+ */
+int xqx_trace_dump(const char *path)
+{
+	struct trace_ring *r;
+	FILE *f;
+	int first = 1;
+
+	f = fopen(path, "w");
+	if (!f)
+		return -1;
+
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+	for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+		uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		uint64_t i = head > RING_SIZE ? head - RING_SIZE : 0;
+
+		for (; i < head; i++) {
+			struct trace_ev *ev = &r->evs[i & (RING_SIZE - 1)];
+
+			if (ev->ts < start_ts)
+				continue;
+
+			dump_ev(f, ev, r->tid, first);
+			first = 0;
+		}
+	}
+
+	fprintf(f, "\n]}\n");
+
+	if (fclose(f))
+		return -1;
+
+	return 0;
+}
+
+static const char *trace_path(void)
+{
+	const char *path = getenv("GPMAPS_TRACE");
+
+	if (!path || !*path)
+		return "gpmaps-trace.json";
+
+	return path;
+}
+
+static void trace_write(void)
+{
+	const char *path = trace_path();
+
+	if (xqx_trace_dump(path))
+		printf("Failed to write trace '%s': %s\n", path, strerror(errno));
+	else
+		printf("Trace written to '%s'\n", path);
+}
+
+void xqx_trace_toggle(void)
+{
+	if (!xqx_trace_enabled) {
+		xqx_trace_start();
+		return;
+	}
+
+	xqx_trace_stop();
+	trace_write();
+}
+
+static void trace_atexit(void)
+{
+	if (!xqx_trace_enabled)
+		return;
+
+	xqx_trace_stop();
+	trace_write();
+}
+
+void xqx_trace_init(void)
+{
+	if (!getenv("GPMAPS_TRACE"))
+		return;
+
+	xqx_trace_start();
+	atexit(trace_atexit);
+}
+
+#endif /* XQX_TRACE */
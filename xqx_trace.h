@@ -0,0 +1,122 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Cyril Hrubis <metan@ucw.cz>
+ */
+
+/*
+
+   Event tracing.
+
+   Events are stored, together with a timestamp, into a per-thread ring
+   buffer, so recording an event does not take any locks and does not do any
+   I/O. The buffers can be dumped into a Chrome trace JSON that can be loaded
+   into chrome://tracing or https://ui.perfetto.dev.
+
+   The tracing is compiled in only when XQX_TRACE is defined, i.e. when
+   gpmaps is build with 'make TRACE=1', otherwise the macros expand to
+   nothing. Once compiled in it has to be enabled by xqx_trace_start().
+
+ */
+
+#ifndef XQX_TRACE_H__
+#define XQX_TRACE_H__
+
+#include <stdint.h>
+
+enum xqx_trace_type {
+	/* tile l, x, y requested from a map with priority */
+	XQX_TRACE_TILE_REQ,
+	/* reading tile l, x, y from storage */
+	XQX_TRACE_TILE_READ,
+	/* decoding tile l, x, y */
+	XQX_TRACE_TILE_DECODE,
+	/* tile l, x, y inserted into the cache */
+	XQX_TRACE_TILE_INSERT,
+	/* tile l, x, y evicted from the cache */
+	XQX_TRACE_TILE_EVICT,
+	/* redraw of lx, ly, hx, hy requested */
+	XQX_TRACE_REDRAW_REQ,
+	/* repaint of lx, ly, hx, hy */
+	XQX_TRACE_REDRAW,
+	/* layer render of lx, ly, hx, hy, name is the layer name */
+	XQX_TRACE_LAYER_RENDER,
+	XQX_TRACE_MAX,
+};
+
+enum xqx_trace_phase {
+	XQX_TRACE_INSTANT = 'i',
+	XQX_TRACE_BEGIN = 'B',
+	XQX_TRACE_END = 'E',
+};
+
+#ifdef XQX_TRACE
+
+extern int xqx_trace_enabled;
+
+void xqx_trace_event(enum xqx_trace_type type, enum xqx_trace_phase phase, const char *name,
+                     uint32_t a, uint32_t b, uint32_t c, uint32_t d);
+
+/*
+ * Starts recording events, previously recorded events are dropped.
+ */
+void xqx_trace_start(void);
+
+/*
+ * Stops recording events.
+ */
+void xqx_trace_stop(void);
+
+/*
+ * Writes recorded events into a Chrome trace JSON file.
+ *
+ * Returns zero on success, -1 and errno on failure.
+ */
+int xqx_trace_dump(const char *path);
+
+/*
+ * Starts tracing or stops it and dumps the trace into a file, the path is
+ * taken from GPMAPS_TRACE environment variable and defaults to
+ * gpmaps-trace.json.
+ */
+void xqx_trace_toggle(void);
+
+/*
+ * Starts tracing right away if GPMAPS_TRACE is set, the trace is written at
+ * the exit.
+ */
+void xqx_trace_init(void);
+
+# define XQX_TRACE_EV(phase, type, name, a, b, c, d) do { \
+	if (xqx_trace_enabled) \
+		xqx_trace_event(type, phase, name, a, b, c, d); \
+} while (0)
+
+#else
+
+static inline void xqx_trace_start(void) {}
+static inline void xqx_trace_stop(void) {}
+static inline int xqx_trace_dump(const char *path)
+{
+	(void) path;
+	return 0;
+}
+static inline void xqx_trace_toggle(void) {}
+static inline void xqx_trace_init(void) {}
+
+# define XQX_TRACE_EV(phase, type, name, a, b, c, d) do {} while (0)
+
+#endif /* XQX_TRACE */
+
+#define XQX_TRACE_TILE(type, l, x, y) \
+	XQX_TRACE_EV(XQX_TRACE_INSTANT, type, NULL, l, x, y, 0)
+
+#define XQX_TRACE_TILE_BEGIN(type, l, x, y) \
+	XQX_TRACE_EV(XQX_TRACE_BEGIN, type, NULL, l, x, y, 0)
+
+#define XQX_TRACE_TILE_END(type, l, x, y) \
+	XQX_TRACE_EV(XQX_TRACE_END, type, NULL, l, x, y, 0)
+
+#define XQX_TRACE_RECT(phase, type, name, lx, ly, hx, hy) \
+	XQX_TRACE_EV(phase, type, name, lx, ly, hx, hy)
+
+#endif /* XQX_TRACE_H__ */
@@ -4,12 +4,215 @@
  * Copyright (c) 2021 Cyril Hrubis <metan@ucw.cz>
  */
 
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
 #include "xqx_view.h"
 #include "xqx_dllist.h"
 #include "xqx_map_layer.h"
 #include "xqx_grid_layer.h"
+#include "xqx_hud_layer.h"
+#include "xqx_time.h"
+#include "xqx_trace.h"
+#include "xqx_workers.h"
 #include "xqx_gps_layer.h"
 
+/* Damage tracking */
+
+static inline int64_t rect_area(const struct xqx_rectangle *r)
+{
+	return (int64_t)(r->hx - r->lx) * (r->hy - r->ly);
+}
+
+static inline int rect_eq(const struct xqx_rectangle *a, const struct xqx_rectangle *b)
+{
+	return a->lx == b->lx && a->ly == b->ly && a->hx == b->hx && a->hy == b->hy;
+}
+
+static inline void rect_union(const struct xqx_rectangle *a, const struct xqx_rectangle *b,
+                              struct xqx_rectangle *res)
+{
+	res->lx = MIN(a->lx, b->lx);
+	res->ly = MIN(a->ly, b->ly);
+	res->hx = MAX(a->hx, b->hx);
+	res->hy = MAX(a->hy, b->hy);
+}
+
+/*
+ * Adds a rectangle into a set, rectangles are merged as long as the union
+ * does not cover more than the rectangles itself, i.e. adjacent tiles end
+ * up as a single rectangle. When the set is full the rectangle is merged with
+ * the one that grows the least.
+ */
+static void rects_add(struct xqx_rectangle *rects, unsigned int *cnt, const struct xqx_rectangle *r)
+{
+	struct xqx_rectangle u = *r, tmp;
+	unsigned int i, best = 0;
+	int64_t growth, best_growth = INT64_MAX;
+
+again:
+	for (i = 0; i < *cnt; i++) {
+		rect_union(&rects[i], &u, &tmp);
+
+		if (rect_area(&tmp) <= rect_area(&rects[i]) + rect_area(&u)) {
+			u = tmp;
+			rects[i] = rects[--(*cnt)];
+			goto again;
+		}
+	}
+
+	if (*cnt < XQX_VIEW_DAMAGE_RECTS) {
+		rects[(*cnt)++] = u;
+		return;
+	}
+
+	for (i = 0; i < *cnt; i++) {
+		rect_union(&rects[i], &u, &tmp);
+		growth = rect_area(&tmp) - rect_area(&rects[i]);
+
+		if (growth < best_growth) {
+			best_growth = growth;
+			best = i;
+		}
+	}
+
+	rect_union(&rects[best], &u, &rects[best]);
+}
+
+/*
+ * Moves rectangles by dx, dy and clips them to the view.
+ */
+static void rects_move(struct xqx_view *vw, struct xqx_rectangle *rects, unsigned int *cnt, int dx, int dy)
+{
+	unsigned int i = 0;
+
+	while (i < *cnt) {
+		struct xqx_rectangle *r = &rects[i];
+
+		r->lx = CLAMP(r->lx + dx, 0, (int)vw->w);
+		r->hx = CLAMP(r->hx + dx, 0, (int)vw->w);
+		r->ly = CLAMP(r->ly + dy, 0, (int)vw->h);
+		r->hy = CLAMP(r->hy + dy, 0, (int)vw->h);
+
+		if (r->lx == r->hx || r->ly == r->hy)
+			*r = rects[--(*cnt)];
+		else
+			i++;
+	}
+}
+
+/* Retained layer surfaces */
+
+/* transparent pixels of retained surfaces, layers must not draw with it */
+#define SURFACE_KEY 0xff00ff
+
+static void surface_invalidate(struct xqx_view_layer *lr, struct xqx_rectangle *rect)
+{
+	struct xqx_view *vw = lr->view;
+	struct xqx_rectangle all = {0, 0, vw ? (int)vw->w : 0, vw ? (int)vw->h : 0};
+
+	if (!rect) {
+		lr->dirty[0] = all;
+		lr->dirty_cnt = 1;
+		return;
+	}
+
+	rects_add(lr->dirty, &lr->dirty_cnt, rect);
+}
+
+/*
+ * Rasterizes dirty parts of a retained layer surface.
+ *
+ * Returns non-zero if the surface could not be allocated.
+ */
+static int surface_update(struct xqx_view_layer *lr, struct xqx_view *vw)
+{
+	unsigned int i;
+
+	if (lr->surface && (lr->surface->w != vw->w || lr->surface->h != vw->h)) {
+		gp_pixmap_free(lr->surface);
+		lr->surface = NULL;
+	}
+
+	if (!lr->surface) {
+		lr->surface = gp_pixmap_alloc(vw->w, vw->h, GP_PIXEL_xRGB8888);
+		if (!lr->surface)
+			return 1;
+
+		surface_invalidate(lr, NULL);
+	}
+
+	for (i = 0; i < lr->dirty_cnt; i++) {
+		struct xqx_rectangle *r = &lr->dirty[i];
+
+		gp_fill_rect_xyxy(lr->surface, r->lx, r->ly, r->hx - 1, r->hy - 1, SURFACE_KEY);
+		lr->render_cb(lr, vw, lr->surface, r);
+	}
+
+	lr->dirty_cnt = 0;
+
+	return 0;
+}
+
+static void surfaces_invalidate(struct xqx_view *vw)
+{
+	struct xqx_view_layer *lr;
+
+	for (lr = vw->view_first; lr; lr = lr->next) {
+		if (lr->flags & XQX_VIEW_LAYER_RETAINED)
+			surface_invalidate(lr, NULL);
+	}
+}
+
+static void surfaces_scroll(struct xqx_view *vw, int dx, int dy,
+                            struct xqx_rectangle *strips, unsigned int strips_cnt)
+{
+	struct xqx_view_layer *lr;
+	unsigned int i;
+
+	for (lr = vw->view_first; lr; lr = lr->next) {
+		if (!(lr->flags & XQX_VIEW_LAYER_RETAINED) || !lr->surface)
+			continue;
+
+		if (xqx_pixmap_scroll(lr->surface, dx, dy)) {
+			surface_invalidate(lr, NULL);
+			continue;
+		}
+
+		rects_move(vw, lr->dirty, &lr->dirty_cnt, dx, dy);
+
+		for (i = 0; i < strips_cnt; i++)
+			surface_invalidate(lr, &strips[i]);
+	}
+}
+
+static void rt_post(struct xqx_view *vw);
+
+void xqx_view_layer_invalidate(struct xqx_view_layer *lr, struct xqx_rectangle *rect)
+{
+	struct xqx_view *vw = lr->view;
+
+	if (!vw)
+		return;
+
+	/* the map is rendered as a whole in the render thread */
+	if (vw->rt && lr == vw->view_last) {
+		rt_post(vw);
+		return;
+	}
+
+	if (lr->flags & XQX_VIEW_LAYER_RETAINED)
+		surface_invalidate(lr, rect);
+
+	if (rect)
+		xqx_view_request_redraw(vw, rect->lx, rect->ly, rect->hx, rect->hy);
+	else
+		xqx_view_request_redraw(vw, 0, 0, vw->w, vw->h);
+}
+
 static inline void do_notify_layer(struct xqx_view_layer *lr, struct xqx_view *vw, enum xqx_view_layer_change change)
 {
 	if (lr->notify_cb)
@@ -18,7 +221,22 @@ static inline void do_notify_layer(struct xqx_view_layer *lr, struct xqx_view *v
 
 static inline void do_render_layer(struct xqx_view_layer *lr, struct xqx_view *vw, gp_pixmap *pixmap, struct xqx_rectangle *rect)
 {
-	lr->render_cb(lr, vw, pixmap, rect);
+	XQX_TRACE_RECT(XQX_TRACE_BEGIN, XQX_TRACE_LAYER_RENDER, lr->name,
+	               rect->lx, rect->ly, rect->hx, rect->hy);
+
+	/*
+	 * Retained surfaces are updated before the layers are rendered, for
+	 * the current view only, i.e. not for a render thread snapshot.
+	 */
+	if ((lr->flags & XQX_VIEW_LAYER_RETAINED) && lr->surface && !lr->dirty_cnt && lr->view == vw) {
+		xqx_pixmap_composite(lr->surface, pixmap, rect->lx, rect->ly,
+		                     rect->hx - rect->lx, rect->hy - rect->ly, SURFACE_KEY);
+	} else {
+		lr->render_cb(lr, vw, pixmap, rect);
+	}
+
+	XQX_TRACE_RECT(XQX_TRACE_END, XQX_TRACE_LAYER_RENDER, lr->name,
+	               rect->lx, rect->ly, rect->hx, rect->hy);
 }
 
 static void do_notify_layers(struct xqx_view *vw, enum xqx_view_layer_change change)
@@ -43,7 +261,26 @@ static inline void notify_layers(struct xqx_view *vw, enum xqx_view_layer_change
 
 static inline void invalidate_view(struct xqx_view *vw)
 {
-	gp_widget_redraw(vw->pixmap);
+	/* whole view is repainted, pending damage is pointless */
+	vw->damage_cnt = 0;
+	vw->paint_cnt = 0;
+	vw->scroll_dx = 0;
+	vw->scroll_dy = 0;
+	vw->redraw_full = 1;
+	vw->redraw_pending = 0;
+	vw->frame_damage = 1;
+	gp_app_timer_stop(&vw->damage_timer);
+
+	surfaces_invalidate(vw);
+
+	/* the screen is updated once the frame is rendered */
+	if (vw->rt) {
+		rt_post(vw);
+		return;
+	}
+
+	if (vw->pixmap)
+		gp_widget_redraw(vw->pixmap);
 }
 
 void xqx_view_pixels_to_coords(struct xqx_view *vw, int px, int py, struct xqx_coordinate *c)
@@ -53,14 +290,16 @@ void xqx_view_pixels_to_coords(struct xqx_view *vw, int px, int py, struct xqx_c
 
 	x -= vw->w / 2;
 	x *= vw->scale_cx;
-	x *= vw->scale_main;
+	x *= vw->scale_fp;
 	x /= vw->scale_px;
+	x /= XQX_SCALE_ONE;
 	x += vw->center.x;
 
 	y -= vw->h / 2;
 	y *= vw->scale_cy;
-	y *= vw->scale_main;
+	y *= vw->scale_fp;
 	y /= vw->scale_py;
+	y /= XQX_SCALE_ONE;
 	y += vw->center.y;
 
 	/* FIXME check overflow */
@@ -72,18 +311,57 @@ static void update_step(struct xqx_view *vw)
 {
 	int64_t sx = 256;
 	sx *= vw->scale_cx;
-	sx *= vw->scale_main;
+	sx *= vw->scale_fp;
 	sx /= vw->scale_px;
+	sx /= XQX_SCALE_ONE;
 
 	int64_t sy = 256;
 	sy *= vw->scale_cy;
-	sy *= vw->scale_main;
+	sy *= vw->scale_fp;
 	sy /= vw->scale_py;
+	sy /= XQX_SCALE_ONE;
 
 	vw->step_x = sx;
 	vw->step_y = sy;
 }
 
+/*
+ * Sets the scale and derives the level scale and the map independent scale.
+ */
+static void update_scale(struct xqx_view *vw, int s)
+{
+	vw->scale_fp = s;
+
+	vw->scale_main = 1;
+	while (vw->scale_main * 2 * XQX_SCALE_ONE <= s)
+		vw->scale_main *= 2;
+
+	int64_t def = vw->scale_fp;
+	def *= vw->scale_cx;
+	def /= vw->scale_px;
+	vw->scale_def = abs((int) def);
+}
+
+/*
+ * Rounds scales that are very close to a power of two, e.g. after several
+ * smooth zoom steps, so that tiles are drawn without resampling.
+ */
+static int snap_scale(int s)
+{
+	int p = XQX_SCALE_ONE;
+
+	while (p * 2 <= s)
+		p *= 2;
+
+	if ((s - p) * 64 < p)
+		return p;
+
+	if ((2 * p - s) * 64 < 2 * p)
+		return 2 * p;
+
+	return s;
+}
+
 static void update_first(struct xqx_view *vw, struct xqx_view_layer *lr)
 {
 	if (vw->view_last == lr) {
@@ -109,50 +387,50 @@ static void update_first(struct xqx_view *vw, struct xqx_view_layer *lr)
 			vw->scale_px = il->map->geo_psx;
 			vw->scale_py = il->map->geo_psy;
 
-			vw->scale_main = 1;
+			int scale = 1;
 			if (il->map->num_levels > 2)
-				vw->scale_main = 1 << (il->map->num_levels - 2);
+				scale = 1 << (il->map->num_levels - 2);
 
-			int64_t def = vw->scale_main;
-			def *= vw->scale_cx;
-			def /= vw->scale_px;
-			vw->scale_def = abs((int) def);
+			update_scale(vw, scale * XQX_SCALE_ONE);
 
 			vw->used = 1;
 		} else {
-			int64_t oscale, nscale;
-			oscale = vw->scale_def;
+			/* Keep the map independent scale when switching maps */
+			int64_t oscale = vw->scale_def;
+			int smax = (1 << (il->map->num_levels - 1)) * XQX_SCALE_ONE;
 
 			vw->scale_cx = il->map->geo_csx;
 			vw->scale_cy = il->map->geo_csy;
 			vw->scale_px = il->map->geo_psx;
 			vw->scale_py = il->map->geo_psy;
 
-			int l;
-			for (l = 0; l < il->map->num_levels; l++) {
-				vw->scale_main = 1 << l;
-				nscale = vw->scale_main;
-				nscale *= vw->scale_cx;
-				nscale /= vw->scale_px;
-
-				if (oscale <= nscale)
-					break;
-			}
+			oscale *= vw->scale_px;
+			oscale /= vw->scale_cx;
+			oscale = ABS(oscale);
 
-			if ((l > 0) && (l < il->map->num_levels) &&
-			   ((oscale * 64 / nscale) < (nscale * 32 / oscale)))
-				vw->scale_main /= 2;
+			update_scale(vw, snap_scale(CLAMP(oscale, XQX_SCALE_ONE, smax)));
 		}
 
 		update_step(vw);
 	}
 }
 
+static void rt_sync(struct xqx_view_rt *rt);
+
 void xqx_view_remove_layer(struct xqx_view *vw, struct xqx_view_layer *lr)
 {
+	/* the render thread must not touch the layer anymore */
+	if (vw->rt && lr == vw->view_last)
+		rt_sync(vw->rt);
+
 	lr->view = NULL;
 	DLL_REMOVE(vw, view_first, view_last, lr, prev, next);
 	notify_layer(lr, vw, XQX_VLC_FINISH);
+
+	if (lr->surface) {
+		gp_pixmap_free(lr->surface);
+		lr->surface = NULL;
+	}
 }
 
 void xqx_view_prepend_layer(struct xqx_view *vw, struct xqx_view_layer *lr)
@@ -171,34 +449,90 @@ void xqx_view_append_layer(struct xqx_view *vw, struct xqx_view_layer *lr)
 	notify_layer(lr, vw, XQX_VLC_INIT);
 }
 
+static int view_scroll(struct xqx_view *vw, int dx, int dy);
+
+/* Recording */
+
+static void record_view(struct xqx_view *vw)
+{
+	if (!vw->record)
+		return;
+
+	fprintf(vw->record, "view %u %u %.4f\n", vw->center.x, vw->center.y,
+	        (double)vw->scale_fp / XQX_SCALE_ONE);
+	fflush(vw->record);
+}
+
+static void record_size(struct xqx_view *vw)
+{
+	if (!vw->record || !vw->valid)
+		return;
+
+	fprintf(vw->record, "size %u %u\n", vw->w, vw->h);
+	fflush(vw->record);
+}
+
+void xqx_view_record(struct xqx_view *vw, FILE *f)
+{
+	vw->record = f;
+
+	record_size(vw);
+
+	if (vw->view_last)
+		record_view(vw);
+}
+
 void xqx_view_set_center(struct xqx_view *vw, int nx, int ny)
 {
+	int dx = xqx_view_abs_px_x(vw, vw->center.x) - xqx_view_abs_px_x(vw, nx);
+	int dy = xqx_view_abs_px_y(vw, vw->center.y) - xqx_view_abs_px_y(vw, ny);
+
 	vw->center.x = nx;
 	vw->center.y = ny;
 
 	notify_layers(vw, XQX_VLC_MOVE);
-	invalidate_view(vw);
+
+	if (view_scroll(vw, dx, dy))
+		invalidate_view(vw);
+
+	record_view(vw);
 }
 
-void xqx_view_set_scale(struct xqx_view *vw, int s)
+static int scale_max(struct xqx_view *vw)
 {
 	struct xqx_map_layer *il = ((struct xqx_map_layer *)(vw->view_last));
-	int smax = 1 << (il->map->num_levels - 1);
-	if (s < 1) s = 1;
-	if (s > smax) s = smax;
 
-	if (s == vw->scale_main)
+	return (1 << (il->map->num_levels - 1)) * XQX_SCALE_ONE;
+}
+
+/*
+ * Moves the center and changes the scale as a single view change, i.e. the
+ * layers are notified only once.
+ */
+static void view_transition(struct xqx_view *vw, int s, int nx, int ny)
+{
+	s = snap_scale(CLAMP(s, XQX_SCALE_ONE, scale_max(vw)));
+
+	if (s == vw->scale_fp) {
+		if (nx != (int)vw->center.x || ny != (int)vw->center.y)
+			xqx_view_set_center(vw, nx, ny);
 		return;
+	}
 
-	vw->scale_main = s;
-	int64_t def = vw->scale_main;
-	def *= vw->scale_cx;
-	def /= vw->scale_px;
-	vw->scale_def = abs((int) def);
+	vw->center.x = nx;
+	vw->center.y = ny;
 
+	update_scale(vw, s);
 	update_step(vw);
 	notify_layers(vw, XQX_VLC_SCALE);
 	invalidate_view(vw);
+
+	record_view(vw);
+}
+
+void xqx_view_set_scale(struct xqx_view *vw, int s)
+{
+	view_transition(vw, s, vw->center.x, vw->center.y);
 }
 
 /* FIXME this function should probably go away */
@@ -215,6 +549,11 @@ void xqx_view_choose_map(struct xqx_view *vw, int s)
 	}
 
 	vw->active_map = vw->maps[s];
+
+	if (vw->record) {
+		fprintf(vw->record, "map %i\n", s);
+		fflush(vw->record);
+	}
 	struct xqx_map_layer *il = xqx_make_map_layer(vw->active_map);
 	xqx_view_append_layer(vw, (struct xqx_view_layer *) il);
 	invalidate_view(vw);
@@ -243,6 +582,20 @@ void xqx_view_toggle_grid(struct xqx_view *vw)
 		xqx_view_enable_grid(vw);
 }
 
+void xqx_view_toggle_hud(struct xqx_view *vw)
+{
+	if (vw->hud) {
+		xqx_view_remove_layer(vw, (struct xqx_view_layer *) (vw->hud));
+		xqx_discard_hud(vw->hud);
+		vw->hud = NULL;
+	} else {
+		vw->hud = xqx_make_hud();
+		xqx_view_prepend_layer(vw, (struct xqx_view_layer *) (vw->hud));
+	}
+
+	invalidate_view(vw);
+}
+
 void xqx_view_enable_gps(struct xqx_view *vw)
 {
 	vw->gps = xqx_make_gps_layer();
@@ -269,36 +622,614 @@ void xqx_view_toggle_gps_lock(struct xqx_view *vw)
 		xqx_view_set_center(vw, vw->gps->px, vw->gps->py);
 }
 
-static inline void xqx_view_move_user(struct xqx_view *vw, int dx, int dy)
+/* User input */
+
+static uint32_t input_flush(gp_timer *self)
+{
+	struct xqx_view *vw = self->priv;
+	int s = vw->input_scale ? vw->input_scale : vw->scale_fp;
+
+	view_transition(vw, s, vw->center.x + vw->input_dx, vw->center.y + vw->input_dy);
+
+	vw->input_scale = 0;
+	vw->input_dx = 0;
+	vw->input_dy = 0;
+	vw->input_pending = 0;
+	vw->input_flushed = xqx_time_us();
+
+	return GP_TIMER_STOP;
+}
+
+static void input_schedulle(struct xqx_view *vw)
+{
+	uint64_t since;
+
+	if (vw->input_pending)
+		return;
+
+	vw->input_pending = 1;
+	since = xqx_time_us() - vw->input_flushed;
+
+	vw->input_timer.expires = since < XQX_VIEW_FRAME_US ? (XQX_VIEW_FRAME_US - since) / 1000 : 0;
+	gp_app_timer_start(&vw->input_timer);
+}
+
+void xqx_view_input_move(struct xqx_view *vw, int dx, int dy)
 {
 	if (vw->gps)
 		vw->gps->locked = 0;
 
-	xqx_view_move(vw, dx, dy);
+	vw->input_dx += dx;
+	vw->input_dy += dy;
+
+	input_schedulle(vw);
 }
 
-void xqx_view_request_redraw(struct xqx_view *vw, int lx, int ly, int hx, int hy)
+/* steps out of the scale range are dropped so that they do not accumulate */
+void xqx_view_input_zoom(struct xqx_view *vw, int coef, int in)
+{
+	int64_t ns = vw->input_scale ? vw->input_scale : vw->scale_fp;
+
+	if (in)
+		ns = (ns * 1024) / coef;
+	else
+		ns = (ns * coef) / 1024;
+
+	vw->input_scale = CLAMP(ns, XQX_SCALE_ONE, scale_max(vw));
+
+	input_schedulle(vw);
+}
+
+static int layers_pan_invariant(struct xqx_view *vw)
+{
+	struct xqx_view_layer *lr;
+
+	for (lr = vw->view_first; lr; lr = lr->next) {
+		if (!(lr->flags & XQX_VIEW_LAYER_PAN_INVARIANT))
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Schedulles the view content to be moved by dx, dy pixels and the exposed
+ * strips to be rendered on the next repaint.
+ *
+ * Returns non-zero if the view has to be repainted as a whole instead.
+ */
+static int view_scroll(struct xqx_view *vw, int dx, int dy)
+{
+	int w = vw->w, h = vw->h;
+	int sdx = vw->scroll_dx + dx;
+	int sdy = vw->scroll_dy + dy;
+	unsigned int i;
+
+	/* there is no content to scroll when rendering offscreen */
+	if (!vw->valid || !vw->pixmap || vw->redraw_full || vw->rt || !layers_pan_invariant(vw))
+		return 1;
+
+	if (ABS(sdx) >= w || ABS(sdy) >= h)
+		return 1;
+
+	if (!dx && !dy)
+		return 0;
+
+	vw->scroll_dx = sdx;
+	vw->scroll_dy = sdy;
+	vw->frame_damage = 1;
+
+	/* pending damage moves together with the content */
+	rects_move(vw, vw->damage, &vw->damage_cnt, dx, dy);
+	rects_move(vw, vw->paint, &vw->paint_cnt, dx, dy);
+
+	struct xqx_rectangle strips[2];
+	unsigned int strips_cnt = 0;
+
+	struct xqx_rectangle strip_x = {
+		.lx = dx > 0 ? 0 : w + dx,
+		.hx = dx > 0 ? dx : w,
+		.ly = 0,
+		.hy = h,
+	};
+
+	struct xqx_rectangle strip_y = {
+		.lx = 0,
+		.hx = w,
+		.ly = dy > 0 ? 0 : h + dy,
+		.hy = dy > 0 ? dy : h,
+	};
+
+	if (dx)
+		strips[strips_cnt++] = strip_x;
+
+	if (dy)
+		strips[strips_cnt++] = strip_y;
+
+	for (i = 0; i < strips_cnt; i++)
+		rects_add(vw->paint, &vw->paint_cnt, &strips[i]);
+
+	surfaces_scroll(vw, dx, dy, strips, strips_cnt);
+
+	XQX_TRACE_RECT(XQX_TRACE_INSTANT, XQX_TRACE_REDRAW_REQ, "scroll", dx, dy, 0, 0);
+
+	/* the moved content has to be updated on the screen as well */
+	gp_widget_redraw(vw->pixmap);
+
+	return 0;
+}
+
+static uint32_t damage_flush(gp_timer *self)
+{
+	struct xqx_view *vw = self->priv;
+	struct xqx_rectangle *r;
+	unsigned int i;
+
+	for (i = 0; i < vw->damage_cnt; i++) {
+		r = &vw->damage[i];
+		rects_add(vw->paint, &vw->paint_cnt, r);
+		gp_widget_pixmap_redraw(vw->pixmap, r->lx, r->ly, r->hx - r->lx, r->hy - r->ly);
+	}
+
+	vw->damage_cnt = 0;
+	vw->damage_flushed = xqx_time_us();
+	vw->redraw_pending = 0;
+
+	return GP_TIMER_STOP;
+}
+
+static void request_redraw(struct xqx_view *vw, int lx, int ly, int hx, int hy, int overlay)
 {
 	lx = CLAMP(lx, 0, ((int) vw->w));
 	ly = CLAMP(ly, 0, ((int) vw->h));
 	hx = CLAMP(hx, lx, ((int) vw->w));
 	hy = CLAMP(hy, ly, ((int) vw->h));
 
-	gp_widget_pixmap_redraw(vw->pixmap, lx, ly, hx, hy);
-	printf("INV %d %d %d %d\n", lx, ly, hx, hy);
+	/* offscreen views are rendered as a whole by xqx_view_render() */
+	if (lx == hx || ly == hy || !vw->pixmap)
+		return;
+
+	XQX_TRACE_RECT(XQX_TRACE_INSTANT, XQX_TRACE_REDRAW_REQ, NULL, lx, ly, hx, hy);
+
+	struct xqx_rectangle r = {lx, ly, hx, hy};
+
+	rects_add(vw->damage, &vw->damage_cnt, &r);
+
+	if (overlay)
+		vw->overlay_damage = 1;
+	else
+		vw->frame_damage = 1;
+
+	if (vw->redraw_pending)
+		return;
+
+	/* first damage since last flush, schedulle the flush */
+	uint64_t since = xqx_time_us() - vw->damage_flushed;
+
+	vw->damage_timer.expires = since < XQX_VIEW_FRAME_US ? (XQX_VIEW_FRAME_US - since) / 1000 : 0;
+	gp_app_timer_start(&vw->damage_timer);
+	vw->redraw_pending = 1;
 }
 
-static void view_resize(struct xqx_view *vw)
+void xqx_view_request_redraw(struct xqx_view *vw, int lx, int ly, int hx, int hy)
+{
+	request_redraw(vw, lx, ly, hx, hy, 0);
+}
+
+void xqx_view_request_overlay_redraw(struct xqx_view *vw, int lx, int ly, int hx, int hy)
+{
+	request_redraw(vw, lx, ly, hx, hy, 1);
+}
+
+void xqx_view_set_size(struct xqx_view *vw, uint32_t w, uint32_t h)
 {
 	int old_valid = vw->valid;
-	gp_widget *pixmap = vw->pixmap;
 
 	vw->valid = 1;
-	vw->w = gp_widget_pixmap_w(pixmap);
-	vw->h = gp_widget_pixmap_h(pixmap);
+	vw->w = w;
+	vw->h = h;
+	vw->redraw_full = 1;
+	vw->scroll_dx = 0;
+	vw->scroll_dy = 0;
 
 	update_step(vw);
 	do_notify_layers(vw, old_valid ? XQX_VLC_RESIZE : XQX_VLC_INIT);
+
+	if (vw->rt)
+		rt_post(vw);
+
+	record_size(vw);
+}
+
+static void view_resize(struct xqx_view *vw)
+{
+	xqx_view_set_size(vw, gp_widget_pixmap_w(vw->pixmap), gp_widget_pixmap_h(vw->pixmap));
+}
+
+/* Rendering */
+
+/* Minimal band height, smaller bands are not worth the synchronization */
+#define BAND_MIN_H 32
+
+struct bands {
+	struct xqx_view *vw;
+	gp_pixmap *pixmap;
+	struct xqx_rectangle *rect;
+	/* layers from the bottom one up to, but not including, the stop */
+	struct xqx_view_layer *bottom, *stop;
+	unsigned int cnt;
+};
+
+static int layer_thread_safe(struct xqx_view_layer *lr)
+{
+	if (lr->flags & XQX_VIEW_LAYER_THREAD_SAFE)
+		return 1;
+
+	/* composition of an up to date surface is thread safe */
+	return (lr->flags & XQX_VIEW_LAYER_RETAINED) && lr->surface && !lr->dirty_cnt;
+}
+
+static void render_band(void *priv, unsigned int i)
+{
+	struct bands *bands = priv;
+	struct xqx_rectangle *rect = bands->rect;
+	struct xqx_view_layer *lr;
+	int h = rect->hy - rect->ly;
+
+	struct xqx_rectangle band = {
+		.lx = rect->lx,
+		.hx = rect->hx,
+		.ly = rect->ly + (h * i) / bands->cnt,
+		.hy = rect->ly + (h * (i + 1)) / bands->cnt,
+	};
+
+	for (lr = bands->bottom; lr != bands->stop; lr = lr->prev)
+		do_render_layer(lr, bands->vw, bands->pixmap, &band);
+}
+
+static unsigned int bands_count(struct xqx_rectangle *rect)
+{
+	/* more bands than threads to balance uneven band costs */
+	unsigned int cnt = MIN(2 * xqx_workers_count(), (unsigned int)(rect->hy - rect->ly) / BAND_MIN_H);
+
+	return MAX(cnt, 1u);
+}
+
+/*
+ * Renders all layers in a rectangle. The bottom layers that are thread safe
+ * are rendered in parallel in horizontal bands, the rest is rendered on top
+ * of that serially.
+ */
+static void render_rect(struct xqx_view *vw, gp_pixmap *pixmap, struct xqx_rectangle *rect)
+{
+	struct xqx_view_layer *lr, *stop = vw->view_last;
+	unsigned int cnt;
+
+	while (stop && layer_thread_safe(stop))
+		stop = stop->prev;
+
+	cnt = bands_count(rect);
+
+	if (stop != vw->view_last && cnt > 1) {
+		struct bands bands = {
+			.vw = vw,
+			.pixmap = pixmap,
+			.rect = rect,
+			.bottom = vw->view_last,
+			.stop = stop,
+			.cnt = cnt,
+		};
+
+		xqx_workers_run(render_band, &bands, cnt);
+	} else {
+		stop = vw->view_last;
+	}
+
+	for (lr = stop; lr; lr = lr->prev)
+		do_render_layer(lr, vw, pixmap, rect);
+}
+
+/* Offscreen rendering */
+
+unsigned int xqx_view_load_tiles(struct xqx_view *vw)
+{
+	struct xqx_map_layer *ml = (struct xqx_map_layer *)vw->view_last;
+	unsigned int ret = 0, cnt;
+
+	if (!ml)
+		return 0;
+
+	/* synthesized tiles finish on the workers and may need more tiles */
+	do {
+		cnt = xqx_map_cache_run_client(ml->cc, MAX_PRIO);
+		ret += cnt;
+	} while (xqx_workers_complete(1) || cnt);
+
+	return ret;
+}
+
+int xqx_view_render(struct xqx_view *vw, gp_pixmap *pixmap)
+{
+	struct xqx_rectangle rect = {0, 0, vw->w, vw->h};
+	struct xqx_view_layer *lr;
+
+	if (!vw->valid || pixmap->w != vw->w || pixmap->h != vw->h)
+		return 1;
+
+	for (lr = vw->view_first; lr; lr = lr->next) {
+		if (lr->flags & XQX_VIEW_LAYER_RETAINED)
+			surface_update(lr, vw);
+	}
+
+	render_rect(vw, pixmap, &rect);
+
+	vw->frames++;
+
+	return 0;
+}
+
+/* Render thread */
+
+struct xqx_view_rt {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	/* snapshot to be rendered next and the pixel type to render into */
+	struct xqx_view next;
+	gp_pixel_type next_type;
+	int pending;
+
+	/* frame being rendered and the view it's rendered for */
+	gp_pixmap *back;
+	struct xqx_view back_snap;
+	uint32_t back_us;
+	int busy;
+	/* back buffer is finished and waits to be flipped */
+	int done;
+
+	/* frame on the screen, owned by the main loop */
+	gp_pixmap *front;
+	struct xqx_view front_snap;
+
+	/* pixel type of the widget pixmap, owned by the main loop */
+	gp_pixel_type pixel_type;
+
+	/* wakes up the main loop when a frame is finished */
+	int pipe[2];
+	gp_fd fd;
+};
+
+/*
+ * Renders the map layer of the snapshot into the back buffer.
+ *
+ * Returns non-zero if the buffer could not be allocated.
+ */
+static int rt_render(struct xqx_view_rt *rt, struct xqx_view *snap, gp_pixel_type pixel_type)
+{
+	struct xqx_rectangle rect = {0, 0, snap->w, snap->h};
+
+	if (rt->back && (rt->back->w != snap->w || rt->back->h != snap->h ||
+	                 rt->back->pixel_type != pixel_type)) {
+		gp_pixmap_free(rt->back);
+		rt->back = NULL;
+	}
+
+	if (!rt->back) {
+		rt->back = gp_pixmap_alloc(snap->w, snap->h, pixel_type);
+		if (!rt->back)
+			return 1;
+	}
+
+	if (!snap->view_last) {
+		gp_fill(rt->back, 0);
+		return 0;
+	}
+
+	struct bands bands = {
+		.vw = snap,
+		.pixmap = rt->back,
+		.rect = &rect,
+		.bottom = snap->view_last,
+		.stop = snap->view_last->prev,
+		.cnt = bands_count(&rect),
+	};
+
+	XQX_TRACE_RECT(XQX_TRACE_BEGIN, XQX_TRACE_REDRAW, "render thread", 0, 0, snap->w, snap->h);
+	xqx_workers_run(render_band, &bands, bands.cnt);
+	XQX_TRACE_RECT(XQX_TRACE_END, XQX_TRACE_REDRAW, "render thread", 0, 0, snap->w, snap->h);
+
+	return 0;
+}
+
+static void *render_thread(void *arg)
+{
+	struct xqx_view_rt *rt = arg;
+	gp_pixel_type pixel_type;
+	uint64_t t;
+	int ret;
+
+	pthread_mutex_lock(&rt->lock);
+
+	for (;;) {
+		/* the back buffer is not reused until it's flipped */
+		while (!rt->pending || rt->done)
+			pthread_cond_wait(&rt->cond, &rt->lock);
+
+		rt->back_snap = rt->next;
+		pixel_type = rt->next_type;
+		rt->pending = 0;
+		rt->busy = 1;
+
+		pthread_mutex_unlock(&rt->lock);
+
+		t = xqx_time_us();
+		ret = rt_render(rt, &rt->back_snap, pixel_type);
+
+		pthread_mutex_lock(&rt->lock);
+
+		rt->busy = 0;
+		pthread_cond_broadcast(&rt->cond);
+
+		if (ret) {
+			printf("WARNING: Failed to allocate render buffer\n");
+			continue;
+		}
+
+		rt->back_us = xqx_time_us() - t;
+		rt->done = 1;
+
+		if (write(rt->pipe[1], "", 1) < 0 && errno != EAGAIN)
+			printf("WARNING: Failed to wake up main loop: %s\n", strerror(errno));
+	}
+
+	return NULL;
+}
+
+/*
+ * Posts a snapshot of the current view, replaces snapshot that has not been
+ * picked up by the render thread yet.
+ */
+static void rt_post(struct xqx_view *vw)
+{
+	struct xqx_view_rt *rt = vw->rt;
+
+	/* nothing to render into until the widget is shown */
+	if (!vw->valid || rt->pixel_type == GP_PIXEL_UNKNOWN)
+		return;
+
+	XQX_TRACE_RECT(XQX_TRACE_INSTANT, XQX_TRACE_REDRAW_REQ, "render thread", 0, 0, vw->w, vw->h);
+
+	pthread_mutex_lock(&rt->lock);
+	rt->next = *vw;
+	rt->next_type = rt->pixel_type;
+	rt->pending = 1;
+	pthread_cond_broadcast(&rt->cond);
+	pthread_mutex_unlock(&rt->lock);
+}
+
+/*
+ * Drops the snapshot that was not picked up yet and waits for the render
+ * thread to finish the current one.
+ */
+static void rt_sync(struct xqx_view_rt *rt)
+{
+	pthread_mutex_lock(&rt->lock);
+
+	rt->pending = 0;
+
+	while (rt->busy)
+		pthread_cond_wait(&rt->cond, &rt->lock);
+
+	pthread_mutex_unlock(&rt->lock);
+}
+
+static enum gp_poll_event_ret rt_flip(struct gp_fd *self)
+{
+	struct xqx_view *vw = self->priv;
+	struct xqx_view_rt *rt = vw->rt;
+	gp_pixmap *tmp;
+	char buf[16];
+
+	while (read(self->fd, buf, sizeof(buf)) > 0);
+
+	pthread_mutex_lock(&rt->lock);
+
+	if (!rt->done) {
+		pthread_mutex_unlock(&rt->lock);
+		return GP_POLL_RET_OK;
+	}
+
+	tmp = rt->front;
+	rt->front = rt->back;
+	rt->back = tmp;
+	rt->front_snap = rt->back_snap;
+	rt->done = 0;
+	vw->frame_us = rt->back_us;
+	vw->frame_damage = 1;
+	pthread_cond_broadcast(&rt->cond);
+
+	pthread_mutex_unlock(&rt->lock);
+
+	gp_widget_redraw(vw->pixmap);
+
+	return GP_POLL_RET_OK;
+}
+
+/*
+ * Copies the last finished frame onto the screen and draws the rest of the
+ * layers on the top for the view the frame was rendered for.
+ */
+static void rt_present(struct xqx_view *vw, gp_pixmap *pixmap, struct xqx_rectangle *area)
+{
+	struct xqx_view_rt *rt = vw->rt;
+	struct xqx_view *snap = &rt->front_snap;
+	struct xqx_view_layer *lr;
+
+	if (rt->pixel_type != pixmap->pixel_type) {
+		rt->pixel_type = pixmap->pixel_type;
+		rt_post(vw);
+	}
+
+	if (!rt->front || rt->front->w != vw->w || rt->front->h != vw->h ||
+	    rt->front->pixel_type != pixmap->pixel_type) {
+		/* the first frame for a new size is not finished yet */
+		gp_fill_rect_xyxy(pixmap, area->lx, area->ly, area->hx - 1, area->hy - 1, 0);
+		snap = vw;
+	} else {
+		gp_blit_xywh_clipped(rt->front, area->lx, area->ly,
+		                     area->hx - area->lx, area->hy - area->ly,
+		                     pixmap, area->lx, area->ly);
+	}
+
+	/* the layers are owned by the main loop, the snapshot ones may be gone */
+	for (lr = vw->view_last ? vw->view_last->prev : NULL; lr; lr = lr->prev)
+		do_render_layer(lr, snap, pixmap, area);
+}
+
+int xqx_view_render_thread(struct xqx_view *vw)
+{
+	struct xqx_view_rt *rt;
+
+	if (vw->rt)
+		return 0;
+
+	rt = calloc(1, sizeof(*rt));
+	if (!rt)
+		return 1;
+
+	if (pipe(rt->pipe)) {
+		printf("WARNING: Failed to create pipe: %s\n", strerror(errno));
+		free(rt);
+		return 1;
+	}
+
+	fcntl(rt->pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(rt->pipe[1], F_SETFL, O_NONBLOCK);
+
+	pthread_mutex_init(&rt->lock, NULL);
+	pthread_cond_init(&rt->cond, NULL);
+
+	if (pthread_create(&rt->thread, NULL, render_thread, rt)) {
+		printf("WARNING: Failed to start render thread\n");
+		pthread_cond_destroy(&rt->cond);
+		pthread_mutex_destroy(&rt->lock);
+		close(rt->pipe[0]);
+		close(rt->pipe[1]);
+		free(rt);
+		return 1;
+	}
+
+	rt->fd.fd = rt->pipe[0];
+	rt->fd.events = GP_POLLIN;
+	rt->fd.event = rt_flip;
+	rt->fd.priv = vw;
+	gp_app_poll_add(&rt->fd);
+
+	vw->rt = rt;
+	invalidate_view(vw);
+
+	return 0;
 }
 
 /* Widget pixmap handler to repaint a screen */
@@ -315,11 +1246,70 @@ static void view_redraw(gp_widget_event *ev)
 	                             ev->bbox->x + ev->bbox->w,
 	                             ev->bbox->y + ev->bbox->h};
 	struct xqx_view_layer *lr;
+	struct xqx_rectangle bbox = area;
+	uint64_t t = xqx_time_us();
+	unsigned int i;
+	int paint_rects;
+
+	XQX_TRACE_RECT(XQX_TRACE_BEGIN, XQX_TRACE_REDRAW, NULL, area.lx, area.ly, area.hx, area.hy);
+
+	if (vw->rt) {
+		rt_present(vw, pixmap, &area);
+		vw->paint_cnt = 0;
+		vw->redraw_full = 0;
+		goto out;
+	}
+
+	for (lr = vw->view_first; lr; lr = lr->next) {
+		if (lr->flags & XQX_VIEW_LAYER_RETAINED)
+			surface_update(lr, vw);
+	}
 
-	printf("REDRAW BBOX " GP_BBOX_FMT "\n", GP_BBOX_PARS(*ev->bbox));
+	/*
+	 * The widget library unions the requested rectangles into a single
+	 * bounding box. If the box matches exactly what we requested render
+	 * only the damaged rectangles, otherwise the repaint was requested by
+	 * someone else and we have to render the whole box.
+	 *
+	 * When the view was panned the content is moved first and then only
+	 * the exposed strips and the damage are rendered.
+	 */
+	if (vw->paint_cnt) {
+		bbox = vw->paint[0];
+		for (i = 1; i < vw->paint_cnt; i++)
+			rect_union(&bbox, &vw->paint[i], &bbox);
+	}
+
+	if (vw->scroll_dx || vw->scroll_dy)
+		paint_rects = !xqx_pixmap_scroll(pixmap, vw->scroll_dx, vw->scroll_dy);
+	else
+		paint_rects = vw->paint_cnt && rect_eq(&bbox, &area);
 
-	for (lr = vw->view_last; lr; lr = lr->prev)
-		do_render_layer(lr, vw, pixmap, &area);
+	if (vw->redraw_full)
+		paint_rects = 0;
+
+	if (paint_rects) {
+		for (i = 0; i < vw->paint_cnt; i++)
+			render_rect(vw, pixmap, &vw->paint[i]);
+	} else {
+		render_rect(vw, pixmap, &area);
+	}
+
+	vw->paint_cnt = 0;
+	vw->scroll_dx = 0;
+	vw->scroll_dy = 0;
+	vw->redraw_full = 0;
+
+	vw->frame_us = xqx_time_us() - t;
+out:
+	XQX_TRACE_RECT(XQX_TRACE_END, XQX_TRACE_REDRAW, NULL, area.lx, area.ly, area.hx, area.hy);
+
+	/* repaints of the HUD and other overlays are not frames */
+	if (vw->frame_damage || !vw->overlay_damage)
+		vw->frames++;
+
+	vw->frame_damage = 0;
+	vw->overlay_damage = 0;
 }
 
 /* widget pixmap keypress handler */
@@ -333,9 +1323,9 @@ static int view_input(gp_widget_event *ev)
 		switch (ev->input_ev->code) {
 		case GP_EV_REL_WHEEL:
 			if (ev->input_ev->val < 0)
-				xqx_view_zoom_out(vw, (2 << 10));
+				xqx_view_input_zoom(vw, XQX_ZOOM_SMOOTH, 0);
 			else
-				xqx_view_zoom_in(vw, (2 << 10));
+				xqx_view_input_zoom(vw, XQX_ZOOM_SMOOTH, 1);
 			return 1;
 		break;
 		}
@@ -358,26 +1348,35 @@ static int view_input(gp_widget_event *ev)
 			xqx_view_choose_map(vw, 3);
 		break;
 		case GP_KEY_LEFT:
-			xqx_view_move_user(vw, vw->step_x, 0);
+			xqx_view_input_move(vw, vw->step_x, 0);
 		break;
 		case GP_KEY_RIGHT:
-			xqx_view_move_user(vw, -vw->step_x, 0);
+			xqx_view_input_move(vw, -vw->step_x, 0);
 		break;
 		case GP_KEY_UP:
-			xqx_view_move_user(vw, 0, vw->step_y);
+			xqx_view_input_move(vw, 0, vw->step_y);
 		break;
 		case GP_KEY_DOWN:
-			xqx_view_move_user(vw, 0, -vw->step_y);
+			xqx_view_input_move(vw, 0, -vw->step_y);
 		break;
 		case GP_KEY_KP_PLUS:
-			xqx_view_zoom_in(vw, (2 << 10));
+			xqx_view_input_zoom(vw, XQX_ZOOM_LEVEL, 1);
 		break;
 		case GP_KEY_KP_MINUS:
-			xqx_view_zoom_out(vw, (2 << 10));
+			xqx_view_input_zoom(vw, XQX_ZOOM_LEVEL, 0);
 		break;
 		case GP_KEY_G:
 			xqx_view_toggle_grid(vw);
 		break;
+		case GP_KEY_H:
+			xqx_view_toggle_hud(vw);
+		break;
+		case GP_KEY_S:
+			xqx_map_cache_stats_print(stdout);
+		break;
+		case GP_KEY_T:
+			xqx_trace_toggle();
+		break;
 		case GP_KEY_L:
 			xqx_view_toggle_gps_lock(vw);
 		break;
@@ -422,10 +1421,22 @@ struct xqx_view *xqx_make_view(gp_widget *pixmap)
 
 	/* Prevent divison by zero */
 	vw->scale_px = vw->scale_py = 1;
+	vw->scale_fp = XQX_SCALE_ONE;
 	vw->pixmap = pixmap;
 
+	vw->damage_timer.id = "view damage flush";
+	vw->damage_timer.callback = damage_flush;
+	vw->damage_timer.priv = vw;
+
+	vw->input_timer.id = "view input";
+	vw->input_timer.callback = input_flush;
+	vw->input_timer.priv = vw;
+
 	//view_resize(vw);
 
+	if (!pixmap)
+		return vw;
+
 	gp_widget_on_event_set(pixmap, view_pixmap_on_event, vw);
 	gp_widget_events_unmask(pixmap, GP_WIDGET_EVENT_REDRAW |
 	                                GP_WIDGET_EVENT_RESIZE |
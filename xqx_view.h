@@ -38,11 +38,34 @@ struct xqx_rectangle
 	int lx, ly, hx, hy;
 };
 
+/*
+ * The view scale is a fixed point number with XQX_SCALE_SHIFT fractional bits.
+ */
+#define XQX_SCALE_SHIFT 8
+#define XQX_SCALE_ONE (1 << XQX_SCALE_SHIFT)
+
+/*
+ * Maximal number of separate rectangles the damage is tracked in and minimal
+ * delay between two repaints requested by xqx_view_request_redraw().
+ */
+#define XQX_VIEW_DAMAGE_RECTS 8
+#define XQX_VIEW_FRAME_US 16000
+
+/* Zoom coeficients for xqx_view_zoom_in() and xqx_view_zoom_out() */
+#define XQX_ZOOM_LEVEL (2 << 10)
+/* 2^(1/4) i.e. four steps per map level */
+#define XQX_ZOOM_SMOOTH 1218
+
 struct xqx_view
 {
 	int valid, used;
 	struct xqx_coordinate center; /* center of view */
-	int scale_px, scale_py, scale_cx, scale_cy, scale_main, scale_def;
+	int scale_px, scale_py, scale_cx, scale_cy, scale_def;
+	/*
+	 * The scale_fp is the actual scale, the scale_main is the nearest
+	 * smaller power of two that selects a map level.
+	 */
+	int scale_fp, scale_main;
 
 	uint32_t w, h; /* width and height of window in pixels */
 	int step_x, step_y;
@@ -53,7 +76,55 @@ struct xqx_view
 
 	gp_widget *pixmap;
 
+	/*
+	 * Damaged rectangles are accumulated and passed to the widget library
+	 * at most once per frame, the paint rectangles are the ones passed
+	 * and not yet repainted.
+	 */
+	struct xqx_rectangle damage[XQX_VIEW_DAMAGE_RECTS];
+	struct xqx_rectangle paint[XQX_VIEW_DAMAGE_RECTS];
+	unsigned int damage_cnt, paint_cnt;
+	uint64_t damage_flushed;
+	gp_timer damage_timer;
+	/* damage_timer is armed */
+	int redraw_pending;
+
+	/*
+	 * Pixels the widget content has to be moved by before the paint
+	 * rectangles are rendered and whole view repaint flag.
+	 */
+	int scroll_dx, scroll_dy;
+	int redraw_full;
+
+	/*
+	 * User input is accumulated and applied at most once per frame, the
+	 * input_scale is the requested scale, zero if unchanged, and the
+	 * input_dx, input_dy is the requested move in coordinates.
+	 */
+	int64_t input_scale;
+	int input_dx, input_dy;
+	int input_pending;
+	uint64_t input_flushed;
+	gp_timer input_timer;
+
+	/* view changes are recorded as a gpmaps-bench script, see xqx_view_record() */
+	FILE *record;
+
+	/* number of frames rendered and duration of the last one */
+	uint32_t frames;
+	uint32_t frame_us;
+	/*
+	 * Set when the view content changed and when an overlay requested a
+	 * repaint since the last one, repaints of overlays only are not frames.
+	 */
+	int frame_damage;
+	int overlay_damage;
+
+	/* render thread state, NULL when the view is rendered in the main loop */
+	struct xqx_view_rt *rt;
+
 	struct xqx_grid *grid;
+	struct xqx_hud *hud;
 	struct xqx_gps_layer *gps;
 	struct xqx_view_layer *view_first;
 	struct xqx_view_layer *view_last;
@@ -67,46 +138,199 @@ struct xqx_view
  *
  * The render_cb callback is the function that actually draws into a pixmap.
  */
+enum xqx_view_layer_flags {
+	/*
+	 * Layer content moves together with the map, i.e. it can be moved
+	 * by a blit when the view is panned. Views with a layer without this
+	 * flag are repainted on each move.
+	 */
+	XQX_VIEW_LAYER_PAN_INVARIANT = 0x01,
+	/*
+	 * Layer is rendered into its own surface that is composited over the
+	 * map, with a color key for the pixels the layer did not draw. The
+	 * surface is rasterized again only after a view change, i.e. scale,
+	 * resize or a move that could not be scrolled, or when the layer
+	 * calls xqx_view_layer_invalidate().
+	 */
+	XQX_VIEW_LAYER_RETAINED = 0x02,
+	/*
+	 * The render_cb does not touch pixels outside of the passed rectangle
+	 * and can be called concurrently for disjoint rectangles. Layers with
+	 * this flag are rendered in horizontal bands on the worker threads.
+	 */
+	XQX_VIEW_LAYER_THREAD_SAFE = 0x04,
+};
+
 struct xqx_view_layer
 {
+	/* layer name, used for tracing */
+	const char *name;
+	unsigned int flags;
 	void (*notify_cb)(void *, struct xqx_view *, uint32_t);
 	void (*render_cb)(void *, struct xqx_view *, gp_pixmap *pixmap, struct xqx_rectangle *);
 	struct xqx_view_layer *prev, *next;
 	struct xqx_view *view;
+
+	/* retained surface and its parts that have to be rasterized again */
+	gp_pixmap *surface;
+	struct xqx_rectangle dirty[XQX_VIEW_DAMAGE_RECTS];
+	unsigned int dirty_cnt;
 };
 
+/*
+ * Creates a view rendered into a widget pixmap.
+ *
+ * @pixmap: A pixmap widget, NULL for an offscreen view that is sized by
+ *          xqx_view_set_size() and rendered by xqx_view_render().
+ */
 struct xqx_view *xqx_make_view(gp_widget *pixmap);
 
+/*
+ * Sets the view size in pixels, called on widget resize for onscreen views.
+ */
+void xqx_view_set_size(struct xqx_view *vw, uint32_t w, uint32_t h);
+
+/*
+ * Loads all tiles visible in the view synchronously, tiles are otherwise
+ * loaded in the background by the main loop.
+ *
+ * Returns number of tiles read.
+ */
+unsigned int xqx_view_load_tiles(struct xqx_view *vw);
+
+/*
+ * Renders the whole view into a pixmap, the pixmap has to have the view size.
+ *
+ * Returns non-zero if the view has no size or the pixmap size does not match.
+ */
+int xqx_view_render(struct xqx_view *vw, gp_pixmap *pixmap);
+
+/*
+ * Moves rendering of the map layer into a dedicated thread so that slow
+ * repaints do not delay input handling and cache tasks in the main loop.
+ *
+ * The main loop posts view snapshots to the thread and flips the finished
+ * frame onto the screen, the rest of the layers are drawn on the top of it
+ * in the main loop for the view the frame was rendered for.
+ *
+ * Returns non-zero on failure, the view is rendered in the main loop then.
+ */
+int xqx_view_render_thread(struct xqx_view *vw);
+
+/*
+ * Starts recording view size, center, scale and map changes into a file as
+ * a gpmaps-bench script, the current size and view are written first.
+ */
+void xqx_view_record(struct xqx_view *vw, FILE *f);
+
 void xqx_view_pixels_to_coords(struct xqx_view *vw, int px, int py, struct xqx_coordinate *c);
 
 void xqx_view_remove_layer(struct xqx_view *vw, struct xqx_view_layer *lr);
 void xqx_view_prepend_layer(struct xqx_view *vw, struct xqx_view_layer *lr);
 void xqx_view_append_layer(struct xqx_view *vw, struct xqx_view_layer *lr);
 
+/*
+ * Called by a layer when its content has changed.
+ *
+ * @rect: Changed area in view pixels, NULL for the whole view.
+ */
+void xqx_view_layer_invalidate(struct xqx_view_layer *lr, struct xqx_rectangle *rect);
+
+void xqx_view_toggle_grid(struct xqx_view *vw);
+void xqx_view_toggle_hud(struct xqx_view *vw);
+
 void xqx_view_enable_gps(struct xqx_view *vw);
 void xqx_view_disable_gps(struct xqx_view *vw);
 
 void xqx_view_set_center(struct xqx_view *vw, int nx, int ny);
+
+/*
+ * Sets the view scale.
+ *
+ * @s: Scale in 1/XQX_SCALE_ONE units, it's not limited to powers of two,
+ *     the map layer resamples tiles from the nearest level.
+ */
 void xqx_view_set_scale(struct xqx_view *vw, int s);
 void xqx_view_choose_map(struct xqx_view *vw, int s);
 
 /*
  * This is called when particular rectangle on a screen needs to be repainted.
  *
- * This function does not do any drawing, it just passes the request to the
- * widget library and the actual repainting is done in the widget repaint even
+ * This function does not do any drawing, the rectangle is merged with other
+ * damaged areas which are passed to the widget library at most once per
+ * frame and the actual repainting is done in the widget repaint event
  * handler.
  */
 void xqx_view_request_redraw(struct xqx_view *vw, int lx, int ly, int hx, int hy);
 
+/*
+ * Same as xqx_view_request_redraw() but a repaint that contains only these
+ * rectangles is not counted as a frame, for layers that display statistics
+ * about the view such as the HUD.
+ */
+void xqx_view_request_overlay_redraw(struct xqx_view *vw, int lx, int ly, int hx, int hy);
+
 static inline void xqx_view_move(struct xqx_view *vw, int dx, int dy)
 {
 	xqx_view_set_center(vw, vw->center.x + dx, vw->center.y + dy);
 }
 
+/*
+ * Converts coordinates to pixels relative to the coordinate origin.
+ *
+ * All positions are rounded on this grid and then moved relatively to the
+ * center, that way moving the center moves everything by the same whole
+ * number of pixels.
+ */
+static inline int64_t xqx_view_abs_px_x(struct xqx_view *vw, int64_t x)
+{
+	return DIV_FLOOR(x * vw->scale_px * XQX_SCALE_ONE, (int64_t)vw->scale_cx * vw->scale_fp);
+}
+
+static inline int64_t xqx_view_abs_px_y(struct xqx_view *vw, int64_t y)
+{
+	return DIV_FLOOR(y * vw->scale_py * XQX_SCALE_ONE, (int64_t)vw->scale_cy * vw->scale_fp);
+}
+
+/*
+ * Converts coordinates to a view pixels.
+ */
+static inline int64_t xqx_view_coord_to_px_x(struct xqx_view *vw, int64_t x)
+{
+	return xqx_view_abs_px_x(vw, x) - xqx_view_abs_px_x(vw, vw->center.x) + vw->w / 2;
+}
+
+static inline int64_t xqx_view_coord_to_px_y(struct xqx_view *vw, int64_t y)
+{
+	return xqx_view_abs_px_y(vw, y) - xqx_view_abs_px_y(vw, vw->center.y) + vw->h / 2;
+}
+
+/*
+ * Converts a distance in coordinates to a distance in view pixels.
+ */
+static inline int64_t xqx_view_len_to_px_x(struct xqx_view *vw, int64_t dx)
+{
+	dx *= vw->scale_px;
+	dx *= XQX_SCALE_ONE;
+	dx /= vw->scale_cx;
+	dx /= vw->scale_fp;
+
+	return ABS(dx);
+}
+
+static inline int64_t xqx_view_len_to_px_y(struct xqx_view *vw, int64_t dy)
+{
+	dy *= vw->scale_py;
+	dy *= XQX_SCALE_ONE;
+	dy /= vw->scale_cy;
+	dy /= vw->scale_fp;
+
+	return ABS(dy);
+}
+
 static inline void xqx_view_zoom_in(struct xqx_view *vw, int coef)
 {
-	int64_t ns = vw->scale_main;
+	int64_t ns = vw->scale_fp;
 	ns = (ns * 1024) / coef;
 
 	/* FIXME check for overflow ? */
@@ -115,11 +339,27 @@ static inline void xqx_view_zoom_in(struct xqx_view *vw, int coef)
 
 static inline void xqx_view_zoom_out(struct xqx_view *vw, int coef)
 {
-	int64_t ns = vw->scale_main;
+	int64_t ns = vw->scale_fp;
 	ns = (ns * coef) / 1024;
 
 	/* FIXME check for overflow ? */
 	xqx_view_set_scale(vw, ns);
 }
 
+/*
+ * Moves the view by dx, dy coordinates in response to user input.
+ *
+ * Unlike xqx_view_move() the moves are accumulated and applied at most once
+ * per frame, it also unlocks the view from the GPS position.
+ */
+void xqx_view_input_move(struct xqx_view *vw, int dx, int dy);
+
+/*
+ * Zooms the view in response to user input, same as xqx_view_zoom_in() and
+ * xqx_view_zoom_out() but accumulated and applied at most once per frame.
+ *
+ * @in: Non-zero to zoom in, zero to zoom out.
+ */
+void xqx_view_input_zoom(struct xqx_view *vw, int coef, int in);
+
 #endif /* XQX_VIEW_H__ */
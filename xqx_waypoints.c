@@ -3,213 +3,337 @@
  * Copyright (c) 2021 Cyril Hrubis <metan@ucw.cz>
  */
 
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <math.h>
-#include <utils/gp_json.h>
+#include "xqx_common.h"
+#include "xqx_projection.h"
 #include "xqx_waypoints.h"
+#include "xqx_path_lod.h"
+#include "xqx_path_cache.h"
 
 struct xqx_path *xqx_path_new(const char *name)
 {
-	struct xqx_path *path = malloc(sizeof(struct xqx_path));
+	struct xqx_path *path = calloc(1, sizeof(struct xqx_path));
 
 	if (!path)
 		return NULL;
 
-	if (name)
+	if (name) {
 		path->name = strdup(name);
-	else
-		path->name = NULL;
-
-	list_init(&path->waypoints);
-	path->waypoints_cnt = 0;
+		if (!path->name) {
+			free(path);
+			return NULL;
+		}
+	}
 
 	return path;
 }
 
-struct xqx_waypoint *xqx_waypoint_new(double lat, double lon, double alt, const char *name)
+/*
+ * Makes sure there is space for size waypoints and that the arrays are not
+ * mapped from the cache file.
+ */
+static int path_reserve(struct xqx_path *path, unsigned int size)
 {
-	struct xqx_waypoint *waypoint = malloc(sizeof(struct xqx_waypoint));
+	unsigned int cnt = path->waypoints_cnt;
+	double *lat, *lon, *alt = NULL;
 
-	if (!waypoint)
-		return NULL;
+	if (size <= path->waypoints_size && !path->mapped)
+		return 0;
 
-	waypoint->lat = lat;
-	waypoint->lon = lon;
-	waypoint->alt = alt;
+	size = MAX(size, path->waypoints_size);
 
-	if (name)
-		waypoint->name = strdup(name);
-	else
-		waypoint->name = NULL;
+	if (path->mapped) {
+		lat = malloc(size * sizeof(double));
+		lon = malloc(size * sizeof(double));
 
-	return waypoint;
-}
+		if (path->alt)
+			alt = malloc(size * sizeof(double));
 
-void xqx_path_waypoint_append(struct xqx_path *path, struct xqx_waypoint *waypoint)
-{
-	list_append(&path->waypoints, &waypoint->list);
-	path->waypoints_cnt++;
-}
+		if (!lat || !lon || (path->alt && !alt)) {
+			free(lat);
+			free(lon);
+			free(alt);
+			return 1;
+		}
 
-void xqx_path_free(struct xqx_path *path)
-{
-	struct xqx_waypoint *waypoint;
+		memcpy(lat, path->lat, cnt * sizeof(double));
+		memcpy(lon, path->lon, cnt * sizeof(double));
+
+		if (alt)
+			memcpy(alt, path->alt, cnt * sizeof(double));
 
-	LIST_FOREACH_SAFE(&path->waypoints, i) {
-		waypoint = LIST_ENTRY(i, struct xqx_waypoint, list);
-		free(waypoint);
+		path->lat = lat;
+		path->lon = lon;
+		path->alt = alt;
+		path->mapped = 0;
+		path->waypoints_size = size;
+
+		return 0;
 	}
 
-	free(path->name);
-	free(path);
+	lat = realloc(path->lat, size * sizeof(double));
+	if (!lat)
+		return 1;
+	path->lat = lat;
+
+	lon = realloc(path->lon, size * sizeof(double));
+	if (!lon)
+		return 1;
+	path->lon = lon;
+
+	if (path->alt) {
+		alt = realloc(path->alt, size * sizeof(double));
+		if (!alt)
+			return 1;
+		path->alt = alt;
+	}
+
+	path->waypoints_size = size;
+
+	return 0;
 }
 
-void xqx_path_print(struct xqx_path *path)
+static int alt_alloc(struct xqx_path *path)
 {
-	struct xqx_waypoint *waypoint;
+	unsigned int i;
 
-	printf("Path '%s' points %u\n", path->name ? path->name : "(unnamed)", path->waypoints_cnt);
+	path->alt = malloc(MAX(path->waypoints_size, 1u) * sizeof(double));
+	if (!path->alt)
+		return 1;
 
-	LIST_FOREACH(&path->waypoints, i) {
-		waypoint = LIST_ENTRY(i, struct xqx_waypoint, list);
-		printf("\t[%2.15lf, %2.15lf, %5.2lf] '%s'\n",
-		       waypoint->lat, waypoint->lon, waypoint->alt,
-		       waypoint->name ? waypoint->name : "(unnamed)");
-	}
+	for (i = 0; i < path->waypoints_cnt; i++)
+		path->alt[i] = NAN;
+
+	return 0;
 }
 
-static struct xqx_path *path_from_coordinates(gp_json_reader *json, gp_json_val *val)
+struct xqx_path *xqx_path_new_arr(const char *name, unsigned int cnt,
+                                  const double *lat, const double *lon, const double *alt)
 {
-	struct xqx_path *path;
+	struct xqx_path *path = xqx_path_new(name);
+	unsigned int i;
 
-	if (gp_json_next_type(json) != GP_JSON_ARR) {
-		gp_json_err(json, "Expected array");
+	if (!path)
 		return NULL;
-	}
 
-	path = xqx_path_new(NULL);
+	if (path_reserve(path, MAX(cnt, 1u)))
+		goto err;
+
+	memcpy(path->lat, lat, cnt * sizeof(double));
+	memcpy(path->lon, lon, cnt * sizeof(double));
 
-	GP_JSON_ARR_FOREACH(json, val) {
-		struct xqx_waypoint *waypoint;
-		double coords[2];
-		int coord_cnt = 0;
+	/* the altitude array is allocated only when there is an altitude */
+	for (i = 0; alt && i < cnt; i++) {
+		if (!isnan(alt[i])) {
+			if (alt_alloc(path))
+				goto err;
 
-		if (val->type != GP_JSON_ARR) {
-			gp_json_err(json, "Expected array of coordinate arrays");
-			goto err0;
+			memcpy(path->alt, alt, cnt * sizeof(double));
+			break;
 		}
+	}
+
+	path->waypoints_cnt = cnt;
+
+	return path;
+err:
+	xqx_path_free(path);
+	return NULL;
+}
 
-		GP_JSON_ARR_FOREACH(json, val) {
-			if (val->type != GP_JSON_FLOAT &&
-			    val->type != GP_JSON_INT) {
-				goto err1;
-			}
+int xqx_path_append(struct xqx_path *path, double lat, double lon, double alt, const char *name)
+{
+	unsigned int idx = path->waypoints_cnt;
 
-			if (coord_cnt > 2)
-				goto err1;
+	if (idx >= path->waypoints_size || path->mapped) {
+		if (path_reserve(path, MAX(2 * path->waypoints_size, 64u)))
+			return 1;
+	}
 
-			coords[coord_cnt++] = val->val_float;
-		}
+	if (!path->alt && !isnan(alt) && alt_alloc(path))
+		return 1;
 
-		if (coord_cnt != 2)
-			goto err1;
+	path->lat[idx] = lat;
+	path->lon[idx] = lon;
 
-		waypoint = xqx_waypoint_new(coords[0], coords[1], NAN, NULL);
+	if (path->alt)
+		path->alt[idx] = alt;
 
-		if (!waypoint)
-			goto err0;
+	if (name && xqx_path_waypoint_name_set(path, idx, name))
+		return 1;
 
-		xqx_path_waypoint_append(path, waypoint);
+	path->waypoints_cnt++;
+
+	return 0;
+}
+
+/*
+ * Returns the index of the first name with idx greater or equal to idx.
+ */
+static unsigned int name_find(struct xqx_path *path, unsigned int idx)
+{
+	unsigned int l = 0, h = path->names_cnt;
+
+	while (l < h) {
+		unsigned int m = l + (h - l) / 2;
+
+		if (path->names[m].idx < idx)
+			l = m + 1;
+		else
+			h = m;
 	}
 
-	return path;
-err1:
-	gp_json_err(json, "Expected [lon, lat]");
-err0:
-	xqx_path_free(path);
+	return l;
+}
+
+const char *xqx_path_waypoint_name(struct xqx_path *path, unsigned int idx)
+{
+	unsigned int i = name_find(path, idx);
+
+	if (i < path->names_cnt && path->names[i].idx == idx)
+		return path->names[i].name;
+
 	return NULL;
 }
 
-static struct xqx_path *path_from_geometry(gp_json_reader *json, gp_json_val *val)
+int xqx_path_waypoint_name_set(struct xqx_path *path, unsigned int idx, const char *name)
 {
-	struct xqx_path *ret = NULL;
+	unsigned int i = name_find(path, idx);
+	char *dup = strdup(name);
 
-	if (gp_json_next_type(json) != GP_JSON_OBJ) {
-		gp_json_err(json, "Wrong geometry type");
-		return NULL;
+	if (!dup)
+		return 1;
+
+	if (i < path->names_cnt && path->names[i].idx == idx) {
+		free(path->names[i].name);
+		path->names[i].name = dup;
+		return 0;
 	}
 
-	GP_JSON_OBJ_FOREACH(json, val) {
-		if (!strcmp(val->id, "coordinates")) {
-			ret = path_from_coordinates(json, val);
-		} else if (!strcmp(val->id, "type")) {
-			if (val->type != GP_JSON_STR ||
-			    strcmp(val->val_str, "LineString"))
-				gp_json_warn(json, "Wrong type expected 'LineString'");
-		} else {
-			gp_json_warn(json, "Unknown key");
-			//TODO: Skip
+	if (path->names_cnt >= path->names_size) {
+		unsigned int size = MAX(2 * path->names_size, 8u);
+		struct xqx_waypoint_name *names = realloc(path->names, size * sizeof(*names));
+
+		if (!names) {
+			free(dup);
+			return 1;
 		}
+
+		path->names = names;
+		path->names_size = size;
 	}
 
-	return ret;
+	memmove(&path->names[i + 1], &path->names[i], (path->names_cnt - i) * sizeof(*path->names));
+
+	path->names[i].idx = idx;
+	path->names[i].name = dup;
+	path->names_cnt++;
+
+	return 0;
 }
 
-static struct xqx_path *path_from_geojson(struct gp_json_reader *json)
+void xqx_path_free(struct xqx_path *path)
 {
-	char buf[64];
-	gp_json_val val = {.buf = buf, .buf_size = sizeof(buf)};
-	struct xqx_path *ret = NULL;
-	char *name = NULL;
-
-	GP_JSON_OBJ_FOREACH(json, &val) {
-		if (!strcmp(val.id, "type")) {
-			if (val.type != GP_JSON_STR) {
-				gp_json_err(json, "Wrong type value type");
-				return NULL;
-			}
-		} else if (!strcmp(val.id, "geometry")) {
-			ret = path_from_geometry(json, &val);
-		} else if (!strcmp(val.id, "properties")) {
-			GP_JSON_OBJ_FOREACH(json, &val) {
-				if (!strcmp(val.id, "name") &&
-				    val.type == GP_JSON_STR) {
-					name = strdup(val.val_str);
-				}
-			}
-		} else {
-			gp_json_warn(json, "Unknown key");
-			//TODO: Skip
-		}
+	unsigned int i;
+
+	xqx_path_lod_stop(path);
+
+	if (!path->mapped) {
+		free(path->lat);
+		free(path->lon);
+		free(path->alt);
 	}
 
-	if (ret)
-		ret->name = name;
-	else
-		free(name);
+	for (i = 0; i < path->names_cnt; i++)
+		free(path->names[i].name);
 
-	return ret;
+	free(path->names);
+
+	if (!path->proj_mapped) {
+		free(path->proj_x);
+		free(path->proj_y);
+	}
+
+	xqx_path_file_put(path->file);
+
+	free(path->name);
+	free(path);
 }
 
-struct xqx_path *xqx_path_geojson(const char *pathname)
+int xqx_path_project(struct xqx_path *path, unsigned int epsg)
 {
-	struct gp_json_reader *json;
-	struct xqx_path *path = NULL;
+	unsigned int cnt = path->waypoints_cnt, size = MAX(path->waypoints_size, 1u);
+	unsigned int start = 0;
+	int32_t *x, *y;
+
+	if (path->proj_x && path->proj_epsg == epsg && path->proj_cnt == cnt)
+		return 0;
+
+	/* waypoints appended to the path are projected incrementally */
+	if (path->proj_x && !path->proj_mapped && path->proj_epsg == epsg && path->proj_cnt < cnt)
+		start = path->proj_cnt;
+
+	/*
+	 * The simplification running on the workers reads the projected
+	 * waypoints, appending is fine as long as the arrays stay in place.
+	 */
+	if (!start)
+		xqx_path_lod_stop(path);
+	else if (size != path->proj_size)
+		xqx_path_lod_cancel(path);
+
+	if (path->proj_mapped) {
+		path->proj_x = NULL;
+		path->proj_y = NULL;
+		path->proj_cnt = 0;
+		path->proj_size = 0;
+		path->proj_mapped = 0;
+	}
 
-	json = gp_json_reader_load(pathname);
-	if (!json)
-		return NULL;
+	if (size != path->proj_size) {
+		x = realloc(path->proj_x, size * sizeof(int32_t));
+		if (!x)
+			return 1;
+		path->proj_x = x;
 
-	if (gp_json_next_type(json) != GP_JSON_OBJ) {
-		gp_json_warn(json, "Expected object!");
-		return NULL;
+		y = realloc(path->proj_y, size * sizeof(int32_t));
+		if (!y)
+			return 1;
+		path->proj_y = y;
+
+		path->proj_size = size;
 	}
 
-	path = path_from_geojson(json);
+	x = path->proj_x;
+	y = path->proj_y;
 
-	gp_json_reader_finish(json);
-	gp_json_reader_free(json);
+	/* invalid until all points are projected */
+	path->proj_cnt = 0;
 
-	return path;
+	if (xqx_wgs84_to_coords_arr(epsg, path->lat + start, path->lon + start,
+	                            cnt - start, x + start, y + start))
+		return 1;
+
+	path->proj_epsg = epsg;
+	path->proj_cnt = cnt;
+
+	xqx_path_lod_update(path);
+
+	return 0;
+}
+
+void xqx_path_print(struct xqx_path *path)
+{
+	printf("Path '%s' points %u\n", path->name ? path->name : "(unnamed)", path->waypoints_cnt);
+
+	XQX_PATH_FOREACH(path, i) {
+		const char *name = xqx_path_waypoint_name(path, i);
+
+		printf("\t[%2.15lf, %2.15lf, %5.2lf] '%s'\n",
+		       path->lat[i], path->lon[i], xqx_path_alt(path, i),
+		       name ? name : "(unnamed)");
+	}
 }
@@ -6,39 +6,119 @@
 #ifndef XQX_WAYPOINTS_H__
 #define XQX_WAYPOINTS_H__
 
-#include "xqx_list.h"
+#include <stdint.h>
+#include <math.h>
+#include "xqx_workers.h"
 
-struct xqx_waypoint {
-	/*
-	 * Coordinates in WGS84
-	 *
-	 * alt may not be defined and set to nan
-	 */
-	double lat, lon, alt;
-
-	/* Optional name may be NULL */
+struct xqx_waypoint_name {
+	unsigned int idx;
 	char *name;
-
-	struct list_head list;
 };
 
 struct xqx_path {
 	/* Optional name may be NULL */
 	char *name;
 
+	/*
+	 * Waypoint coordinates in WGS84 stored as arrays so that they can be
+	 * passed to the projection and iterated over without chasing pointers.
+	 *
+	 * alt is NULL until a waypoint with a defined altitude is added, use
+	 * xqx_path_alt() to read it.
+	 */
 	unsigned int waypoints_cnt;
-	struct list_head waypoints;
+	unsigned int waypoints_size;
+	double *lat, *lon, *alt;
+	/* lat, lon and alt point into the cache file */
+	int mapped;
+
+	/* Optional waypoint names sorted by index */
+	unsigned int names_cnt;
+	unsigned int names_size;
+	struct xqx_waypoint_name *names;
+
+	/*
+	 * Waypoints projected by xqx_path_project() in 28.4 fixed point, in
+	 * the order of the waypoint arrays.
+	 */
+	unsigned int proj_epsg;
+	unsigned int proj_cnt;
+	unsigned int proj_size;
+	int32_t *proj_x, *proj_y;
+	/* proj_x and proj_y point into the cache file */
+	int proj_mapped;
+
+	/* Path cache file the path was loaded from, may be NULL */
+	struct xqx_path_file *file;
+
+	/* Level of detail for the projected waypoints, see xqx_path_lod.h */
+	struct xqx_path_lod *lod;
+	struct xqx_path_lod *lod_new;
+	struct xqx_work lod_work;
+	/* number of waypoints the queued work simplifies */
+	unsigned int lod_work_cnt;
+	int lod_queued;
+	int lod_abort;
+
+	/* Optional, called from the main loop once the level of detail is computed */
+	void (*lod_done)(struct xqx_path *path, void *priv);
+	void *lod_priv;
 };
 
+#define XQX_PATH_FOREACH(path, i) \
+	for (unsigned int i = 0; i < (path)->waypoints_cnt; i++)
+
 struct xqx_path *xqx_path_new(const char *name);
 
+/*
+ * Creates a path from arrays of coordinates, the arrays are copied. More
+ * waypoints can be appended later.
+ *
+ * @alt: May be NULL if not known
+ */
+struct xqx_path *xqx_path_new_arr(const char *name, unsigned int cnt,
+                                  const double *lat, const double *lon, const double *alt);
+
 void xqx_path_free(struct xqx_path *path);
 
-struct xqx_waypoint *xqx_waypoint_new(double lat, double lon, double alt, const char *name);
+/*
+ * Appends a waypoint, e.g. when recording a track.
+ *
+ * @alt: May be nan if not known
+ * @name: Optional name, may be NULL
+ *
+ * Returns non-zero on failure.
+ */
+int xqx_path_append(struct xqx_path *path, double lat, double lon, double alt, const char *name);
 
-void xqx_path_waypoint_append(struct xqx_path *path, struct xqx_waypoint *waypoint);
+static inline double xqx_path_alt(struct xqx_path *path, unsigned int idx)
+{
+	return path->alt ? path->alt[idx] : NAN;
+}
 
-struct xqx_path *xqx_path_geojson(const char *pathname);
+/*
+ * Returns waypoint name or NULL if the waypoint is not named.
+ */
+const char *xqx_path_waypoint_name(struct xqx_path *path, unsigned int idx);
+
+/*
+ * Sets a waypoint name, replaces the previous one if any.
+ *
+ * Returns non-zero on failure.
+ */
+int xqx_path_waypoint_name_set(struct xqx_path *path, unsigned int idx, const char *name);
+
+/*
+ * Projects the waypoints into the epsg projection and stores the result into
+ * path->proj_x and path->proj_y. The result is kept until the projection or
+ * the number of waypoints changes so that it's cheap to call on each redraw.
+ *
+ * When the projection changes the level of detail is recomputed in the
+ * background.
+ *
+ * Returns non-zero on failure.
+ */
+int xqx_path_project(struct xqx_path *path, unsigned int epsg);
 
 void xqx_path_print(struct xqx_path *path);
 
@@ -6,75 +6,192 @@
 #include "xqx_view.h"
 #include "xqx_waypoints_layer.h"
 #include "xqx_projection.h"
+#include "xqx_path_lod.h"
 
-static void waypoints_layer_render(void *wl_i, struct xqx_view *vw, gp_pixmap *pixmap, struct xqx_rectangle *rect)
+static void draw_point(struct xqx_waypoints_layer *wl, gp_pixmap *pixmap, int64_t x, int64_t y,
+                       gp_pixel point_color, gp_pixel line_color)
 {
-	struct xqx_waypoints_layer *wl = wl_i;
-	struct xqx_waypoint *waypoint;
-	int first = 1;
-	int32_t tx, ty, tz, px, py;
-
-	(void) vw;
-	(void) rect;
-
-	LIST_FOREACH(&wl->path->waypoints, i) {
-		waypoint = LIST_ENTRY(i, struct xqx_waypoint, list);
-
-		xqx_wgs84_to_coords(vw->active_map->epsg,
-		                    waypoint->lat, waypoint->lon, waypoint->alt,
-				    &tx, &ty, &tz);
-
-		int64_t x = tx;
-		x -= vw->center.x;
-		x *= vw->scale_px;
-		x /= vw->scale_cx;
-		x /= vw->scale_main;
-		x += vw->w / 2;
-
-		int64_t y = ty;
-		y -= vw->center.y;
-		y *= vw->scale_py;
-		y /= vw->scale_cy;
-		y /= vw->scale_main;
-		y += vw->h / 2;
-
-		gp_fill_circle(pixmap, x, y, wl->point_r, wl->point_color);
-		gp_fill_circle(pixmap, x, y, wl->line_r, wl->line_color);
-
-		if (first) {
-			first = 0;
-			px = x;
-			py = y;
+	gp_fill_circle(pixmap, x, y, wl->point_r, point_color);
+	gp_fill_circle(pixmap, x, y, wl->line_r, line_color);
+}
+
+/*
+ * Draws the path from the waypoint from to the end, used until the spatial
+ * index is built and for the waypoints appended since.
+ */
+static void draw_all(struct xqx_waypoints_layer *wl, struct xqx_path *path, struct xqx_view *vw,
+                     gp_pixmap *pixmap, unsigned int from, gp_pixel point_color, gp_pixel line_color)
+{
+	int64_t px = 0, py = 0;
+	unsigned int i;
+
+	for (i = from; i < path->proj_cnt; i++) {
+		int64_t x = xqx_view_coord_to_px_x(vw, path->proj_x[i]);
+		int64_t y = xqx_view_coord_to_px_y(vw, path->proj_y[i]);
+
+		if (i > from && x == px && y == py)
 			continue;
-		}
 
-		gp_line_th(pixmap, x, y, px, py, wl->line_r, wl->line_color);
+		draw_point(wl, pixmap, x, y, point_color, line_color);
+
+		if (i > from)
+			gp_line_th(pixmap, x, y, px, py, wl->line_r, line_color);
 
 		px = x;
 		py = y;
 	}
 }
 
-struct xqx_waypoints_layer *xqx_make_waypoints_layer(struct xqx_path *path)
+static void add_hit(void *priv, uint32_t id)
+{
+	struct xqx_waypoints_layer *wl = priv;
+
+	if (wl->hits_cnt >= wl->hits_size) {
+		unsigned int size = MAX(2 * wl->hits_size, 64u);
+		uint32_t *hits = realloc(wl->hits, size * sizeof(uint32_t));
+
+		if (!hits)
+			return;
+
+		wl->hits = hits;
+		wl->hits_size = size;
+	}
+
+	wl->hits[wl->hits_cnt++] = id;
+}
+
+static int cmp_hit(const void *a, const void *b)
+{
+	uint32_t ha = *(const uint32_t *)a, hb = *(const uint32_t *)b;
+
+	return (ha > hb) - (ha < hb);
+}
+
+/*
+ * Draws the segments of the simplified path that intersect the rectangle, in
+ * the path order, so that the result does not depend on the index layout.
+ */
+static void draw_rect(struct xqx_waypoints_layer *wl, struct xqx_path *path, struct xqx_view *vw,
+                      gp_pixmap *pixmap, struct xqx_rectangle *rect, struct xqx_path_lod_level *level,
+                      gp_pixel point_color, gp_pixel line_color)
+{
+	int margin = MAX(wl->point_r, wl->line_r) + 1;
+	struct xqx_coordinate c1, c2;
+	unsigned int i;
+
+	xqx_view_pixels_to_coords(vw, rect->lx - margin, rect->ly - margin, &c1);
+	xqx_view_pixels_to_coords(vw, rect->hx + margin, rect->hy + margin, &c2);
+
+	wl->hits_cnt = 0;
+
+	xqx_rtree_query(&level->tree,
+	                MIN((int32_t)c1.x, (int32_t)c2.x), MIN((int32_t)c1.y, (int32_t)c2.y),
+	                MAX((int32_t)c1.x, (int32_t)c2.x), MAX((int32_t)c1.y, (int32_t)c2.y),
+	                add_hit, wl);
+
+	qsort(wl->hits, wl->hits_cnt, sizeof(uint32_t), cmp_hit);
+
+	for (i = 0; i < wl->hits_cnt; i++) {
+		uint32_t k = wl->hits[i];
+		uint32_t a = level->verts[k];
+		uint32_t b = level->verts[MIN(k + 1, level->verts_cnt - 1)];
+		int64_t ax = xqx_view_coord_to_px_x(vw, path->proj_x[a]);
+		int64_t ay = xqx_view_coord_to_px_y(vw, path->proj_y[a]);
+		int64_t bx = xqx_view_coord_to_px_x(vw, path->proj_x[b]);
+		int64_t by = xqx_view_coord_to_px_y(vw, path->proj_y[b]);
+
+		/* shared with the previous segment, already drawn */
+		if (!i || wl->hits[i - 1] + 1 != k)
+			draw_point(wl, pixmap, ax, ay, point_color, line_color);
+
+		if (ax == bx && ay == by)
+			continue;
+
+		draw_point(wl, pixmap, bx, by, point_color, line_color);
+		gp_line_th(pixmap, bx, by, ax, ay, wl->line_r, line_color);
+	}
+}
+
+static void draw_path(struct xqx_waypoints_layer *wl, struct xqx_path *path, struct xqx_view *vw,
+                      gp_pixmap *pixmap, struct xqx_rectangle *rect,
+                      gp_pixel point_color, gp_pixel line_color)
+{
+	struct xqx_path_lod *lod;
+
+	if (xqx_path_project(path, vw->active_map->epsg))
+		return;
+
+	lod = xqx_path_lod_get(path);
+	if (!lod) {
+		draw_all(wl, path, vw, pixmap, 0, point_color, line_color);
+		return;
+	}
+
+	/* waypoints deviating from the path by less than half a pixel are skipped */
+	int64_t cx = ABS((int64_t)vw->scale_cx * vw->scale_fp / ((int64_t)vw->scale_px * XQX_SCALE_ONE));
+	int64_t cy = ABS((int64_t)vw->scale_cy * vw->scale_fp / ((int64_t)vw->scale_py * XQX_SCALE_ONE));
+	unsigned int min_lod = xqx_path_lod_min(MIN(cx, cy));
+
+	draw_rect(wl, path, vw, pixmap, rect, xqx_path_lod_level(lod, min_lod), point_color, line_color);
+
+	/* waypoints appended after the level of detail was computed */
+	if (lod->cnt < path->proj_cnt)
+		draw_all(wl, path, vw, pixmap, lod->cnt - 1, point_color, line_color);
+}
+
+static void waypoints_layer_render(void *wl_i, struct xqx_view *vw, gp_pixmap *pixmap, struct xqx_rectangle *rect)
+{
+	struct xqx_waypoints_layer *wl = wl_i;
+	unsigned int i;
+
+	gp_pixel point_color = gp_rgb_to_pixmap_pixel((wl->point_rgb >> 16) & 0xff, (wl->point_rgb >> 8) & 0xff,
+	                                              wl->point_rgb & 0xff, pixmap);
+	gp_pixel line_color = gp_rgb_to_pixmap_pixel((wl->line_rgb >> 16) & 0xff, (wl->line_rgb >> 8) & 0xff,
+	                                             wl->line_rgb & 0xff, pixmap);
+
+	for (i = 0; i < wl->paths->cnt; i++)
+		draw_path(wl, wl->paths->paths[i], vw, pixmap, rect, point_color, line_color);
+}
+
+/* the layer is retained, redraw it with the simplified path */
+static void lod_done(struct xqx_path *path, void *priv)
+{
+	struct xqx_waypoints_layer *wl = priv;
+
+	(void) path;
+
+	xqx_view_layer_invalidate(&wl->common, NULL);
+}
+
+struct xqx_waypoints_layer *xqx_make_waypoints_layer(struct xqx_paths *paths)
 {
 	struct xqx_waypoints_layer *wl = calloc(1, sizeof(struct xqx_waypoints_layer));
+	unsigned int i;
 
 	if (!wl)
 		return NULL;
 
+	wl->common.name = "waypoints";
 	wl->common.render_cb = waypoints_layer_render;
-	wl->path = path;
+	wl->common.flags = XQX_VIEW_LAYER_PAN_INVARIANT | XQX_VIEW_LAYER_RETAINED;
+	wl->paths = paths;
 	wl->line_r = 1;
 	wl->point_r = 3;
 
-	wl->point_color = 0x0000ff;
-	wl->line_color = 0x000000;
+	wl->point_rgb = 0x0000ff;
+	wl->line_rgb = 0x000000;
+
+	for (i = 0; i < paths->cnt; i++) {
+		paths->paths[i]->lod_done = lod_done;
+		paths->paths[i]->lod_priv = wl;
+	}
 
 	return wl;
 }
 
 void xqx_discard_waypoints_layer(struct xqx_waypoints_layer *wl)
 {
-	xqx_path_free(wl->path);
+	xqx_paths_free(wl->paths);
+	free(wl->hits);
 	free(wl);
 }
@@ -5,27 +5,38 @@
 
 /*
 
+   A layer that draws paths, all paths loaded from a file share a single layer
+   and its surface.
 
  */
 
 #ifndef XQX_WAYPOINTS_LAYER_H__
 #define XQX_WAYPOINTS_LAYER_H__
 
-#include "xqx_waypoints.h"
+#include "xqx_path_load.h"
 
 struct xqx_waypoints_layer
 {
 	struct xqx_view_layer common;
-	struct xqx_path *path;
+	struct xqx_paths *paths;
 
 	unsigned int line_r;
 	unsigned int point_r;
 
-	gp_pixel line_color;
-	gp_pixel point_color;
+	/* colors in 0xRRGGBB */
+	uint32_t line_rgb;
+	uint32_t point_rgb;
+
+	/* segments hit by the spatial index query, reused between redraws */
+	uint32_t *hits;
+	unsigned int hits_cnt;
+	unsigned int hits_size;
 };
 
-struct xqx_waypoints_layer *xqx_make_waypoints_layer(struct xqx_path *path);
+/*
+ * Creates a layer that draws the paths, the layer takes ownership of them.
+ */
+struct xqx_waypoints_layer *xqx_make_waypoints_layer(struct xqx_paths *paths);
 
 void xqx_discard_waypoints_layer(struct xqx_waypoints_layer *wl);
 
@@ -0,0 +1,321 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Cyril Hrubis <metan@ucw.cz>
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xqx_workers.h"
+
+#define MAX_THREADS 64
+
+struct job {
+	void (*fn)(void *priv, unsigned int i);
+	void *priv;
+	unsigned int cnt;
+	unsigned int next;
+	unsigned int done;
+	/* workers that still may touch the job */
+	unsigned int refs;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t job_done = PTHREAD_COND_INITIALIZER;
+
+/* job lives on the stack of xqx_workers_run() caller */
+static struct job *job;
+static unsigned long job_gen;
+
+static unsigned int threads = 1;
+
+/* background work, protected by the lock */
+static struct xqx_work *queue_first, *queue_last;
+static struct xqx_work *done_first, *done_last;
+static unsigned int work_running;
+static pthread_cond_t work_done = PTHREAD_COND_INITIALIZER;
+
+/* wakes up the main loop when work is finished */
+static int done_pipe[2] = {-1, -1};
+
+static void run_items(struct job *j)
+{
+	unsigned int i;
+
+	while ((i = __atomic_fetch_add(&j->next, 1, __ATOMIC_RELAXED)) < j->cnt) {
+		j->fn(j->priv, i);
+
+		pthread_mutex_lock(&lock);
+		if (++j->done == j->cnt)
+			pthread_cond_broadcast(&job_done);
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+static void work_finish(struct xqx_work *w)
+{
+	w->state = XQX_WORK_DONE;
+	w->next = NULL;
+
+	if (done_last)
+		done_last->next = w;
+	else
+		done_first = w;
+
+	done_last = w;
+
+	pthread_cond_broadcast(&work_done);
+
+	if (done_pipe[1] >= 0 && write(done_pipe[1], "", 1) < 0 && errno != EAGAIN)
+		printf("WARNING: Failed to wake up main loop: %s\n", strerror(errno));
+}
+
+static void *worker(void *arg)
+{
+	unsigned long seen = 0;
+	struct xqx_work *w;
+	struct job *j;
+
+	(void) arg;
+
+	pthread_mutex_lock(&lock);
+
+	for (;;) {
+		while ((!job || job_gen == seen) && !queue_first)
+			pthread_cond_wait(&job_start, &lock);
+
+		/* split jobs have priority, the caller waits for them */
+		if (job && job_gen != seen) {
+			seen = job_gen;
+			j = job;
+			j->refs++;
+
+			pthread_mutex_unlock(&lock);
+			run_items(j);
+			pthread_mutex_lock(&lock);
+
+			if (!--j->refs)
+				pthread_cond_broadcast(&job_done);
+
+			continue;
+		}
+
+		w = queue_first;
+		queue_first = w->next;
+		if (!queue_first)
+			queue_last = NULL;
+
+		w->state = XQX_WORK_RUNNING;
+		work_running++;
+
+		pthread_mutex_unlock(&lock);
+		w->fn(w);
+		pthread_mutex_lock(&lock);
+
+		work_running--;
+		work_finish(w);
+	}
+
+	return NULL;
+}
+
+unsigned int xqx_workers_init(unsigned int cnt)
+{
+	const char *env = getenv("GPMAPS_THREADS");
+	pthread_t tid;
+	unsigned int i;
+
+	if (threads > 1)
+		return threads;
+
+	if (!cnt && env) {
+		char *end;
+		unsigned long val = strtoul(env, &end, 10);
+
+		if (env[strspn(env, "0123456789")] || end == env || !val)
+			printf("WARNING: Invalid GPMAPS_THREADS='%s'\n", env);
+		else
+			cnt = val > MAX_THREADS ? MAX_THREADS : val;
+	}
+
+	if (!cnt) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		cnt = cpus > 0 ? cpus : 1;
+	}
+
+	if (cnt > MAX_THREADS)
+		cnt = MAX_THREADS;
+
+	/* may exist from a previous call that did not start any threads */
+	if (done_pipe[0] < 0) {
+		if (pipe(done_pipe)) {
+			printf("WARNING: Failed to create pipe: %s\n", strerror(errno));
+			done_pipe[0] = done_pipe[1] = -1;
+		} else {
+			fcntl(done_pipe[0], F_SETFL, O_NONBLOCK);
+			fcntl(done_pipe[1], F_SETFL, O_NONBLOCK);
+		}
+	}
+
+	for (i = 1; i < cnt; i++) {
+		if (pthread_create(&tid, NULL, worker, NULL)) {
+			printf("WARNING: Failed to start worker thread\n");
+			break;
+		}
+
+		pthread_detach(tid);
+	}
+
+	threads = i;
+
+	return threads;
+}
+
+unsigned int xqx_workers_count(void)
+{
+	return threads;
+}
+
+void xqx_workers_run(void (*fn)(void *priv, unsigned int i), void *priv, unsigned int cnt)
+{
+	struct job j = {
+		.fn = fn,
+		.priv = priv,
+		.cnt = cnt,
+	};
+	unsigned int i;
+
+	if (threads == 1 || cnt <= 1)
+		goto serial;
+
+	pthread_mutex_lock(&lock);
+
+	/* the pool is busy with a job from a different thread */
+	if (job) {
+		pthread_mutex_unlock(&lock);
+		goto serial;
+	}
+
+	job = &j;
+	job_gen++;
+	pthread_cond_broadcast(&job_start);
+	pthread_mutex_unlock(&lock);
+
+	run_items(&j);
+
+	pthread_mutex_lock(&lock);
+	while (j.done < j.cnt || j.refs)
+		pthread_cond_wait(&job_done, &lock);
+	job = NULL;
+	pthread_mutex_unlock(&lock);
+	return;
+serial:
+	for (i = 0; i < cnt; i++)
+		fn(priv, i);
+}
+
+void xqx_workers_queue(struct xqx_work *work)
+{
+	pthread_mutex_lock(&lock);
+
+	if (threads == 1) {
+		pthread_mutex_unlock(&lock);
+		work->fn(work);
+		pthread_mutex_lock(&lock);
+		work_finish(work);
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+
+	work->state = XQX_WORK_QUEUED;
+	work->next = NULL;
+
+	if (queue_last)
+		queue_last->next = work;
+	else
+		queue_first = work;
+
+	queue_last = work;
+
+	pthread_cond_broadcast(&job_start);
+	pthread_mutex_unlock(&lock);
+}
+
+static void list_remove(struct xqx_work **first, struct xqx_work **last, struct xqx_work *work)
+{
+	struct xqx_work **pos, *prev = NULL;
+
+	for (pos = first; *pos != work; pos = &(*pos)->next)
+		prev = *pos;
+
+	*pos = work->next;
+
+	if (*last == work)
+		*last = prev;
+}
+
+void xqx_workers_cancel(struct xqx_work *work)
+{
+	pthread_mutex_lock(&lock);
+
+	if (work->state == XQX_WORK_QUEUED) {
+		list_remove(&queue_first, &queue_last, work);
+		work->state = XQX_WORK_IDLE;
+	}
+
+	while (work->state == XQX_WORK_RUNNING)
+		pthread_cond_wait(&work_done, &lock);
+
+	if (work->state == XQX_WORK_DONE) {
+		list_remove(&done_first, &done_last, work);
+		work->state = XQX_WORK_IDLE;
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+unsigned int xqx_workers_complete(int wait)
+{
+	struct xqx_work *w, *next;
+	unsigned int ret = 0;
+	char buf[16];
+
+	pthread_mutex_lock(&lock);
+
+	while (wait && (queue_first || work_running))
+		pthread_cond_wait(&work_done, &lock);
+
+	if (done_pipe[0] >= 0)
+		while (read(done_pipe[0], buf, sizeof(buf)) > 0);
+
+	w = done_first;
+	done_first = done_last = NULL;
+
+	for (next = w; next; next = next->next)
+		next->state = XQX_WORK_IDLE;
+
+	pthread_mutex_unlock(&lock);
+
+	/* the done callback may free or queue the work again */
+	for (; w; w = next) {
+		next = w->next;
+
+		if (w->done)
+			w->done(w);
+
+		ret++;
+	}
+
+	return ret;
+}
+
+int xqx_workers_fd(void)
+{
+	return done_pipe[0];
+}
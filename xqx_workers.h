@@ -0,0 +1,90 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Cyril Hrubis <metan@ucw.cz>
+ */
+
+/*
+
+   A pool of worker threads for splitting work, e.g. rendering, into
+   independent pieces.
+
+   The workers also run background work queued from the main loop, e.g.
+   synthesizing map tiles, when they are not busy with a split job. The work
+   is completed on the main loop once it has finished.
+
+ */
+
+#ifndef XQX_WORKERS_H__
+#define XQX_WORKERS_H__
+
+/*
+ * Starts worker threads.
+ *
+ * @threads: Number of threads including the calling one, zero for number of
+ *           online CPUs or GPMAPS_THREADS environment variable if set.
+ *
+ * Returns number of threads actually available.
+ */
+unsigned int xqx_workers_init(unsigned int threads);
+
+/*
+ * Returns number of threads work is split into, including the calling one.
+ */
+unsigned int xqx_workers_count(void);
+
+/*
+ * Calls fn(priv, i) for each i in [0, cnt) on the worker threads and the
+ * calling thread, returns when all calls have finished.
+ *
+ * May be called from several threads, if the pool is busy the calls are done
+ * serially in the calling thread.
+ */
+void xqx_workers_run(void (*fn)(void *priv, unsigned int i), void *priv, unsigned int cnt);
+
+enum xqx_work_state {
+	XQX_WORK_IDLE,
+	XQX_WORK_QUEUED,
+	XQX_WORK_RUNNING,
+	XQX_WORK_DONE,
+};
+
+struct xqx_work {
+	/* called on a worker thread */
+	void (*fn)(struct xqx_work *self);
+	/* optional, called from xqx_workers_complete() once fn has finished */
+	void (*done)(struct xqx_work *self);
+
+	/* private */
+	enum xqx_work_state state;
+	struct xqx_work *next;
+};
+
+/*
+ * Queues background work, the work must not be queued already.
+ *
+ * Without worker threads the fn is called right away.
+ */
+void xqx_workers_queue(struct xqx_work *work);
+
+/*
+ * Removes the work from the queue, waits for it to finish if it's running
+ * already. The done callback is not called for a cancelled work.
+ */
+void xqx_workers_cancel(struct xqx_work *work);
+
+/*
+ * Calls the done callbacks of finished work.
+ *
+ * @wait: If set waits for all the queued work to finish first.
+ *
+ * Returns number of completed works.
+ */
+unsigned int xqx_workers_complete(int wait);
+
+/*
+ * Returns a file descriptor that becomes readable when there is finished work
+ * to be completed, -1 if not available.
+ */
+int xqx_workers_fd(void);
+
+#endif /* XQX_WORKERS_H__ */
@@ -0,0 +1,53 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Cyril Hrubis <metan@ucw.cz>
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "xqx_xdg.h"
+
+int xqx_xdg_make_dirs(char *pathname)
+{
+	char *p;
+
+	for (p = pathname + 1; *p; p++) {
+		if (*p != '/')
+			continue;
+
+		*p = 0;
+		if (mkdir(pathname, 0777) && errno != EEXIST) {
+			*p = '/';
+			return 1;
+		}
+		*p = '/';
+	}
+
+	return 0;
+}
+
+int xqx_xdg_cache_path(char *buf, size_t buf_size, const char *name, int create)
+{
+	const char *cache_dir = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	int len;
+
+	if (cache_dir && cache_dir[0])
+		len = snprintf(buf, buf_size, "%s/gpmaps/%s", cache_dir, name);
+	else if (home)
+		len = snprintf(buf, buf_size, "%s/.cache/gpmaps/%s", home, name);
+	else
+		return 1;
+
+	if (len < 0 || (size_t)len >= buf_size)
+		return 1;
+
+	if (create)
+		return xqx_xdg_make_dirs(buf);
+
+	return 0;
+}
@@ -0,0 +1,37 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Cyril Hrubis <metan@ucw.cz>
+ */
+
+/*
+
+   Files written by gpmaps that can be recreated are stored in
+   $XDG_CACHE_HOME/gpmaps/, or ~/.cache/gpmaps/ if the variable is not set.
+
+ */
+
+#ifndef XQX_XDG_H__
+#define XQX_XDG_H__
+
+#include <stddef.h>
+
+/*
+ * Creates the directories on the pathname, i.e. up to the last slash, the
+ * ones that exist already are skipped.
+ *
+ * Returns non-zero if a directory couldn't be created.
+ */
+int xqx_xdg_make_dirs(char *pathname);
+
+/*
+ * Formats path to the name in the gpmaps cache directory.
+ *
+ * @name: File name, may include subdirectories.
+ * @create: If set the directories on the path are created.
+ *
+ * Returns non-zero if the path does not fit or the directories couldn't be
+ * created.
+ */
+int xqx_xdg_cache_path(char *buf, size_t buf_size, const char *name, int create);
+
+#endif /* XQX_XDG_H__ */